@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "array_2d_benchmark.h"
+#include "midpoint_disp_terrain.h"
+#include "ogldev_util.h"
+
+#define NUM_BENCHMARK_RUNS 5
+
+struct BenchmarkVertex {
+    Vector3f Pos;
+    Vector3f Normal;
+};
+
+
+// Builds the vertices of every patch into a block of its own - position and a
+// central difference normal, so each vertex reads its four neighbours
+template<typename Layout>
+static float BuildPatchVertices(const Array2D<float, Layout>& HeightMap, int TerrainSize, int PatchSize, std::vector<BenchmarkVertex>& Vertices)
+{
+    int NumPatches = (TerrainSize - 1) / (PatchSize - 1);
+    size_t Index = 0;
+
+    Vertices.resize((size_t)NumPatches * NumPatches * PatchSize * PatchSize);
+
+    for (int PatchZ = 0; PatchZ < NumPatches; PatchZ++) {
+        for (int PatchX = 0; PatchX < NumPatches; PatchX++) {
+            int BaseX = PatchX * (PatchSize - 1);
+            int BaseZ = PatchZ * (PatchSize - 1);
+
+            for (int z = BaseZ; z < BaseZ + PatchSize; z++) {
+                for (int x = BaseX; x < BaseX + PatchSize; x++) {
+                    float Left = HeightMap.Get(std::max(x - 1, 0), z);
+                    float Right = HeightMap.Get(std::min(x + 1, TerrainSize - 1), z);
+                    float Up = HeightMap.Get(x, std::max(z - 1, 0));
+                    float Down = HeightMap.Get(x, std::min(z + 1, TerrainSize - 1));
+
+                    BenchmarkVertex& v = Vertices[Index++];
+                    v.Pos = Vector3f((float)x, HeightMap.Get(x, z), (float)z);
+                    v.Normal = Vector3f(Left - Right, 2.0f, Up - Down);
+                    v.Normal.Normalize();
+                }
+            }
+        }
+    }
+
+    // Keeps the compiler from dropping the work
+    return Vertices[Index / 2].Pos.y;
+}
+
+
+// Height range of every patch - what the culling code needs for the patch bounding boxes
+template<typename Layout>
+static float CalcPatchBounds(const Array2D<float, Layout>& HeightMap, int TerrainSize, int PatchSize)
+{
+    int NumPatches = (TerrainSize - 1) / (PatchSize - 1);
+    float Total = 0.0f;
+
+    for (int PatchZ = 0; PatchZ < NumPatches; PatchZ++) {
+        for (int PatchX = 0; PatchX < NumPatches; PatchX++) {
+            int BaseX = PatchX * (PatchSize - 1);
+            int BaseZ = PatchZ * (PatchSize - 1);
+
+            float Min = HeightMap.Get(BaseX, BaseZ);
+            float Max = Min;
+
+            for (int z = BaseZ; z < BaseZ + PatchSize; z++) {
+                for (int x = BaseX; x < BaseX + PatchSize; x++) {
+                    float y = HeightMap.Get(x, z);
+                    Min = std::min(Min, y);
+                    Max = std::max(Max, y);
+                }
+            }
+
+            Total += Max - Min;
+        }
+    }
+
+    return Total;
+}
+
+
+struct LayoutTimes {
+    long long GenSerial = 0;
+    long long GenParallel = 0;
+    long long PatchVertices = 0;
+    long long PatchBounds = 0;
+};
+
+
+template<typename Layout>
+static void RunLayout(int TerrainSize, int PatchSize, LayoutTimes& Times)
+{
+    Array2D<float, Layout> HeightMap;
+    std::vector<BenchmarkVertex> Vertices;
+    volatile float Sink = 0.0f;
+
+    // Best of a few runs to filter out the noise
+    Times.GenSerial = Times.GenParallel = Times.PatchVertices = Times.PatchBounds = -1;
+
+    for (int i = 0; i < NUM_BENCHMARK_RUNS; i++) {
+        long long Start = GetCurrentTimeMillis();
+        CreateMidpointDisplacementF32(HeightMap, TerrainSize, 1.0f, 1234, 1);
+        long long GenSerial = GetCurrentTimeMillis() - Start;
+
+        Start = GetCurrentTimeMillis();
+        CreateMidpointDisplacementF32(HeightMap, TerrainSize, 1.0f, 1234, 0);
+        long long GenParallel = GetCurrentTimeMillis() - Start;
+
+        Start = GetCurrentTimeMillis();
+        Sink = Sink + BuildPatchVertices(HeightMap, TerrainSize, PatchSize, Vertices);
+        long long PatchVertices = GetCurrentTimeMillis() - Start;
+
+        Start = GetCurrentTimeMillis();
+        Sink = Sink + CalcPatchBounds(HeightMap, TerrainSize, PatchSize);
+        long long PatchBounds = GetCurrentTimeMillis() - Start;
+
+        if ((Times.GenSerial < 0) || (GenSerial < Times.GenSerial)) {
+            Times.GenSerial = GenSerial;
+        }
+
+        if ((Times.GenParallel < 0) || (GenParallel < Times.GenParallel)) {
+            Times.GenParallel = GenParallel;
+        }
+
+        if ((Times.PatchVertices < 0) || (PatchVertices < Times.PatchVertices)) {
+            Times.PatchVertices = PatchVertices;
+        }
+
+        if ((Times.PatchBounds < 0) || (PatchBounds < Times.PatchBounds)) {
+            Times.PatchBounds = PatchBounds;
+        }
+    }
+}
+
+
+static void PrintTimes(const char* pName, long long RowMajor, long long Tiled)
+{
+    printf("%-32s %10lld %10lld %9.2fx\n", pName, RowMajor, Tiled, Tiled > 0 ? (float)RowMajor / (float)Tiled : 0.0f);
+}
+
+
+void RunArray2DLayoutBenchmark(int TerrainSize, int PatchSize)
+{
+    if ((TerrainSize - 1) % (PatchSize - 1) != 0) {
+        printf("%s: terrain size minus one (%d) must be divisible by patch size minus one (%d)\n", __FUNCTION__, TerrainSize - 1, PatchSize - 1);
+        exit(0);
+    }
+
+    printf("Array2D layout benchmark - %dx%d, patch size %d, best of %d runs\n", TerrainSize, TerrainSize, PatchSize, NUM_BENCHMARK_RUNS);
+
+    LayoutTimes RowMajor, Tiled;
+    RunLayout<Array2DRowMajor>(TerrainSize, PatchSize, RowMajor);
+    RunLayout<Array2DTiled<> >(TerrainSize, PatchSize, Tiled);
+
+    printf("%-32s %10s %10s %10s\n", "ms", "row major", "tiled 32", "speedup");
+    PrintTimes("midpoint displacement (serial)", RowMajor.GenSerial, Tiled.GenSerial);
+    PrintTimes("midpoint displacement (pool)", RowMajor.GenParallel, Tiled.GenParallel);
+    PrintTimes("patch vertex build", RowMajor.PatchVertices, Tiled.PatchVertices);
+    PrintTimes("patch height bounds", RowMajor.PatchBounds, Tiled.PatchBounds);
+}
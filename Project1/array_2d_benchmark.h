@@ -0,0 +1,9 @@
+#ifndef ARRAY_2D_BENCHMARK_H
+#define ARRAY_2D_BENCHMARK_H
+
+// Compares the row major and the tiled Array2D layouts on height map generation
+// and on patch by patch workloads (vertex build, culling bounds) and prints the
+// times. Doesn't need a GL context - run it with --bench-layout [size].
+void RunArray2DLayoutBenchmark(int TerrainSize, int PatchSize);
+
+#endif
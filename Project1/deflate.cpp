@@ -0,0 +1,946 @@
+#include <string.h>
+#include <queue>
+#include <algorithm>
+
+#include "deflate.h"
+
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_CODE_BITS 15
+#define MAX_CODE_LENGTH_BITS 7
+#define NUM_LITLEN_CODES 286
+#define NUM_DIST_CODES 30
+#define NUM_CODE_LENGTH_CODES 19
+
+// Codes up to this length are decoded with a single table lookup
+#define FAST_BITS 10
+
+#define HASH_BITS 15
+#define MAX_CHAIN 32
+#define MAX_BLOCK_TOKENS 32768
+
+static const u16 LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const u8 LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const u16 DistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                  4097, 6145, 8193, 12289, 16385, 24577 };
+static const u8 DistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Order of the code length code lengths in a dynamic block header
+static const u8 CodeLengthOrder[NUM_CODE_LENGTH_CODES] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+
+u32 CalcAdler32(u32 Adler, const u8* pData, size_t Size)
+{
+    u32 a = Adler & 0xFFFF;
+    u32 b = Adler >> 16;
+
+    while (Size > 0) {
+        // Largest run that can't overflow b before the modulo
+        size_t Run = std::min(Size, (size_t)5552);
+        Size -= Run;
+
+        for (size_t i = 0; i < Run; i++) {
+            a += pData[i];
+            b += a;
+        }
+
+        pData += Run;
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return (b << 16) | a;
+}
+
+
+u32 CalcAdler32Combine(u32 Adler1, u32 Adler2, size_t Size2)
+{
+    const u32 Base = 65521;
+
+    // a = a1 + a2 - 1 and b = b1 + b2 + Size2 * a1 - Size2, all mod Base
+    u32 Rem = (u32)(Size2 % Base);
+    u32 a = Adler1 & 0xFFFF;
+    u32 b = (Rem * a) % Base;
+
+    a += (Adler2 & 0xFFFF) + Base - 1;
+    b += (Adler1 >> 16) + (Adler2 >> 16) + Base - Rem;
+
+    a %= Base;
+    b %= Base;
+
+    return (b << 16) | a;
+}
+
+
+struct CRC32Table {
+    u32 Entries[256];
+
+    CRC32Table()
+    {
+        for (u32 i = 0; i < 256; i++) {
+            u32 c = i;
+
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            }
+
+            Entries[i] = c;
+        }
+    }
+};
+
+
+u32 CalcCRC32(u32 CRC, const u8* pData, size_t Size)
+{
+    static const CRC32Table Table;
+
+    CRC = ~CRC;
+
+    for (size_t i = 0; i < Size; i++) {
+        CRC = Table.Entries[(CRC ^ pData[i]) & 0xFF] ^ (CRC >> 8);
+    }
+
+    return ~CRC;
+}
+
+
+static u32 ReverseBits(u32 Code, int Length)
+{
+    u32 Reversed = 0;
+
+    for (int i = 0; i < Length; i++) {
+        Reversed = (Reversed << 1) | (Code & 1);
+        Code >>= 1;
+    }
+
+    return Reversed;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compression
+////////////////////////////////////////////////////////////////////////////////
+
+// Deflate wants the bits of the codes reversed (first bit in the lowest bit)
+class BitWriter {
+public:
+    BitWriter(std::vector<u8>& Out) : m_out(Out) {}
+
+    void Put(u32 Value, int NumBits)
+    {
+        m_bits |= (u64)Value << m_numBits;
+        m_numBits += NumBits;
+
+        while (m_numBits >= 8) {
+            m_out.push_back((u8)m_bits);
+            m_bits >>= 8;
+            m_numBits -= 8;
+        }
+    }
+
+    void Align()
+    {
+        if (m_numBits > 0) {
+            m_out.push_back((u8)m_bits);
+            m_bits = 0;
+            m_numBits = 0;
+        }
+    }
+
+private:
+    std::vector<u8>& m_out;
+    u64 m_bits = 0;
+    int m_numBits = 0;
+};
+
+
+struct Token {
+    u16 LitLen;     // literal byte or match length
+    u16 Dist;       // 0 for a literal
+};
+
+
+static int GetLengthCode(int Length)
+{
+    int v = Length - MIN_MATCH;
+
+    if (v < 8) {
+        return 257 + v;
+    }
+
+    if (Length == MAX_MATCH) {
+        return 285;
+    }
+
+    int Msb = 31;
+
+    while (!(v & (1 << Msb))) {
+        Msb--;
+    }
+
+    return 257 + 4 * (Msb - 1) + ((v >> (Msb - 2)) & 3);
+}
+
+
+static int GetDistCode(int Dist)
+{
+    int v = Dist - 1;
+
+    if (v < 4) {
+        return v;
+    }
+
+    int Msb = 31;
+
+    while (!(v & (1 << Msb))) {
+        Msb--;
+    }
+
+    return 2 * Msb + ((v >> (Msb - 1)) & 1);
+}
+
+
+// Huffman code lengths for the frequencies, limited to MaxLength bits. If the tree is
+// too deep the frequencies are flattened and it is built again. Always gives at least
+// two codes so that every code is complete.
+static void BuildLengths(const u32* pFreq, int NumSymbols, int MaxLength, u8* pLengths)
+{
+    memset(pLengths, 0, NumSymbols);
+
+    std::vector<int> Symbols;
+
+    for (int i = 0; i < NumSymbols; i++) {
+        if (pFreq[i] > 0) {
+            Symbols.push_back(i);
+        }
+    }
+
+    if (Symbols.size() < 2) {
+        int Used = Symbols.empty() ? 0 : Symbols[0];
+        pLengths[Used] = 1;
+        pLengths[Used == 0 ? 1 : 0] = 1;
+        return;
+    }
+
+    int NumLeaves = (int)Symbols.size();
+    std::vector<u64> Freq(NumLeaves);
+
+    for (int i = 0; i < NumLeaves; i++) {
+        Freq[i] = pFreq[Symbols[i]];
+    }
+
+    std::vector<int> Parent(2 * NumLeaves - 1);
+    std::vector<int> Depth(2 * NumLeaves - 1);
+
+    for (;;) {
+        typedef std::pair<u64, int> Node;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node> > Heap;
+
+        for (int i = 0; i < NumLeaves; i++) {
+            Heap.push(Node(Freq[i], i));
+        }
+
+        int NextNode = NumLeaves;
+
+        while (Heap.size() > 1) {
+            Node a = Heap.top();
+            Heap.pop();
+            Node b = Heap.top();
+            Heap.pop();
+
+            Parent[a.second] = NextNode;
+            Parent[b.second] = NextNode;
+            Heap.push(Node(a.first + b.first, NextNode));
+            NextNode++;
+        }
+
+        // Parents always come after their children
+        int Root = NextNode - 1;
+        Depth[Root] = 0;
+
+        for (int i = Root - 1; i >= 0; i--) {
+            Depth[i] = Depth[Parent[i]] + 1;
+        }
+
+        int MaxDepth = *std::max_element(Depth.begin(), Depth.begin() + NumLeaves);
+
+        if (MaxDepth <= MaxLength) {
+            for (int i = 0; i < NumLeaves; i++) {
+                pLengths[Symbols[i]] = (u8)Depth[i];
+            }
+
+            return;
+        }
+
+        for (int i = 0; i < NumLeaves; i++) {
+            Freq[i] = (Freq[i] >> 1) | 1;
+        }
+    }
+}
+
+
+// Canonical codes, already reversed for the bit writer
+static void MakeCodes(const u8* pLengths, int NumSymbols, u16* pCodes)
+{
+    int Count[MAX_CODE_BITS + 1] = { 0 };
+
+    for (int i = 0; i < NumSymbols; i++) {
+        Count[pLengths[i]]++;
+    }
+
+    Count[0] = 0;
+
+    u32 NextCode[MAX_CODE_BITS + 1] = { 0 };
+    u32 Code = 0;
+
+    for (int Length = 1; Length <= MAX_CODE_BITS; Length++) {
+        Code = (Code + Count[Length - 1]) << 1;
+        NextCode[Length] = Code;
+    }
+
+    for (int i = 0; i < NumSymbols; i++) {
+        int Length = pLengths[i];
+        pCodes[i] = Length ? (u16)ReverseBits(NextCode[Length]++, Length) : 0;
+    }
+}
+
+
+static void WriteDynamicBlock(BitWriter& Writer, const std::vector<Token>& Tokens, bool Final)
+{
+    u32 LitFreq[NUM_LITLEN_CODES] = { 0 };
+    u32 DistFreq[NUM_DIST_CODES] = { 0 };
+
+    for (size_t i = 0; i < Tokens.size(); i++) {
+        if (Tokens[i].Dist == 0) {
+            LitFreq[Tokens[i].LitLen]++;
+        } else {
+            LitFreq[GetLengthCode(Tokens[i].LitLen)]++;
+            DistFreq[GetDistCode(Tokens[i].Dist)]++;
+        }
+    }
+
+    LitFreq[256] = 1;
+
+    u8 Lengths[NUM_LITLEN_CODES + NUM_DIST_CODES];
+    u8* pLitLengths = Lengths;
+    u8 DistLengths[NUM_DIST_CODES];
+    u16 LitCodes[NUM_LITLEN_CODES];
+    u16 DistCodes[NUM_DIST_CODES];
+
+    BuildLengths(LitFreq, NUM_LITLEN_CODES, MAX_CODE_BITS, pLitLengths);
+    BuildLengths(DistFreq, NUM_DIST_CODES, MAX_CODE_BITS, DistLengths);
+    MakeCodes(pLitLengths, NUM_LITLEN_CODES, LitCodes);
+    MakeCodes(DistLengths, NUM_DIST_CODES, DistCodes);
+
+    int NumLit = NUM_LITLEN_CODES;
+
+    while ((NumLit > 257) && (pLitLengths[NumLit - 1] == 0)) {
+        NumLit--;
+    }
+
+    int NumDist = NUM_DIST_CODES;
+
+    while ((NumDist > 1) && (DistLengths[NumDist - 1] == 0)) {
+        NumDist--;
+    }
+
+    // The literal/length and distance code lengths are sent as one run length coded sequence
+    memcpy(Lengths + NumLit, DistLengths, NumDist);
+    int NumLengths = NumLit + NumDist;
+
+    std::vector<std::pair<u8, u8> > Runs;     // code length symbol, extra bits value
+    u32 CodeLengthFreq[NUM_CODE_LENGTH_CODES] = { 0 };
+
+    for (int i = 0; i < NumLengths;) {
+        u8 Length = Lengths[i];
+        int Run = 1;
+
+        while ((i + Run < NumLengths) && (Lengths[i + Run] == Length)) {
+            Run++;
+        }
+
+        if ((Length == 0) && (Run >= 3)) {
+            Run = std::min(Run, 138);
+            Runs.push_back(Run >= 11 ? std::make_pair((u8)18, (u8)(Run - 11)) : std::make_pair((u8)17, (u8)(Run - 3)));
+            i += Run;
+        } else if ((Length != 0) && (Run >= 4)) {
+            // The first one is sent as is and the rest repeat it
+            int Repeat = std::min(Run - 1, 6);
+            Runs.push_back(std::make_pair(Length, (u8)0));
+            Runs.push_back(std::make_pair((u8)16, (u8)(Repeat - 3)));
+            i += 1 + Repeat;
+        } else {
+            Runs.push_back(std::make_pair(Length, (u8)0));
+            i++;
+        }
+    }
+
+    for (size_t i = 0; i < Runs.size(); i++) {
+        CodeLengthFreq[Runs[i].first]++;
+    }
+
+    u8 CodeLengthLengths[NUM_CODE_LENGTH_CODES];
+    u16 CodeLengthCodes[NUM_CODE_LENGTH_CODES];
+    BuildLengths(CodeLengthFreq, NUM_CODE_LENGTH_CODES, MAX_CODE_LENGTH_BITS, CodeLengthLengths);
+    MakeCodes(CodeLengthLengths, NUM_CODE_LENGTH_CODES, CodeLengthCodes);
+
+    int NumCodeLengths = NUM_CODE_LENGTH_CODES;
+
+    while ((NumCodeLengths > 4) && (CodeLengthLengths[CodeLengthOrder[NumCodeLengths - 1]] == 0)) {
+        NumCodeLengths--;
+    }
+
+    Writer.Put(Final ? 1 : 0, 1);
+    Writer.Put(2, 2);
+    Writer.Put(NumLit - 257, 5);
+    Writer.Put(NumDist - 1, 5);
+    Writer.Put(NumCodeLengths - 4, 4);
+
+    for (int i = 0; i < NumCodeLengths; i++) {
+        Writer.Put(CodeLengthLengths[CodeLengthOrder[i]], 3);
+    }
+
+    static const int RunExtraBits[3] = { 2, 3, 7 };
+
+    for (size_t i = 0; i < Runs.size(); i++) {
+        u8 Symbol = Runs[i].first;
+        Writer.Put(CodeLengthCodes[Symbol], CodeLengthLengths[Symbol]);
+
+        if (Symbol >= 16) {
+            Writer.Put(Runs[i].second, RunExtraBits[Symbol - 16]);
+        }
+    }
+
+    for (size_t i = 0; i < Tokens.size(); i++) {
+        const Token& t = Tokens[i];
+
+        if (t.Dist == 0) {
+            Writer.Put(LitCodes[t.LitLen], pLitLengths[t.LitLen]);
+            continue;
+        }
+
+        int LengthCode = GetLengthCode(t.LitLen);
+        Writer.Put(LitCodes[LengthCode], pLitLengths[LengthCode]);
+        Writer.Put(t.LitLen - LengthBase[LengthCode - 257], LengthExtra[LengthCode - 257]);
+
+        int DistCode = GetDistCode(t.Dist);
+        Writer.Put(DistCodes[DistCode], DistLengths[DistCode]);
+        Writer.Put(t.Dist - DistBase[DistCode], DistExtra[DistCode]);
+    }
+
+    Writer.Put(LitCodes[256], pLitLengths[256]);
+}
+
+
+static u32 Hash3(const u8* p)
+{
+    return (((u32)p[0] << 16 | (u32)p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+void DeflateChunk(const u8* pData, size_t Size, bool Final, std::vector<u8>& Out)
+{
+    // Greedy LZ77 over hash chains - the most recent MAX_CHAIN candidates are tried
+    thread_local std::vector<i32> Head;
+    thread_local std::vector<i32> Prev;
+    thread_local std::vector<Token> Tokens;
+
+    Head.assign((size_t)1 << HASH_BITS, -1);
+    Prev.resize(Size);
+    Tokens.clear();
+
+    BitWriter Writer(Out);
+
+    size_t Pos = 0;
+
+    while (Pos < Size) {
+        size_t BestLength = 0;
+        size_t BestDist = 0;
+
+        if (Pos + MIN_MATCH <= Size) {
+            u32 Hash = Hash3(pData + Pos);
+            i32 Candidate = Head[Hash];
+            Prev[Pos] = Candidate;
+            Head[Hash] = (i32)Pos;
+
+            size_t MaxLength = std::min((size_t)MAX_MATCH, Size - Pos);
+            int Chain = MAX_CHAIN;
+
+            while ((Candidate >= 0) && (Pos - Candidate <= WINDOW_SIZE) && (Chain-- > 0)) {
+                const u8* a = pData + Candidate;
+                const u8* b = pData + Pos;
+
+                if (a[BestLength] == b[BestLength]) {
+                    size_t Length = 0;
+
+                    while ((Length < MaxLength) && (a[Length] == b[Length])) {
+                        Length++;
+                    }
+
+                    if (Length > BestLength) {
+                        BestLength = Length;
+                        BestDist = Pos - Candidate;
+
+                        if (Length == MaxLength) {
+                            break;
+                        }
+                    }
+                }
+
+                Candidate = Prev[Candidate];
+            }
+        }
+
+        if (BestLength >= MIN_MATCH) {
+            Token t = { (u16)BestLength, (u16)BestDist };
+            Tokens.push_back(t);
+
+            for (size_t i = Pos + 1; (i < Pos + BestLength) && (i + MIN_MATCH <= Size); i++) {
+                u32 Hash = Hash3(pData + i);
+                Prev[i] = Head[Hash];
+                Head[Hash] = (i32)i;
+            }
+
+            Pos += BestLength;
+        } else {
+            Token t = { pData[Pos], 0 };
+            Tokens.push_back(t);
+            Pos++;
+        }
+
+        if ((Tokens.size() == MAX_BLOCK_TOKENS) && (Pos < Size)) {
+            WriteDynamicBlock(Writer, Tokens, false);
+            Tokens.clear();
+        }
+    }
+
+    WriteDynamicBlock(Writer, Tokens, Final);
+
+    if (!Final) {
+        // Sync flush - an empty stored block ends on a byte boundary
+        Writer.Put(0, 3);
+        Writer.Align();
+        Writer.Put(0x0000, 16);
+        Writer.Put(0xFFFF, 16);
+    }
+
+    Writer.Align();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Decompression
+////////////////////////////////////////////////////////////////////////////////
+
+struct Inflater::HuffmanTable {
+    u16 Count[MAX_CODE_BITS + 1];           // number of codes of every length
+    u16 Symbol[NUM_LITLEN_CODES + 2];       // sorted by code
+    u16 Fast[1 << FAST_BITS];               // Length << 9 | Symbol, 0 for longer codes
+};
+
+
+static bool BuildTable(Inflater::HuffmanTable& Table, const u8* pLengths, int NumSymbols)
+{
+    memset(Table.Count, 0, sizeof(Table.Count));
+
+    for (int i = 0; i < NumSymbols; i++) {
+        Table.Count[pLengths[i]]++;
+    }
+
+    Table.Count[0] = 0;
+
+    int Left = 1;
+
+    for (int Length = 1; Length <= MAX_CODE_BITS; Length++) {
+        Left = (Left << 1) - Table.Count[Length];
+
+        if (Left < 0) {
+            return false;   // over subscribed
+        }
+    }
+
+    u16 Offset[MAX_CODE_BITS + 1];
+    Offset[1] = 0;
+
+    for (int Length = 1; Length < MAX_CODE_BITS; Length++) {
+        Offset[Length + 1] = Offset[Length] + Table.Count[Length];
+    }
+
+    u32 NextCode[MAX_CODE_BITS + 1] = { 0 };
+    u32 Code = 0;
+
+    for (int Length = 1; Length <= MAX_CODE_BITS; Length++) {
+        Code = (Code + Table.Count[Length - 1]) << 1;
+        NextCode[Length] = Code;
+    }
+
+    memset(Table.Fast, 0, sizeof(Table.Fast));
+
+    for (int i = 0; i < NumSymbols; i++) {
+        int Length = pLengths[i];
+
+        if (Length == 0) {
+            continue;
+        }
+
+        Table.Symbol[Offset[Length]++] = (u16)i;
+
+        u32 Reversed = ReverseBits(NextCode[Length]++, Length);
+
+        if (Length <= FAST_BITS) {
+            for (u32 j = Reversed; j < (1u << FAST_BITS); j += 1u << Length) {
+                Table.Fast[j] = (u16)(Length << 9 | i);
+            }
+        }
+    }
+
+    return true;
+}
+
+
+struct FixedTables {
+    Inflater::HuffmanTable LitLen;
+    Inflater::HuffmanTable Dist;
+
+    FixedTables()
+    {
+        u8 Lengths[288];
+        memset(Lengths, 8, 144);
+        memset(Lengths + 144, 9, 112);
+        memset(Lengths + 256, 7, 24);
+        memset(Lengths + 280, 8, 8);
+        BuildTable(LitLen, Lengths, 288);
+
+        memset(Lengths, 5, NUM_DIST_CODES);
+        BuildTable(Dist, Lengths, NUM_DIST_CODES);
+    }
+};
+
+
+static const FixedTables& GetFixedTables()
+{
+    static const FixedTables Tables;
+
+    return Tables;
+}
+
+
+bool Inflater::Refill(int NumBits)
+{
+    while (m_numBits <= 56) {
+        if (m_pIn == m_pInEnd) {
+            if (m_endOfInput) {
+                break;
+            }
+
+            size_t Size = m_source(m_pIn);
+
+            if (Size == 0) {
+                m_pIn = m_pInEnd = NULL;
+                m_endOfInput = true;
+                break;
+            }
+
+            m_pInEnd = m_pIn + Size;
+        }
+
+        m_bits |= (u64)(*m_pIn++) << m_numBits;
+        m_numBits += 8;
+    }
+
+    return m_numBits >= NumBits;
+}
+
+
+u32 Inflater::GetBits(int NumBits)
+{
+    if ((m_numBits < NumBits) && !Refill(NumBits)) {
+        m_error = true;
+        return 0;
+    }
+
+    u32 Value = (u32)(m_bits & ((1ull << NumBits) - 1));
+    m_bits >>= NumBits;
+    m_numBits -= NumBits;
+
+    return Value;
+}
+
+
+int Inflater::Decode(const HuffmanTable& Table)
+{
+    if (m_numBits < MAX_CODE_BITS) {
+        Refill(MAX_CODE_BITS);
+    }
+
+    u16 Entry = Table.Fast[m_bits & ((1 << FAST_BITS) - 1)];
+    int Length = Entry >> 9;
+
+    if (Entry && (Length <= m_numBits)) {
+        m_bits >>= Length;
+        m_numBits -= Length;
+        return Entry & 511;
+    }
+
+    // Canonical decoding one bit at a time
+    int Code = 0;
+    int First = 0;
+    int Index = 0;
+
+    for (Length = 1; Length <= MAX_CODE_BITS; Length++) {
+        if (m_numBits == 0) {
+            return -1;
+        }
+
+        Code |= (int)(m_bits & 1);
+        m_bits >>= 1;
+        m_numBits--;
+
+        int Count = Table.Count[Length];
+
+        if (Code - Count < First) {
+            return Table.Symbol[Index + (Code - First)];
+        }
+
+        Index += Count;
+        First = (First + Count) << 1;
+        Code <<= 1;
+    }
+
+    return -1;
+}
+
+
+// Keeps the last WINDOW_SIZE bytes for the matches and passes the rest to the sink
+void Inflater::MakeRoom()
+{
+    if (m_pos <= m_window.size() - MAX_MATCH) {
+        return;
+    }
+
+    (*m_pSink)(&m_window[m_flushed], m_pos - m_flushed);
+
+    memmove(&m_window[0], &m_window[m_pos - WINDOW_SIZE], WINDOW_SIZE);
+    m_pos = WINDOW_SIZE;
+    m_flushed = WINDOW_SIZE;
+}
+
+
+bool Inflater::InflateStored()
+{
+    m_bits >>= m_numBits & 7;
+    m_numBits -= m_numBits & 7;
+
+    u32 Length = GetBits(16);
+    u32 NLength = GetBits(16);
+
+    if (m_error || (Length != (~NLength & 0xFFFF))) {
+        return false;
+    }
+
+    while (Length > 0) {
+        MakeRoom();
+
+        // Whatever is left in the bit buffer first, then straight from the input
+        if (m_numBits >= 8) {
+            m_window[m_pos++] = (u8)m_bits;
+            m_bits >>= 8;
+            m_numBits -= 8;
+            Length--;
+            continue;
+        }
+
+        if (m_pIn == m_pInEnd) {
+            if (!Refill(8)) {
+                return false;
+            }
+
+            continue;
+        }
+
+        size_t Size = std::min((size_t)Length, std::min((size_t)(m_pInEnd - m_pIn), m_window.size() - m_pos));
+        memcpy(&m_window[m_pos], m_pIn, Size);
+        m_pos += Size;
+        m_pIn += Size;
+        Length -= (u32)Size;
+    }
+
+    return true;
+}
+
+
+bool Inflater::InflateCodes(const HuffmanTable& LitLen, const HuffmanTable& Dist)
+{
+    for (;;) {
+        MakeRoom();
+
+        int Symbol = Decode(LitLen);
+
+        if (Symbol < 256) {
+            if (Symbol < 0) {
+                return false;
+            }
+
+            m_window[m_pos++] = (u8)Symbol;
+            continue;
+        }
+
+        if (Symbol == 256) {
+            return true;
+        }
+
+        Symbol -= 257;
+
+        if (Symbol >= 29) {
+            return false;
+        }
+
+        u32 Length = LengthBase[Symbol] + GetBits(LengthExtra[Symbol]);
+
+        int DistSymbol = Decode(Dist);
+
+        if ((DistSymbol < 0) || (DistSymbol >= NUM_DIST_CODES)) {
+            return false;
+        }
+
+        size_t Distance = DistBase[DistSymbol] + GetBits(DistExtra[DistSymbol]);
+
+        if (m_error || (Distance > m_pos)) {
+            return false;
+        }
+
+        // Byte by byte - the match may overlap the bytes it produces
+        u8* pOut = &m_window[m_pos];
+        const u8* pMatch = pOut - Distance;
+
+        for (u32 i = 0; i < Length; i++) {
+            pOut[i] = pMatch[i];
+        }
+
+        m_pos += Length;
+    }
+}
+
+
+bool Inflater::ReadDynamicTables(HuffmanTable& LitLen, HuffmanTable& Dist)
+{
+    u32 NumLit = GetBits(5) + 257;
+    u32 NumDist = GetBits(5) + 1;
+    u32 NumCodeLengths = GetBits(4) + 4;
+
+    if (m_error || (NumLit > NUM_LITLEN_CODES) || (NumDist > NUM_DIST_CODES)) {
+        return false;
+    }
+
+    u8 CodeLengthLengths[NUM_CODE_LENGTH_CODES] = { 0 };
+
+    for (u32 i = 0; i < NumCodeLengths; i++) {
+        CodeLengthLengths[CodeLengthOrder[i]] = (u8)GetBits(3);
+    }
+
+    HuffmanTable CodeLengths;
+
+    if (m_error || !BuildTable(CodeLengths, CodeLengthLengths, NUM_CODE_LENGTH_CODES)) {
+        return false;
+    }
+
+    u8 Lengths[NUM_LITLEN_CODES + NUM_DIST_CODES];
+    u32 Num = 0;
+
+    while (Num < NumLit + NumDist) {
+        int Symbol = Decode(CodeLengths);
+
+        if (Symbol < 0) {
+            return false;
+        }
+
+        if (Symbol < 16) {
+            Lengths[Num++] = (u8)Symbol;
+            continue;
+        }
+
+        u8 Value = 0;
+        u32 Repeat = 0;
+
+        if (Symbol == 16) {
+            if (Num == 0) {
+                return false;
+            }
+
+            Value = Lengths[Num - 1];
+            Repeat = 3 + GetBits(2);
+        } else if (Symbol == 17) {
+            Repeat = 3 + GetBits(3);
+        } else {
+            Repeat = 11 + GetBits(7);
+        }
+
+        if (m_error || (Num + Repeat > NumLit + NumDist)) {
+            return false;
+        }
+
+        memset(Lengths + Num, Value, Repeat);
+        Num += Repeat;
+    }
+
+    // A block without an end of block code can't end
+    if (Lengths[256] == 0) {
+        return false;
+    }
+
+    return BuildTable(LitLen, Lengths, NumLit) && BuildTable(Dist, Lengths + NumLit, NumDist);
+}
+
+
+bool Inflater::Inflate(const SinkFunc& Sink)
+{
+    m_pSink = &Sink;
+    m_window.resize(WINDOW_SIZE * 2);
+    m_pos = 0;
+    m_flushed = 0;
+
+    bool Ok = true;
+    bool Last = false;
+
+    while (Ok && !Last) {
+        Last = GetBits(1) != 0;
+        u32 Type = GetBits(2);
+
+        if (m_error) {
+            Ok = false;
+        } else if (Type == 0) {
+            Ok = InflateStored();
+        } else if (Type == 1) {
+            Ok = InflateCodes(GetFixedTables().LitLen, GetFixedTables().Dist);
+        } else if (Type == 2) {
+            HuffmanTable LitLen, Dist;
+            Ok = ReadDynamicTables(LitLen, Dist) && InflateCodes(LitLen, Dist);
+        } else {
+            Ok = false;
+        }
+
+        Ok = Ok && !m_error;
+    }
+
+    if (Ok) {
+        Sink(&m_window[m_flushed], m_pos - m_flushed);
+    }
+
+    m_pSink = NULL;
+
+    return Ok;
+}
+
+
+bool Inflater::ReadBytes(u8* pData, size_t Size)
+{
+    m_bits >>= m_numBits & 7;
+    m_numBits -= m_numBits & 7;
+
+    for (size_t i = 0; i < Size; i++) {
+        pData[i] = (u8)GetBits(8);
+    }
+
+    return !m_error;
+}
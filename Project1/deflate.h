@@ -0,0 +1,77 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <vector>
+#include <functional>
+
+#include "ogldev_types.h"
+
+// Deflate (RFC 1951) compression and decompression plus the checksums of the zlib
+// and PNG formats. Only what the height map PNG code needs - the stb libraries
+// either decode the whole image at once or can't write 16 bit.
+
+u32 CalcAdler32(u32 Adler, const u8* pData, size_t Size);
+
+// Adler-32 of two pieces of data one after the other from the checksums of the
+// pieces - Size2 is the size of the second one
+u32 CalcAdler32Combine(u32 Adler1, u32 Adler2, size_t Size2);
+
+u32 CalcCRC32(u32 CRC, const u8* pData, size_t Size);
+
+// Compresses Size bytes as dynamic Huffman blocks and appends them to Out. The data
+// doesn't refer to earlier calls so several pieces can be compressed independently.
+// Unless Final is set the output ends with a sync flush (an empty stored block) so
+// it is byte aligned and the compressed pieces can be concatenated into one stream.
+void DeflateChunk(const u8* pData, size_t Size, bool Final, std::vector<u8>& Out);
+
+
+// Decompresses a raw deflate stream while pulling the input from Source in pieces
+// of any size and passing the output to Sink as it's produced, so neither side
+// has to be in memory as a whole. Errors in the stream make the calls return false.
+class Inflater {
+public:
+    // Sets pData to the next piece of input and returns its size - 0 at the end
+    typedef std::function<size_t(const u8*& pData)> SourceFunc;
+
+    typedef std::function<void(const u8* pData, size_t Size)> SinkFunc;
+
+    Inflater(const SourceFunc& Source) : m_source(Source) {}
+
+    // Decompresses up to the end of the final block
+    bool Inflate(const SinkFunc& Sink);
+
+    // Reads whole bytes from the input, e.g. the zlib header and trailer around the
+    // deflate stream
+    bool ReadBytes(u8* pData, size_t Size);
+
+    struct HuffmanTable;
+
+private:
+    bool Refill(int NumBits);
+
+    u32 GetBits(int NumBits);
+
+    int Decode(const HuffmanTable& Table);
+
+    bool InflateStored();
+
+    bool InflateCodes(const HuffmanTable& LitLen, const HuffmanTable& Dist);
+
+    bool ReadDynamicTables(HuffmanTable& LitLen, HuffmanTable& Dist);
+
+    void MakeRoom();
+
+    SourceFunc m_source;
+    const u8* m_pIn = NULL;
+    const u8* m_pInEnd = NULL;
+    bool m_endOfInput = false;
+    u64 m_bits = 0;
+    int m_numBits = 0;
+    bool m_error = false;       // set by GetBits when the input ends early
+    std::vector<u8> m_window;
+    size_t m_pos = 0;
+    size_t m_flushed = 0;
+    const SinkFunc* m_pSink = NULL;
+};
+
+#endif
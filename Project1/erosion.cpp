@@ -0,0 +1,520 @@
+#include <math.h>
+#include <algorithm>
+
+#include "erosion.h"
+#include "ogldev_util.h"
+#include "thread_pool.h"
+#include "simd_utils.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define MIN_ROWS_PER_BAND 16
+
+// Avoids a division by zero for cells without water or lower neighbours
+#define MIN_FLOW_DENOM 1e-20f
+
+// Direction of the flux arrays
+enum {
+    FLUX_LEFT = 0,     // x - 1
+    FLUX_RIGHT = 1,    // x + 1
+    FLUX_UP = 2,       // z - 1
+    FLUX_DOWN = 3,     // z + 1
+    NUM_FLUX_DIRS = 4
+};
+
+
+// Rows of the hydraulic state needed to update row z of the transport pass
+struct TransportRows {
+    const float* pWater[3];        // rows z - 1, z, z + 1
+    const float* pSediment[3];
+    const float* pFlux[NUM_FLUX_DIRS];
+    const float* pFluxDownAbove;   // FLUX_DOWN of row z - 1
+    const float* pFluxUpBelow;     // FLUX_UP of row z + 1
+    float* pHeight;
+    float* pNewWater;
+    float* pNewSediment;
+};
+
+
+// Runs the erosion iterations on a height map. The passes are Jacobi style - each
+// one reads the previous state and writes a new one - so every cell of a pass can
+// be computed independently.
+class Eroder {
+public:
+    Eroder(Array2D<float>& HeightMap, const ErosionParams& Params);
+
+    void Run();
+
+private:
+    void FlowPass();
+    void TransportPass();
+    void ThermalPass();
+    void DepositSediment();
+
+    void FlowCell(int x, int z);
+    void TransportCell(int x, int z);
+    void ThermalCell(int x, int z);
+
+    void GetTransportRows(int z, TransportRows& Rows);
+
+    Array2D<float>& m_heightMap;
+    ErosionParams m_params;
+    int m_cols = 0;
+    int m_rows = 0;
+    bool m_useAVX2 = false;
+
+    Array2D<float> m_newHeight;
+    Array2D<float> m_water;
+    Array2D<float> m_sediment;
+    Array2D<float> m_newWater;
+    Array2D<float> m_newSediment;
+    Array2D<float> m_flux[NUM_FLUX_DIRS];   // fraction of the water (and sediment) that leaves a cell in each direction
+};
+
+
+//
+// Scalar building blocks - also used for the border cells when the interior runs in SIMD
+//
+
+static inline float ThermalExchange(float Diff, float Talus)
+{
+    float Excess = std::max(fabsf(Diff) - Talus, 0.0f);
+
+    return copysignf(Excess, Diff);
+}
+
+
+static inline void CalcFlow(float Surface, float Water, const float NeighborSurface[NUM_FLUX_DIRS], float Rain, float Flux[NUM_FLUX_DIRS])
+{
+    float Drop[NUM_FLUX_DIRS];
+
+    for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+        Drop[i] = std::max(Surface - NeighborSurface[i], 0.0f);
+    }
+
+    float DropSum = ((Drop[0] + Drop[1]) + Drop[2]) + Drop[3];
+    float w = Water + Rain;
+
+    // Never more than the water in the cell and never more than what levels it with its neighbours
+    float Out = std::min(w, DropSum * 0.25f);
+    float k = Out / std::max(DropSum * w, MIN_FLOW_DENOM);
+
+    for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+        Flux[i] = Drop[i] * k;
+    }
+}
+
+
+#ifdef SIMD_X86
+
+//
+// AVX2 spans - eight interior cells of a row at a time, following the scalar code
+// operation by operation (up to rounding where the compiler fuses a multiply-add)
+//
+
+SIMD_TARGET_AVX2 static int ThermalSpan_AVX2(const float* pUp, const float* pCur, const float* pDown, float* pDst,
+                                             int Begin, int End, float Talus, float Rate)
+{
+    const __m256 SignMask = _mm256_set1_ps(-0.0f);
+    const __m256 vTalus = _mm256_set1_ps(Talus);
+    const __m256 vRate = _mm256_set1_ps(Rate);
+    const __m256 Zero = _mm256_setzero_ps();
+
+    int x = Begin;
+
+    for (; x + 8 <= End; x += 8) {
+        __m256 h = _mm256_loadu_ps(pCur + x);
+
+        __m256 Diff[4];
+        Diff[0] = _mm256_sub_ps(_mm256_loadu_ps(pCur + x - 1), h);
+        Diff[1] = _mm256_sub_ps(_mm256_loadu_ps(pCur + x + 1), h);
+        Diff[2] = _mm256_sub_ps(_mm256_loadu_ps(pUp + x), h);
+        Diff[3] = _mm256_sub_ps(_mm256_loadu_ps(pDown + x), h);
+
+        __m256 Exchange[4];
+
+        for (int i = 0; i < 4; i++) {
+            __m256 Excess = _mm256_max_ps(_mm256_sub_ps(_mm256_andnot_ps(SignMask, Diff[i]), vTalus), Zero);
+            Exchange[i] = _mm256_or_ps(Excess, _mm256_and_ps(Diff[i], SignMask));
+        }
+
+        __m256 Sum = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(Exchange[0], Exchange[1]), Exchange[2]), Exchange[3]);
+
+        _mm256_storeu_ps(pDst + x, _mm256_add_ps(h, _mm256_mul_ps(vRate, Sum)));
+    }
+
+    return x;
+}
+
+
+SIMD_TARGET_AVX2 static int FlowSpan_AVX2(const float* pHeight[3], const float* pWater[3], float* pFlux[NUM_FLUX_DIRS],
+                                          int Begin, int End, float Rain)
+{
+    const __m256 Zero = _mm256_setzero_ps();
+    const __m256 vRain = _mm256_set1_ps(Rain);
+    const __m256 Quarter = _mm256_set1_ps(0.25f);
+    const __m256 MinDenom = _mm256_set1_ps(MIN_FLOW_DENOM);
+
+    int x = Begin;
+
+    for (; x + 8 <= End; x += 8) {
+        __m256 Water = _mm256_loadu_ps(pWater[1] + x);
+        __m256 Surface = _mm256_add_ps(_mm256_loadu_ps(pHeight[1] + x), Water);
+
+        __m256 Neighbor[NUM_FLUX_DIRS];
+        Neighbor[FLUX_LEFT] = _mm256_add_ps(_mm256_loadu_ps(pHeight[1] + x - 1), _mm256_loadu_ps(pWater[1] + x - 1));
+        Neighbor[FLUX_RIGHT] = _mm256_add_ps(_mm256_loadu_ps(pHeight[1] + x + 1), _mm256_loadu_ps(pWater[1] + x + 1));
+        Neighbor[FLUX_UP] = _mm256_add_ps(_mm256_loadu_ps(pHeight[0] + x), _mm256_loadu_ps(pWater[0] + x));
+        Neighbor[FLUX_DOWN] = _mm256_add_ps(_mm256_loadu_ps(pHeight[2] + x), _mm256_loadu_ps(pWater[2] + x));
+
+        __m256 Drop[NUM_FLUX_DIRS];
+
+        for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+            Drop[i] = _mm256_max_ps(_mm256_sub_ps(Surface, Neighbor[i]), Zero);
+        }
+
+        __m256 DropSum = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(Drop[0], Drop[1]), Drop[2]), Drop[3]);
+        __m256 w = _mm256_add_ps(Water, vRain);
+        __m256 Out = _mm256_min_ps(w, _mm256_mul_ps(DropSum, Quarter));
+        __m256 k = _mm256_div_ps(Out, _mm256_max_ps(_mm256_mul_ps(DropSum, w), MinDenom));
+
+        for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+            _mm256_storeu_ps(pFlux[i] + x, _mm256_mul_ps(Drop[i], k));
+        }
+    }
+
+    return x;
+}
+
+
+SIMD_TARGET_AVX2 static int TransportSpan_AVX2(const TransportRows& r, int Begin, int End, const ErosionParams& Params)
+{
+    const __m256 Zero = _mm256_setzero_ps();
+    const __m256 One = _mm256_set1_ps(1.0f);
+    const __m256 vRain = _mm256_set1_ps(Params.Rain);
+    const __m256 Capacity = _mm256_set1_ps(Params.SedimentCapacity);
+    const __m256 ErosionRate = _mm256_set1_ps(Params.ErosionRate);
+    const __m256 DepositionRate = _mm256_set1_ps(Params.DepositionRate);
+    const __m256 Retain = _mm256_set1_ps(1.0f - Params.Evaporation);
+
+    int x = Begin;
+
+    for (; x + 8 <= End; x += 8) {
+        __m256 w = _mm256_add_ps(_mm256_loadu_ps(r.pWater[1] + x), vRain);
+        __m256 s = _mm256_loadu_ps(r.pSediment[1] + x);
+
+        __m256 FluxOut = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(r.pFlux[FLUX_LEFT] + x),
+                                                                   _mm256_loadu_ps(r.pFlux[FLUX_RIGHT] + x)),
+                                                     _mm256_loadu_ps(r.pFlux[FLUX_UP] + x)),
+                                       _mm256_loadu_ps(r.pFlux[FLUX_DOWN] + x));
+
+        // What the neighbours send towards this cell
+        __m256 FromLeft = _mm256_loadu_ps(r.pFlux[FLUX_RIGHT] + x - 1);
+        __m256 FromRight = _mm256_loadu_ps(r.pFlux[FLUX_LEFT] + x + 1);
+        __m256 FromUp = _mm256_loadu_ps(r.pFluxDownAbove + x);
+        __m256 FromDown = _mm256_loadu_ps(r.pFluxUpBelow + x);
+
+        __m256 WaterIn = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(r.pWater[1] + x - 1), vRain), FromLeft);
+        WaterIn = _mm256_add_ps(WaterIn, _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(r.pWater[1] + x + 1), vRain), FromRight));
+        WaterIn = _mm256_add_ps(WaterIn, _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(r.pWater[0] + x), vRain), FromUp));
+        WaterIn = _mm256_add_ps(WaterIn, _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(r.pWater[2] + x), vRain), FromDown));
+
+        __m256 SedimentIn = _mm256_mul_ps(_mm256_loadu_ps(r.pSediment[1] + x - 1), FromLeft);
+        SedimentIn = _mm256_add_ps(SedimentIn, _mm256_mul_ps(_mm256_loadu_ps(r.pSediment[1] + x + 1), FromRight));
+        SedimentIn = _mm256_add_ps(SedimentIn, _mm256_mul_ps(_mm256_loadu_ps(r.pSediment[0] + x), FromUp));
+        SedimentIn = _mm256_add_ps(SedimentIn, _mm256_mul_ps(_mm256_loadu_ps(r.pSediment[2] + x), FromDown));
+
+        __m256 Keep = _mm256_sub_ps(One, FluxOut);
+        __m256 NewWater = _mm256_add_ps(_mm256_mul_ps(w, Keep), WaterIn);
+        __m256 NewSediment = _mm256_add_ps(_mm256_mul_ps(s, Keep), SedimentIn);
+
+        __m256 Diff = _mm256_sub_ps(_mm256_mul_ps(Capacity, _mm256_mul_ps(w, FluxOut)), NewSediment);
+        __m256 Amount = _mm256_add_ps(_mm256_mul_ps(ErosionRate, _mm256_max_ps(Diff, Zero)),
+                                      _mm256_mul_ps(DepositionRate, _mm256_min_ps(Diff, Zero)));
+
+        _mm256_storeu_ps(r.pHeight + x, _mm256_sub_ps(_mm256_loadu_ps(r.pHeight + x), Amount));
+        _mm256_storeu_ps(r.pNewSediment + x, _mm256_add_ps(NewSediment, Amount));
+        _mm256_storeu_ps(r.pNewWater + x, _mm256_mul_ps(NewWater, Retain));
+    }
+
+    return x;
+}
+
+#endif
+
+
+Eroder::Eroder(Array2D<float>& HeightMap, const ErosionParams& Params) : m_heightMap(HeightMap), m_params(Params)
+{
+    m_cols = HeightMap.GetCols();
+    m_rows = HeightMap.GetRows();
+
+#ifdef SIMD_X86
+    m_useAVX2 = (GetSimdLevel() == SIMD_LEVEL_AVX2);
+#endif
+
+    m_newHeight.InitArray2D(m_cols, m_rows);
+    m_water.InitArray2D(m_cols, m_rows, 0.0f);
+    m_sediment.InitArray2D(m_cols, m_rows, 0.0f);
+    m_newWater.InitArray2D(m_cols, m_rows);
+    m_newSediment.InitArray2D(m_cols, m_rows);
+
+    for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+        m_flux[i].InitArray2D(m_cols, m_rows);
+    }
+}
+
+
+void Eroder::Run()
+{
+    for (int i = 0; i < m_params.Iterations; i++) {
+        FlowPass();
+
+        TransportPass();
+
+        ThermalPass();
+    }
+
+    DepositSediment();
+}
+
+
+// Splits the outflow of every cell between its lower neighbours
+void Eroder::FlowPass()
+{
+    GetThreadPool().ParallelFor(0, m_rows, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            int x = 0;
+
+            if ((z > 0) && (z < m_rows - 1)) {
+                FlowCell(0, z);
+                x = 1;
+#ifdef SIMD_X86
+                if (m_useAVX2) {
+                    const float* pHeight[3] = { m_heightMap.GetAddr(0, z - 1), m_heightMap.GetAddr(0, z), m_heightMap.GetAddr(0, z + 1) };
+                    const float* pWater[3] = { m_water.GetAddr(0, z - 1), m_water.GetAddr(0, z), m_water.GetAddr(0, z + 1) };
+                    float* pFlux[NUM_FLUX_DIRS];
+
+                    for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+                        pFlux[i] = m_flux[i].GetAddr(0, z);
+                    }
+
+                    x = FlowSpan_AVX2(pHeight, pWater, pFlux, 1, m_cols - 1, m_params.Rain);
+                }
+#endif
+            }
+
+            for (; x < m_cols; x++) {
+                FlowCell(x, z);
+            }
+        }
+    });
+}
+
+
+// Moves water and sediment along the flux and erodes/deposits depending on how
+// much sediment the water that left the cell could carry
+void Eroder::TransportPass()
+{
+    GetThreadPool().ParallelFor(0, m_rows, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            int x = 0;
+
+            if ((z > 0) && (z < m_rows - 1)) {
+                TransportCell(0, z);
+                x = 1;
+#ifdef SIMD_X86
+                if (m_useAVX2) {
+                    TransportRows Rows;
+                    GetTransportRows(z, Rows);
+                    x = TransportSpan_AVX2(Rows, 1, m_cols - 1, m_params);
+                }
+#endif
+            }
+
+            for (; x < m_cols; x++) {
+                TransportCell(x, z);
+            }
+        }
+    });
+
+    m_water.Swap(m_newWater);
+    m_sediment.Swap(m_newSediment);
+}
+
+
+void Eroder::ThermalPass()
+{
+    GetThreadPool().ParallelFor(0, m_rows, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            int x = 0;
+
+            if ((z > 0) && (z < m_rows - 1)) {
+                ThermalCell(0, z);
+                x = 1;
+#ifdef SIMD_X86
+                if (m_useAVX2) {
+                    x = ThermalSpan_AVX2(m_heightMap.GetAddr(0, z - 1), m_heightMap.GetAddr(0, z), m_heightMap.GetAddr(0, z + 1),
+                                         m_newHeight.GetAddr(0, z), 1, m_cols - 1, m_params.Talus, m_params.ThermalRate);
+                }
+#endif
+            }
+
+            for (; x < m_cols; x++) {
+                ThermalCell(x, z);
+            }
+        }
+    });
+
+    m_heightMap.Swap(m_newHeight);
+}
+
+
+// Whatever is still dissolved when the iterations run out settles where it is
+void Eroder::DepositSediment()
+{
+    GetThreadPool().ParallelFor(0, m_rows, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            float* pHeight = m_heightMap.GetAddr(0, z);
+            const float* pSediment = m_sediment.GetAddr(0, z);
+
+            for (int x = 0; x < m_cols; x++) {
+                pHeight[x] += pSediment[x];
+            }
+        }
+    });
+}
+
+
+// Neighbours outside the map are replaced by the cell itself, which has no height
+// difference and so no flow
+void Eroder::FlowCell(int x, int z)
+{
+    int Left = std::max(x - 1, 0);
+    int Right = std::min(x + 1, m_cols - 1);
+    int Up = std::max(z - 1, 0);
+    int Down = std::min(z + 1, m_rows - 1);
+
+    float NeighborSurface[NUM_FLUX_DIRS];
+    NeighborSurface[FLUX_LEFT] = m_heightMap.Get(Left, z) + m_water.Get(Left, z);
+    NeighborSurface[FLUX_RIGHT] = m_heightMap.Get(Right, z) + m_water.Get(Right, z);
+    NeighborSurface[FLUX_UP] = m_heightMap.Get(x, Up) + m_water.Get(x, Up);
+    NeighborSurface[FLUX_DOWN] = m_heightMap.Get(x, Down) + m_water.Get(x, Down);
+
+    float Water = m_water.Get(x, z);
+    float Flux[NUM_FLUX_DIRS];
+
+    CalcFlow(m_heightMap.Get(x, z) + Water, Water, NeighborSurface, m_params.Rain, Flux);
+
+    for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+        m_flux[i].Set(x, z, Flux[i]);
+    }
+}
+
+
+void Eroder::TransportCell(int x, int z)
+{
+    float Rain = m_params.Rain;
+    float w = m_water.Get(x, z) + Rain;
+    float s = m_sediment.Get(x, z);
+
+    float FluxOut = ((m_flux[FLUX_LEFT].Get(x, z) + m_flux[FLUX_RIGHT].Get(x, z)) + m_flux[FLUX_UP].Get(x, z)) + m_flux[FLUX_DOWN].Get(x, z);
+
+    float WaterIn = 0.0f;
+    float SedimentIn = 0.0f;
+
+    if (x > 0) {
+        float FromLeft = m_flux[FLUX_RIGHT].Get(x - 1, z);
+        WaterIn += (m_water.Get(x - 1, z) + Rain) * FromLeft;
+        SedimentIn += m_sediment.Get(x - 1, z) * FromLeft;
+    }
+
+    if (x < m_cols - 1) {
+        float FromRight = m_flux[FLUX_LEFT].Get(x + 1, z);
+        WaterIn += (m_water.Get(x + 1, z) + Rain) * FromRight;
+        SedimentIn += m_sediment.Get(x + 1, z) * FromRight;
+    }
+
+    if (z > 0) {
+        float FromUp = m_flux[FLUX_DOWN].Get(x, z - 1);
+        WaterIn += (m_water.Get(x, z - 1) + Rain) * FromUp;
+        SedimentIn += m_sediment.Get(x, z - 1) * FromUp;
+    }
+
+    if (z < m_rows - 1) {
+        float FromDown = m_flux[FLUX_UP].Get(x, z + 1);
+        WaterIn += (m_water.Get(x, z + 1) + Rain) * FromDown;
+        SedimentIn += m_sediment.Get(x, z + 1) * FromDown;
+    }
+
+    float Keep = 1.0f - FluxOut;
+    float NewWater = w * Keep + WaterIn;
+    float NewSediment = s * Keep + SedimentIn;
+
+    // Positive - the water can carry more and dissolves some of the ground,
+    // negative - it carries too much and drops some of it
+    float Diff = m_params.SedimentCapacity * (w * FluxOut) - NewSediment;
+    float Amount = m_params.ErosionRate * std::max(Diff, 0.0f) + m_params.DepositionRate * std::min(Diff, 0.0f);
+
+    m_heightMap.At(x, z) -= Amount;
+    m_newSediment.Set(x, z, NewSediment + Amount);
+    m_newWater.Set(x, z, NewWater * (1.0f - m_params.Evaporation));
+}
+
+
+void Eroder::ThermalCell(int x, int z)
+{
+    float h = m_heightMap.Get(x, z);
+    float Talus = m_params.Talus;
+
+    float Sum = ThermalExchange(m_heightMap.Get(std::max(x - 1, 0), z) - h, Talus) +
+                ThermalExchange(m_heightMap.Get(std::min(x + 1, m_cols - 1), z) - h, Talus);
+    Sum += ThermalExchange(m_heightMap.Get(x, std::max(z - 1, 0)) - h, Talus);
+    Sum += ThermalExchange(m_heightMap.Get(x, std::min(z + 1, m_rows - 1)) - h, Talus);
+
+    m_newHeight.Set(x, z, h + m_params.ThermalRate * Sum);
+}
+
+
+void Eroder::GetTransportRows(int z, TransportRows& Rows)
+{
+    for (int i = 0; i < 3; i++) {
+        Rows.pWater[i] = m_water.GetAddr(0, z - 1 + i);
+        Rows.pSediment[i] = m_sediment.GetAddr(0, z - 1 + i);
+    }
+
+    for (int i = 0; i < NUM_FLUX_DIRS; i++) {
+        Rows.pFlux[i] = m_flux[i].GetAddr(0, z);
+    }
+
+    Rows.pFluxDownAbove = m_flux[FLUX_DOWN].GetAddr(0, z - 1);
+    Rows.pFluxUpBelow = m_flux[FLUX_UP].GetAddr(0, z + 1);
+    Rows.pHeight = m_heightMap.GetAddr(0, z);
+    Rows.pNewWater = m_newWater.GetAddr(0, z);
+    Rows.pNewSediment = m_newSediment.GetAddr(0, z);
+}
+
+
+void ErodeHeightMap(Array2D<float>& HeightMap, const ErosionParams& Params)
+{
+    if (Params.Iterations <= 0) {
+        return;
+    }
+
+    if ((Params.ThermalRate < 0.0f) || (Params.ThermalRate > 0.25f)) {
+        printf("%s: thermal rate must be in [0, 0.25] - %f\n", __FUNCTION__, Params.ThermalRate);
+        exit(0);
+    }
+
+    long long StartTime = GetCurrentTimeMillis();
+
+    Eroder e(HeightMap, Params);
+
+    e.Run();
+
+    long long Duration = GetCurrentTimeMillis() - StartTime;
+
+    printf("Erosion %dx%d: %d iterations in %lld ms (%.2f ms per iteration)\n",
+           HeightMap.GetCols(), HeightMap.GetRows(), Params.Iterations, Duration, (float)Duration / Params.Iterations);
+}
@@ -0,0 +1,27 @@
+#ifndef EROSION_H
+#define EROSION_H
+
+#include "ogldev_array_2d.h"
+
+struct ErosionParams {
+    int Iterations = 0;               // 0 disables erosion
+
+    // Thermal erosion - material slides off slopes that are steeper than the talus
+    float Talus = 1.0f;               // stable height difference between neighbours
+    float ThermalRate = 0.1f;         // fraction of the excess moved per iteration (at most 0.25)
+
+    // Hydraulic erosion - rain flows downhill, dissolving and depositing sediment
+    float Rain = 0.01f;               // water added to every cell per iteration
+    float SedimentCapacity = 1.0f;    // sediment carried per unit of water flowing out of a cell
+    float ErosionRate = 0.3f;         // fraction of the free capacity dissolved per iteration
+    float DepositionRate = 0.3f;      // fraction of the excess sediment dropped per iteration
+    float Evaporation = 0.02f;        // fraction of the water lost per iteration
+};
+
+// Grid based hydraulic and thermal erosion. Every iteration is a few passes over
+// the whole height map that only read the previous state of the neighbours, so the
+// rows are split across the thread pool and the interior of a row runs in SIMD.
+// Heights are in the same units as the height map (run it after Normalize).
+void ErodeHeightMap(Array2D<float>& HeightMap, const ErosionParams& Params);
+
+#endif
@@ -0,0 +1,278 @@
+#include <algorithm>
+
+#include "fault_formation_terrain.h"
+#include "thread_pool.h"
+#include "simd_utils.h"
+
+// Every row walks all the fault lines so even a few rows are worth a thread
+#define MIN_ROWS_PER_BAND 16
+
+// Columns handed to a thread by the vertical filter passes
+#define MIN_COLS_PER_BAND 256
+
+// A fault line through P1 and P2 raises the cells with
+//     DirX * (z - P1.z) - DirZ * (x - P1.x) > 0
+// which on row z is a half open span of x bounded by A(z) / DirZ, where
+//     A(z) = DirX * (z - P1.z) + DirZ * P1.x
+// A(z) grows by DirX from one row to the next, so the bound is tracked with an
+// integer quotient/remainder pair and no division is needed inside the row loop.
+struct FaultLine {
+    int DirX = 0;
+    int DirZ = 0;
+    int P1x = 0;
+    int P1z = 0;
+    int Denom = 0;       // |DirZ|
+    int StepQuot = 0;    // DirX = StepQuot * Denom + StepRem
+    int StepRem = 0;
+    float Delta = 0.0f;
+};
+
+
+// floor((A(z) - 1) / Denom) as Quot/Rem with 0 <= Rem < Denom. For horizontal
+// lines (Denom == 0) Quot holds A(z) itself.
+struct FaultRowState {
+    long long Quot = 0;
+    long long Rem = 0;
+};
+
+
+static long long FloorDiv(long long a, long long b)
+{
+    long long q = a / b;
+
+    if ((a % b != 0) && ((a < 0) != (b < 0))) {
+        q--;
+    }
+
+    return q;
+}
+
+
+static void ValidateParams(int TerrainSize, int Iterations, float Filter)
+{
+    if (TerrainSize < 2) {
+        printf("%s: terrain size must be at least 2 - %d\n", __FUNCTION__, TerrainSize);
+        exit(0);
+    }
+
+    if (Iterations < 1) {
+        printf("%s: number of iterations must be at least one - %d\n", __FUNCTION__, Iterations);
+        exit(0);
+    }
+
+    if ((Filter < 0.0f) || (Filter >= 1.0f)) {
+        printf("%s: filter must be in [0, 1) - %f\n", __FUNCTION__, Filter);
+        exit(0);
+    }
+}
+
+
+static void GenRandomFaultLines(int TerrainSize, int Iterations, float MinHeight, float MaxHeight, uint Seed, std::vector<FaultLine>& Faults)
+{
+    Faults.resize(Iterations);
+
+    for (int CurIter = 0; CurIter < Iterations; CurIter++) {
+        FaultLine& f = Faults[CurIter];
+
+        int P2x = 0, P2z = 0;
+        int Attempt = 0;
+
+        do {
+            f.P1x = HashRandomU32(Seed, CurIter, 0, Attempt) % TerrainSize;
+            f.P1z = HashRandomU32(Seed, CurIter, 1, Attempt) % TerrainSize;
+            P2x = HashRandomU32(Seed, CurIter, 2, Attempt) % TerrainSize;
+            P2z = HashRandomU32(Seed, CurIter, 3, Attempt) % TerrainSize;
+            Attempt++;
+        } while ((f.P1x == P2x) && (f.P1z == P2z));
+
+        f.DirX = P2x - f.P1x;
+        f.DirZ = P2z - f.P1z;
+        f.Denom = abs(f.DirZ);
+
+        if (f.Denom > 0) {
+            f.StepQuot = (int)FloorDiv(f.DirX, f.Denom);
+            f.StepRem = f.DirX - f.StepQuot * f.Denom;
+        }
+
+        f.Delta = MaxHeight - ((MaxHeight - MinHeight) * CurIter) / Iterations;
+    }
+}
+
+
+static void InitFaultRowState(const FaultLine& f, int z, FaultRowState& State)
+{
+    long long A = (long long)f.DirX * (z - f.P1z) + (long long)f.DirZ * f.P1x;
+
+    if (f.Denom == 0) {
+        State.Quot = A;
+        State.Rem = 0;
+    } else {
+        State.Quot = FloorDiv(A - 1, f.Denom);
+        State.Rem = (A - 1) - State.Quot * f.Denom;
+    }
+}
+
+
+static void StepFaultRowState(const FaultLine& f, FaultRowState& State)
+{
+    if (f.Denom == 0) {
+        State.Quot += f.DirX;
+        return;
+    }
+
+    State.Quot += f.StepQuot;
+    State.Rem += f.StepRem;
+
+    if (State.Rem >= f.Denom) {
+        State.Rem -= f.Denom;
+        State.Quot++;
+    }
+}
+
+
+// Instead of testing every cell against every line, each line adds its height to
+// a single entry of a per row difference array which is then prefix summed, so a
+// row costs O(Iterations + TerrainSize). Lines that raise the low x side are
+// applied as a lowering of the high x side - the constant that this adds to the
+// whole map goes away when the map is normalized.
+static void ApplyFaultLines(Array2D<float>& HeightMap, int TerrainSize, const std::vector<FaultLine>& Faults)
+{
+    GetThreadPool().ParallelFor(0, TerrainSize, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        std::vector<FaultRowState> States(Faults.size());
+        std::vector<float> Diff(TerrainSize + 1);
+
+        for (size_t i = 0; i < Faults.size(); i++) {
+            InitFaultRowState(Faults[i], RowBegin, States[i]);
+        }
+
+        for (int z = RowBegin; z < RowEnd; z++) {
+            std::fill(Diff.begin(), Diff.end(), 0.0f);
+
+            for (size_t i = 0; i < Faults.size(); i++) {
+                const FaultLine& f = Faults[i];
+                FaultRowState& State = States[i];
+
+                if (f.DirZ > 0) {
+                    // Raised span is [0, ceil(A / Denom))
+                    long long End = std::min(std::max(State.Quot + 1, 0LL), (long long)TerrainSize);
+                    Diff[End] -= f.Delta;
+                } else if (f.DirZ < 0) {
+                    // Raised span is [1 - ceil(A / Denom), TerrainSize)
+                    long long Begin = std::min(std::max(-State.Quot, 0LL), (long long)TerrainSize);
+                    Diff[Begin] += f.Delta;
+                } else if (State.Quot > 0) {
+                    Diff[0] += f.Delta;
+                }
+
+                StepFaultRowState(f, State);
+            }
+
+            float* pRow = HeightMap.GetAddr(0, z);
+            double Sum = 0.0;
+
+            for (int x = 0; x < TerrainSize; x++) {
+                Sum += Diff[x];
+                pRow[x] = (float)Sum;
+            }
+        }
+    });
+}
+
+
+// Four passes of a first order filter - left to right, right to left, bottom to
+// top and top to bottom. The horizontal passes are a recurrence along each row so
+// rows are done in parallel; the vertical ones blend whole rows at a time which
+// runs in SIMD across the columns.
+static void ApplyFIRFilter(Array2D<float>& HeightMap, int TerrainSize, float Filter)
+{
+    float CurWeight = 1.0f - Filter;
+
+    GetThreadPool().ParallelFor(0, TerrainSize, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            float* pRow = HeightMap.GetAddr(0, z);
+
+            for (int x = 1; x < TerrainSize; x++) {
+                pRow[x] = pRow[x - 1] * Filter + pRow[x] * CurWeight;
+            }
+
+            for (int x = TerrainSize - 2; x >= 0; x--) {
+                pRow[x] = pRow[x + 1] * Filter + pRow[x] * CurWeight;
+            }
+        }
+    });
+
+    GetThreadPool().ParallelFor(0, TerrainSize, MIN_COLS_PER_BAND, [&](int ColBegin, int ColEnd) {
+        int NumCols = ColEnd - ColBegin;
+
+        for (int z = 1; z < TerrainSize; z++) {
+            BlendF32(HeightMap.GetAddr(ColBegin, z), HeightMap.GetAddr(ColBegin, z - 1), NumCols, Filter);
+        }
+
+        for (int z = TerrainSize - 2; z >= 0; z--) {
+            BlendF32(HeightMap.GetAddr(ColBegin, z), HeightMap.GetAddr(ColBegin, z + 1), NumCols, Filter);
+        }
+    });
+}
+
+
+static void CreateFaultFormationF32(Array2D<float>& HeightMap, int TerrainSize, int Iterations, float MinHeight, float MaxHeight, float Filter, uint Seed)
+{
+    HeightMap.InitArray2D(TerrainSize, TerrainSize);
+
+    std::vector<FaultLine> Faults;
+    GenRandomFaultLines(TerrainSize, Iterations, MinHeight, MaxHeight, Seed, Faults);
+
+    ApplyFaultLines(HeightMap, TerrainSize, Faults);
+
+    ApplyFIRFilter(HeightMap, TerrainSize, Filter);
+
+    HeightMap.Normalize(MinHeight, MaxHeight);
+}
+
+
+void FaultFormationTerrain::CreateFaultFormation(int TerrainSize, int PatchSize, int Iterations, float MinHeight, float MaxHeight, float Filter, uint Seed)
+{
+    ValidateParams(TerrainSize, Iterations, Filter);
+
+    if (LoadFromCache(GetCacheKey(TerrainSize, PatchSize, Iterations, MinHeight, MaxHeight, Filter, Seed))) {
+        return;
+    }
+
+    m_terrainSize = TerrainSize;
+    m_patchSize = PatchSize;
+
+    SetMinMaxHeight(MinHeight, MaxHeight);
+
+    long long StartTime = GetCurrentTimeMillis();
+
+    CreateFaultFormationF32(m_heightMap, TerrainSize, Iterations, MinHeight, MaxHeight, Filter, Seed);
+
+    printf("Fault formation %dx%d (%d iterations) generated in %lld ms\n", TerrainSize, TerrainSize, Iterations, GetCurrentTimeMillis() - StartTime);
+
+    Finalize();
+}
+
+
+bool FaultFormationTerrain::CreateFaultFormationAsync(int TerrainSize, int PatchSize, int Iterations, float MinHeight, float MaxHeight, float Filter, uint Seed)
+{
+    ValidateParams(TerrainSize, Iterations, Filter);
+
+    if (LoadFromCache(GetCacheKey(TerrainSize, PatchSize, Iterations, MinHeight, MaxHeight, Filter, Seed))) {
+        return true;
+    }
+
+    return StartAsyncBuild(TerrainSize, PatchSize, MinHeight, MaxHeight, [=](Array2D<float>& HeightMap) {
+        CreateFaultFormationF32(HeightMap, TerrainSize, Iterations, MinHeight, MaxHeight, Filter, Seed);
+    });
+}
+
+
+TerrainCacheKey FaultFormationTerrain::GetCacheKey(int TerrainSize, int PatchSize, int Iterations, float MinHeight, float MaxHeight, float Filter, uint Seed) const
+{
+    TerrainCacheKey Key = BaseTerrain::GetCacheKey("fault formation", TerrainSize, PatchSize, MinHeight, MaxHeight);
+    Key.Add(Iterations);
+    Key.Add(Filter);
+    Key.Add(Seed);
+
+    return Key;
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef FAULT_FORMATION_TERRAIN_H
+#define FAULT_FORMATION_TERRAIN_H
+
+#include "terrain.h"
+
+class FaultFormationTerrain : public BaseTerrain {
+
+public:
+    FaultFormationTerrain() {}
+
+    // Raises one side of Iterations random lines across the map (by a height that
+    // decreases from MaxHeight to MinHeight) and then smooths the result with an
+    // FIR filter - Filter is the weight of the previous sample, in [0, 1)
+    void CreateFaultFormation(int TerrainSize, int PatchSize, int Iterations, float MinHeight, float MaxHeight, float Filter, uint Seed);
+
+    bool CreateFaultFormationAsync(int TerrainSize, int PatchSize, int Iterations, float MinHeight, float MaxHeight, float Filter, uint Seed);
+
+private:
+    TerrainCacheKey GetCacheKey(int TerrainSize, int PatchSize, int Iterations, float MinHeight, float MaxHeight, float Filter, uint Seed) const;
+};
+
+#endif
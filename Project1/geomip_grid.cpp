@@ -1,9 +1,26 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <vector>
+#include <algorithm>
 
 #include "ogldev_math_3d.h"
 #include "geomip_grid.h"
 #include "terrain.h"
+#include "terrain_technique.h"
+#include "texture_config.h"
+#include "height_map_normals.h"
+#include "thread_pool.h"
+#include "simd_utils.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define MIN_ROWS_PER_BAND 16
+
+// Upper limit of the vertices of the rows of patches that are built together and then streamed
+#define MAX_STREAM_GROUP_SIZE (32 * 1024 * 1024)
 
 int gShowPoints = 0;
 
@@ -23,34 +40,121 @@ void GeomipGrid::Destroy()
 {
     if (m_vao > 0) {
         glDeleteVertexArrays(1, &m_vao);
+        m_vao = 0;
     }
 
     if (m_vb > 0) {
         glDeleteBuffers(1, &m_vb);
+        m_vb = 0;
     }
 
     if (m_ib > 0) {
         glDeleteBuffers(1, &m_ib);
+        m_ib = 0;
+    }
+
+    if (m_heightTexture > 0) {
+        glDeleteTextures(1, &m_heightTexture);
+        m_heightTexture = 0;
+    }
+
+    if (m_normalTexture > 0) {
+        glDeleteTextures(1, &m_normalTexture);
+        m_normalTexture = 0;
     }
+
+    m_vertices.clear();
+    m_vertices.shrink_to_fit();
+    m_indices.clear();
+    m_indices.shrink_to_fit();
+    m_patchBounds.clear();
+    m_packedVertices.clear();
+    m_packedVertices.shrink_to_fit();
+    m_patchHeightBase.clear();
+    m_compactVertices.clear();
+    m_compactVertices.shrink_to_fit();
+    m_textureHeights.clear();
+    m_textureHeights.shrink_to_fit();
+    m_textureSamples.clear();
+    m_textureSamples.shrink_to_fit();
+    m_textureNormals.clear();
+    m_textureNormals.shrink_to_fit();
+    m_quantized = false;
+
+    m_uploadStream.Destroy();
 }
 
 
 void GeomipGrid::CreateGeomipGrid(int Width, int Depth, int PatchSize, const BaseTerrain* pTerrain)
 {
-    if ((Width - 1) % (PatchSize - 1) != 0) {
-        int RecommendedWidth = ((Width - 1 + PatchSize - 1) / (PatchSize - 1)) * (PatchSize - 1) + 1;
-        printf("Width minus 1 (%d) must be divisible by PatchSize minus 1 (%d)\n", Width, PatchSize);
-        printf("Try using Width = %d\n", RecommendedWidth);
-        exit(0);
+    const Array2D<float>& HeightMap = pTerrain->GetHeightMap();
+    const QuantizedHeightMap* pQuantized = pTerrain->GetQuantizedHeightMap();
+
+    m_pTerrain = pTerrain;
+
+    InitGridLayout(Width, Depth, PatchSize, pTerrain->GetWorldScale());
+
+    InitIndexBuffer();
+
+    CalcPatchBounds(HeightMap);
+
+    m_quantized = (pQuantized != NULL);
+
+    if (m_quantized) {
+        m_patchHeightBase = pQuantized->GetPatchBases();
+    }
+
+    InitCompactDecoding(pTerrain->GetTextureScale(), pQuantized);
+
+    CreateGLState();
+
+    if (m_heightTextures) {
+        std::vector<i8> Normals((size_t)m_heightMapWidth * m_heightMapDepth * 2);
+        BuildNormalMap(HeightMap, 0, m_heightMapDepth, &Normals[0]);
+        UploadHeightTextures(GetTextureHeights(HeightMap, pQuantized), &Normals[0], 0, m_heightMapDepth);
+
+        PrintVertexBufferSize();
+
+        UploadIndexBuffer();
+        return;
     }
 
-    if ((Depth - 1) % (PatchSize - 1) != 0) {
-        int RecommendedDepth = ((Depth - 1 + PatchSize - 1) / (PatchSize - 1)) * (PatchSize - 1) + 1;
-        printf("Depth minus 1 (%d) must be divisible by PatchSize minus 1 (%d)\n", Depth, PatchSize);
-        printf("Try using Width = %d\n", RecommendedDepth);
+    glBufferData(GL_ARRAY_BUFFER, GetNumVertices() * GetBytesPerVertex(), NULL, GL_STATIC_DRAW);
+
+    UploadStream& Stream = GetUploadStream();
+
+    StreamVertices(HeightMap, pTerrain->GetTextureScale(), pQuantized, 0, m_numPatchesZ, Stream);
+
+    PrintVertexBufferSize();
+    printf("Vertex buffer %s\n", Stream.IsPersistent() ? "streamed through a persistent mapped buffer" : "streamed with glBufferSubData");
+
+    Stream.Flush();
+
+    UploadIndexBuffer();
+}
+
+
+void GeomipGrid::PrepareGeomipGrid(int Width, int Depth, int PatchSize, const Array2D<float>& HeightMap, float WorldScale, float TextureScale,
+                                   const QuantizedHeightMap* pQuantized, const HeightMapBorder* pBorder)
+{
+    if (pBorder && ((pBorder->Left.size() != (size_t)Depth) || (pBorder->Right.size() != (size_t)Depth) ||
+                    (pBorder->Top.size() != (size_t)Width) || (pBorder->Bottom.size() != (size_t)Width))) {
+        printf("%s: the border doesn't match the %dx%d height map\n", __FUNCTION__, Width, Depth);
         exit(0);
     }
 
+    InitGridLayout(Width, Depth, PatchSize, WorldScale);
+
+    m_pBorder = pBorder;
+
+    PopulateBuffers(HeightMap, TextureScale, pQuantized);
+
+    m_pBorder = NULL;
+}
+
+
+void GeomipGrid::InitGridLayout(int Width, int Depth, int PatchSize, float WorldScale)
+{
     if (PatchSize < 3) {
         printf("The minimum patch size is 3 (%d)\n", PatchSize);
         exit(0);
@@ -61,28 +165,506 @@ void GeomipGrid::CreateGeomipGrid(int Width, int Depth, int PatchSize, const Bas
         exit(0);
     }
 
-    m_width = Width;
-    m_depth = Depth;
+    // The indices into the vertex block of a patch are 16 bit
+    if (PatchSize * PatchSize > 65536) {
+        printf("The maximum patch size is 255 (%d)\n", PatchSize);
+        exit(0);
+    }
+
+    m_heightMapWidth = Width;
+    m_heightMapDepth = Depth;
     m_patchSize = PatchSize;
-    m_pTerrain = pTerrain;
 
-    m_numPatchesX = (Width - 1) / (PatchSize - 1);
-    m_numPatchesZ = (Depth - 1) / (PatchSize - 1);
+    // Any size works - the last row/column of patches may stick out of the height map.
+    // Their vertices outside of it are clamped onto the edge, which turns the triangles
+    // there into degenerate ones, so every patch keeps the same index buffers.
+    m_numPatchesX = (Width - 1 + PatchSize - 2) / (PatchSize - 1);
+    m_numPatchesZ = (Depth - 1 + PatchSize - 2) / (PatchSize - 1);
+
+    m_width = m_numPatchesX * (PatchSize - 1) + 1;
+    m_depth = m_numPatchesZ * (PatchSize - 1) + 1;
 
-    m_worldScale = pTerrain->GetWorldScale();
+    m_worldScale = WorldScale;
     m_maxLOD = m_lodManager.InitLodManager(PatchSize, m_numPatchesX, m_numPatchesZ, m_worldScale);
     m_lodInfo.resize(m_maxLOD + 1);
 
     m_patchWorldSize = (m_patchSize - 1) * m_worldScale;  // m_patchSize is in vertices and PatchSize is the actual size (2 vertices --> size 1)
     m_patchWorldHalfSize = m_patchWorldSize / 2.0f;
+}
+
+
+void GeomipGrid::UploadGeomipGrid(const BaseTerrain* pTerrain)
+{
+    m_pTerrain = pTerrain;
 
     CreateGLState();
 
-    PopulateBuffers(pTerrain);
+    if (m_heightTextures) {
+        const void* pHeights = m_quantized ? (const void*)&m_textureSamples[0] : (const void*)&m_textureHeights[0];
+        UploadHeightTextures(pHeights, &m_textureNormals[0], 0, m_heightMapDepth);
+    } else if (m_compact) {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(m_compactVertices[0]) * m_compactVertices.size(), &m_compactVertices[0], GL_STATIC_DRAW);
+    } else if (m_quantized) {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(m_packedVertices[0]) * m_packedVertices.size(), &m_packedVertices[0], GL_STATIC_DRAW);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(m_vertices[0]) * m_vertices.size(), &m_vertices[0], GL_STATIC_DRAW);
+    }
+
+    PrintVertexBufferSize();
+
+    UploadIndexBuffer();
+}
+
+
+// Expects the GL state of CreateGLState to be bound
+void GeomipGrid::UploadIndexBuffer()
+{
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(m_indices[0]) * m_numIndices, &m_indices[0], GL_STATIC_DRAW);
 
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // The driver has its own copy now
+    m_vertices.clear();
+    m_vertices.shrink_to_fit();
+    m_packedVertices.clear();
+    m_packedVertices.shrink_to_fit();
+    m_compactVertices.clear();
+    m_compactVertices.shrink_to_fit();
+    m_textureHeights.clear();
+    m_textureHeights.shrink_to_fit();
+    m_textureSamples.clear();
+    m_textureSamples.shrink_to_fit();
+    m_textureNormals.clear();
+    m_textureNormals.shrink_to_fit();
+    m_indices.clear();
+    m_indices.shrink_to_fit();
+}
+
+
+void GeomipGrid::Swap(GeomipGrid& Other)
+{
+    std::swap(m_width, Other.m_width);
+    std::swap(m_depth, Other.m_depth);
+    std::swap(m_heightMapWidth, Other.m_heightMapWidth);
+    std::swap(m_heightMapDepth, Other.m_heightMapDepth);
+    std::swap(m_patchSize, Other.m_patchSize);
+    std::swap(m_maxLOD, Other.m_maxLOD);
+    std::swap(m_vao, Other.m_vao);
+    std::swap(m_vb, Other.m_vb);
+    std::swap(m_ib, Other.m_ib);
+    std::swap(m_worldScale, Other.m_worldScale);
+    m_lodInfo.swap(Other.m_lodInfo);
+    m_patchBounds.swap(Other.m_patchBounds);
+    std::swap(m_numPatchesX, Other.m_numPatchesX);
+    std::swap(m_numPatchesZ, Other.m_numPatchesZ);
+    m_lodManager.Swap(Other.m_lodManager);
+    std::swap(m_pTerrain, Other.m_pTerrain);
+    std::swap(m_patchWorldSize, Other.m_patchWorldSize);
+    std::swap(m_patchWorldHalfSize, Other.m_patchWorldHalfSize);
+    m_vertices.swap(Other.m_vertices);
+    m_indices.swap(Other.m_indices);
+    std::swap(m_numIndices, Other.m_numIndices);
+    std::swap(m_quantized, Other.m_quantized);
+    m_packedVertices.swap(Other.m_packedVertices);
+    m_patchHeightBase.swap(Other.m_patchHeightBase);
+    std::swap(m_compact, Other.m_compact);
+    m_compactVertices.swap(Other.m_compactVertices);
+    std::swap(m_heightStep, Other.m_heightStep);
+    std::swap(m_heightOrigin, Other.m_heightOrigin);
+    std::swap(m_texCoordScale, Other.m_texCoordScale);
+    std::swap(m_heightTextures, Other.m_heightTextures);
+    std::swap(m_heightTexture, Other.m_heightTexture);
+    std::swap(m_normalTexture, Other.m_normalTexture);
+    m_textureHeights.swap(Other.m_textureHeights);
+    m_textureSamples.swap(Other.m_textureSamples);
+    m_textureNormals.swap(Other.m_textureNormals);
+}
+
+
+void GeomipGrid::UpdateHeights(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized)
+{
+    UpdateHeightRows(HeightMap, TextureScale, pQuantized, 0, HeightMap.GetRows());
+}
+
+
+void GeomipGrid::UpdateHeightRows(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized, int MinZ, int MaxZ)
+{
+    if ((HeightMap.GetCols() != m_heightMapWidth) || (HeightMap.GetRows() != m_heightMapDepth)) {
+        printf("%s: height map size %dx%d doesn't match the grid %dx%d\n", __FUNCTION__,
+               HeightMap.GetCols(), HeightMap.GetRows(), m_heightMapWidth, m_heightMapDepth);
+        exit(0);
+    }
+
+    if (m_quantized && !pQuantized) {
+        printf("%s: a quantized grid needs the quantized heights\n", __FUNCTION__);
+        exit(0);
+    }
+
+    // The normals of the rows next to the changed ones see the new heights too
+    MinZ = std::max(MinZ - 1, 0);
+    MaxZ = std::min(MaxZ + 1, m_heightMapDepth);
+
+    if (MinZ >= MaxZ) {
+        return;
+    }
+
+    // The first row of a patch is also the last row of the patch above it
+    int RowsPerPatch = m_patchSize - 1;
+    int FirstPatchZ = std::max((MinZ - 1) / RowsPerPatch, 0);
+    int EndPatchZ = std::min((MaxZ - 1) / RowsPerPatch + 1, m_numPatchesZ);
+
+    CalcPatchBounds(HeightMap, FirstPatchZ, EndPatchZ);
+
+    if (m_quantized) {
+        m_patchHeightBase = pQuantized->GetPatchBases();
+    }
+
+    // The lattice of a compact grid without quantized heights follows the new range -
+    // if it moved all the compact vertices have to be redone
+    float HeightStep = m_heightStep;
+    float HeightOrigin = m_heightOrigin;
+
+    InitCompactDecoding(TextureScale, pQuantized);
+
+    if (m_compact && !pQuantized && ((m_heightStep != HeightStep) || (m_heightOrigin != HeightOrigin))) {
+        FirstPatchZ = 0;
+        EndPatchZ = m_numPatchesZ;
+    }
+
+    if (m_heightTextures) {
+        std::vector<i8> Normals((size_t)m_heightMapWidth * (MaxZ - MinZ) * 2);
+        BuildNormalMap(HeightMap, MinZ, MaxZ, &Normals[0]);
+        UploadHeightTextures(GetTextureHeights(HeightMap, pQuantized), &Normals[0], MinZ, MaxZ);
+        return;
+    }
+
+    // For a quantized grid the lattice may have changed but the samples didn't - only
+    // the normals are new
+    UploadStream& Stream = GetUploadStream();
+
+    StreamVertices(HeightMap, TextureScale, pQuantized, FirstPatchZ, EndPatchZ, Stream);
+
+    Stream.Flush();
+}
+
+
+void GeomipGrid::RescaleHeights(const Array2D<float>& HeightMap, float SrcMin, float Scale, float DstMin, const QuantizedHeightMap* pQuantized)
+{
+    if (!pQuantized && ((HeightMap.GetCols() != m_heightMapWidth) || (HeightMap.GetRows() != m_heightMapDepth))) {
+        printf("%s: height map size %dx%d doesn't match the grid %dx%d\n", __FUNCTION__,
+               HeightMap.GetCols(), HeightMap.GetRows(), m_heightMapWidth, m_heightMapDepth);
+        exit(0);
+    }
+
+    if ((m_quantized != (pQuantized != NULL)) || (Scale <= 0.0f)) {
+        printf("%s: a quantized grid needs the quantized heights and the scale must be positive (%f)\n", __FUNCTION__, Scale);
+        exit(0);
+    }
+
+    for (size_t i = 0; i < m_patchBounds.size(); i++) {
+        m_patchBounds[i].MinHeight = (m_patchBounds[i].MinHeight - SrcMin) * Scale + DstMin;
+        m_patchBounds[i].MaxHeight = (m_patchBounds[i].MaxHeight - SrcMin) * Scale + DstMin;
+    }
+
+    // The lattice moves with the heights - the samples (and the patch bases of a
+    // quantized grid) stay as they are
+    if (m_quantized) {
+        m_heightStep = pQuantized->GetStep();
+        m_heightOrigin = pQuantized->GetOrigin();
+    } else {
+        m_heightStep *= Scale;
+        m_heightOrigin = (m_heightOrigin - SrcMin) * Scale + DstMin;
+    }
+
+    if (m_heightTextures) {
+        std::vector<i8> Normals((size_t)m_heightMapWidth * m_heightMapDepth * 2);
+
+        glBindTexture(GL_TEXTURE_2D, m_normalTexture);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_BYTE, &Normals[0]);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        GetThreadPool().ParallelFor(0, m_heightMapDepth, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+            for (size_t i = (size_t)RowBegin * m_heightMapWidth; i < (size_t)RowEnd * m_heightMapWidth; i++) {
+                RescaleOctahedral(&Normals[i * 2], Scale);
+            }
+        });
+
+        UploadHeightTextures(m_quantized ? NULL : HeightMap.GetBaseAddr(), &Normals[0], 0, m_heightMapDepth);
+        return;
+    }
+
+    // The vertex buffer is read back a group of rows of patches at a time, rescaled
+    // and streamed back
+    size_t PatchRowSize = GetPatchRowOffset(1) * GetBytesPerVertex();
+    int PatchRowsPerGroup = std::max(1, std::min((int)(MAX_STREAM_GROUP_SIZE / PatchRowSize), m_numPatchesZ));
+
+    std::vector<u8> Group(PatchRowSize * PatchRowsPerGroup);
+    UploadStream& Stream = GetUploadStream();
+
+    for (int GroupBegin = 0; GroupBegin < m_numPatchesZ; GroupBegin += PatchRowsPerGroup) {
+        int GroupEnd = std::min(GroupBegin + PatchRowsPerGroup, m_numPatchesZ);
+        size_t Offset = GetPatchRowOffset(GroupBegin) * GetBytesPerVertex();
+        size_t Size = PatchRowSize * (GroupEnd - GroupBegin);
+
+        glBindBuffer(GL_COPY_READ_BUFFER, m_vb);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, Offset, Size, &Group[0]);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        RescalePatchRows(HeightMap, Scale, GroupBegin, GroupEnd, &Group[0]);
+
+        Stream.Write(m_vb, Offset, &Group[0], Size);
+    }
+
+    Stream.Flush();
+}
+
+
+UploadStream& GeomipGrid::GetUploadStream()
+{
+    if (!m_uploadStream.IsInitialized()) {
+        m_uploadStream.Init();
+    }
+
+    return m_uploadStream;
+}
+
+
+void GeomipGrid::RescalePatchRows(const Array2D<float>& HeightMap, float Scale, int FirstPatchZ, int EndPatchZ, void* pVertices) const
+{
+    int RowsPerPatch = m_patchSize - 1;
+    size_t PatchRowVertices = GetPatchRowOffset(1);
+
+    GetThreadPool().ParallelFor(FirstPatchZ, EndPatchZ, 1, [&](int PatchRowBegin, int PatchRowEnd) {
+        for (int PatchZ = PatchRowBegin; PatchZ < PatchRowEnd; PatchZ++) {
+            size_t First = (size_t)(PatchZ - FirstPatchZ) * PatchRowVertices;
+
+            if (m_compact) {
+                CompactVertex* pCompact = (CompactVertex*)pVertices + First;
+
+                for (size_t i = 0; i < PatchRowVertices; i++) {
+                    RescaleOctahedral(pCompact[i].Normal, Scale);
+                }
+
+                continue;
+            }
+
+            if (m_quantized) {
+                QuantizedVertex* pQuantizedVertices = (QuantizedVertex*)pVertices + First;
+
+                for (size_t i = 0; i < PatchRowVertices; i++) {
+                    RescaleNormal16(pQuantizedVertices[i].Normal, Scale);
+                }
+
+                continue;
+            }
+
+            // The heights come from the height map so that they match the CPU side exactly
+            for (int PatchX = 0; PatchX < m_numPatchesX; PatchX++) {
+                for (int z = 0; z < m_patchSize; z++) {
+                    int SrcZ = std::min(PatchZ * RowsPerPatch + z, m_heightMapDepth - 1);
+                    Vertex* pDst = (Vertex*)pVertices + First + ((size_t)PatchX * m_patchSize + z) * m_patchSize;
+
+                    for (int i = 0; i < m_patchSize; i++) {
+                        int SrcX = std::min(PatchX * RowsPerPatch + i, m_heightMapWidth - 1);
+
+                        pDst[i].Pos.y = HeightMap.Get(SrcX, SrcZ);
+                        pDst[i].Normal = RescaleNormal(pDst[i].Normal, Scale);
+                    }
+                }
+            }
+        }
+    });
+}
+
+
+void GeomipGrid::SaveToFile(TerrainFileWriter& Writer) const
+{
+    // A grid that is prepared but not uploaded yet still has its CPU copies
+    bool Prepared = (m_vao == 0) && !m_indices.empty();
+
+    if ((m_vao == 0) && !Prepared) {
+        printf("%s: the grid must be prepared or uploaded before it is saved\n", __FUNCTION__);
+        exit(0);
+    }
+
+    Writer.AddSection(TERRAIN_SECTION_PATCH_BOUNDS, m_patchBounds.data(), sizeof(PatchBounds) * m_patchBounds.size());
+
+    // The heights of a grid with height textures are saved by the terrain - only its normals are needed
+    std::vector<u8> Vertices;
+    std::vector<u16> Indices;
+    const void* pVertices = NULL;
+    const u16* pIndices = NULL;
+
+    if (Prepared) {
+        if (m_heightTextures) {
+            pVertices = &m_textureNormals[0];
+        } else if (m_compact) {
+            pVertices = &m_compactVertices[0];
+        } else if (m_quantized) {
+            pVertices = &m_packedVertices[0];
+        } else {
+            pVertices = &m_vertices[0];
+        }
+
+        pIndices = &m_indices[0];
+    } else {
+        // The CPU copies are released after the upload. GL_COPY_READ_BUFFER leaves the
+        // array and element array bindings (and the VAO) alone.
+        Vertices.resize(GetVertexSectionSize());
+        Indices.resize(m_numIndices);
+
+        if (m_heightTextures) {
+            glBindTexture(GL_TEXTURE_2D, m_normalTexture);
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_BYTE, &Vertices[0]);
+            glPixelStorei(GL_PACK_ALIGNMENT, 4);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        } else {
+            glBindBuffer(GL_COPY_READ_BUFFER, m_vb);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, 0, Vertices.size(), &Vertices[0]);
+        }
+
+        glBindBuffer(GL_COPY_READ_BUFFER, m_ib);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(Indices[0]) * Indices.size(), &Indices[0]);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        pVertices = &Vertices[0];
+        pIndices = &Indices[0];
+    }
+
+    Writer.AddSection(GetVertexSection(), pVertices, GetVertexSectionSize());
+
+    // Number of LODs and number of indices, the LOD ranges, the indices
+    i32 Counts[2] = { (i32)m_lodInfo.size(), (i32)m_numIndices };
+
+    Writer.BeginSection(TERRAIN_SECTION_LOD_TABLES, sizeof(Counts) + sizeof(LodInfo) * m_lodInfo.size() + sizeof(u16) * m_numIndices);
+    Writer.Write(Counts, sizeof(Counts));
+    Writer.Write(m_lodInfo.data(), sizeof(LodInfo) * m_lodInfo.size());
+    Writer.Write(pIndices, sizeof(u16) * m_numIndices);
+}
+
+
+bool GeomipGrid::LoadFromFile(const TerrainFileReader& Reader, int Width, int Depth, int PatchSize, float WorldScale, const BaseTerrain* pTerrain)
+{
+    InitGridLayout(Width, Depth, PatchSize, WorldScale);
+
+    // The vertex format follows the heights of the terrain and the compact and height texture settings
+    const QuantizedHeightMap* pQuantized = pTerrain->GetQuantizedHeightMap();
+    m_quantized = (pQuantized != NULL);
+
+    size_t VerticesSize = 0;
+    size_t LodTablesSize = 0;
+    size_t BoundsSize = 0;
+    const void* pVertices = Reader.GetSection(GetVertexSection(), VerticesSize);
+    const u8* pLodTables = (const u8*)Reader.GetSection(TERRAIN_SECTION_LOD_TABLES, LodTablesSize);
+    const void* pBounds = Reader.GetSection(TERRAIN_SECTION_PATCH_BOUNDS, BoundsSize);
+
+    if (!pVertices || !pLodTables) {
+        return false;
+    }
+
+    if (Reader.GetHeader().Version < TERRAIN_FILE_PATCH_BLOCKS_VERSION) {
+        printf("%s: the grid in a version %u file has no patch blocks\n", __FUNCTION__, Reader.GetHeader().Version);
+        return false;
+    }
+
+    if (VerticesSize != GetVertexSectionSize()) {
+        printf("%s: the vertex section doesn't match a %dx%d grid (%zu bytes)\n", __FUNCTION__, m_width, m_depth, VerticesSize);
+        return false;
+    }
+
+    i32 Counts[2] = { 0, 0 };
+
+    if (LodTablesSize >= sizeof(Counts)) {
+        memcpy(Counts, pLodTables, sizeof(Counts));
+    }
+
+    if ((Counts[0] != (i32)m_lodInfo.size()) || (Counts[1] <= 0) ||
+        (LodTablesSize != sizeof(Counts) + sizeof(LodInfo) * Counts[0] + sizeof(u16) * Counts[1])) {
+        printf("%s: the LOD tables don't match patch size %d\n", __FUNCTION__, PatchSize);
+        return false;
+    }
+
+    std::vector<LodInfo> LodTables(Counts[0]);
+    memcpy(LodTables.data(), pLodTables + sizeof(Counts), sizeof(LodInfo) * Counts[0]);
+
+    std::vector<u16> Indices(Counts[1]);
+    memcpy(&Indices[0], pLodTables + sizeof(Counts) + sizeof(LodInfo) * Counts[0], sizeof(u16) * Counts[1]);
+
+    // Everything is drawn relative to the vertex block of a patch so an index can't go past its last vertex
+    uint MaxIndex = m_patchSize * m_patchSize - 1;
+
+    for (size_t i = 0; i < Indices.size(); i++) {
+        if (Indices[i] > MaxIndex) {
+            printf("%s: index %u is out of the patch (max %u)\n", __FUNCTION__, (uint)Indices[i], MaxIndex);
+            return false;
+        }
+    }
+
+    const SingleLodInfo* pRanges = &LodTables[0].info[0][0][0][0];
+    int NumRanges = Counts[0] * LEFT * RIGHT * TOP * BOTTOM;
+
+    for (int i = 0; i < NumRanges; i++) {
+        if ((pRanges[i].Start < 0) || (pRanges[i].Count < 0) || (pRanges[i].Start > Counts[1] - pRanges[i].Count)) {
+            printf("%s: LOD range %d (start %d count %d) is out of the index buffer\n", __FUNCTION__, i, pRanges[i].Start, pRanges[i].Count);
+            return false;
+        }
+    }
+
+    m_lodInfo.swap(LodTables);
+    m_indices.swap(Indices);
+    m_numIndices = Counts[1];
+
+    if (m_quantized) {
+        m_patchHeightBase = pQuantized->GetPatchBases();
+    }
+
+    if (pBounds && (BoundsSize == sizeof(PatchBounds) * m_numPatchesX * m_numPatchesZ)) {
+        m_patchBounds.resize(m_numPatchesX * m_numPatchesZ);
+        memcpy(m_patchBounds.data(), pBounds, BoundsSize);
+    } else if (m_quantized) {
+        Array2D<float> HeightMap;
+        pQuantized->Dequantize(HeightMap);
+        CalcPatchBounds(HeightMap);
+    } else {
+        CalcPatchBounds(pTerrain->GetHeightMap());
+    }
+
+    // The patch bounds are the same as when the vertices were saved so the lattice is too
+    InitCompactDecoding(pTerrain->GetTextureScale(), pQuantized);
+
+    m_pTerrain = pTerrain;
+
+    CreateGLState();
+
+    if (m_heightTextures) {
+        const Array2D<float>& HeightMap = pTerrain->GetHeightMap();
+        UploadHeightTextures(GetTextureHeights(HeightMap, pQuantized), (const i8*)pVertices, 0, m_heightMapDepth);
+
+        PrintVertexBufferSize();
+
+        UploadIndexBuffer();
+
+        return true;
+    }
+
+    // Straight from the mapped file to the vertex buffer
+    glBufferData(GL_ARRAY_BUFFER, VerticesSize, NULL, GL_STATIC_DRAW);
+
+    UploadStream Stream;
+    Stream.Init();
+    Stream.Write(m_vb, 0, pVertices, VerticesSize);
+    Stream.Destroy();
+
+    PrintVertexBufferSize();
+
+    UploadIndexBuffer();
+
+    return true;
 }
 
 
@@ -92,16 +674,47 @@ void GeomipGrid::CreateGLState()
 
     glBindVertexArray(m_vao);
 
+    glGenBuffers(1, &m_ib);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ib);
+
+    // No vertex attributes at all - everything comes from gl_VertexID and the textures
+    if (m_heightTextures) {
+        CreateHeightTextures();
+        return;
+    }
+
     glGenBuffers(1, &m_vb);
 
     glBindBuffer(GL_ARRAY_BUFFER, m_vb);
 
-    glGenBuffers(1, &m_ib);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ib);
-
     int POS_LOC = 0;
     int TEX_LOC = 1;
     int NORMAL_LOC = 2;
+    int HEIGHT_LOC = 3;
+
+    if (m_compact) {
+        // Nothing but the height and the normal - the position attribute stays disabled
+        glEnableVertexAttribArray(HEIGHT_LOC);
+        glVertexAttribIPointer(HEIGHT_LOC, 1, GL_UNSIGNED_SHORT, sizeof(CompactVertex), (const void*)offsetof(CompactVertex, Height));
+
+        glEnableVertexAttribArray(NORMAL_LOC);
+        glVertexAttribPointer(NORMAL_LOC, 2, GL_BYTE, GL_TRUE, sizeof(CompactVertex), (const void*)offsetof(CompactVertex, Normal));
+        return;
+    }
+
+    if (m_quantized) {
+        // X and Z arrive in the xy of the position - the shader decodes the height
+        // and derives the texture coordinates
+        glEnableVertexAttribArray(POS_LOC);
+        glVertexAttribPointer(POS_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(QuantizedVertex), (const void*)offsetof(QuantizedVertex, X));
+
+        glEnableVertexAttribArray(HEIGHT_LOC);
+        glVertexAttribIPointer(HEIGHT_LOC, 1, GL_UNSIGNED_SHORT, sizeof(QuantizedVertex), (const void*)offsetof(QuantizedVertex, Height));
+
+        glEnableVertexAttribArray(NORMAL_LOC);
+        glVertexAttribPointer(NORMAL_LOC, 3, GL_SHORT, GL_TRUE, sizeof(QuantizedVertex), (const void*)offsetof(QuantizedVertex, Normal));
+        return;
+    }
 
     size_t NumFloats = 0;
 
@@ -119,74 +732,651 @@ void GeomipGrid::CreateGLState()
 }
 
 
-void GeomipGrid::PopulateBuffers(const BaseTerrain* pTerrain)
+void GeomipGrid::PopulateBuffers(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized)
 {
-    std::vector<Vertex> Vertices;
-    Vertices.resize(m_width * m_depth);
-    printf("Preparing space for %zu vertices\n", Vertices.size());
-    InitVertices(pTerrain, Vertices);
+    InitIndexBuffer();
+
+    CalcPatchBounds(HeightMap);
+
+    m_quantized = (pQuantized != NULL);
+
+    if (m_quantized) {
+        m_patchHeightBase = pQuantized->GetPatchBases();
+    }
+
+    InitCompactDecoding(TextureScale, pQuantized);
+
+    if (m_heightTextures) {
+        if (m_quantized) {
+            const u16* pSamples = pQuantized->GetSamples().GetBaseAddr();
+            m_textureSamples.assign(pSamples, pSamples + (size_t)m_heightMapWidth * m_heightMapDepth);
+        } else {
+            m_textureHeights.assign(HeightMap.GetBaseAddr(), HeightMap.GetBaseAddr() + (size_t)m_heightMapWidth * m_heightMapDepth);
+        }
+
+        m_textureNormals.resize((size_t)m_heightMapWidth * m_heightMapDepth * 2);
+        BuildNormalMap(HeightMap, 0, m_heightMapDepth, &m_textureNormals[0]);
+        return;
+    }
+
+    // Only the vertices in the format of the grid are kept
+    void* pVertices = NULL;
+
+    if (m_compact) {
+        m_compactVertices.resize(GetNumVertices());
+        pVertices = &m_compactVertices[0];
+    } else if (m_quantized) {
+        m_packedVertices.resize(GetNumVertices());
+        pVertices = &m_packedVertices[0];
+    } else {
+        m_vertices.resize(GetNumVertices());
+        pVertices = &m_vertices[0];
+    }
+
+    printf("Preparing space for %zu vertices\n", GetNumVertices());
+
+    BuildPatchRows(HeightMap, TextureScale, pQuantized, 0, m_numPatchesZ, pVertices);
+}
+
 
+void GeomipGrid::InitIndexBuffer()
+{
     int NumIndices = CalcNumIndices();
-    std::vector<unsigned int> Indices;
-    Indices.resize(NumIndices);
+    m_indices.resize(NumIndices);
+
+    m_numIndices = InitIndices(m_indices);
+    printf("Final number of indices %d\n", m_numIndices);
+}
+
 
-    NumIndices = InitIndices(Indices);
-    printf("Final number of indices %d\n", NumIndices);
+void GeomipGrid::StreamVertices(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized,
+                                int FirstPatchZ, int EndPatchZ, UploadStream& Stream)
+{
+    // The threads build a group of rows of patches, which is contiguous in the vertex
+    // buffer, and then it is streamed
+    size_t PatchRowSize = GetPatchRowOffset(1) * GetBytesPerVertex();
+    int PatchRowsPerGroup = std::min(2 * GetThreadPool().GetNumThreads(), (int)(MAX_STREAM_GROUP_SIZE / PatchRowSize));
+    PatchRowsPerGroup = std::max(1, std::min(PatchRowsPerGroup, EndPatchZ - FirstPatchZ));
+
+    std::vector<u8> Group(PatchRowSize * PatchRowsPerGroup);
 
-    CalcNormals(Vertices, Indices);
+    for (int GroupBegin = FirstPatchZ; GroupBegin < EndPatchZ; GroupBegin += PatchRowsPerGroup) {
+        int GroupEnd = std::min(GroupBegin + PatchRowsPerGroup, EndPatchZ);
 
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertices[0]) * Vertices.size(), &Vertices[0], GL_STATIC_DRAW);
+        BuildPatchRows(HeightMap, TextureScale, pQuantized, GroupBegin, GroupEnd, &Group[0]);
 
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Indices[0]) * NumIndices, &Indices[0], GL_STATIC_DRAW);
+        Stream.Write(m_vb, GetPatchRowOffset(GroupBegin) * GetBytesPerVertex(), &Group[0], PatchRowSize * (GroupEnd - GroupBegin));
+    }
 }
 
 
-int GeomipGrid::CalcNumIndices()
+#ifdef SIMD_X86
+
+// Count vertices (8 floats each) from the columns of a row - 8 at a time, with the
+// 8 values of each of them transposed from the rows of an 8x8 block. Returns where
+// it stopped.
+SIMD_TARGET_AVX2 static int VertexSpan_AVX2(const float* pX, const float* pHeight, float Z, const float* pTexU, float TexV,
+                                            const float* pNormalX, const float* pNormalY, const float* pNormalZ, int Count, float* pDst)
 {
-    int NumQuads = (m_patchSize - 1) * (m_patchSize - 1);
-    int NumIndices = 0;
-    int MaxPermutationsPerLevel = 16;    // true/false for each of the four sides
-    const int IndicesPerQuad = 6;        // two triangles
-    for (int lod = 0; lod <= m_maxLOD; lod++) {
-        printf("LOD %d: num quads %d\n", lod, NumQuads);
-        NumIndices += NumQuads * IndicesPerQuad * MaxPermutationsPerLevel;
-        NumQuads /= 4;
+    const __m256 vZ = _mm256_set1_ps(Z);
+    const __m256 vTexV = _mm256_set1_ps(TexV);
+
+    int i = 0;
+
+    for (; i + 8 <= Count; i += 8) {
+        __m256 t0 = _mm256_unpacklo_ps(_mm256_loadu_ps(pX + i), _mm256_loadu_ps(pHeight + i));
+        __m256 t1 = _mm256_unpackhi_ps(_mm256_loadu_ps(pX + i), _mm256_loadu_ps(pHeight + i));
+        __m256 t2 = _mm256_unpacklo_ps(vZ, _mm256_loadu_ps(pTexU + i));
+        __m256 t3 = _mm256_unpackhi_ps(vZ, _mm256_loadu_ps(pTexU + i));
+        __m256 t4 = _mm256_unpacklo_ps(vTexV, _mm256_loadu_ps(pNormalX + i));
+        __m256 t5 = _mm256_unpackhi_ps(vTexV, _mm256_loadu_ps(pNormalX + i));
+        __m256 t6 = _mm256_unpacklo_ps(_mm256_loadu_ps(pNormalY + i), _mm256_loadu_ps(pNormalZ + i));
+        __m256 t7 = _mm256_unpackhi_ps(_mm256_loadu_ps(pNormalY + i), _mm256_loadu_ps(pNormalZ + i));
+
+        // The first halves of vertices 0-3 in the low lanes and of 4-7 in the high lanes
+        __m256 First0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 First1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 First2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 First3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+
+        __m256 Second0 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 Second1 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 Second2 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 Second3 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+        float* pVertex = pDst + (size_t)i * 8;
+
+        _mm256_storeu_ps(pVertex, _mm256_permute2f128_ps(First0, Second0, 0x20));
+        _mm256_storeu_ps(pVertex + 8, _mm256_permute2f128_ps(First1, Second1, 0x20));
+        _mm256_storeu_ps(pVertex + 16, _mm256_permute2f128_ps(First2, Second2, 0x20));
+        _mm256_storeu_ps(pVertex + 24, _mm256_permute2f128_ps(First3, Second3, 0x20));
+        _mm256_storeu_ps(pVertex + 32, _mm256_permute2f128_ps(First0, Second0, 0x31));
+        _mm256_storeu_ps(pVertex + 40, _mm256_permute2f128_ps(First1, Second1, 0x31));
+        _mm256_storeu_ps(pVertex + 48, _mm256_permute2f128_ps(First2, Second2, 0x31));
+        _mm256_storeu_ps(pVertex + 56, _mm256_permute2f128_ps(First3, Second3, 0x31));
     }
-    printf("Initial number of indices %d\n", NumIndices);
-    return NumIndices;
+
+    return i;
 }
 
 
-void GeomipGrid::Vertex::InitVertex(const BaseTerrain* pTerrain, int x, int z)
+// The snorm16 normals of Count columns (3 values each) - 8 at a time
+SIMD_TARGET_AVX2 static int PackNormalSpan_AVX2(const float* pX, const float* pY, const float* pZ, int Count, i16* pDst)
 {
-    float y = pTerrain->GetHeight(x, z);
+    const __m256 One = _mm256_set1_ps(1.0f);
+    const __m256 MinusOne = _mm256_set1_ps(-1.0f);
+    const __m256 Scale = _mm256_set1_ps(32767.0f);
+    const __m256 Half = _mm256_set1_ps(0.5f);
+
+    const float* pSrc[3] = { pX, pY, pZ };
 
-    float WorldScale = pTerrain->GetWorldScale();
-    Pos = Vector3f(x * WorldScale, y, z * WorldScale);
+    int i = 0;
 
-    float Size = (float)pTerrain->GetSize();
-    float TextureScale = pTerrain->GetTextureScale();
-    Tex = Vector2f(TextureScale * (float)x / Size, TextureScale * (float)z / Size);
+    for (; i + 8 <= Count; i += 8) {
+        i32 Packed[3][8];
+
+        for (int c = 0; c < 3; c++) {
+            __m256 n = _mm256_max_ps(MinusOne, _mm256_min_ps(_mm256_loadu_ps(pSrc[c] + i), One));
+            __m256 Rounded = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(n, Scale), Half));
+            _mm256_storeu_si256((__m256i*)Packed[c], _mm256_cvttps_epi32(Rounded));
+        }
+
+        for (int j = 0; j < 8; j++) {
+            pDst[(i + j) * 3] = (i16)Packed[0][j];
+            pDst[(i + j) * 3 + 1] = (i16)Packed[1][j];
+            pDst[(i + j) * 3 + 2] = (i16)Packed[2][j];
+        }
+    }
+
+    return i;
 }
 
 
-void GeomipGrid::InitVertices(const BaseTerrain* pTerrain, std::vector<Vertex>& Vertices)
+// EncodeOctahedral of Count columns - 8 at a time
+SIMD_TARGET_AVX2 static int EncodeOctahedralSpan_AVX2(const float* pX, const float* pY, const float* pZ, int Count, i8* pDst)
 {
-    int Index = 0;
+    const __m256 SignMask = _mm256_set1_ps(-0.0f);
+    const __m256 Zero = _mm256_setzero_ps();
+    const __m256 One = _mm256_set1_ps(1.0f);
+    const __m256 MinusOne = _mm256_set1_ps(-1.0f);
+    const __m256 Scale = _mm256_set1_ps(127.0f);
+    const __m256 Half = _mm256_set1_ps(0.5f);
+
+    int i = 0;
+
+    for (; i + 8 <= Count; i += 8) {
+        __m256 x = _mm256_loadu_ps(pX + i);
+        __m256 y = _mm256_loadu_ps(pY + i);
+        __m256 z = _mm256_loadu_ps(pZ + i);
+
+        __m256 Sum = _mm256_add_ps(_mm256_add_ps(_mm256_andnot_ps(SignMask, x), _mm256_andnot_ps(SignMask, y)), _mm256_andnot_ps(SignMask, z));
+        __m256 HasSum = _mm256_cmp_ps(Sum, Zero, _CMP_GT_OQ);
+
+        __m256 OctX = _mm256_and_ps(_mm256_div_ps(x, Sum), HasSum);
+        __m256 OctZ = _mm256_and_ps(_mm256_div_ps(z, Sum), HasSum);
+
+        __m256 SignX = _mm256_blendv_ps(MinusOne, One, _mm256_cmp_ps(OctX, Zero, _CMP_GE_OQ));
+        __m256 SignZ = _mm256_blendv_ps(MinusOne, One, _mm256_cmp_ps(OctZ, Zero, _CMP_GE_OQ));
+        __m256 FoldedX = _mm256_mul_ps(_mm256_sub_ps(One, _mm256_andnot_ps(SignMask, OctZ)), SignX);
+        __m256 FoldedZ = _mm256_mul_ps(_mm256_sub_ps(One, _mm256_andnot_ps(SignMask, OctX)), SignZ);
+
+        __m256 Fold = _mm256_and_ps(_mm256_cmp_ps(y, Zero, _CMP_LT_OQ), HasSum);
+        OctX = _mm256_blendv_ps(OctX, FoldedX, Fold);
+        OctZ = _mm256_blendv_ps(OctZ, FoldedZ, Fold);
+
+        i32 PackedX[8];
+        i32 PackedZ[8];
+        _mm256_storeu_si256((__m256i*)PackedX, _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(OctX, Scale), Half))));
+        _mm256_storeu_si256((__m256i*)PackedZ, _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(OctZ, Scale), Half))));
+
+        for (int j = 0; j < 8; j++) {
+            pDst[(i + j) * 2] = (i8)PackedX[j];
+            pDst[(i + j) * 2 + 1] = (i8)PackedZ[j];
+        }
+    }
+
+    return i;
+}
+
+
+// Heights to the levels of the lattice of a compact grid - 8 at a time
+SIMD_TARGET_AVX2 static int HeightLevelSpan_AVX2(const float* pHeight, int Count, float Origin, float Step, u16* pDst)
+{
+    const __m256 vOrigin = _mm256_set1_ps(Origin);
+    const __m256 vStep = _mm256_set1_ps(Step);
+    const __m256 Half = _mm256_set1_ps(0.5f);
+    const __m256 Zero = _mm256_setzero_ps();
+    const __m256 MaxLevel = _mm256_set1_ps(65535.0f);
+
+    int i = 0;
+
+    for (; i + 8 <= Count; i += 8) {
+        __m256 Level = _mm256_floor_ps(_mm256_add_ps(_mm256_div_ps(_mm256_sub_ps(_mm256_loadu_ps(pHeight + i), vOrigin), vStep), Half));
+        Level = _mm256_max_ps(Zero, _mm256_min_ps(Level, MaxLevel));
+
+        i32 Levels[8];
+        _mm256_storeu_si256((__m256i*)Levels, _mm256_cvttps_epi32(Level));
+
+        for (int j = 0; j < 8; j++) {
+            pDst[i + j] = (u16)Levels[j];
+        }
+    }
+
+    return i;
+}
+
+#endif
+
+
+// The rows of patches don't depend on each other (the normals come straight from the
+// height map) so they are spread over the thread pool, and every thread writes the
+// vertices of its rows of patches in the format of the grid straight into their
+// patch blocks. pVertices is where the blocks of FirstPatchZ go.
+void GeomipGrid::BuildPatchRows(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized,
+                                int FirstPatchZ, int EndPatchZ, void* pVertices)
+{
+    // X and the texture coordinate of a column are the same on every row
+    std::vector<float> ColumnX(m_width);
+    std::vector<float> ColumnTex(m_width);
+
+    for (int x = 0; x < m_width; x++) {
+        int SrcX = std::min(x, m_heightMapWidth - 1);
+
+        ColumnX[x] = SrcX * m_worldScale;
+        ColumnTex[x] = TextureScale * (float)SrcX / (float)m_heightMapWidth;
+    }
+
+    int RowsPerPatch = m_patchSize - 1;
+    size_t PatchRowVertices = GetPatchRowOffset(1);
+
+    GetThreadPool().ParallelFor(FirstPatchZ, EndPatchZ, 1, [&](int PatchRowBegin, int PatchRowEnd) {
+        VertexRow Row;
+
+        for (int PatchZ = PatchRowBegin; PatchZ < PatchRowEnd; PatchZ++) {
+            size_t First = (size_t)(PatchZ - FirstPatchZ) * PatchRowVertices;
+
+            for (int z = 0; z < m_patchSize; z++) {
+                LoadVertexRow(HeightMap, TextureScale, pQuantized, PatchZ * RowsPerPatch + z, Row);
+
+                for (int PatchX = 0; PatchX < m_numPatchesX; PatchX++) {
+                    int x0 = PatchX * RowsPerPatch;
+                    size_t Index = First + ((size_t)PatchX * m_patchSize + z) * m_patchSize;
+
+                    if (m_compact) {
+                        WriteCompactVertices(Row, x0, (CompactVertex*)pVertices + Index);
+                    } else if (m_quantized) {
+                        WriteQuantizedVertices(Row, &ColumnX[0], x0, (QuantizedVertex*)pVertices + Index);
+                    } else {
+                        WriteVertices(Row, &ColumnX[0], &ColumnTex[0], x0, (Vertex*)pVertices + Index);
+                    }
+                }
+            }
+        }
+    });
+}
+
+
+// Row z of the grid comes from the row of the height map it is clamped to
+void GeomipGrid::LoadVertexRow(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized, int z, VertexRow& Row) const
+{
+    Row.Height.resize(m_width);
+    Row.NormalX.resize(m_width);
+    Row.NormalY.resize(m_width);
+    Row.NormalZ.resize(m_width);
+
+    int SrcZ = std::min(z, m_heightMapDepth - 1);
+    int Last = m_heightMapWidth - 1;
+
+    const float* pHeights = HeightMap.GetAddr(0, SrcZ);
+    std::copy(pHeights, pHeights + m_heightMapWidth, Row.Height.begin());
+
+    CalcHeightMapNormalRow(HeightMap, m_worldScale, SrcZ, 0, m_heightMapWidth, &Row.NormalX[0], &Row.NormalY[0], &Row.NormalZ[0], m_pBorder);
+
+    for (int x = m_heightMapWidth; x < m_width; x++) {
+        Row.Height[x] = Row.Height[Last];
+        Row.NormalX[x] = Row.NormalX[Last];
+        Row.NormalY[x] = Row.NormalY[Last];
+        Row.NormalZ[x] = Row.NormalZ[Last];
+    }
+
+    Row.Z = SrcZ * m_worldScale;
+    Row.TexV = TextureScale * (float)SrcZ / (float)m_heightMapWidth;
+
+    if (!m_compact && !m_quantized) {
+        return;
+    }
+
+    // The 16 bit heights
+    Row.Sample.resize(m_width);
+
+    if (pQuantized) {
+        const u16* pSamples = pQuantized->GetSamples().GetAddr(0, SrcZ);
+        std::copy(pSamples, pSamples + m_heightMapWidth, Row.Sample.begin());
+        std::fill(Row.Sample.begin() + m_heightMapWidth, Row.Sample.end(), pSamples[Last]);
+    } else {
+        int x = 0;
+
+#ifdef SIMD_X86
+        if (GetSimdLevel() == SIMD_LEVEL_AVX2) {
+            x = HeightLevelSpan_AVX2(&Row.Height[0], m_width, m_heightOrigin, m_heightStep, &Row.Sample[0]);
+        }
+#endif
+
+        for (; x < m_width; x++) {
+            float Level = floorf((Row.Height[x] - m_heightOrigin) / m_heightStep + 0.5f);
+            Row.Sample[x] = (u16)std::max(0.0f, std::min(Level, 65535.0f));
+        }
+    }
+
+    // And the packed normals
+    int x = 0;
+
+    if (m_compact) {
+        Row.NormalOct.resize((size_t)m_width * 2);
+
+#ifdef SIMD_X86
+        if (GetSimdLevel() == SIMD_LEVEL_AVX2) {
+            x = EncodeOctahedralSpan_AVX2(&Row.NormalX[0], &Row.NormalY[0], &Row.NormalZ[0], m_width, &Row.NormalOct[0]);
+        }
+#endif
+
+        for (; x < m_width; x++) {
+            EncodeOctahedral(Vector3f(Row.NormalX[x], Row.NormalY[x], Row.NormalZ[x]), &Row.NormalOct[x * 2]);
+        }
+    } else {
+        Row.Normal16.resize((size_t)m_width * 3);
+
+#ifdef SIMD_X86
+        if (GetSimdLevel() == SIMD_LEVEL_AVX2) {
+            x = PackNormalSpan_AVX2(&Row.NormalX[0], &Row.NormalY[0], &Row.NormalZ[0], m_width, &Row.Normal16[0]);
+        }
+#endif
+
+        for (; x < m_width; x++) {
+            Row.Normal16[x * 3] = (i16)floorf(std::max(-1.0f, std::min(Row.NormalX[x], 1.0f)) * 32767.0f + 0.5f);
+            Row.Normal16[x * 3 + 1] = (i16)floorf(std::max(-1.0f, std::min(Row.NormalY[x], 1.0f)) * 32767.0f + 0.5f);
+            Row.Normal16[x * 3 + 2] = (i16)floorf(std::max(-1.0f, std::min(Row.NormalZ[x], 1.0f)) * 32767.0f + 0.5f);
+        }
+    }
+}
+
+
+// The PatchSize vertices of a row of a patch block from column x0 on
+void GeomipGrid::WriteVertices(const VertexRow& Row, const float* pColumnX, const float* pColumnTex, int x0, Vertex* pDst) const
+{
+    int i = 0;
+
+#ifdef SIMD_X86
+    if (GetSimdLevel() == SIMD_LEVEL_AVX2) {
+        i = VertexSpan_AVX2(pColumnX + x0, &Row.Height[x0], Row.Z, pColumnTex + x0, Row.TexV,
+                            &Row.NormalX[x0], &Row.NormalY[x0], &Row.NormalZ[x0], m_patchSize, (float*)pDst);
+    }
+#endif
+
+    for (; i < m_patchSize; i++) {
+        int x = x0 + i;
+
+        pDst[i].Pos = Vector3f(pColumnX[x], Row.Height[x], Row.Z);
+        pDst[i].Tex = Vector2f(pColumnTex[x], Row.TexV);
+        pDst[i].Normal = Vector3f(Row.NormalX[x], Row.NormalY[x], Row.NormalZ[x]);
+    }
+}
+
+
+void GeomipGrid::WriteQuantizedVertices(const VertexRow& Row, const float* pColumnX, int x0, QuantizedVertex* pDst) const
+{
+    const i16* pNormals = &Row.Normal16[0];
+
+    for (int i = 0; i < m_patchSize; i++) {
+        int x = x0 + i;
+        QuantizedVertex& q = pDst[i];
+
+        q.X = pColumnX[x];
+        q.Z = Row.Z;
+        q.Height = Row.Sample[x];
+        q.Normal[0] = pNormals[x * 3];
+        q.Normal[1] = pNormals[x * 3 + 1];
+        q.Normal[2] = pNormals[x * 3 + 2];
+    }
+}
+
+
+void GeomipGrid::WriteCompactVertices(const VertexRow& Row, int x0, CompactVertex* pDst) const
+{
+    const i8* pNormals = &Row.NormalOct[0];
+
+    for (int i = 0; i < m_patchSize; i++) {
+        int x = x0 + i;
+        CompactVertex& c = pDst[i];
+
+        c.Height = Row.Sample[x];
+        c.Normal[0] = pNormals[x * 2];
+        c.Normal[1] = pNormals[x * 2 + 1];
+    }
+}
+
+
+// Octahedral normals - the upper hemisphere maps to the diamond |x| + |z| <= 1 and
+// the lower one is folded over its edges into the corners of the square
+void GeomipGrid::EncodeOctahedral(const Vector3f& Normal, i8* pOct)
+{
+    float Sum = fabsf(Normal.x) + fabsf(Normal.y) + fabsf(Normal.z);
+    float OctX = 0.0f;
+    float OctZ = 0.0f;
+
+    if (Sum > 0.0f) {
+        OctX = Normal.x / Sum;
+        OctZ = Normal.z / Sum;
+
+        if (Normal.y < 0.0f) {
+            float FoldedX = (1.0f - fabsf(OctZ)) * (OctX >= 0.0f ? 1.0f : -1.0f);
+            float FoldedZ = (1.0f - fabsf(OctX)) * (OctZ >= 0.0f ? 1.0f : -1.0f);
+            OctX = FoldedX;
+            OctZ = FoldedZ;
+        }
+    }
+
+    pOct[0] = (i8)floorf(OctX * 127.0f + 0.5f);
+    pOct[1] = (i8)floorf(OctZ * 127.0f + 0.5f);
+}
+
+
+// EncodeOctahedral in reverse - the same as DecodeOctahedral in terrain.vs
+Vector3f GeomipGrid::DecodeOctahedral(const i8* pOct)
+{
+    float OctX = std::max(pOct[0] / 127.0f, -1.0f);
+    float OctZ = std::max(pOct[1] / 127.0f, -1.0f);
+    Vector3f Normal(OctX, 1.0f - fabsf(OctX) - fabsf(OctZ), OctZ);
+
+    if (Normal.y < 0.0f) {
+        Normal.x = (1.0f - fabsf(OctZ)) * (OctX >= 0.0f ? 1.0f : -1.0f);
+        Normal.z = (1.0f - fabsf(OctX)) * (OctZ >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    return RescaleNormal(Normal, 1.0f);
+}
+
+
+void GeomipGrid::RescaleOctahedral(i8* pOct, float Scale)
+{
+    EncodeOctahedral(RescaleNormal(DecodeOctahedral(pOct), Scale), pOct);
+}
+
+
+void GeomipGrid::RescaleNormal16(i16* pNormal, float Scale)
+{
+    Vector3f Normal(std::max(pNormal[0] / 32767.0f, -1.0f), std::max(pNormal[1] / 32767.0f, -1.0f), std::max(pNormal[2] / 32767.0f, -1.0f));
+    Normal = RescaleNormal(Normal, Scale);
+
+    pNormal[0] = (i16)floorf(std::max(-1.0f, std::min(Normal.x, 1.0f)) * 32767.0f + 0.5f);
+    pNormal[1] = (i16)floorf(std::max(-1.0f, std::min(Normal.y, 1.0f)) * 32767.0f + 0.5f);
+    pNormal[2] = (i16)floorf(std::max(-1.0f, std::min(Normal.z, 1.0f)) * 32767.0f + 0.5f);
+}
+
+
+// The x and z of a normal are the slopes (times y) - see height_map_normals.h
+Vector3f GeomipGrid::RescaleNormal(const Vector3f& Normal, float Scale)
+{
+    Vector3f Scaled(Normal.x * Scale, Normal.y, Normal.z * Scale);
+    float Length = Scaled.Length();
+
+    return (Length > 0.0f) ? Scaled / Length : Vector3f(0.0f, 1.0f, 0.0f);
+}
+
+
+void GeomipGrid::BuildNormalMap(const Array2D<float>& HeightMap, int MinZ, int MaxZ, i8* pNormals)
+{
+    GetThreadPool().ParallelFor(MinZ, MaxZ, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        std::vector<Vector3f> Row(m_heightMapWidth);
+
+        for (int z = RowBegin; z < RowEnd; z++) {
+            CalcHeightMapNormalRow(HeightMap, m_worldScale, z, 0, m_heightMapWidth, &Row[0], m_pBorder);
+
+            i8* pDst = pNormals + ((size_t)(z - MinZ) * m_heightMapWidth) * 2;
 
-    for (int z = 0; z < m_depth; z++) {
-        for (int x = 0; x < m_width; x++) {
-            assert(Index < Vertices.size());
-            Vertices[Index].InitVertex(pTerrain, x, z);
-            Index++;
+            for (int x = 0; x < m_heightMapWidth; x++) {
+                EncodeOctahedral(Row[x], pDst + x * 2);
+            }
         }
+    });
+}
+
+
+void GeomipGrid::CreateHeightTextures()
+{
+    GLenum HeightFormat = m_quantized ? GL_R16UI : GL_R32F;
+    GLenum HeightPixelFormat = m_quantized ? GL_RED_INTEGER : GL_RED;
+    GLenum HeightType = m_quantized ? GL_UNSIGNED_SHORT : GL_FLOAT;
+
+    glGenTextures(1, &m_heightTexture);
+    glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, HeightFormat, m_heightMapWidth, m_heightMapDepth, 0, HeightPixelFormat, HeightType, NULL);
+
+    // No mipmaps - the default filter would leave the textures incomplete
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &m_normalTexture);
+    glBindTexture(GL_TEXTURE_2D, m_normalTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8_SNORM, m_heightMapWidth, m_heightMapDepth, 0, GL_RG, GL_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+void GeomipGrid::UploadHeightTextures(const void* pHeights, const i8* pNormals, int MinZ, int MaxZ)
+{
+    size_t HeightRowSize = (size_t)m_heightMapWidth * (m_quantized ? sizeof(u16) : sizeof(float));
+
+    // The rows of the 16 bit textures don't have to be multiples of 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (pHeights) {
+        const char* pHeightRows = (const char*)pHeights + HeightRowSize * MinZ;
+
+        glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, MinZ, m_heightMapWidth, MaxZ - MinZ, m_quantized ? GL_RED_INTEGER : GL_RED,
+                        m_quantized ? GL_UNSIGNED_SHORT : GL_FLOAT, pHeightRows);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_normalTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, MinZ, m_heightMapWidth, MaxZ - MinZ, GL_RG, GL_BYTE, pNormals);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+
+const void* GeomipGrid::GetTextureHeights(const Array2D<float>& HeightMap, const QuantizedHeightMap* pQuantized)
+{
+    return pQuantized ? (const void*)pQuantized->GetSamples().GetBaseAddr() : (const void*)HeightMap.GetBaseAddr();
+}
+
+
+void GeomipGrid::InitCompactDecoding(float TextureScale, const QuantizedHeightMap* pQuantized)
+{
+    // The same mapping as the texture coordinates of the float vertices
+    m_texCoordScale = TextureScale / (m_worldScale * m_heightMapWidth);
+
+    if (pQuantized) {
+        m_heightStep = pQuantized->GetStep();
+        m_heightOrigin = pQuantized->GetOrigin();
+        return;
+    }
+
+    float MinHeight = m_patchBounds[0].MinHeight;
+    float MaxHeight = m_patchBounds[0].MaxHeight;
+
+    for (size_t i = 1; i < m_patchBounds.size(); i++) {
+        MinHeight = std::min(MinHeight, m_patchBounds[i].MinHeight);
+        MaxHeight = std::max(MaxHeight, m_patchBounds[i].MaxHeight);
+    }
+
+    m_heightOrigin = MinHeight;
+    m_heightStep = (MaxHeight > MinHeight) ? (MaxHeight - MinHeight) / 65535.0f : 1.0f;
+}
+
+
+TERRAIN_FILE_SECTION GeomipGrid::GetVertexSection() const
+{
+    if (m_heightTextures) {
+        return TERRAIN_SECTION_NORMAL_MAP;
+    }
+
+    if (m_compact) {
+        return TERRAIN_SECTION_COMPACT_VERTICES;
+    }
+
+    return m_quantized ? TERRAIN_SECTION_QUANTIZED_VERTICES : TERRAIN_SECTION_VERTICES;
+}
+
+
+size_t GeomipGrid::GetVertexSectionSize() const
+{
+    if (m_heightTextures) {
+        return (size_t)m_heightMapWidth * m_heightMapDepth * 2 * sizeof(i8);
     }
 
-    assert(Index == Vertices.size());
+    return GetNumVertices() * GetBytesPerVertex();
+}
+
+
+void GeomipGrid::PrintVertexBufferSize() const
+{
+    size_t Size = GetNumVertices() * GetBytesPerVertex();
+    size_t FloatSize = GetNumVertices() * sizeof(Vertex);
+
+    if (m_heightTextures) {
+        printf("Height textures: %dx%d, %.1f MB instead of a %.1f MB float vertex buffer\n", m_heightMapWidth, m_heightMapDepth,
+               GetTextureSizeInBytes() / (1024.0 * 1024.0), FloatSize / (1024.0 * 1024.0));
+        return;
+    }
+
+    printf("Vertex buffer: %zu vertices, %d bytes per vertex, %.1f MB (float vertices: %d bytes, %.1f MB - %.1fx as large)\n",
+           GetNumVertices(), GetBytesPerVertex(), Size / (1024.0 * 1024.0), (int)sizeof(Vertex), FloatSize / (1024.0 * 1024.0),
+           (double)FloatSize / Size);
+}
+
+
+int GeomipGrid::CalcNumIndices()
+{
+    int NumQuads = (m_patchSize - 1) * (m_patchSize - 1);
+    int NumIndices = 0;
+    int MaxPermutationsPerLevel = 16;    // true/false for each of the four sides
+    const int IndicesPerQuad = 6;        // two triangles
+    for (int lod = 0; lod <= m_maxLOD; lod++) {
+        printf("LOD %d: num quads %d\n", lod, NumQuads);
+        NumIndices += NumQuads * IndicesPerQuad * MaxPermutationsPerLevel;
+        NumQuads /= 4;
+    }
+    printf("Initial number of indices %d\n", NumIndices);
+    return NumIndices;
 }
 
 
-int GeomipGrid::InitIndices(std::vector<unsigned int>& Indices)
+int GeomipGrid::InitIndices(std::vector<u16>& Indices)
 {
     int Index = 0;
 
@@ -199,7 +1389,7 @@ int GeomipGrid::InitIndices(std::vector<unsigned int>& Indices)
     return Index;
 }
 
-int GeomipGrid::InitIndicesLOD(int Index, std::vector<unsigned int>& Indices, int lod)
+int GeomipGrid::InitIndicesLOD(int Index, std::vector<u16>& Indices, int lod)
 {
     int TotalIndicesForLOD = 0;
 
@@ -223,7 +1413,7 @@ int GeomipGrid::InitIndicesLOD(int Index, std::vector<unsigned int>& Indices, in
 }
 
 
-int GeomipGrid::InitIndicesLODSingle(int Index, std::vector<unsigned int>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom)
+int GeomipGrid::InitIndicesLODSingle(int Index, std::vector<u16>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom)
 {
     int FanStep = powi(2, lodCore + 1);   // lod = 0 --> 2, lod = 1 --> 4, lod = 2 --> 8, etc
     int EndPos = m_patchSize - 1 - FanStep;  // patch size 5, fan step 2 --> EndPos = 2; patch size 9, fan step 2 --> EndPos = 6
@@ -243,7 +1433,7 @@ int GeomipGrid::InitIndicesLODSingle(int Index, std::vector<unsigned int>& Indic
 }
 
 
-uint GeomipGrid::CreateTriangleFan(int Index, std::vector<unsigned int>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom, int x, int z)
+uint GeomipGrid::CreateTriangleFan(int Index, std::vector<u16>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom, int x, int z)
 {
     int StepLeft = powi(2, lodLeft); // because LOD starts at zero...
     int StepRight = powi(2, lodRight);
@@ -251,18 +1441,19 @@ uint GeomipGrid::CreateTriangleFan(int Index, std::vector<unsigned int>& Indices
     int StepBottom = powi(2, lodBottom);
     int StepCenter = powi(2, lodCore);
 
-    uint IndexCenter = (z + StepCenter) * m_width + x + StepCenter;
+    // Within the vertex block of the patch
+    uint IndexCenter = (z + StepCenter) * m_patchSize + x + StepCenter;
 
     // first up
-    uint IndexTemp1 = z * m_width + x;
-    uint IndexTemp2 = (z + StepLeft) * m_width + x;
+    uint IndexTemp1 = z * m_patchSize + x;
+    uint IndexTemp2 = (z + StepLeft) * m_patchSize + x;
 
     Index = AddTriangle(Index, Indices, IndexCenter, IndexTemp1, IndexTemp2);
 
     // second up
     if (lodLeft == lodCore) {
         IndexTemp1 = IndexTemp2;
-        IndexTemp2 += StepLeft * m_width;
+        IndexTemp2 += StepLeft * m_patchSize;
 
         Index = AddTriangle(Index, Indices, IndexCenter, IndexTemp1, IndexTemp2);
     }
@@ -283,14 +1474,14 @@ uint GeomipGrid::CreateTriangleFan(int Index, std::vector<unsigned int>& Indices
 
     // first down
     IndexTemp1 = IndexTemp2;
-    IndexTemp2 -= StepRight * m_width;
+    IndexTemp2 -= StepRight * m_patchSize;
 
     Index = AddTriangle(Index, Indices, IndexCenter, IndexTemp1, IndexTemp2);
 
     // second down
     if (lodRight == lodCore) {
         IndexTemp1 = IndexTemp2;
-        IndexTemp2 -= StepRight * m_width;
+        IndexTemp2 -= StepRight * m_patchSize;
 
         Index = AddTriangle(Index, Indices, IndexCenter, IndexTemp1, IndexTemp2);
     }
@@ -313,7 +1504,7 @@ uint GeomipGrid::CreateTriangleFan(int Index, std::vector<unsigned int>& Indices
 }
 
 
-uint GeomipGrid::AddTriangle(uint Index, std::vector<uint>& Indices, uint v1, uint v2, uint v3)
+uint GeomipGrid::AddTriangle(uint Index, std::vector<u16>& Indices, uint v1, uint v2, uint v3)
 {
     assert(Index < Indices.size());
     Indices[Index++] = v1;
@@ -326,36 +1517,36 @@ uint GeomipGrid::AddTriangle(uint Index, std::vector<uint>& Indices, uint v1, ui
 }
 
 
-void GeomipGrid::CalcNormals(std::vector<Vertex>& Vertices, std::vector<uint>& Indices)
+// Height range of every patch for the frustum culling
+void GeomipGrid::CalcPatchBounds(const Array2D<float>& HeightMap)
 {
-    unsigned int Index = 0;
+    m_patchBounds.resize(m_numPatchesX * m_numPatchesZ);
+
+    CalcPatchBounds(HeightMap, 0, m_numPatchesZ);
+}
 
-    // Accumulate each triangle normal into each of the triangle vertices
-    for (int z = 0; z < m_depth - 1; z += (m_patchSize - 1)) {
-        for (int x = 0; x < m_width - 1; x += (m_patchSize - 1)) {
-            int BaseVertex = z * m_width + x;
-            //printf("Base index %d\n", BaseVertex);
-            int NumIndices = m_lodInfo[0].info[0][0][0][0].Count;
-            for (int i = 0; i < NumIndices; i += 3) {
-                unsigned int Index0 = BaseVertex + Indices[i];
-                unsigned int Index1 = BaseVertex + Indices[i + 1];
-                unsigned int Index2 = BaseVertex + Indices[i + 2];
-                Vector3f v1 = Vertices[Index1].Pos - Vertices[Index0].Pos;
-                Vector3f v2 = Vertices[Index2].Pos - Vertices[Index0].Pos;
-                Vector3f Normal = v1.Cross(v2);
-                Normal.Normalize();
 
-                Vertices[Index0].Normal += Normal;
-                Vertices[Index1].Normal += Normal;
-                Vertices[Index2].Normal += Normal;
+void GeomipGrid::CalcPatchBounds(const Array2D<float>& HeightMap, int FirstPatchZ, int EndPatchZ)
+{
+    for (int PatchZ = FirstPatchZ; PatchZ < EndPatchZ; PatchZ++) {
+        for (int PatchX = 0; PatchX < m_numPatchesX; PatchX++) {
+            int x0 = PatchX * (m_patchSize - 1);
+            int z0 = PatchZ * (m_patchSize - 1);
+            int x1 = std::min(x0 + m_patchSize - 1, m_heightMapWidth - 1);
+            int z1 = std::min(z0 + m_patchSize - 1, m_heightMapDepth - 1);
+
+            PatchBounds& Bounds = m_patchBounds[PatchZ * m_numPatchesX + PatchX];
+            Bounds.MinHeight = Bounds.MaxHeight = HeightMap.Get(x0, z0);
+
+            for (int z = z0; z <= z1; z++) {
+                for (int x = x0; x <= x1; x++) {
+                    float Height = HeightMap.Get(x, z);
+                    Bounds.MinHeight = std::min(Bounds.MinHeight, Height);
+                    Bounds.MaxHeight = std::max(Bounds.MaxHeight, Height);
+                }
             }
         }
     }
-
-    // Normalize all the vertex normals
-    for (unsigned int i = 0; i < Vertices.size(); i++) {
-        Vertices[i].Normal.Normalize();
-    }
 }
 
 
@@ -364,7 +1555,7 @@ void clrscr()
     std::system("cls");
 }
 
-void GeomipGrid::Render(const Vector3f& CameraPos, const Matrix4f& ViewProj)
+void GeomipGrid::Render(const Vector3f& CameraPos, const Matrix4f& ViewProj, TerrainTechnique* pTech)
 {
 #ifdef _WIN64
     if (gShowPoints == 3) {
@@ -377,8 +1568,32 @@ void GeomipGrid::Render(const Vector3f& CameraPos, const Matrix4f& ViewProj)
 
     glBindVertexArray(m_vao);
 
+    pTech->SetGridLayout(m_patchSize, m_numPatchesX, m_heightMapWidth, m_heightMapDepth, m_worldScale);
+    pTech->SetCompactVertices(m_compact && !m_heightTextures);
+    pTech->SetHeightTextures(m_heightTextures);
+
+    if (m_heightTextures) {
+        glActiveTexture(m_quantized ? QUANTIZED_HEIGHT_MAP_TEXTURE_UNIT : HEIGHT_MAP_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+        glActiveTexture(NORMAL_MAP_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, m_normalTexture);
+    }
+
+    if (m_compact || m_heightTextures) {
+        pTech->SetQuantizedHeights(m_quantized, m_heightStep, m_heightOrigin, m_texCoordScale);
+
+        // The grid wide lattice has no patch bases
+        if (!m_quantized) {
+            pTech->SetPatchHeightBase(0);
+        }
+    }
+
     if (gShowPoints > 0) {
-        glDrawElementsBaseVertex(GL_POINTS, m_lodInfo[0].info[0][0][0][0].Count, GL_UNSIGNED_INT, (void*)0, 0);
+        if (m_quantized) {
+            pTech->SetPatchHeightBase(m_patchHeightBase[0]);
+        }
+
+        glDrawElementsBaseVertex(GL_POINTS, m_lodInfo[0].info[0][0][0][0].Count, GL_UNSIGNED_SHORT, (void*)0, 0);
     }
 
     if (gShowPoints != 2) {
@@ -412,12 +1627,16 @@ void GeomipGrid::Render(const Vector3f& CameraPos, const Matrix4f& ViewProj)
                 int T = plod.Top;
                 int B = plod.Bottom;
 
-                size_t BaseIndex = sizeof(unsigned int) * m_lodInfo[C].info[L][R][T][B].Start;
+                size_t BaseIndex = sizeof(u16) * m_lodInfo[C].info[L][R][T][B].Start;
 
-                int BaseVertex = z * m_width + x;
+                int BaseVertex = (int)GetPatchRowOffset(PatchZ) + PatchX * m_patchSize * m_patchSize;
+
+                if (m_quantized) {
+                    pTech->SetPatchHeightBase(m_patchHeightBase[PatchZ * m_numPatchesX + PatchX]);
+                }
 
                 glDrawElementsBaseVertex(GL_TRIANGLES, m_lodInfo[C].info[L][R][T][B].Count,
-                    GL_UNSIGNED_INT, (void*)BaseIndex, BaseVertex);
+                    GL_UNSIGNED_SHORT, (void*)BaseIndex, BaseVertex);
             }
 
             if (gShowPoints == 3)  printf("\n");
@@ -430,6 +1649,13 @@ void GeomipGrid::Render(const Vector3f& CameraPos, const Matrix4f& ViewProj)
 }
 
 
+// The far corners of the edge patches can be outside of the height map
+float GeomipGrid::GetClampedHeight(int x, int z) const
+{
+    return m_pTerrain->GetHeight(std::min(x, m_heightMapWidth - 1), std::min(z, m_heightMapDepth - 1));
+}
+
+
 bool GeomipGrid::IsPatchInsideViewFrustum_ViewSpace(int X, int Z, const Matrix4f& ViewProj)
 {
     int x0 = X;
@@ -437,10 +1663,10 @@ bool GeomipGrid::IsPatchInsideViewFrustum_ViewSpace(int X, int Z, const Matrix4f
     int z0 = Z;
     int z1 = Z + m_patchSize - 1;
 
-    Vector3f p00((float)x0 * m_worldScale, m_pTerrain->GetHeight(x0, z0), (float)z0 * m_worldScale);
-    Vector3f p01((float)x0 * m_worldScale, m_pTerrain->GetHeight(x0, z1), (float)z1 * m_worldScale);
-    Vector3f p10((float)x1 * m_worldScale, m_pTerrain->GetHeight(x1, z0), (float)z0 * m_worldScale);
-    Vector3f p11((float)x1 * m_worldScale, m_pTerrain->GetHeight(x1, z1), (float)z1 * m_worldScale);
+    Vector3f p00((float)x0 * m_worldScale, GetClampedHeight(x0, z0), (float)z0 * m_worldScale);
+    Vector3f p01((float)x0 * m_worldScale, GetClampedHeight(x0, z1), (float)z1 * m_worldScale);
+    Vector3f p10((float)x1 * m_worldScale, GetClampedHeight(x1, z0), (float)z0 * m_worldScale);
+    Vector3f p11((float)x1 * m_worldScale, GetClampedHeight(x1, z1), (float)z1 * m_worldScale);
 
     bool InsideViewFrustum =
         IsPointInsideViewFrustum(p00, ViewProj) ||
@@ -459,33 +1685,31 @@ bool GeomipGrid::IsPatchInsideViewFrustum_WorldSpace(int X, int Z, const Frustum
     int z0 = Z;
     int z1 = Z + m_patchSize - 1;
 
-    float h00 = m_pTerrain->GetHeight(x0, z0);
-    float h01 = m_pTerrain->GetHeight(x0, z1);
-    float h10 = m_pTerrain->GetHeight(x1, z0);
-    float h11 = m_pTerrain->GetHeight(x1, z1);
-
-    float MinHeight = std::min(h00, std::min(h01, std::min(h10, h11)));
-    float MaxHeight = std::max(h00, std::max(h01, std::max(h10, h11)));
+    // Corners of the box around the whole patch - a peak in the middle of the
+    // patch can be visible when none of the corner vertices is
+    const PatchBounds& Bounds = m_patchBounds[(Z / (m_patchSize - 1)) * m_numPatchesX + X / (m_patchSize - 1)];
+    float MinHeight = Bounds.MinHeight;
+    float MaxHeight = Bounds.MaxHeight;
 
-    Vector3f p00_low((float)x0 * m_worldScale, h00, (float)z0 * m_worldScale);
-    Vector3f p01_low((float)x0 * m_worldScale, h01, (float)z1 * m_worldScale);
-    Vector3f p10_low((float)x1 * m_worldScale, h10, (float)z0 * m_worldScale);
-    Vector3f p11_low((float)x1 * m_worldScale, h11, (float)z1 * m_worldScale);
+    Vector3f p00_low((float)x0 * m_worldScale, MinHeight, (float)z0 * m_worldScale);
+    Vector3f p01_low((float)x0 * m_worldScale, MinHeight, (float)z1 * m_worldScale);
+    Vector3f p10_low((float)x1 * m_worldScale, MinHeight, (float)z0 * m_worldScale);
+    Vector3f p11_low((float)x1 * m_worldScale, MinHeight, (float)z1 * m_worldScale);
 
-    /*  Vector3f p00_high((float)x0 * m_worldScale, MaxHeight, (float)z0 * m_worldScale);
-      Vector3f p01_high((float)x0 * m_worldScale, MaxHeight, (float)z1 * m_worldScale);
-      Vector3f p10_high((float)x1 * m_worldScale, MaxHeight, (float)z0 * m_worldScale);
-      Vector3f p11_high((float)x1 * m_worldScale, MaxHeight, (float)z1 * m_worldScale);*/
+    Vector3f p00_high((float)x0 * m_worldScale, MaxHeight, (float)z0 * m_worldScale);
+    Vector3f p01_high((float)x0 * m_worldScale, MaxHeight, (float)z1 * m_worldScale);
+    Vector3f p10_high((float)x1 * m_worldScale, MaxHeight, (float)z0 * m_worldScale);
+    Vector3f p11_high((float)x1 * m_worldScale, MaxHeight, (float)z1 * m_worldScale);
 
     bool InsideViewFrustm =
         fc.IsPointInsideViewFrustum(p00_low) ||
         fc.IsPointInsideViewFrustum(p01_low) ||
         fc.IsPointInsideViewFrustum(p10_low) ||
-        fc.IsPointInsideViewFrustum(p11_low);// ||
-    /*   fc.IsPointInsideViewFrustum(p00_high) ||
-       fc.IsPointInsideViewFrustum(p01_high) ||
-       fc.IsPointInsideViewFrustum(p10_high) ||
-       fc.IsPointInsideViewFrustum(p11_high);*/
+        fc.IsPointInsideViewFrustum(p11_low) ||
+        fc.IsPointInsideViewFrustum(p00_high) ||
+        fc.IsPointInsideViewFrustum(p01_high) ||
+        fc.IsPointInsideViewFrustum(p10_high) ||
+        fc.IsPointInsideViewFrustum(p11_high);
 
     return InsideViewFrustm;
 }
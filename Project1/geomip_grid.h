@@ -5,11 +5,17 @@
 #include <vector>
 
 #include "ogldev_math_3d.h"
+#include "ogldev_array_2d.h"
 #include "lod_manager.h"
+#include "terrain_file.h"
+#include "quantized_height_map.h"
+#include "upload_stream.h"
 
 // this header is included by terrain.h so we have a forward 
 // declaration for BaseTerrain.
 class BaseTerrain;
+class TerrainTechnique;
+struct HeightMapBorder;
 
 class GeomipGrid {
 public:
@@ -17,11 +23,105 @@ public:
 
     ~GeomipGrid();
 
+    // Builds the grid from the heights of the terrain and fills the vertex buffer a
+    // band of patches at a time, so there's never a CPU copy of the whole buffer
     void CreateGeomipGrid(int Width, int Depth, int PatchSize, const BaseTerrain* pTerrain);
 
+    // CPU half of CreateGeomipGrid - builds the vertices, indices and normals from the
+    // height map without touching GL so it can run on a background thread.
+    // With pQuantized the vertex buffer holds its 16 bit samples instead of float
+    // heights (HeightMap must then hold the decoded heights). pBorder has the
+    // samples around the height map of a tile for the normals along its edges.
+    void PrepareGeomipGrid(int Width, int Depth, int PatchSize, const Array2D<float>& HeightMap, float WorldScale, float TextureScale,
+                           const QuantizedHeightMap* pQuantized = NULL, const HeightMapBorder* pBorder = NULL);
+
+    // GL half of CreateGeomipGrid - creates the buffers from the data prepared by
+    // PrepareGeomipGrid. Must be called on the thread that owns the GL context.
+    void UploadGeomipGrid(const BaseTerrain* pTerrain);
+
+    // Exchanges the GL objects and the LOD state of two grids
+    void Swap(GeomipGrid& Other);
+
+    // Rewrites the positions and normals in the existing vertex buffer after the
+    // heights changed (same size). The index buffer and the LOD tables are kept.
+    void UpdateHeights(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized = NULL);
+
+    // UpdateHeights for heights that only changed in the rows [MinZ, MaxZ) - only the
+    // rows of patches that have them or their neighbours (whose normals see them) are
+    // rewritten. A compact grid without quantized heights is rewritten in full if its
+    // height range changed.
+    void UpdateHeightRows(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized, int MinZ, int MaxZ);
+
+    // For heights that were all remapped with h' = (h - SrcMin) * Scale + DstMin
+    // (Scale > 0) - HeightMap has the new ones. Only the heights and normals in the
+    // vertex buffer change and the normals aren't computed again: scaling the heights
+    // scales the slopes, so (nx, ny, nz) becomes normalize(Scale * nx, ny, Scale * nz).
+    // A quantized grid takes the remapped lattice of pQuantized and keeps its samples -
+    // HeightMap isn't used then and can be empty.
+    void RescaleHeights(const Array2D<float>& HeightMap, float SrcMin, float Scale, float DstMin, const QuantizedHeightMap* pQuantized = NULL);
+
+    // Writes the patch bounds, the vertex buffer and the LOD tables as sections of a
+    // terrain file. A prepared grid is written from its CPU copies and doesn't need
+    // GL, an uploaded one reads the buffers back from GL.
+    void SaveToFile(TerrainFileWriter& Writer) const;
+
+    // Creates the grid from the sections written by SaveToFile instead of building
+    // it from the height map. Returns false if the file doesn't have them or they
+    // don't belong to a grid of this size.
+    bool LoadFromFile(const TerrainFileReader& Reader, int Width, int Depth, int PatchSize, float WorldScale, const BaseTerrain* pTerrain);
+
     void Destroy();
 
-    void Render(const Vector3f& CameraPos, const Matrix4f& ViewProj);
+    // pTech must be enabled - it receives the height base of every patch of a quantized
+    // grid and the decoding uniforms of a compact one
+    void Render(const Vector3f& CameraPos, const Matrix4f& ViewProj, TerrainTechnique* pTech);
+
+    bool IsQuantized() const { return m_quantized; }
+
+    // From the next build (or load) on the vertices only have a 16 bit height and an
+    // octahedral normal - X, Z and the texture coordinates are rebuilt by the shader
+    // from gl_VertexID. Without quantized heights the heights are rounded to an even
+    // lattice over the range of the grid.
+    void SetCompactVertices(bool Enabled) { m_compact = Enabled; }
+
+    bool IsCompact() const { return m_compact; }
+
+    // From the next build (or load) on the grid has no vertex buffer - the heights
+    // (float or the 16 bit samples of a quantized terrain) and octahedral normals are
+    // uploaded as textures of the height map size, which the shader reads at the grid
+    // position it derives from gl_VertexID. Every patch is drawn with the shared
+    // patch mesh of its LOD permutation, so the GPU memory of the vertices doesn't
+    // grow with the patches and new heights are just a texture upload.
+    // Takes precedence over compact vertices.
+    void SetHeightTextures(bool Enabled) { m_heightTextures = Enabled; }
+
+    bool HasHeightTextures() const { return m_heightTextures; }
+
+    int GetBytesPerVertex() const
+    {
+        return m_compact ? (int)sizeof(CompactVertex) : (m_quantized ? (int)sizeof(QuantizedVertex) : (int)sizeof(Vertex));
+    }
+
+    // Every patch has a block of its own PatchSize x PatchSize vertices (the vertices
+    // along the patch edges are repeated in the neighbouring blocks) so the indices
+    // are local to a block and fit in 16 bits
+    size_t GetNumVertices() const { return (size_t)m_numPatchesX * m_numPatchesZ * m_patchSize * m_patchSize; }
+
+    size_t GetTextureSizeInBytes() const
+    {
+        return (size_t)m_heightMapWidth * m_heightMapDepth * ((m_quantized ? sizeof(u16) : sizeof(float)) + 2 * sizeof(i8));
+    }
+
+    // Of the vertex (or height and normal textures) and index buffers
+    size_t GetSizeInBytes() const
+    {
+        size_t VerticesSize = m_heightTextures ? GetTextureSizeInBytes() : GetNumVertices() * GetBytesPerVertex();
+
+        return VerticesSize + sizeof(u16) * m_numIndices;
+    }
+
+    // For grids that are tiles of a larger terrain - see LodManager::SetStitchEdges
+    void SetStitchEdges(bool Enabled) { m_lodManager.SetStitchEdges(Enabled); }
 
 private:
 
@@ -29,27 +129,116 @@ private:
         Vector3f Pos;
         Vector2f Tex;
         Vector3f Normal = Vector3f(0.0f, 0.0f, 0.0f);
+    };
+
+    // Vertex of a quantized grid - the height is decoded with the base of the patch
+    // and the texture coordinates are derived from the position in the shader
+    struct QuantizedVertex {
+        float X;
+        float Z;
+        u16 Height;
+        i16 Normal[3];
+    };
 
-        void InitVertex(const BaseTerrain* pTerrain, int x, int z);
+    // Vertex of a compact grid - the position in the grid follows from the index of
+    // the vertex in the buffer (see GetPatchRowOffset)
+    struct CompactVertex {
+        u16 Height;
+        i8 Normal[2];   // octahedral, y up
     };
 
+    void InitGridLayout(int Width, int Depth, int PatchSize, float WorldScale);
+
     void CreateGLState();
 
-    void PopulateBuffers(const BaseTerrain* pTerrain);
+    void PopulateBuffers(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized);
+
+    void UploadIndexBuffer();
+
+    // A row of the grid in separate arrays, padded to the width of the grid by
+    // repeating the last column of the height map
+    struct VertexRow {
+        std::vector<float> Height;
+        std::vector<float> NormalX;
+        std::vector<float> NormalY;
+        std::vector<float> NormalZ;
+        std::vector<u16> Sample;        // quantized and compact grids - the 16 bit heights
+        std::vector<i16> Normal16;      // quantized grids - 3 per column
+        std::vector<i8> NormalOct;      // compact grids - 2 per column
+        float Z = 0.0f;
+        float TexV = 0.0f;
+    };
+
+    void BuildPatchRows(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized,
+                        int FirstPatchZ, int EndPatchZ, void* pVertices);
+
+    void LoadVertexRow(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized, int z, VertexRow& Row) const;
+
+    void WriteVertices(const VertexRow& Row, const float* pColumnX, const float* pColumnTex, int x0, Vertex* pDst) const;
+
+    void WriteQuantizedVertices(const VertexRow& Row, const float* pColumnX, int x0, QuantizedVertex* pDst) const;
 
-    void InitVertices(const BaseTerrain* pTerrain, std::vector<Vertex>& Vertices);
+    void WriteCompactVertices(const VertexRow& Row, int x0, CompactVertex* pDst) const;
 
-    int InitIndices(std::vector<uint>& Indices);
+    void StreamVertices(const Array2D<float>& HeightMap, float TextureScale, const QuantizedHeightMap* pQuantized,
+                        int FirstPatchZ, int EndPatchZ, UploadStream& Stream);
 
-    int InitIndicesLOD(int Index, std::vector<uint>& Indices, int lod);
+    // Created on first use and kept for the updates that follow
+    UploadStream& GetUploadStream();
 
-    int InitIndicesLODSingle(int Index, std::vector<uint>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom);
+    // RescaleHeights of the vertices of the rows of patches [FirstPatchZ, EndPatchZ) -
+    // pVertices is where the blocks of FirstPatchZ are
+    void RescalePatchRows(const Array2D<float>& HeightMap, float Scale, int FirstPatchZ, int EndPatchZ, void* pVertices) const;
 
-    void CalcNormals(std::vector<Vertex>& Vertices, std::vector<uint>& Indices);
+    static Vector3f RescaleNormal(const Vector3f& Normal, float Scale);
 
-    uint AddTriangle(uint Index, std::vector<uint>& Indices, uint v1, uint v2, uint v3);
+    static void EncodeOctahedral(const Vector3f& Normal, i8* pOct);
 
-    uint CreateTriangleFan(int Index, std::vector<uint>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom, int x, int z);
+    static Vector3f DecodeOctahedral(const i8* pOct);
+
+    static void RescaleOctahedral(i8* pOct, float Scale);
+
+    static void RescaleNormal16(i16* pNormal, float Scale);
+
+    // Octahedral normals of the rows [MinZ, MaxZ) of the height map - pNormals starts at row MinZ
+    void BuildNormalMap(const Array2D<float>& HeightMap, int MinZ, int MaxZ, i8* pNormals);
+
+    // Expects the VAO of CreateGLState to be bound
+    void CreateHeightTextures();
+
+    // The rows [MinZ, MaxZ). pHeights are all the floats or the 16 bit samples of a
+    // quantized grid (NULL leaves the heights as they are) while pNormals starts at row MinZ.
+    void UploadHeightTextures(const void* pHeights, const i8* pNormals, int MinZ, int MaxZ);
+
+    static const void* GetTextureHeights(const Array2D<float>& HeightMap, const QuantizedHeightMap* pQuantized);
+
+    // The height lattice and texture coordinate scale the shader decodes compact vertices with
+    void InitCompactDecoding(float TextureScale, const QuantizedHeightMap* pQuantized);
+
+    TERRAIN_FILE_SECTION GetVertexSection() const;
+
+    size_t GetVertexSectionSize() const;
+
+    void PrintVertexBufferSize() const;
+
+    size_t GetPatchRowOffset(int PatchZ) const { return (size_t)PatchZ * m_numPatchesX * m_patchSize * m_patchSize; }
+
+    void InitIndexBuffer();
+
+    int InitIndices(std::vector<u16>& Indices);
+
+    int InitIndicesLOD(int Index, std::vector<u16>& Indices, int lod);
+
+    int InitIndicesLODSingle(int Index, std::vector<u16>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom);
+
+    void CalcPatchBounds(const Array2D<float>& HeightMap);
+
+    // Of the rows of patches [FirstPatchZ, EndPatchZ) only
+    void CalcPatchBounds(const Array2D<float>& HeightMap, int FirstPatchZ, int EndPatchZ);
+
+    uint AddTriangle(uint Index, std::vector<u16>& Indices, uint v1, uint v2, uint v3);
+
+    uint CreateTriangleFan(int Index, std::vector<u16>& Indices, int lodCore, int lodLeft, int lodRight, int lodTop, int lodBottom, int x, int z);
 
     int CalcNumIndices();
 
@@ -61,8 +250,12 @@ private:
 
     bool IsCameraCloseToPatch(const Vector3f& CameraPos, int PatchBaseX, int PatchBaseZ);
 
-    int m_width = 0;
+    float GetClampedHeight(int x, int z) const;
+
+    int m_width = 0;            // of the grid - whole patches
     int m_depth = 0;
+    int m_heightMapWidth = 0;   // of the height map - can end in the middle of a patch
+    int m_heightMapDepth = 0;
     int m_patchSize = 0;
     int m_maxLOD = 0;
     GLuint m_vao = 0;
@@ -85,12 +278,49 @@ private:
     };
 
     std::vector<LodInfo> m_lodInfo;
+
+    struct PatchBounds {
+        float MinHeight = 0.0f;
+        float MaxHeight = 0.0f;
+    };
+
+    std::vector<PatchBounds> m_patchBounds;
+
     int m_numPatchesX = 0;
     int m_numPatchesZ = 0;
     LodManager m_lodManager;
     const BaseTerrain* m_pTerrain = NULL;
     float m_patchWorldSize = 0.0f;
     float m_patchWorldHalfSize = 0.0f;
+    const HeightMapBorder* m_pBorder = NULL;    // only while PrepareGeomipGrid runs
+
+    // Filled by PrepareGeomipGrid and released once they are uploaded
+    std::vector<Vertex> m_vertices;
+    std::vector<u16> m_indices; // patch local
+    int m_numIndices = 0;
+
+    // Quantized grids upload m_packedVertices instead of m_vertices
+    bool m_quantized = false;
+    std::vector<QuantizedVertex> m_packedVertices;
+    std::vector<i32> m_patchHeightBase;
+
+    // Compact grids upload m_compactVertices
+    bool m_compact = false;
+    std::vector<CompactVertex> m_compactVertices;
+    float m_heightStep = 1.0f;
+    float m_heightOrigin = 0.0f;
+    float m_texCoordScale = 1.0f;
+
+    // Height texture grids have no vertex buffer and upload these instead
+    bool m_heightTextures = false;
+    GLuint m_heightTexture = 0;
+    GLuint m_normalTexture = 0;
+    std::vector<float> m_textureHeights;
+    std::vector<u16> m_textureSamples;  // quantized grids
+    std::vector<i8> m_textureNormals;
+
+    // Staging buffer of the vertex updates - stays with the grid on Swap
+    UploadStream m_uploadStream;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include <math.h>
+#include <algorithm>
+
+#include "height_map_normals.h"
+#include "thread_pool.h"
+#include "simd_utils.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define MIN_ROWS_PER_BAND 4
+
+// The Vector3f version goes through the separate arrays in pieces of this many normals
+#define NORMALS_PER_CHUNK 256
+
+
+// Left/Right and Up/Down are the heights of the neighbours and KX/KZ one over their
+// distance in world units
+static inline Vector3f CalcNormal(float Left, float Right, float Up, float Down, float KX, float KZ)
+{
+    float x = (Left - Right) * KX;
+    float z = (Up - Down) * KZ;
+    float InvLength = 1.0f / sqrtf(x * x + 1.0f + z * z);
+
+    return Vector3f(x * InvLength, InvLength, z * InvLength);
+}
+
+
+#ifdef SIMD_X86
+
+// The interior samples [Begin, End) of a row - both neighbours of every sample must
+// be in the row. Returns where it stopped.
+SIMD_TARGET_AVX2 static int NormalSpan_AVX2(const float* pUp, const float* pRow, const float* pDown, int Begin, int End,
+                                            float KX, float KZ, float* pX, float* pY, float* pZ)
+{
+    const __m256 vKX = _mm256_set1_ps(KX);
+    const __m256 vKZ = _mm256_set1_ps(KZ);
+    const __m256 One = _mm256_set1_ps(1.0f);
+
+    int x = Begin;
+
+    for (; x + 8 <= End; x += 8) {
+        __m256 nx = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(pRow + x - 1), _mm256_loadu_ps(pRow + x + 1)), vKX);
+        __m256 nz = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(pUp + x), _mm256_loadu_ps(pDown + x)), vKZ);
+        __m256 LengthSq = _mm256_fmadd_ps(nx, nx, _mm256_fmadd_ps(nz, nz, One));
+        __m256 InvLength = _mm256_div_ps(One, _mm256_sqrt_ps(LengthSq));
+
+        _mm256_storeu_ps(pX + x, _mm256_mul_ps(nx, InvLength));
+        _mm256_storeu_ps(pY + x, InvLength);
+        _mm256_storeu_ps(pZ + x, _mm256_mul_ps(nz, InvLength));
+    }
+
+    return x;
+}
+
+#endif
+
+
+// Column x of a row. A neighbour outside the row comes from the border if there
+// is one - otherwise the sample itself is used and the difference is one sided.
+static inline Vector3f CalcColumnNormal(const float* pUp, const float* pRow, const float* pDown, int x, int Cols,
+                                        const float* pLeftBorder, const float* pRightBorder, float WorldScale, float KZ)
+{
+    bool HaveLeft = (x > 0) || pLeftBorder;
+    bool HaveRight = (x < Cols - 1) || pRightBorder;
+    float Left = (x > 0) ? pRow[x - 1] : (pLeftBorder ? *pLeftBorder : pRow[x]);
+    float Right = (x < Cols - 1) ? pRow[x + 1] : (pRightBorder ? *pRightBorder : pRow[x]);
+    int Span = (int)HaveLeft + (int)HaveRight;
+    float KX = (Span > 0) ? 1.0f / (Span * WorldScale) : 0.0f;
+
+    return CalcNormal(Left, Right, pUp[x], pDown[x], KX, KZ);
+}
+
+
+void CalcHeightMapNormalRow(const Array2D<float>& HeightMap, float WorldScale, int z, int MinX, int MaxX, float* pX, float* pY, float* pZ,
+                            const HeightMapBorder* pBorder)
+{
+    int Cols = HeightMap.GetCols();
+    int Rows = HeightMap.GetRows();
+
+    const float* pRow = HeightMap.GetAddr(0, z);
+    const float* pUp = pRow;
+    const float* pDown = pRow;
+    int Span = 0;
+
+    if (z > 0) {
+        pUp = HeightMap.GetAddr(0, z - 1);
+        Span++;
+    } else if (pBorder) {
+        pUp = &pBorder->Top[0];
+        Span++;
+    }
+
+    if (z < Rows - 1) {
+        pDown = HeightMap.GetAddr(0, z + 1);
+        Span++;
+    } else if (pBorder) {
+        pDown = &pBorder->Bottom[0];
+        Span++;
+    }
+
+    float KZ = (Span > 0) ? 1.0f / (Span * WorldScale) : 0.0f;
+
+    const float* pLeftBorder = pBorder ? &pBorder->Left[z] : NULL;
+    const float* pRightBorder = pBorder ? &pBorder->Right[z] : NULL;
+
+    // Indexed by x from here on
+    pX -= MinX;
+    pY -= MinX;
+    pZ -= MinX;
+
+    int x = MinX;
+
+#ifdef SIMD_X86
+    if (GetSimdLevel() == SIMD_LEVEL_AVX2) {
+        for (; (x < MaxX) && (x < 1); x++) {
+            Vector3f n = CalcColumnNormal(pUp, pRow, pDown, x, Cols, pLeftBorder, pRightBorder, WorldScale, KZ);
+            pX[x] = n.x;
+            pY[x] = n.y;
+            pZ[x] = n.z;
+        }
+
+        x = NormalSpan_AVX2(pUp, pRow, pDown, x, std::min(MaxX, Cols - 1), 1.0f / (2.0f * WorldScale), KZ, pX, pY, pZ);
+    }
+#endif
+
+    for (; x < MaxX; x++) {
+        Vector3f n = CalcColumnNormal(pUp, pRow, pDown, x, Cols, pLeftBorder, pRightBorder, WorldScale, KZ);
+        pX[x] = n.x;
+        pY[x] = n.y;
+        pZ[x] = n.z;
+    }
+}
+
+
+void CalcHeightMapNormalRow(const Array2D<float>& HeightMap, float WorldScale, int z, int MinX, int MaxX, Vector3f* pNormals,
+                            const HeightMapBorder* pBorder)
+{
+    float X[NORMALS_PER_CHUNK];
+    float Y[NORMALS_PER_CHUNK];
+    float Z[NORMALS_PER_CHUNK];
+
+    for (int x0 = MinX; x0 < MaxX; x0 += NORMALS_PER_CHUNK) {
+        int Count = std::min(NORMALS_PER_CHUNK, MaxX - x0);
+
+        CalcHeightMapNormalRow(HeightMap, WorldScale, z, x0, x0 + Count, X, Y, Z, pBorder);
+
+        for (int i = 0; i < Count; i++) {
+            pNormals[x0 - MinX + i] = Vector3f(X[i], Y[i], Z[i]);
+        }
+    }
+}
+
+
+void CalcHeightMapNormals(const Array2D<float>& HeightMap, float WorldScale, int MinX, int MinZ, int MaxX, int MaxZ,
+                          Vector3f* pNormals, size_t Stride, const HeightMapBorder* pBorder)
+{
+    GetThreadPool().ParallelFor(MinZ, MaxZ, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            CalcHeightMapNormalRow(HeightMap, WorldScale, z, MinX, MaxX, pNormals + (size_t)(z - MinZ) * Stride, pBorder);
+        }
+    });
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef HEIGHT_MAP_NORMALS_H
+#define HEIGHT_MAP_NORMALS_H
+
+#include <vector>
+
+#include "ogldev_math_3d.h"
+#include "ogldev_array_2d.h"
+
+// Normals of a height map straight from the heights. The slopes are the central
+// differences of the neighbours of a sample (one sided on the edges of the map
+// unless the samples around it are given - see HeightMapBorder)
+//
+//     N = normalize(-dh/dx, 1, -dh/dz)
+//
+// with x and z in world units (sample index * WorldScale).
+//
+// A normal only depends on the four neighbours of its sample so any part of the
+// map can be done on its own - after the heights in a rectangle change, the normals
+// of the rectangle grown by one sample in every direction are the ones to redo.
+
+// The samples just outside a height map that is a part of a larger one (a tile) -
+// with them the edge normals are central differences as well and match the normals
+// the neighbouring parts compute for the samples they share. The corners aren't needed.
+struct HeightMapBorder {
+    std::vector<float> Left;    // column -1, a height per row
+    std::vector<float> Right;   // column Cols
+    std::vector<float> Top;     // row -1, a height per column
+    std::vector<float> Bottom;  // row Rows
+};
+
+// Normals of the samples [MinX, MaxX) of row z on the calling thread
+void CalcHeightMapNormalRow(const Array2D<float>& HeightMap, float WorldScale, int z, int MinX, int MaxX, Vector3f* pNormals,
+                            const HeightMapBorder* pBorder = NULL);
+
+// The same with the x, y and z of the normals in separate arrays
+void CalcHeightMapNormalRow(const Array2D<float>& HeightMap, float WorldScale, int z, int MinX, int MaxX, float* pX, float* pY, float* pZ,
+                            const HeightMapBorder* pBorder = NULL);
+
+// Normals of the samples in [MinX, MaxX) x [MinZ, MaxZ) with the rows spread over
+// the thread pool. The normal of (x, z) goes to pNormals[(z - MinZ) * Stride + x - MinX].
+void CalcHeightMapNormals(const Array2D<float>& HeightMap, float WorldScale, int MinX, int MinZ, int MaxX, int MaxZ,
+                          Vector3f* pNormals, size_t Stride, const HeightMapBorder* pBorder = NULL);
+
+#endif
\ No newline at end of file
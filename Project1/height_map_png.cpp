@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <algorithm>
+
+#include "height_map_png.h"
+#include "deflate.h"
+#include "thread_pool.h"
+
+// Rows filtered and compressed together by the writer - the unit of work of
+// the threads
+#define PNG_ROWS_PER_BAND 64
+
+// Size of the reads from the IDAT chunks
+#define PNG_READ_SIZE 65536
+
+#define PNG_HEIGHT_RANGE_KEY "Height range"
+
+static const u8 PNGSignature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+
+enum PNG_FILTER {
+    PNG_FILTER_NONE = 0,
+    PNG_FILTER_SUB = 1,
+    PNG_FILTER_UP = 2,
+    PNG_FILTER_AVERAGE = 3,
+    PNG_FILTER_PAETH = 4,
+    PNG_NUM_FILTERS = 5
+};
+
+
+static u32 ReadBE32(const u8* p)
+{
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+
+static void WriteBE32(u8* p, u32 Value)
+{
+    p[0] = (u8)(Value >> 24);
+    p[1] = (u8)(Value >> 16);
+    p[2] = (u8)(Value >> 8);
+    p[3] = (u8)Value;
+}
+
+
+static FILE* OpenFile(const char* pFilename, const char* pMode)
+{
+    FILE* f = NULL;
+
+#ifdef _WIN32
+    fopen_s(&f, pFilename, pMode);
+#else
+    f = fopen(pFilename, pMode);
+#endif
+
+    if (!f) {
+        printf("Error opening '%s': %s\n", pFilename, strerror(errno));
+        exit(0);
+    }
+
+    return f;
+}
+
+
+static u8 PaethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if ((pa <= pb) && (pa <= pc)) {
+        return (u8)a;
+    }
+
+    return (pb <= pc) ? (u8)b : (u8)c;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reading
+////////////////////////////////////////////////////////////////////////////////
+
+// Reads the chunks one after the other and checks their CRCs
+class PNGChunkReader {
+public:
+    PNGChunkReader(FILE* f, const char* pFilename) : m_pFile(f), m_pFilename(pFilename) {}
+
+    void BeginChunk()
+    {
+        u8 Header[8];
+        ReadFile(Header, sizeof(Header));
+
+        m_left = ReadBE32(Header);
+        memcpy(m_type, Header + 4, 4);
+        m_crc = CalcCRC32(0, Header + 4, 4);
+    }
+
+    bool IsType(const char* pType) const { return memcmp(m_type, pType, 4) == 0; }
+
+    u32 GetBytesLeft() const { return m_left; }
+
+    void Read(u8* pData, size_t Size)
+    {
+        if (Size > m_left) {
+            printf("'%s': chunk %.4s is too short\n", m_pFilename, m_type);
+            exit(0);
+        }
+
+        ReadFile(pData, Size);
+        m_crc = CalcCRC32(m_crc, pData, Size);
+        m_left -= (u32)Size;
+    }
+
+    // Reads the rest of the chunk and the CRC
+    void EndChunk()
+    {
+        u8 Buffer[4096];
+
+        while (m_left > 0) {
+            Read(Buffer, std::min((size_t)m_left, sizeof(Buffer)));
+        }
+
+        u8 CRC[4];
+        ReadFile(CRC, sizeof(CRC));
+
+        if (ReadBE32(CRC) != m_crc) {
+            printf("'%s': CRC error in chunk %.4s\n", m_pFilename, m_type);
+            exit(0);
+        }
+    }
+
+    void ReadFile(u8* pData, size_t Size)
+    {
+        if (fread(pData, 1, Size, m_pFile) != Size) {
+            printf("'%s' is truncated\n", m_pFilename);
+            exit(0);
+        }
+    }
+
+private:
+    FILE* m_pFile;
+    const char* m_pFilename;
+    char m_type[4] = { 0 };
+    u32 m_left = 0;
+    u32 m_crc = 0;
+};
+
+
+// Collects the inflated bytes into scanlines, unfilters them and converts the
+// samples into a row of the height map
+class PNGRowDecoder {
+public:
+    PNGRowDecoder(Array2D<float>& HeightMap, int BytesPerPixel, int BytesPerSample, float MinHeight, float MaxHeight, const char* pFilename) :
+        m_heightMap(HeightMap), m_bytesPerPixel(BytesPerPixel), m_bytesPerSample(BytesPerSample), m_pFilename(pFilename)
+    {
+        m_rowBytes = (size_t)HeightMap.GetCols() * BytesPerPixel;
+
+        // Filter byte + the samples. The previous row starts as zeros.
+        m_row.assign(m_rowBytes + 1, 0);
+        m_prevRow.assign(m_rowBytes + 1, 0);
+
+        m_minHeight = MinHeight;
+        m_scale = (MaxHeight - MinHeight) / (BytesPerSample == 2 ? 65535.0f : 255.0f);
+    }
+
+    void AddBytes(const u8* pData, size_t Size)
+    {
+        m_adler = CalcAdler32(m_adler, pData, Size);
+
+        while (Size > 0) {
+            if (m_numRows == m_heightMap.GetRows()) {
+                printf("'%s' has more image data than %d rows\n", m_pFilename, m_numRows);
+                exit(0);
+            }
+
+            size_t Count = std::min(Size, m_row.size() - m_filled);
+            memcpy(&m_row[m_filled], pData, Count);
+            m_filled += Count;
+            pData += Count;
+            Size -= Count;
+
+            if (m_filled == m_row.size()) {
+                Unfilter();
+                ConvertRow();
+
+                m_row.swap(m_prevRow);
+                m_filled = 0;
+                m_numRows++;
+            }
+        }
+    }
+
+    int GetNumRows() const { return m_numRows; }
+
+    u32 GetAdler32() const { return m_adler; }
+
+private:
+    void Unfilter()
+    {
+        u8* p = &m_row[1];
+        const u8* pPrev = &m_prevRow[1];
+        int Bpp = m_bytesPerPixel;
+
+        switch (m_row[0]) {
+        case PNG_FILTER_NONE:
+            break;
+
+        case PNG_FILTER_SUB:
+            for (size_t i = Bpp; i < m_rowBytes; i++) {
+                p[i] = (u8)(p[i] + p[i - Bpp]);
+            }
+            break;
+
+        case PNG_FILTER_UP:
+            for (size_t i = 0; i < m_rowBytes; i++) {
+                p[i] = (u8)(p[i] + pPrev[i]);
+            }
+            break;
+
+        case PNG_FILTER_AVERAGE:
+            for (size_t i = 0; i < m_rowBytes; i++) {
+                int Left = i >= (size_t)Bpp ? p[i - Bpp] : 0;
+                p[i] = (u8)(p[i] + ((Left + pPrev[i]) >> 1));
+            }
+            break;
+
+        case PNG_FILTER_PAETH:
+            for (size_t i = 0; i < m_rowBytes; i++) {
+                int Left = i >= (size_t)Bpp ? p[i - Bpp] : 0;
+                int UpLeft = i >= (size_t)Bpp ? pPrev[i - Bpp] : 0;
+                p[i] = (u8)(p[i] + PaethPredictor(Left, pPrev[i], UpLeft));
+            }
+            break;
+
+        default:
+            printf("'%s': invalid filter type %d in row %d\n", m_pFilename, m_row[0], m_numRows);
+            exit(0);
+        }
+    }
+
+    void ConvertRow()
+    {
+        const u8* p = &m_row[1];
+        int Width = m_heightMap.GetCols();
+
+        for (int x = 0; x < Width; x++) {
+            const u8* pSample = p + (size_t)x * m_bytesPerPixel;
+            u32 Sample = (m_bytesPerSample == 2) ? ((u32)pSample[0] << 8 | pSample[1]) : pSample[0];
+
+            m_heightMap.Set(x, m_numRows, m_minHeight + (float)Sample * m_scale);
+        }
+    }
+
+    Array2D<float>& m_heightMap;
+    int m_bytesPerPixel;
+    int m_bytesPerSample;
+    const char* m_pFilename;
+    size_t m_rowBytes = 0;
+    std::vector<u8> m_row;
+    std::vector<u8> m_prevRow;
+    size_t m_filled = 0;
+    int m_numRows = 0;
+    float m_minHeight = 0.0f;
+    float m_scale = 1.0f;
+    u32 m_adler = 1;
+};
+
+
+static int GetNumChannels(int ColorType)
+{
+    switch (ColorType) {
+    case 0: return 1;   // gray
+    case 2: return 3;   // RGB
+    case 4: return 2;   // gray + alpha
+    case 6: return 4;   // RGBA
+    default: return 0;  // palette (3) isn't supported
+    }
+}
+
+
+void LoadHeightMapPNG(const char* pFilename, Array2D<float>& HeightMap, float& MinHeight, float& MaxHeight)
+{
+    FILE* f = OpenFile(pFilename, "rb");
+
+    PNGChunkReader Reader(f, pFilename);
+
+    u8 Signature[8];
+    Reader.ReadFile(Signature, sizeof(Signature));
+
+    if (memcmp(Signature, PNGSignature, sizeof(Signature)) != 0) {
+        printf("'%s' is not a PNG file\n", pFilename);
+        exit(0);
+    }
+
+    Reader.BeginChunk();
+
+    if (!Reader.IsType("IHDR") || (Reader.GetBytesLeft() != 13)) {
+        printf("'%s' doesn't start with an image header\n", pFilename);
+        exit(0);
+    }
+
+    u8 Header[13];
+    Reader.Read(Header, sizeof(Header));
+    Reader.EndChunk();
+
+    int Width = (int)ReadBE32(Header);
+    int Depth = (int)ReadBE32(Header + 4);
+    int BitDepth = Header[8];
+    int ColorType = Header[9];
+    int Interlace = Header[12];
+    int NumChannels = GetNumChannels(ColorType);
+
+    if ((Width <= 0) || (Depth <= 0) || (NumChannels == 0) || ((BitDepth != 8) && (BitDepth != 16)) ||
+        (Header[10] != 0) || (Header[11] != 0) || (Interlace != 0)) {
+        printf("'%s': unsupported PNG format %dx%d, color type %d, %d bits, interlace %d\n", pFilename, Width, Depth, ColorType, BitDepth, Interlace);
+        exit(0);
+    }
+
+    // The chunks before the image data - only the height range is of interest
+    for (;;) {
+        Reader.BeginChunk();
+
+        if (Reader.IsType("IDAT")) {
+            break;
+        }
+
+        if (Reader.IsType("IEND")) {
+            printf("'%s' has no image data\n", pFilename);
+            exit(0);
+        }
+
+        if (Reader.IsType("tEXt") && (Reader.GetBytesLeft() < 256)) {
+            char Text[256] = { 0 };
+            u32 Size = Reader.GetBytesLeft();
+            Reader.Read((u8*)Text, Size);
+
+            size_t KeySize = strlen(PNG_HEIGHT_RANGE_KEY) + 1;
+
+            if ((Size > KeySize) && (memcmp(Text, PNG_HEIGHT_RANGE_KEY, KeySize) == 0)) {
+                char* pMinEnd = NULL;
+                char* pMaxEnd = NULL;
+                float Min = strtof(Text + KeySize, &pMinEnd);
+                float Max = strtof(pMinEnd, &pMaxEnd);
+
+                if ((pMinEnd != Text + KeySize) && (pMaxEnd != pMinEnd)) {
+                    MinHeight = Min;
+                    MaxHeight = Max;
+                }
+            }
+        }
+
+        Reader.EndChunk();
+    }
+
+    HeightMap.InitArray2D(Width, Depth);
+
+    int BytesPerSample = BitDepth / 8;
+    PNGRowDecoder Rows(HeightMap, NumChannels * BytesPerSample, BytesPerSample, MinHeight, MaxHeight, pFilename);
+
+    // Feeds the inflater from consecutive IDAT chunks
+    std::vector<u8> Buffer(PNG_READ_SIZE);
+    bool InImageData = true;
+
+    Inflater Decoder([&](const u8*& pData) -> size_t {
+        while (InImageData && (Reader.GetBytesLeft() == 0)) {
+            Reader.EndChunk();
+            Reader.BeginChunk();
+            InImageData = Reader.IsType("IDAT");
+        }
+
+        if (!InImageData) {
+            return 0;
+        }
+
+        size_t Size = std::min((size_t)Reader.GetBytesLeft(), Buffer.size());
+        Reader.Read(Buffer.data(), Size);
+        pData = Buffer.data();
+
+        return Size;
+    });
+
+    u8 ZlibHeader[2];
+
+    if (!Decoder.ReadBytes(ZlibHeader, sizeof(ZlibHeader)) || ((ZlibHeader[0] & 0x0F) != 8) ||
+        (((ZlibHeader[0] << 8) | ZlibHeader[1]) % 31 != 0) || (ZlibHeader[1] & 0x20)) {
+        printf("'%s': invalid zlib header in the image data\n", pFilename);
+        exit(0);
+    }
+
+    bool Ok = Decoder.Inflate([&](const u8* pData, size_t Size) {
+        Rows.AddBytes(pData, Size);
+    });
+
+    u8 Adler[4];
+
+    if (!Ok || !Decoder.ReadBytes(Adler, sizeof(Adler))) {
+        printf("'%s': the image data is corrupt\n", pFilename);
+        exit(0);
+    }
+
+    if (ReadBE32(Adler) != Rows.GetAdler32()) {
+        printf("'%s': checksum error in the image data\n", pFilename);
+        exit(0);
+    }
+
+    if (Rows.GetNumRows() != Depth) {
+        printf("'%s' has %d rows of image data instead of %d\n", pFilename, Rows.GetNumRows(), Depth);
+        exit(0);
+    }
+
+    fclose(f);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Writing
+////////////////////////////////////////////////////////////////////////////////
+
+static void WriteChunk(FILE* f, const char* pType, const u8* pData, size_t Size)
+{
+    u8 Header[8];
+    WriteBE32(Header, (u32)Size);
+    memcpy(Header + 4, pType, 4);
+
+    u8 CRC[4];
+    WriteBE32(CRC, CalcCRC32(CalcCRC32(0, Header + 4, 4), pData, Size));
+
+    if ((fwrite(Header, 1, sizeof(Header), f) != sizeof(Header)) ||
+        ((Size > 0) && (fwrite(pData, 1, Size, f) != Size)) ||
+        (fwrite(CRC, 1, sizeof(CRC), f) != sizeof(CRC))) {
+        printf("Error writing PNG chunk %s: %s\n", pType, strerror(errno));
+        exit(0);
+    }
+}
+
+
+// Big endian 16 bit samples
+static void QuantizeRow(const Array2D<float>& HeightMap, int z, float MinHeight, float Scale, u8* pRow)
+{
+    for (int x = 0; x < HeightMap.GetCols(); x++) {
+        float Value = (HeightMap.Get(x, z) - MinHeight) * Scale + 0.5f;
+        u32 Sample = (u32)std::min(std::max(Value, 0.0f), 65535.0f);
+
+        pRow[2 * x] = (u8)(Sample >> 8);
+        pRow[2 * x + 1] = (u8)Sample;
+    }
+}
+
+
+// Appends the filter byte and the filtered row. Every filter is tried and the one
+// with the smallest sum of the (signed) output bytes is kept - the usual heuristic.
+static void FilterRow(const u8* pRow, const u8* pPrevRow, size_t RowBytes, std::vector<u8>& Out)
+{
+    const size_t Bpp = 2;
+
+    thread_local std::vector<u8> Filtered[PNG_NUM_FILTERS];
+    u32 Cost[PNG_NUM_FILTERS] = { 0 };
+
+    for (int Filter = 0; Filter < PNG_NUM_FILTERS; Filter++) {
+        std::vector<u8>& Dst = Filtered[Filter];
+        Dst.resize(RowBytes);
+
+        for (size_t i = 0; i < RowBytes; i++) {
+            int Left = i >= Bpp ? pRow[i - Bpp] : 0;
+            int Up = pPrevRow[i];
+            int UpLeft = i >= Bpp ? pPrevRow[i - Bpp] : 0;
+            u8 Predicted = 0;
+
+            switch (Filter) {
+            case PNG_FILTER_SUB: Predicted = (u8)Left; break;
+            case PNG_FILTER_UP: Predicted = (u8)Up; break;
+            case PNG_FILTER_AVERAGE: Predicted = (u8)((Left + Up) >> 1); break;
+            case PNG_FILTER_PAETH: Predicted = PaethPredictor(Left, Up, UpLeft); break;
+            }
+
+            Dst[i] = (u8)(pRow[i] - Predicted);
+            Cost[Filter] += (u32)abs((i8)Dst[i]);
+        }
+    }
+
+    int Best = (int)(std::min_element(Cost, Cost + PNG_NUM_FILTERS) - Cost);
+
+    Out.push_back((u8)Best);
+    Out.insert(Out.end(), Filtered[Best].begin(), Filtered[Best].end());
+}
+
+
+// One band of rows on its way to the file
+struct PNGBand {
+    std::vector<u8> Compressed;
+    u32 Adler = 1;              // of the filtered rows
+    size_t FilteredSize = 0;
+};
+
+
+// Quantize -> filter -> deflate for rows [BandBegin, BandEnd). A band only needs
+// the row before it for the filters so the bands are independent.
+static void CompressBand(const Array2D<float>& HeightMap, int BandBegin, int BandEnd, float MinHeight, float Scale, PNGBand& Band)
+{
+    size_t RowBytes = (size_t)HeightMap.GetCols() * 2;
+
+    thread_local std::vector<u8> Row;
+    thread_local std::vector<u8> PrevRow;
+    thread_local std::vector<u8> Filtered;
+    Row.resize(RowBytes);
+    PrevRow.assign(RowBytes, 0);
+    Filtered.clear();
+
+    if (BandBegin > 0) {
+        QuantizeRow(HeightMap, BandBegin - 1, MinHeight, Scale, PrevRow.data());
+    }
+
+    for (int z = BandBegin; z < BandEnd; z++) {
+        QuantizeRow(HeightMap, z, MinHeight, Scale, Row.data());
+        FilterRow(Row.data(), PrevRow.data(), RowBytes, Filtered);
+        Row.swap(PrevRow);
+    }
+
+    Band.Adler = CalcAdler32(1, Filtered.data(), Filtered.size());
+    Band.FilteredSize = Filtered.size();
+
+    Band.Compressed.clear();
+
+    if (BandBegin == 0) {
+        // zlib header - deflate with a 32K window
+        Band.Compressed.push_back(0x78);
+        Band.Compressed.push_back(0x9C);
+    }
+
+    DeflateChunk(Filtered.data(), Filtered.size(), BandEnd == HeightMap.GetRows(), Band.Compressed);
+}
+
+
+void SaveHeightMapPNG(const char* pFilename, const Array2D<float>& HeightMap, float MinHeight, float MaxHeight)
+{
+    int Width = HeightMap.GetCols();
+    int Depth = HeightMap.GetRows();
+
+    FILE* f = OpenFile(pFilename, "wb");
+
+    if (fwrite(PNGSignature, 1, sizeof(PNGSignature), f) != sizeof(PNGSignature)) {
+        printf("Error writing '%s': %s\n", pFilename, strerror(errno));
+        exit(0);
+    }
+
+    u8 Header[13] = { 0 };
+    WriteBE32(Header, (u32)Width);
+    WriteBE32(Header + 4, (u32)Depth);
+    Header[8] = 16;     // bits per sample
+    Header[9] = 0;      // grayscale
+    WriteChunk(f, "IHDR", Header, sizeof(Header));
+
+    char Text[128];
+    size_t KeySize = strlen(PNG_HEIGHT_RANGE_KEY) + 1;
+    memcpy(Text, PNG_HEIGHT_RANGE_KEY, KeySize);
+    int TextSize = snprintf(Text + KeySize, sizeof(Text) - KeySize, "%.9g %.9g", MinHeight, MaxHeight);
+    WriteChunk(f, "tEXt", (const u8*)Text, KeySize + TextSize);
+
+    float Scale = (MaxHeight > MinHeight) ? 65535.0f / (MaxHeight - MinHeight) : 0.0f;
+
+    // The threads compress a group of bands, then they are written in order as IDAT
+    // chunks. The checksums of the bands are combined into the one of the stream.
+    int NumBands = (Depth + PNG_ROWS_PER_BAND - 1) / PNG_ROWS_PER_BAND;
+    int BandsPerGroup = 2 * GetThreadPool().GetNumThreads();
+    std::vector<PNGBand> Bands(BandsPerGroup);
+    u32 Adler = 1;
+
+    for (int GroupBegin = 0; GroupBegin < NumBands; GroupBegin += BandsPerGroup) {
+        int GroupEnd = std::min(GroupBegin + BandsPerGroup, NumBands);
+
+        GetThreadPool().ParallelFor(GroupBegin, GroupEnd, 1, [&](int Begin, int End) {
+            for (int i = Begin; i < End; i++) {
+                int BandBegin = i * PNG_ROWS_PER_BAND;
+                int BandEnd = std::min(BandBegin + PNG_ROWS_PER_BAND, Depth);
+                CompressBand(HeightMap, BandBegin, BandEnd, MinHeight, Scale, Bands[i - GroupBegin]);
+            }
+        });
+
+        for (int i = GroupBegin; i < GroupEnd; i++) {
+            PNGBand& Band = Bands[i - GroupBegin];
+
+            Adler = CalcAdler32Combine(Adler, Band.Adler, Band.FilteredSize);
+
+            if (i == NumBands - 1) {
+                u8 Trailer[4];
+                WriteBE32(Trailer, Adler);
+                Band.Compressed.insert(Band.Compressed.end(), Trailer, Trailer + sizeof(Trailer));
+            }
+
+            WriteChunk(f, "IDAT", Band.Compressed.data(), Band.Compressed.size());
+        }
+    }
+
+    WriteChunk(f, "IEND", NULL, 0);
+
+    fclose(f);
+}
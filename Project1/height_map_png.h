@@ -0,0 +1,22 @@
+#ifndef HEIGHT_MAP_PNG_H
+#define HEIGHT_MAP_PNG_H
+
+#include "ogldev_array_2d.h"
+
+// PNG import/export of height maps. Both directions work a few rows at a time -
+// the reader inflates the IDAT chunks as it reads them and unfilters every row
+// straight into the height map, the writer filters and compresses bands of rows -
+// so there's never a full image sized buffer next to the heights.
+
+// Reads 8 or 16 bit grayscale (gray + alpha, RGB and RGBA use the first channel).
+// Samples 0..max become MinHeight..MaxHeight unless the file has the height range
+// written by SaveHeightMapPNG, in which case MinHeight/MaxHeight are set to it.
+// Errors are fatal.
+void LoadHeightMapPNG(const char* pFilename, Array2D<float>& HeightMap, float& MinHeight, float& MaxHeight);
+
+// Writes a 16 bit grayscale PNG with MinHeight..MaxHeight mapped to 0..65535 and
+// the range in a text chunk so that loading restores the heights. The bands are
+// quantized, filtered and compressed on the thread pool.
+void SaveHeightMapPNG(const char* pFilename, const Array2D<float>& HeightMap, float MinHeight, float MaxHeight);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "height_mip_pyramid.h"
+#include "thread_pool.h"
+
+// A band of base level rows is reduced this many levels further by the thread that
+// built it - the levels above that are small enough to do in one go afterwards
+#define MIP_BAND_LEVELS 4
+
+// Stored in front of the texels in TERRAIN_SECTION_HEIGHT_MIPS
+struct HeightMipHeader {
+    i32 Width = 0;          // of the height map
+    i32 Depth = 0;
+    i32 BaseCellSize = 0;
+    i32 NumLevels = 0;
+};
+
+
+void HeightMipPyramid::InitLevels(int Width, int Depth)
+{
+    if ((Width < 2) || (Depth < 2)) {
+        printf("%s: a %dx%d height map has no quads\n", __FUNCTION__, Width, Depth);
+        exit(0);
+    }
+
+    m_quadsX = Width - 1;
+    m_quadsZ = Depth - 1;
+    m_levels.clear();
+
+    size_t NumTexels = 0;
+
+    for (int CellSize = HEIGHT_MIP_BASE_CELL_SIZE; ; CellSize *= 2) {
+        MipLevel l;
+        l.Width = (m_quadsX + CellSize - 1) / CellSize;
+        l.Depth = (m_quadsZ + CellSize - 1) / CellSize;
+        l.Offset = NumTexels;
+
+        m_levels.push_back(l);
+        NumTexels += (size_t)l.Width * l.Depth;
+
+        if ((l.Width == 1) && (l.Depth == 1)) {
+            break;
+        }
+    }
+
+    m_texels.resize(NumTexels);
+}
+
+
+void HeightMipPyramid::Build(const Array2D<float>& HeightMap)
+{
+    InitLevels(HeightMap.GetCols(), HeightMap.GetRows());
+
+    int NumBandLevels = std::min(MIP_BAND_LEVELS, GetNumLevels() - 1);
+    int BandRows = 1 << NumBandLevels;
+    int NumBands = (m_levels[0].Depth + BandRows - 1) / BandRows;
+
+    // The cells of a band at the levels above the base only cover base cells of the
+    // same band, so every band goes all the way up while its rows are in the cache
+    GetThreadPool().ParallelFor(0, NumBands, 1, [&](int BandBegin, int BandEnd) {
+        for (int Band = BandBegin; Band < BandEnd; Band++) {
+            int RowBegin = Band * BandRows;
+            int RowEnd = std::min(RowBegin + BandRows, m_levels[0].Depth);
+
+            BuildBaseRows(HeightMap, RowBegin, RowEnd);
+
+            for (int Level = 1; Level <= NumBandLevels; Level++) {
+                ReduceRows(Level, RowBegin >> Level, (RowEnd + (1 << Level) - 1) >> Level);
+            }
+        }
+    });
+
+    for (int Level = NumBandLevels + 1; Level < GetNumLevels(); Level++) {
+        ReduceRows(Level, 0, m_levels[Level].Depth);
+    }
+}
+
+
+void HeightMipPyramid::BuildBaseRows(const Array2D<float>& HeightMap, int RowBegin, int RowEnd)
+{
+    const MipLevel& Base = m_levels[0];
+
+    for (int CellZ = RowBegin; CellZ < RowEnd; CellZ++) {
+        int z0 = CellZ * HEIGHT_MIP_BASE_CELL_SIZE;
+        int z1 = std::min(z0 + HEIGHT_MIP_BASE_CELL_SIZE, m_quadsZ);
+
+        for (int CellX = 0; CellX < Base.Width; CellX++) {
+            int x0 = CellX * HEIGHT_MIP_BASE_CELL_SIZE;
+            int x1 = std::min(x0 + HEIGHT_MIP_BASE_CELL_SIZE, m_quadsX);
+
+            float Min = HeightMap.Get(x0, z0);
+            float Max = Min;
+            float Sum = 0.0f;
+
+            // The mean of a bilinear quad is the mean of its corners, so over the cell
+            // a sample counts once inside, half on an edge and a quarter in a corner
+            for (int z = z0; z <= z1; z++) {
+                float RowWeight = ((z == z0) || (z == z1)) ? 0.5f : 1.0f;
+                float RowSum = 0.0f;
+
+                for (int x = x0; x <= x1; x++) {
+                    float Height = HeightMap.Get(x, z);
+                    Min = std::min(Min, Height);
+                    Max = std::max(Max, Height);
+                    RowSum += ((x == x0) || (x == x1)) ? 0.5f * Height : Height;
+                }
+
+                Sum += RowWeight * RowSum;
+            }
+
+            HeightMipTexel& t = m_texels[Base.Offset + (size_t)CellZ * Base.Width + CellX];
+            t.Min = Min;
+            t.Max = Max;
+            t.Avg = Sum / (float)((x1 - x0) * (z1 - z0));
+        }
+    }
+}
+
+
+void HeightMipPyramid::ReduceRows(int Level, int RowBegin, int RowEnd)
+{
+    const MipLevel& Parent = m_levels[Level];
+    const MipLevel& Child = m_levels[Level - 1];
+    int ChildCellSize = GetCellSize(Level - 1);
+
+    for (int z = RowBegin; z < RowEnd; z++) {
+        for (int x = 0; x < Parent.Width; x++) {
+            HeightMipTexel& t = m_texels[Parent.Offset + (size_t)z * Parent.Width + x];
+            t = Get(Level - 1, 2 * x, 2 * z);
+
+            float Sum = 0.0f;
+            float Area = 0.0f;
+
+            // The average is weighted by the area of the children - the last ones
+            // along the edges of the map are clipped
+            for (int ChildZ = 2 * z; ChildZ < std::min(2 * z + 2, Child.Depth); ChildZ++) {
+                float Depth = (float)std::min(ChildCellSize, m_quadsZ - ChildZ * ChildCellSize);
+
+                for (int ChildX = 2 * x; ChildX < std::min(2 * x + 2, Child.Width); ChildX++) {
+                    const HeightMipTexel& c = Get(Level - 1, ChildX, ChildZ);
+                    float ChildArea = Depth * (float)std::min(ChildCellSize, m_quadsX - ChildX * ChildCellSize);
+
+                    t.Min = std::min(t.Min, c.Min);
+                    t.Max = std::max(t.Max, c.Max);
+                    Sum += c.Avg * ChildArea;
+                    Area += ChildArea;
+                }
+            }
+
+            t.Avg = Sum / Area;
+        }
+    }
+}
+
+
+void HeightMipPyramid::Destroy()
+{
+    m_levels.clear();
+    m_texels.clear();
+    m_texels.shrink_to_fit();
+    m_quadsX = 0;
+    m_quadsZ = 0;
+}
+
+
+void HeightMipPyramid::Remap(float SrcMin, float Scale, float DstMin)
+{
+    for (size_t i = 0; i < m_texels.size(); i++) {
+        HeightMipTexel& t = m_texels[i];
+        t.Min = (t.Min - SrcMin) * Scale + DstMin;
+        t.Max = (t.Max - SrcMin) * Scale + DstMin;
+        t.Avg = (t.Avg - SrcMin) * Scale + DstMin;
+
+        if (Scale < 0.0f) {
+            std::swap(t.Min, t.Max);
+        }
+    }
+}
+
+
+void HeightMipPyramid::Swap(HeightMipPyramid& Other)
+{
+    m_levels.swap(Other.m_levels);
+    m_texels.swap(Other.m_texels);
+    std::swap(m_quadsX, Other.m_quadsX);
+    std::swap(m_quadsZ, Other.m_quadsZ);
+}
+
+
+void HeightMipPyramid::SaveToFile(TerrainFileWriter& Writer) const
+{
+    HeightMipHeader Header;
+    Header.Width = m_quadsX + 1;
+    Header.Depth = m_quadsZ + 1;
+    Header.BaseCellSize = HEIGHT_MIP_BASE_CELL_SIZE;
+    Header.NumLevels = GetNumLevels();
+
+    Writer.BeginSection(TERRAIN_SECTION_HEIGHT_MIPS, sizeof(Header) + GetSizeInBytes());
+    Writer.Write(&Header, sizeof(Header));
+    Writer.Write(m_texels.data(), GetSizeInBytes());
+}
+
+
+bool HeightMipPyramid::LoadFromFile(const TerrainFileReader& Reader, int Width, int Depth)
+{
+    Destroy();
+
+    size_t Size = 0;
+    const u8* pData = (const u8*)Reader.GetSection(TERRAIN_SECTION_HEIGHT_MIPS, Size);
+
+    if (!pData) {
+        return false;
+    }
+
+    HeightMipHeader Header;
+
+    if (Size >= sizeof(Header)) {
+        memcpy(&Header, pData, sizeof(Header));
+    }
+
+    InitLevels(Width, Depth);
+
+    if ((Header.Width != Width) || (Header.Depth != Depth) || (Header.BaseCellSize != HEIGHT_MIP_BASE_CELL_SIZE) ||
+        (Header.NumLevels != GetNumLevels()) || (Size != sizeof(Header) + GetSizeInBytes())) {
+        printf("%s: the height mip pyramid doesn't match the %dx%d height map\n", __FUNCTION__, Width, Depth);
+        Destroy();
+        return false;
+    }
+
+    memcpy(m_texels.data(), pData + sizeof(Header), GetSizeInBytes());
+
+    return true;
+}
\ No newline at end of file
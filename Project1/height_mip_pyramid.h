@@ -0,0 +1,95 @@
+#ifndef HEIGHT_MIP_PYRAMID_H
+#define HEIGHT_MIP_PYRAMID_H
+
+#include <vector>
+#include <algorithm>
+
+#include "ogldev_types.h"
+#include "ogldev_array_2d.h"
+#include "terrain_file.h"
+
+// Lowest, highest and average height of a cell
+struct HeightMipTexel {
+    float Min = 0.0f;
+    float Max = 0.0f;
+    float Avg = 0.0f;
+};
+
+// Coarse versions of a height map for far LODs, culling bounds, raycasts and
+// minimaps. A cell of level L covers the quads between the samples
+//
+//     [x * CellSize, (x + 1) * CellSize] x [z * CellSize, (z + 1) * CellSize]
+//
+// (CellSize = HEIGHT_MIP_BASE_CELL_SIZE << L, neighbours share their border samples,
+// the last cells are clipped to the map) so Min/Max bound everything drawn over the
+// cell. Avg is the mean height of the bilinear surface over the cell. The levels go
+// down to a single cell for the whole map.
+#define HEIGHT_MIP_BASE_CELL_SIZE 4
+
+class HeightMipPyramid {
+public:
+    HeightMipPyramid() {}
+
+    // All the levels in one pass over the heights on the thread pool
+    void Build(const Array2D<float>& HeightMap);
+
+    void Destroy();
+
+    bool IsEmpty() const { return m_levels.empty(); }
+
+    int GetNumLevels() const { return (int)m_levels.size(); }
+
+    int GetLevelWidth(int Level) const { return m_levels[Level].Width; }
+
+    int GetLevelDepth(int Level) const { return m_levels[Level].Depth; }
+
+    int GetCellSize(int Level) const { return HEIGHT_MIP_BASE_CELL_SIZE << Level; }
+
+    const HeightMipTexel& Get(int Level, int x, int z) const
+    {
+        const MipLevel& l = m_levels[Level];
+        return m_texels[l.Offset + (size_t)z * l.Width + x];
+    }
+
+    // Cell of the level under a position in height map samples (clamped to the map)
+    const HeightMipTexel& GetAt(int Level, float x, float z) const
+    {
+        const MipLevel& l = m_levels[Level];
+        int CellX = std::min(std::max((int)(x / GetCellSize(Level)), 0), l.Width - 1);
+        int CellZ = std::min(std::max((int)(z / GetCellSize(Level)), 0), l.Depth - 1);
+        return m_texels[l.Offset + (size_t)CellZ * l.Width + CellX];
+    }
+
+    size_t GetSizeInBytes() const { return m_texels.size() * sizeof(HeightMipTexel); }
+
+    // Height -> (Height - SrcMin) * Scale + DstMin for every texel
+    void Remap(float SrcMin, float Scale, float DstMin);
+
+    void Swap(HeightMipPyramid& Other);
+
+    void SaveToFile(TerrainFileWriter& Writer) const;
+
+    // Returns false if the file has no pyramid or it doesn't belong to a height map
+    // of this size
+    bool LoadFromFile(const TerrainFileReader& Reader, int Width, int Depth);
+
+private:
+    struct MipLevel {
+        int Width = 0;
+        int Depth = 0;
+        size_t Offset = 0;      // of the first texel in m_texels
+    };
+
+    void InitLevels(int Width, int Depth);
+
+    void BuildBaseRows(const Array2D<float>& HeightMap, int RowBegin, int RowEnd);
+
+    void ReduceRows(int Level, int RowBegin, int RowEnd);
+
+    std::vector<MipLevel> m_levels;
+    std::vector<HeightMipTexel> m_texels;
+    int m_quadsX = 0;
+    int m_quadsZ = 0;
+};
+
+#endif
\ No newline at end of file
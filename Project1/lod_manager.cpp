@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <algorithm>
 
 #include "lod_manager.h"
 #include "demo_config.h"
@@ -50,23 +51,28 @@ void LodManager::Update(const Vector3f& CameraPos)
 
 void LodManager::UpdateLodMapPass1(const Vector3f& CameraPos)
 {
-    int CenterStep = m_patchSize / 2;
-
     for (int LodMapZ = 0; LodMapZ < m_numPatchesZ; LodMapZ++) {
         for (int LodMapX = 0; LodMapX < m_numPatchesX; LodMapX++) {
-            int x = LodMapX * (m_patchSize - 1) + CenterStep;
-            int z = LodMapZ * (m_patchSize - 1) + CenterStep;
+            PatchLod* pPatchLOD = m_map.GetAddr(LodMapX, LodMapZ);
+            pPatchLOD->Core = CalcCoreLod(CameraPos, LodMapX, LodMapZ);
+        }
+    }
+}
 
-            Vector3f PatchCenter = Vector3f(x * (float)m_worldScale, 0.0f, z * (float)m_worldScale);
 
-            float DistanceToCamera = CameraPos.Distance(PatchCenter);
+// The patch may be outside of the grid
+int LodManager::CalcCoreLod(const Vector3f& CameraPos, int PatchX, int PatchZ)
+{
+    int CenterStep = m_patchSize / 2;
 
-            int CoreLod = DistanceToLod(DistanceToCamera);
+    int x = PatchX * (m_patchSize - 1) + CenterStep;
+    int z = PatchZ * (m_patchSize - 1) + CenterStep;
 
-            PatchLod* pPatchLOD = m_map.GetAddr(LodMapX, LodMapZ);
-            pPatchLOD->Core = CoreLod;
-        }
-    }
+    Vector3f PatchCenter = Vector3f(x * (float)m_worldScale, 0.0f, z * (float)m_worldScale);
+
+    float DistanceToCamera = CameraPos.Distance(PatchCenter);
+
+    return DistanceToLod(DistanceToCamera);
 }
 
 
@@ -93,6 +99,9 @@ void LodManager::UpdateLodMapPass2(const Vector3f& CameraPos)
                     m_map.At(LodMapX, LodMapZ).Left = 0;
                 }
             }
+            else if (m_stitchEdges) {
+                m_map.At(LodMapX, LodMapZ).Left = (CalcCoreLod(CameraPos, LodMapX - 1, LodMapZ) > CoreLod) ? 1 : 0;
+            }
 
             if (LodMapX < m_numPatchesX - 1) {
                 IndexRight++;
@@ -104,6 +113,9 @@ void LodManager::UpdateLodMapPass2(const Vector3f& CameraPos)
                     m_map.At(LodMapX, LodMapZ).Right = 0;
                 }
             }
+            else if (m_stitchEdges) {
+                m_map.At(LodMapX, LodMapZ).Right = (CalcCoreLod(CameraPos, LodMapX + 1, LodMapZ) > CoreLod) ? 1 : 0;
+            }
 
             if (LodMapZ > 0) {
                 IndexBottom--;
@@ -115,6 +127,9 @@ void LodManager::UpdateLodMapPass2(const Vector3f& CameraPos)
                     m_map.At(LodMapX, LodMapZ).Bottom = 0;
                 }
             }
+            else if (m_stitchEdges) {
+                m_map.At(LodMapX, LodMapZ).Bottom = (CalcCoreLod(CameraPos, LodMapX, LodMapZ - 1) > CoreLod) ? 1 : 0;
+            }
 
             if (LodMapZ < m_numPatchesZ - 1) {
                 IndexTop++;
@@ -126,6 +141,9 @@ void LodManager::UpdateLodMapPass2(const Vector3f& CameraPos)
                     m_map.At(LodMapX, LodMapZ).Top = 0;
                 }
             }
+            else if (m_stitchEdges) {
+                m_map.At(LodMapX, LodMapZ).Top = (CalcCoreLod(CameraPos, LodMapX, LodMapZ + 1) > CoreLod) ? 1 : 0;
+            }
         }
     }
 }
@@ -184,4 +202,17 @@ void LodManager::CalcLodRegions()
         Temp += CurRange;
         printf("%d %d\n", i, m_regions[i]);
     }
+}
+
+
+void LodManager::Swap(LodManager& Other)
+{
+    std::swap(m_maxLOD, Other.m_maxLOD);
+    std::swap(m_patchSize, Other.m_patchSize);
+    std::swap(m_numPatchesX, Other.m_numPatchesX);
+    std::swap(m_numPatchesZ, Other.m_numPatchesZ);
+    std::swap(m_worldScale, Other.m_worldScale);
+    std::swap(m_stitchEdges, Other.m_stitchEdges);
+    m_map.Swap(Other.m_map);
+    m_regions.swap(Other.m_regions);
 }
\ No newline at end of file
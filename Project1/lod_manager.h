@@ -13,6 +13,11 @@ public:
 
     void Update(const Vector3f& CameraPos);
 
+    // The patches along the edges are stitched to the virtual patches just outside of
+    // the grid, which get their LOD from the same distance rule. Grids that are tiles
+    // of a larger terrain (see terrain_pager.h) then agree along their shared edges.
+    void SetStitchEdges(bool Enabled) { m_stitchEdges = Enabled; }
+
     struct PatchLod {
         int Core = 0;
         int Left = 0;
@@ -25,6 +30,8 @@ public:
 
     void PrintLodMap();
 
+    void Swap(LodManager& Other);
+
 private:
     void CalcLodRegions();
     void CalcMaxLOD();
@@ -33,11 +40,14 @@ private:
 
     int DistanceToLod(float Distance);
 
+    int CalcCoreLod(const Vector3f& CameraPos, int PatchX, int PatchZ);
+
     int m_maxLOD = 0;
     int m_patchSize = 0;
     int m_numPatchesX = 0;
     int m_numPatchesZ = 0;
     float m_worldScale = 0.0f;
+    bool m_stitchEdges = false;
 
     Array2D<PatchLod> m_map;
     std::vector<int> m_regions;
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "mapped_file.h"
+
+
+size_t GetFileSize(const char* pFilename)
+{
+#ifdef _WIN32
+    struct _stat64 StatBuf;
+    int Error = _stat64(pFilename, &StatBuf);
+#else
+    struct stat StatBuf;
+    int Error = stat(pFilename, &StatBuf);
+#endif
+
+    if (Error) {
+        printf("Error getting the size of '%s': %s\n", pFilename, strerror(errno));
+        exit(0);
+    }
+
+    return (size_t)StatBuf.st_size;
+}
+
+
+// Pages of a mapping that are past the end of the file can't be accessed so both
+// versions check the range first
+static void ValidateRange(const char* pFilename, size_t Offset, size_t Size)
+{
+    size_t FileSize = GetFileSize(pFilename);
+
+    if ((Size == 0) || (Offset > FileSize) || (Size > FileSize - Offset)) {
+        printf("Can't map %zu bytes at offset %zu of '%s' (file size %zu)\n", Size, Offset, pFilename, FileSize);
+        exit(0);
+    }
+}
+
+
+#ifdef __linux__
+
+static size_t GetPageSize()
+{
+    static size_t PageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+    return PageSize;
+}
+
+
+void* MapFile(const char* pFilename, size_t Offset, size_t Size, void*& pMapping, size_t& MappingSize)
+{
+    ValidateRange(pFilename, Offset, Size);
+
+    int fd = open(pFilename, O_RDONLY);
+
+    if (fd == -1) {
+        printf("Error opening '%s': %s\n", pFilename, strerror(errno));
+        exit(0);
+    }
+
+    // mmap wants a page aligned offset
+    size_t PageOffset = Offset % GetPageSize();
+
+    MappingSize = Size + PageOffset;
+    pMapping = mmap(NULL, MappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)(Offset - PageOffset));
+
+    // The mapping keeps its own reference to the file
+    close(fd);
+
+    if (pMapping == MAP_FAILED) {
+        printf("Error mapping %zu bytes of '%s' at offset %zu: %s\n", Size, pFilename, Offset, strerror(errno));
+        exit(0);
+    }
+
+    return (char*)pMapping + PageOffset;
+}
+
+
+void UnmapFile(void* pMapping, size_t MappingSize)
+{
+    if (munmap(pMapping, MappingSize) != 0) {
+        printf("Error unmapping %zu bytes: %s\n", MappingSize, strerror(errno));
+    }
+}
+
+
+void PrefetchMappedRange(const void* p, size_t Size)
+{
+    if (Size == 0) {
+        return;
+    }
+
+    // madvise also wants page aligned addresses
+    size_t Begin = (size_t)p & ~(GetPageSize() - 1);
+    size_t End = (size_t)p + Size;
+
+    // Only a hint - nothing to do if it fails
+    madvise((void*)Begin, End - Begin, MADV_WILLNEED);
+}
+
+#elif defined(_WIN32)
+
+static size_t GetAllocationGranularity()
+{
+    SYSTEM_INFO Info;
+    GetSystemInfo(&Info);
+
+    return (size_t)Info.dwAllocationGranularity;
+}
+
+
+void* MapFile(const char* pFilename, size_t Offset, size_t Size, void*& pMapping, size_t& MappingSize)
+{
+    ValidateRange(pFilename, Offset, Size);
+
+    HANDLE hFile = CreateFileA(pFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        printf("Error opening '%s': error %lu\n", pFilename, GetLastError());
+        exit(0);
+    }
+
+    // Copy on write like MAP_PRIVATE - PAGE_WRITECOPY only needs GENERIC_READ on the
+    // file and the view is mapped with FILE_MAP_COPY to match
+    HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+
+    if (!hMapping) {
+        printf("Error creating a mapping of '%s': error %lu\n", pFilename, GetLastError());
+        exit(0);
+    }
+
+    // The view must start on the allocation granularity (64 KB), not just a page
+    size_t ViewOffset = Offset % GetAllocationGranularity();
+    unsigned long long Start = (unsigned long long)(Offset - ViewOffset);
+
+    MappingSize = Size + ViewOffset;
+    pMapping = MapViewOfFile(hMapping, FILE_MAP_COPY, (DWORD)(Start >> 32), (DWORD)(Start & 0xFFFFFFFF), MappingSize);
+
+    // The view keeps its own references to the file and the mapping
+    DWORD Error = GetLastError();
+    CloseHandle(hMapping);
+    CloseHandle(hFile);
+
+    if (!pMapping) {
+        printf("Error mapping %zu bytes of '%s' at offset %zu: error %lu\n", Size, pFilename, Offset, Error);
+        exit(0);
+    }
+
+    return (char*)pMapping + ViewOffset;
+}
+
+
+void UnmapFile(void* pMapping, size_t MappingSize)
+{
+    if (!UnmapViewOfFile(pMapping)) {
+        printf("Error unmapping %zu bytes: error %lu\n", MappingSize, GetLastError());
+    }
+}
+
+
+// PrefetchVirtualMemory is Windows 8 and later and is only declared when _WIN32_WINNT
+// targets those, so it is looked up at run time - older systems just don't prefetch.
+// Same layout as WIN32_MEMORY_RANGE_ENTRY.
+struct PrefetchRange {
+    PVOID VirtualAddress;
+    SIZE_T NumberOfBytes;
+};
+
+typedef BOOL (WINAPI *PrefetchVirtualMemoryFunc)(HANDLE hProcess, ULONG_PTR NumberOfEntries, PrefetchRange* pAddresses, ULONG Flags);
+
+static PrefetchVirtualMemoryFunc GetPrefetchVirtualMemory()
+{
+    static PrefetchVirtualMemoryFunc pFunc =
+        (PrefetchVirtualMemoryFunc)(void*)GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+
+    return pFunc;
+}
+
+
+void PrefetchMappedRange(const void* p, size_t Size)
+{
+    PrefetchVirtualMemoryFunc pPrefetchVirtualMemory = GetPrefetchVirtualMemory();
+
+    if ((Size == 0) || !pPrefetchVirtualMemory) {
+        return;
+    }
+
+    PrefetchRange Range;
+    Range.VirtualAddress = (PVOID)p;
+    Range.NumberOfBytes = Size;
+
+    // Only a hint - nothing to do if it fails
+    pPrefetchVirtualMemory(GetCurrentProcess(), 1, &Range, 0);
+}
+
+#else
+
+void* MapFile(const char* pFilename, size_t Offset, size_t Size, void*& pMapping, size_t& MappingSize)
+{
+    ValidateRange(pFilename, Offset, Size);
+
+    FILE* f = fopen(pFilename, "rb");
+
+    if (!f) {
+        printf("Error opening '%s': %s\n", pFilename, strerror(errno));
+        exit(0);
+    }
+
+    pMapping = malloc(Size);
+    MappingSize = Size;
+
+    if (!pMapping) {
+        printf("Error allocating %zu bytes for '%s'\n", Size, pFilename);
+        exit(0);
+    }
+
+    int Error = fseeko(f, (off_t)Offset, SEEK_SET);
+
+    if (Error || (fread(pMapping, 1, Size, f) != Size)) {
+        printf("Error reading %zu bytes of '%s' at offset %zu\n", Size, pFilename, Offset);
+        exit(0);
+    }
+
+    fclose(f);
+
+    return pMapping;
+}
+
+
+void UnmapFile(void* pMapping, size_t MappingSize)
+{
+    free(pMapping);
+}
+
+
+void PrefetchMappedRange(const void* p, size_t Size)
+{
+}
+
+#endif
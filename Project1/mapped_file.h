@@ -0,0 +1,27 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+
+// Read only access to large files without reading them up front. On Linux (mmap) and
+// Windows (a file mapping) the pages are read on first access and shared with the
+// page cache; elsewhere the range is read into a malloc'ed buffer.
+//
+// The mapping is private - the data can be modified in memory (copy on write) but
+// the changes never reach the file.
+
+// Size of the file in bytes. Exits if the file can't be accessed.
+size_t GetFileSize(const char* pFilename);
+
+// Maps Size bytes starting at Offset (no alignment requirement) and returns the
+// address of the byte at Offset. pMapping/MappingSize receive what must be passed
+// to UnmapFile.
+void* MapFile(const char* pFilename, size_t Offset, size_t Size, void*& pMapping, size_t& MappingSize);
+
+void UnmapFile(void* pMapping, size_t MappingSize);
+
+// Starts reading the pages of the range in the background (madvise WILLNEED or
+// PrefetchVirtualMemory) so that they don't fault in one by one later. A no-op when the data isn't mapped.
+void PrefetchMappedRange(const void* p, size_t Size);
+
+#endif
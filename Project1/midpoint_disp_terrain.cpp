@@ -1,114 +1,300 @@
 #include "midpoint_disp_terrain.h"
-
-void MidpointDispTerrain::CreateMidpointDisplacement(int TerrainSize, int PatchSize, float Roughness, float MinHeight, float MaxHeight)
+#include "thread_pool.h"
+
+// Minimum number of points handed to a thread in one go - smaller levels are
+// not worth waking up the pool for
+#define MIN_POINTS_PER_BAND 8192
+
+// The coarsest level is a grid of up to this many cells per side with random
+// corners. Allowing more than one cell lets the padded grid follow the terrain
+// size closely instead of jumping to the next power of two plus one.
+#define MAX_TOP_LEVEL_CELLS 8
+
+// Runs the diamond-square steps on a height map of (NumTopCells * TopRectSize + 1)
+// points per side - the smallest such size that covers the terrain. There is no
+// wrap around so every point only reads points inside the grid. Kept apart from
+// the terrain class so that a new height map can be generated on a background
+// thread while the terrain keeps rendering the current one.
+template<typename Layout>
+class MidpointDispGenerator {
+public:
+    MidpointDispGenerator(Array2D<float, Layout>& HeightMap, int TerrainSize, uint Seed, int NumThreads);
+
+    int GetPaddedSize() const { return m_paddedSize; }
+
+    void Generate(float Roughness);
+
+private:
+    void InitTopLevel(float CurHeight);
+    void DiamondStep(int RectSize, int Level, float CurHeight);
+    void SquareStep(int RectSize, int Level, float CurHeight);
+    void SquarePoint(int x, int z, int HalfRectSize, int Level, float CurHeight);
+
+    Array2D<float, Layout>& m_heightMap;
+    int m_terrainSize = 0;
+    int m_topRectSize = 0;
+    int m_numTopCells = 0;
+    int m_paddedSize = 0;
+    uint m_seed = 0;
+    int m_numThreads = 0;
+};
+
+
+void MidpointDispTerrain::CreateMidpointDisplacement(int TerrainSize, int PatchSize, float Roughness, float MinHeight, float MaxHeight, uint Seed)
 {
     if (Roughness < 0.0f) {
         printf("%s: roughness must be positive - %f\n", __FUNCTION__, Roughness);
         exit(0);
     }
 
+    if (LoadFromCache(GetCacheKey(TerrainSize, PatchSize, Roughness, MinHeight, MaxHeight, Seed))) {
+        return;
+    }
+
     m_terrainSize = TerrainSize;
     m_patchSize = PatchSize;
 
     SetMinMaxHeight(MinHeight, MaxHeight);
 
-    m_heightMap.InitArray2D(TerrainSize, TerrainSize, 0.0f);
+    long long StartTime = GetCurrentTimeMillis();
 
-    CreateMidpointDisplacementF32(Roughness);
+    CreateMidpointDisplacementF32(m_heightMap, TerrainSize, Roughness, Seed, m_numThreads);
 
     m_heightMap.Normalize(MinHeight, MaxHeight);
 
+    printf("Midpoint displacement %dx%d generated in %lld ms\n", TerrainSize, TerrainSize, GetCurrentTimeMillis() - StartTime);
+
+    ErodeHeightMap(m_heightMap, m_erosionParams);
+
     Finalize();
 }
 
 
-void MidpointDispTerrain::CreateMidpointDisplacementF32(float Roughness)
+bool MidpointDispTerrain::CreateMidpointDisplacementAsync(int TerrainSize, int PatchSize, float Roughness, float MinHeight, float MaxHeight, uint Seed)
 {
-    int RectSize = CalcNextPowerOfTwo(m_terrainSize);
-    float CurHeight = (float)RectSize / 2.0f;
-    float HeightReduce = pow(2.0f, -Roughness);
+    if (Roughness < 0.0f) {
+        printf("%s: roughness must be positive - %f\n", __FUNCTION__, Roughness);
+        exit(0);
+    }
 
-    while (RectSize > 0) {
+    if (LoadFromCache(GetCacheKey(TerrainSize, PatchSize, Roughness, MinHeight, MaxHeight, Seed))) {
+        return true;
+    }
 
-        DiamondStep(RectSize, CurHeight);
+    int NumThreads = m_numThreads;
+    ErosionParams Erosion = m_erosionParams;
 
-        SquareStep(RectSize, CurHeight);
+    // Everything is captured by value - the build must not depend on the terrain object
+    return StartAsyncBuild(TerrainSize, PatchSize, MinHeight, MaxHeight, [=](Array2D<float>& HeightMap) {
+        CreateMidpointDisplacementF32(HeightMap, TerrainSize, Roughness, Seed, NumThreads);
+        HeightMap.Normalize(MinHeight, MaxHeight);
+        ErodeHeightMap(HeightMap, Erosion);
+    });
+}
 
-        RectSize /= 2;
-        CurHeight *= HeightReduce;
+
+// The number of threads isn't part of the key - the terrain doesn't depend on it
+TerrainCacheKey MidpointDispTerrain::GetCacheKey(int TerrainSize, int PatchSize, float Roughness, float MinHeight, float MaxHeight, uint Seed) const
+{
+    TerrainCacheKey Key = BaseTerrain::GetCacheKey("midpoint displacement", TerrainSize, PatchSize, MinHeight, MaxHeight);
+    Key.Add(Roughness);
+    Key.Add(Seed);
+    Key.Add(m_erosionParams.Iterations);
+
+    if (m_erosionParams.Iterations > 0) {
+        Key.Add(m_erosionParams.Talus);
+        Key.Add(m_erosionParams.ThermalRate);
+        Key.Add(m_erosionParams.Rain);
+        Key.Add(m_erosionParams.SedimentCapacity);
+        Key.Add(m_erosionParams.ErosionRate);
+        Key.Add(m_erosionParams.DepositionRate);
+        Key.Add(m_erosionParams.Evaporation);
     }
+
+    return Key;
 }
 
 
-void MidpointDispTerrain::DiamondStep(int RectSize, float CurHeight)
+template<typename Layout>
+void CreateMidpointDisplacementF32(Array2D<float, Layout>& HeightMap, int TerrainSize, float Roughness, uint Seed, int NumThreads)
 {
-    int HalfRectSize = RectSize / 2;
+    if (TerrainSize < 2) {
+        printf("%s: terrain size must be at least 2 - %d\n", __FUNCTION__, TerrainSize);
+        exit(0);
+    }
 
-    for (int y = 0; y < m_terrainSize; y += RectSize) {
-        for (int x = 0; x < m_terrainSize; x += RectSize) {
-            int next_x = (x + RectSize) % m_terrainSize;
-            int next_y = (y + RectSize) % m_terrainSize;
+    MidpointDispGenerator<Layout> Generator(HeightMap, TerrainSize, Seed, NumThreads);
 
-            if (next_x < x) {
-                next_x = m_terrainSize - 1;
-            }
+    HeightMap.InitArray2D(Generator.GetPaddedSize(), Generator.GetPaddedSize());
 
-            if (next_y < y) {
-                next_y = m_terrainSize - 1;
-            }
+    Generator.Generate(Roughness);
+
+    // Drop the padding - the rows are compacted in place and the allocation shrinks
+    HeightMap.Crop(TerrainSize, TerrainSize);
+}
+
+
+template<typename Layout>
+MidpointDispGenerator<Layout>::MidpointDispGenerator(Array2D<float, Layout>& HeightMap, int TerrainSize, uint Seed, int NumThreads) :
+    m_heightMap(HeightMap), m_terrainSize(TerrainSize), m_seed(Seed), m_numThreads(NumThreads)
+{
+    int NumSegments = TerrainSize - 1;
+
+    // Smallest top level cell that needs no more than MAX_TOP_LEVEL_CELLS cells to cover the terrain
+    m_topRectSize = CalcNextPowerOfTwo(NumSegments);
+
+    while ((m_topRectSize > 1) && ((NumSegments + m_topRectSize / 2 - 1) / (m_topRectSize / 2) <= MAX_TOP_LEVEL_CELLS)) {
+        m_topRectSize /= 2;
+    }
+
+    m_numTopCells = (NumSegments + m_topRectSize - 1) / m_topRectSize;
+    m_paddedSize = m_numTopCells * m_topRectSize + 1;
+}
+
+
+template<typename Layout>
+void MidpointDispGenerator<Layout>::Generate(float Roughness)
+{
+    float HeightReduce = pow(2.0f, -Roughness);
 
-            float TopLeft = m_heightMap.Get(x, y);
-            float TopRight = m_heightMap.Get(next_x, y);
-            float BottomLeft = m_heightMap.Get(x, next_y);
-            float BottomRight = m_heightMap.Get(next_x, next_y);
+    // Start from the amplitude that a single cell over the whole map would have
+    // had so that the roughness keeps the same meaning for every size
+    int RectSize = CalcNextPowerOfTwo(m_terrainSize - 1);
+    float CurHeight = (float)RectSize / 2.0f;
+
+    while (RectSize > m_topRectSize) {
+        RectSize /= 2;
+        CurHeight *= HeightReduce;
+    }
 
-            int mid_x = (x + HalfRectSize) % m_terrainSize;
-            int mid_y = (y + HalfRectSize) % m_terrainSize;
+    InitTopLevel(CurHeight);
 
-            float RandValue = RandomFloatRange(CurHeight, -CurHeight);
-            float MidPoint = (TopLeft + TopRight + BottomLeft + BottomRight) / 4.0f;
+    int Level = 1;
 
-            m_heightMap.Set(mid_x, mid_y, MidPoint + RandValue);
+    while (RectSize > 1) {
+
+        DiamondStep(RectSize, Level, CurHeight);
+
+        SquareStep(RectSize, Level, CurHeight);
+
+        RectSize /= 2;
+        CurHeight *= HeightReduce;
+        Level++;
+    }
+}
+
+
+template<typename Layout>
+void MidpointDispGenerator<Layout>::InitTopLevel(float CurHeight)
+{
+    for (int z = 0; z < m_paddedSize; z += m_topRectSize) {
+        for (int x = 0; x < m_paddedSize; x += m_topRectSize) {
+            m_heightMap.Set(x, z, HashRandomFloatRange(m_seed, 0, x, z, -CurHeight, CurHeight));
         }
     }
 }
 
 
-void MidpointDispTerrain::SquareStep(int RectSize, float CurHeight)
+// The centre of every cell is the average of its four corners plus a random offset.
+// The random offset of every point is keyed by the level and the coordinates of
+// the point so it doesn't depend on the order in which the points are visited.
+template<typename Layout>
+void MidpointDispGenerator<Layout>::DiamondStep(int RectSize, int Level, float CurHeight)
 {
     int HalfRectSize = RectSize / 2;
+    int NumCells = (m_paddedSize - 1) / RectSize;
+    int MinBandRows = (MIN_POINTS_PER_BAND + NumCells - 1) / NumCells;
+
+    GetThreadPool().ParallelFor(0, NumCells, MinBandRows, [&](int RowBegin, int RowEnd) {
+        for (int j = RowBegin; j < RowEnd; j++) {
+            int z = j * RectSize;
+
+            for (int i = 0; i < NumCells; i++) {
+                int x = i * RectSize;
+
+                float TopLeft = m_heightMap.Get(x, z);
+                float TopRight = m_heightMap.Get(x + RectSize, z);
+                float BottomLeft = m_heightMap.Get(x, z + RectSize);
+                float BottomRight = m_heightMap.Get(x + RectSize, z + RectSize);
+
+                int mid_x = x + HalfRectSize;
+                int mid_z = z + HalfRectSize;
 
-    for (int y = 0; y < m_terrainSize; y += RectSize) {
-        for (int x = 0; x < m_terrainSize; x += RectSize) {
-            int next_x = (x + RectSize) % m_terrainSize;
-            int next_y = (y + RectSize) % m_terrainSize;
+                float RandValue = HashRandomFloatRange(m_seed, Level, mid_x, mid_z, -CurHeight, CurHeight);
+                float MidPoint = (TopLeft + TopRight + BottomLeft + BottomRight) / 4.0f;
 
-            if (next_x < x) {
-                next_x = m_terrainSize - 1;
+                m_heightMap.Set(mid_x, mid_z, MidPoint + RandValue);
             }
+        }
+    }, m_numThreads);
+}
+
 
-            if (next_y < y) {
-                next_y = m_terrainSize - 1;
+// The mid points of the cell edges are the average of their (up to four) diamond
+// neighbours - two corners and two cell centres - plus a random offset. They are
+// visited in rows of HalfRectSize: even rows go through the corners and have their
+// points between them, odd rows go through the centres and have their points on
+// the corner columns.
+template<typename Layout>
+void MidpointDispGenerator<Layout>::SquareStep(int RectSize, int Level, float CurHeight)
+{
+    int HalfRectSize = RectSize / 2;
+    int NumRows = (m_paddedSize - 1) / HalfRectSize + 1;
+    int MinBandRows = (MIN_POINTS_PER_BAND + NumRows - 1) / NumRows;
+
+    GetThreadPool().ParallelFor(0, NumRows, MinBandRows, [&](int RowBegin, int RowEnd) {
+        for (int j = RowBegin; j < RowEnd; j++) {
+            int z = j * HalfRectSize;
+            int FirstX = (j % 2 == 0) ? HalfRectSize : 0;
+
+            for (int x = FirstX; x < m_paddedSize; x += RectSize) {
+                SquarePoint(x, z, HalfRectSize, Level, CurHeight);
             }
+        }
+    }, m_numThreads);
+}
 
-            int mid_x = (x + HalfRectSize) % m_terrainSize;
-            int mid_y = (y + HalfRectSize) % m_terrainSize;
 
-            int prev_mid_x = (x - HalfRectSize + m_terrainSize) % m_terrainSize;
-            int prev_mid_y = (y - HalfRectSize + m_terrainSize) % m_terrainSize;
+template<typename Layout>
+void MidpointDispGenerator<Layout>::SquarePoint(int x, int z, int HalfRectSize, int Level, float CurHeight)
+{
+    float Average;
+
+    if ((x >= HalfRectSize) && (x + HalfRectSize < m_paddedSize) && (z >= HalfRectSize) && (z + HalfRectSize < m_paddedSize)) {
+        Average = (m_heightMap.Get(x - HalfRectSize, z) + m_heightMap.Get(x + HalfRectSize, z) +
+                   m_heightMap.Get(x, z - HalfRectSize) + m_heightMap.Get(x, z + HalfRectSize)) / 4.0f;
+    } else {
+        // On the border of the grid one of the neighbours is missing
+        float Sum = 0.0f;
+        int Count = 0;
+
+        if (x >= HalfRectSize) {
+            Sum += m_heightMap.Get(x - HalfRectSize, z);
+            Count++;
+        }
 
-            float CurTopLeft = m_heightMap.Get(x, y);
-            float CurTopRight = m_heightMap.Get(next_x, y);
-            float CurCenter = m_heightMap.Get(mid_x, mid_y);
-            float PrevYCenter = m_heightMap.Get(mid_x, prev_mid_y);
-            float CurBotLeft = m_heightMap.Get(x, next_y);
-            float PrevXCenter = m_heightMap.Get(prev_mid_x, mid_y);
+        if (x + HalfRectSize < m_paddedSize) {
+            Sum += m_heightMap.Get(x + HalfRectSize, z);
+            Count++;
+        }
 
-            float CurLeftMid = (CurTopLeft + CurCenter + CurBotLeft + PrevXCenter) / 4.0f + RandomFloatRange(-CurHeight, CurHeight);
-            float CurTopMid = (CurTopLeft + CurCenter + CurTopRight + PrevYCenter) / 4.0f + RandomFloatRange(-CurHeight, CurHeight);
+        if (z >= HalfRectSize) {
+            Sum += m_heightMap.Get(x, z - HalfRectSize);
+            Count++;
+        }
 
-            m_heightMap.Set(mid_x, y, CurTopMid);
-            m_heightMap.Set(x, mid_y, CurLeftMid);
+        if (z + HalfRectSize < m_paddedSize) {
+            Sum += m_heightMap.Get(x, z + HalfRectSize);
+            Count++;
         }
+
+        Average = Sum / (float)Count;
     }
-}
\ No newline at end of file
+
+    m_heightMap.Set(x, z, Average + HashRandomFloatRange(m_seed, Level, x, z, -CurHeight, CurHeight));
+}
+
+
+// Layouts used by the terrain and by the layout benchmark
+template void CreateMidpointDisplacementF32(Array2D<float, Array2DRowMajor>& HeightMap, int TerrainSize, float Roughness, uint Seed, int NumThreads);
+template void CreateMidpointDisplacementF32(Array2D<float, Array2DTiled<> >& HeightMap, int TerrainSize, float Roughness, uint Seed, int NumThreads);
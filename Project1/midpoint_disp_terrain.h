@@ -2,18 +2,36 @@
 #define MIDPOINT_DISP_TERRAIN_H
 
 #include "terrain.h"
+#include "erosion.h"
 
 class MidpointDispTerrain : public BaseTerrain {
 
 public:
     MidpointDispTerrain() {}
 
-    void CreateMidpointDisplacement(int Size, int PatchSize, float Roughness, float MinHeight, float MaxHeight);
+    void CreateMidpointDisplacement(int Size, int PatchSize, float Roughness, float MinHeight, float MaxHeight, uint Seed);
+
+    // Same terrain as CreateMidpointDisplacement but built on a background thread while
+    // the current one keeps rendering. UpdateAsyncBuild swaps it in when it is ready.
+    bool CreateMidpointDisplacementAsync(int Size, int PatchSize, float Roughness, float MinHeight, float MaxHeight, uint Seed);
+
+    // 0 - use all the threads of the shared pool, 1 - generate serially
+    void SetNumThreads(int NumThreads) { m_numThreads = NumThreads; }
+
+    // Erosion that runs on the normalized height map - off by default
+    void SetErosionParams(const ErosionParams& Params) { m_erosionParams = Params; }
 
 private:
-    void CreateMidpointDisplacementF32(float Roughness);
-    void DiamondStep(int RectSize, float CurHeight);
-    void SquareStep(int RectSize, float CurHeight);
+    TerrainCacheKey GetCacheKey(int TerrainSize, int PatchSize, float Roughness, float MinHeight, float MaxHeight, uint Seed) const;
+
+    int m_numThreads = 0;
+    ErosionParams m_erosionParams;
 };
 
-#endif
\ No newline at end of file
+
+// Diamond-square into a height map of any layout, before normalization. Instantiated
+// for the row major layout used by the terrain and for Array2DTiled<>.
+template<typename Layout>
+void CreateMidpointDisplacementF32(Array2D<float, Layout>& HeightMap, int TerrainSize, float Roughness, uint Seed, int NumThreads);
+
+#endif
@@ -0,0 +1,363 @@
+#include <string.h>
+#include <algorithm>
+
+#include "noise_terrain.h"
+#include "thread_pool.h"
+#include "simd_utils.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Skew/unskew factors between the square grid and the simplex (triangle) grid
+#define F2 0.36602540378f   // (sqrt(3) - 1) / 2
+#define G2 0.21132486540f   // (3 - sqrt(3)) / 6
+
+// Scales the sum of the three corner contributions to roughly [-1, 1]
+#define SIMPLEX_SCALE 70.0f
+
+// Eight gradient directions picked by the low bits of the lattice hash
+static const float s_gradX[8] = { 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 0.0f,  0.0f };
+static const float s_gradY[8] = { 1.0f,  1.0f, -1.0f, -1.0f, 0.0f, 0.0f, 1.0f, -1.0f };
+
+
+static void ValidateParams(const NoiseParams& Params)
+{
+    if (Params.Octaves < 1) {
+        printf("%s: number of octaves must be at least one - %d\n", __FUNCTION__, Params.Octaves);
+        exit(0);
+    }
+
+    if (Params.Frequency <= 0.0f) {
+        printf("%s: frequency must be positive - %f\n", __FUNCTION__, Params.Frequency);
+        exit(0);
+    }
+}
+
+
+static inline u32 OctaveSeed(u32 Seed, int Octave)
+{
+    return HashU32(Seed + (u32)Octave * 0x632BE5ABu);
+}
+
+
+//
+// Scalar implementation - used when the CPU doesn't have AVX2
+//
+
+static inline u32 LatticeHash(u32 Seed, int i, int j)
+{
+    return HashU32((Seed + (u32)i * 0x9E3779B1u) ^ ((u32)j * 0x85EBCA77u));
+}
+
+
+static inline float SimplexCorner(u32 Hash, float x, float y)
+{
+    float t = 0.5f - x * x - y * y;
+    t = std::max(t, 0.0f);
+    t = t * t;
+
+    int g = Hash & 7;
+
+    return t * t * (s_gradX[g] * x + s_gradY[g] * y);
+}
+
+
+static float Simplex2D(float x, float y, u32 Seed)
+{
+    float s = (x + y) * F2;
+    float fi = floorf(x + s);
+    float fj = floorf(y + s);
+
+    float t = (fi + fj) * G2;
+    float x0 = x - (fi - t);
+    float y0 = y - (fj - t);
+
+    // Which of the two triangles of the cell we are in
+    float i1 = (x0 > y0) ? 1.0f : 0.0f;
+    float j1 = 1.0f - i1;
+
+    float x1 = x0 - i1 + G2;
+    float y1 = y0 - j1 + G2;
+    float x2 = x0 - 1.0f + 2.0f * G2;
+    float y2 = y0 - 1.0f + 2.0f * G2;
+
+    int i = (int)fi;
+    int j = (int)fj;
+
+    float n = SimplexCorner(LatticeHash(Seed, i, j), x0, y0) +
+              SimplexCorner(LatticeHash(Seed, i + (int)i1, j + (int)j1), x1, y1) +
+              SimplexCorner(LatticeHash(Seed, i + 1, j + 1), x2, y2);
+
+    return SIMPLEX_SCALE * n;
+}
+
+
+static float FractalSample(float x, float z, const NoiseParams& Params)
+{
+    float Sum = 0.0f;
+    float Amplitude = 1.0f;
+    float AmplitudeSum = 0.0f;
+    float Frequency = Params.Frequency;
+
+    for (int Octave = 0; Octave < Params.Octaves; Octave++) {
+        float n = Simplex2D(x * Frequency, z * Frequency, OctaveSeed(Params.Seed, Octave));
+
+        switch (Params.Type) {
+        case NOISE_TYPE_RIDGED:
+            n = 1.0f - fabsf(n);
+            n = n * n * 2.0f - 1.0f;
+            break;
+
+        case NOISE_TYPE_BILLOW:
+            n = fabsf(n) * 2.0f - 1.0f;
+            break;
+
+        default:
+            break;
+        }
+
+        Sum += n * Amplitude;
+        AmplitudeSum += Amplitude;
+        Amplitude *= Params.Gain;
+        Frequency *= Params.Lacunarity;
+    }
+
+    return Sum / AmplitudeSum;
+}
+
+
+static void GenerateRow_Scalar(float* pDst, int Count, int OriginX, int z, const NoiseParams& Params)
+{
+    for (int i = 0; i < Count; i++) {
+        pDst[i] = FractalSample((float)(OriginX + i), (float)z, Params);
+    }
+}
+
+
+//
+// AVX2 implementation - eight samples of a row at a time
+//
+
+#ifdef SIMD_X86
+
+SIMD_TARGET_AVX2 static inline __m256i HashU32_AVX2(__m256i h)
+{
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0x85EBCA6Bu));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0xC2B2AE35u));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+
+    return h;
+}
+
+
+SIMD_TARGET_AVX2 static inline __m256i LatticeHash_AVX2(__m256i Seed, __m256i i, __m256i j)
+{
+    __m256i a = _mm256_add_epi32(Seed, _mm256_mullo_epi32(i, _mm256_set1_epi32((int)0x9E3779B1u)));
+    __m256i b = _mm256_mullo_epi32(j, _mm256_set1_epi32((int)0x85EBCA77u));
+
+    return HashU32_AVX2(_mm256_xor_si256(a, b));
+}
+
+
+SIMD_TARGET_AVX2 static inline __m256 SimplexCorner_AVX2(__m256i Hash, __m256 x, __m256 y)
+{
+    __m256 t = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(0.5f), _mm256_mul_ps(x, x)), _mm256_mul_ps(y, y));
+    t = _mm256_max_ps(t, _mm256_setzero_ps());
+    t = _mm256_mul_ps(t, t);
+
+    __m256i g = _mm256_and_si256(Hash, _mm256_set1_epi32(7));
+    __m256 gx = _mm256_permutevar8x32_ps(_mm256_loadu_ps(s_gradX), g);
+    __m256 gy = _mm256_permutevar8x32_ps(_mm256_loadu_ps(s_gradY), g);
+
+    __m256 Dot = _mm256_add_ps(_mm256_mul_ps(gx, x), _mm256_mul_ps(gy, y));
+
+    return _mm256_mul_ps(_mm256_mul_ps(t, t), Dot);
+}
+
+
+SIMD_TARGET_AVX2 static __m256 Simplex2D_AVX2(__m256 x, __m256 y, u32 Seed)
+{
+    const __m256 One = _mm256_set1_ps(1.0f);
+    const __m256 vG2 = _mm256_set1_ps(G2);
+
+    __m256 s = _mm256_mul_ps(_mm256_add_ps(x, y), _mm256_set1_ps(F2));
+    __m256 fi = _mm256_floor_ps(_mm256_add_ps(x, s));
+    __m256 fj = _mm256_floor_ps(_mm256_add_ps(y, s));
+
+    __m256 t = _mm256_mul_ps(_mm256_add_ps(fi, fj), vG2);
+    __m256 x0 = _mm256_sub_ps(x, _mm256_sub_ps(fi, t));
+    __m256 y0 = _mm256_sub_ps(y, _mm256_sub_ps(fj, t));
+
+    __m256 Upper = _mm256_cmp_ps(x0, y0, _CMP_GT_OQ);
+    __m256 i1 = _mm256_and_ps(Upper, One);
+    __m256 j1 = _mm256_sub_ps(One, i1);
+
+    __m256 x1 = _mm256_add_ps(_mm256_sub_ps(x0, i1), vG2);
+    __m256 y1 = _mm256_add_ps(_mm256_sub_ps(y0, j1), vG2);
+    __m256 x2 = _mm256_add_ps(_mm256_sub_ps(x0, One), _mm256_set1_ps(2.0f * G2));
+    __m256 y2 = _mm256_add_ps(_mm256_sub_ps(y0, One), _mm256_set1_ps(2.0f * G2));
+
+    __m256i vSeed = _mm256_set1_epi32((int)Seed);
+    __m256i i = _mm256_cvtps_epi32(fi);
+    __m256i j = _mm256_cvtps_epi32(fj);
+    __m256i iOne = _mm256_set1_epi32(1);
+
+    __m256 n = SimplexCorner_AVX2(LatticeHash_AVX2(vSeed, i, j), x0, y0);
+    n = _mm256_add_ps(n, SimplexCorner_AVX2(LatticeHash_AVX2(vSeed, _mm256_add_epi32(i, _mm256_cvtps_epi32(i1)), _mm256_add_epi32(j, _mm256_cvtps_epi32(j1))), x1, y1));
+    n = _mm256_add_ps(n, SimplexCorner_AVX2(LatticeHash_AVX2(vSeed, _mm256_add_epi32(i, iOne), _mm256_add_epi32(j, iOne)), x2, y2));
+
+    return _mm256_mul_ps(n, _mm256_set1_ps(SIMPLEX_SCALE));
+}
+
+
+SIMD_TARGET_AVX2 static __m256 FractalSample_AVX2(__m256 x, __m256 z, const NoiseParams& Params)
+{
+    const __m256 AbsMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 One = _mm256_set1_ps(1.0f);
+    const __m256 Two = _mm256_set1_ps(2.0f);
+
+    __m256 Sum = _mm256_setzero_ps();
+    float Amplitude = 1.0f;
+    float AmplitudeSum = 0.0f;
+    float Frequency = Params.Frequency;
+
+    for (int Octave = 0; Octave < Params.Octaves; Octave++) {
+        __m256 vFreq = _mm256_set1_ps(Frequency);
+        __m256 n = Simplex2D_AVX2(_mm256_mul_ps(x, vFreq), _mm256_mul_ps(z, vFreq), OctaveSeed(Params.Seed, Octave));
+
+        switch (Params.Type) {
+        case NOISE_TYPE_RIDGED:
+            n = _mm256_sub_ps(One, _mm256_and_ps(n, AbsMask));
+            n = _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(n, n), Two), One);
+            break;
+
+        case NOISE_TYPE_BILLOW:
+            n = _mm256_sub_ps(_mm256_mul_ps(_mm256_and_ps(n, AbsMask), Two), One);
+            break;
+
+        default:
+            break;
+        }
+
+        Sum = _mm256_add_ps(Sum, _mm256_mul_ps(n, _mm256_set1_ps(Amplitude)));
+        AmplitudeSum += Amplitude;
+        Amplitude *= Params.Gain;
+        Frequency *= Params.Lacunarity;
+    }
+
+    return _mm256_div_ps(Sum, _mm256_set1_ps(AmplitudeSum));
+}
+
+
+SIMD_TARGET_AVX2 static void GenerateRow_AVX2(float* pDst, int Count, int OriginX, int z, const NoiseParams& Params)
+{
+    const __m256i Lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 vz = _mm256_set1_ps((float)z);
+
+    for (int i = 0; i < Count; i += 8) {
+        __m256 vx = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(OriginX + i), Lanes));
+        __m256 v = FractalSample_AVX2(vx, vz, Params);
+
+        if (i + 8 <= Count) {
+            _mm256_storeu_ps(pDst + i, v);
+        }
+        else {
+            // The tail goes through the same code path so that every sample is computed
+            // identically no matter where it falls in the tile - keeps the tile edges exact
+            float Temp[8];
+            _mm256_storeu_ps(Temp, v);
+            memcpy(pDst + i, Temp, (Count - i) * sizeof(float));
+        }
+    }
+}
+
+#endif
+
+
+static void GenerateRow(float* pDst, int Count, int OriginX, int z, const NoiseParams& Params)
+{
+#ifdef SIMD_X86
+    if (GetSimdLevel() == SIMD_LEVEL_AVX2) {
+        GenerateRow_AVX2(pDst, Count, OriginX, z, Params);
+        return;
+    }
+#endif
+
+    GenerateRow_Scalar(pDst, Count, OriginX, z, Params);
+}
+
+
+void NoiseTerrain::GenerateTile(Array2D<float>& HeightMap, int OriginX, int OriginZ, const NoiseParams& Params)
+{
+    ValidateParams(Params);
+
+    int Cols = HeightMap.GetCols();
+    int Rows = HeightMap.GetRows();
+
+    // Rows are independent so they are simply spread across the pool
+    GetThreadPool().ParallelFor(0, Rows, 4, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            GenerateRow(HeightMap.GetAddr(0, z), Cols, OriginX, OriginZ + z, Params);
+        }
+    });
+}
+
+
+void NoiseTerrain::CreateNoiseTerrain(int TerrainSize, int PatchSize, const NoiseParams& Params, float MinHeight, float MaxHeight)
+{
+    if (LoadFromCache(GetCacheKey(TerrainSize, PatchSize, Params, MinHeight, MaxHeight))) {
+        return;
+    }
+
+    m_terrainSize = TerrainSize;
+    m_patchSize = PatchSize;
+
+    SetMinMaxHeight(MinHeight, MaxHeight);
+
+    long long StartTime = GetCurrentTimeMillis();
+
+    m_heightMap.InitArray2D(TerrainSize, TerrainSize);
+
+    GenerateTile(m_heightMap, 0, 0, Params);
+
+    m_heightMap.Normalize(MinHeight, MaxHeight);
+
+    printf("Noise terrain %dx%d (%d octaves) generated in %lld ms\n", TerrainSize, TerrainSize, Params.Octaves, GetCurrentTimeMillis() - StartTime);
+
+    Finalize();
+}
+
+
+bool NoiseTerrain::CreateNoiseTerrainAsync(int TerrainSize, int PatchSize, const NoiseParams& Params, float MinHeight, float MaxHeight)
+{
+    ValidateParams(Params);
+
+    if (LoadFromCache(GetCacheKey(TerrainSize, PatchSize, Params, MinHeight, MaxHeight))) {
+        return true;
+    }
+
+    NoiseParams ParamsCopy = Params;
+
+    return StartAsyncBuild(TerrainSize, PatchSize, MinHeight, MaxHeight, [=](Array2D<float>& HeightMap) {
+        HeightMap.InitArray2D(TerrainSize, TerrainSize);
+        GenerateTile(HeightMap, 0, 0, ParamsCopy);
+        HeightMap.Normalize(MinHeight, MaxHeight);
+    });
+}
+
+
+TerrainCacheKey NoiseTerrain::GetCacheKey(int TerrainSize, int PatchSize, const NoiseParams& Params, float MinHeight, float MaxHeight) const
+{
+    TerrainCacheKey Key = BaseTerrain::GetCacheKey("noise", TerrainSize, PatchSize, MinHeight, MaxHeight);
+    Key.Add((int)Params.Type);
+    Key.Add(Params.Octaves);
+    Key.Add(Params.Frequency);
+    Key.Add(Params.Lacunarity);
+    Key.Add(Params.Gain);
+    Key.Add(Params.Seed);
+
+    return Key;
+}
\ No newline at end of file
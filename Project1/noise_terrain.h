@@ -0,0 +1,43 @@
+#ifndef NOISE_TERRAIN_H
+#define NOISE_TERRAIN_H
+
+#include "terrain.h"
+
+enum NOISE_TYPE {
+    NOISE_TYPE_FBM = 0,       // plain sum of simplex octaves - rolling hills
+    NOISE_TYPE_RIDGED = 1,    // inverted absolute value - sharp mountain ridges
+    NOISE_TYPE_BILLOW = 2     // absolute value - rounded, puffy shapes
+};
+
+struct NoiseParams {
+    NOISE_TYPE Type = NOISE_TYPE_FBM;
+    int Octaves = 8;
+    float Frequency = 1.0f / 256.0f;   // of the first octave, in cycles per height map sample
+    float Lacunarity = 2.0f;           // frequency multiplier between octaves
+    float Gain = 0.5f;                 // amplitude multiplier between octaves
+    uint Seed = 0;
+};
+
+// Height maps made of multi-octave simplex noise. Every sample is a pure function
+// of its coordinates, so unlike diamond-square there is no power-of-two size and
+// no dependency between levels - any rectangle of the (unbounded) noise field can
+// be generated on its own and neighbouring tiles line up exactly.
+class NoiseTerrain : public BaseTerrain {
+
+public:
+    NoiseTerrain() {}
+
+    void CreateNoiseTerrain(int TerrainSize, int PatchSize, const NoiseParams& Params, float MinHeight, float MaxHeight);
+
+    bool CreateNoiseTerrainAsync(int TerrainSize, int PatchSize, const NoiseParams& Params, float MinHeight, float MaxHeight);
+
+    // Fills the (already allocated) height map with the tile of the noise field whose
+    // first sample is at (OriginX, OriginZ). Values are roughly in [-1, 1] and are not
+    // normalized so that separately generated tiles match along their edges.
+    static void GenerateTile(Array2D<float>& HeightMap, int OriginX, int OriginZ, const NoiseParams& Params);
+
+private:
+    TerrainCacheKey GetCacheKey(int TerrainSize, int PatchSize, const NoiseParams& Params, float MinHeight, float MaxHeight) const;
+};
+
+#endif
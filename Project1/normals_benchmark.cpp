@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "normals_benchmark.h"
+#include "height_map_normals.h"
+#include "midpoint_disp_terrain.h"
+#include "ogldev_util.h"
+
+#define NUM_BENCHMARK_RUNS 5
+#define BENCHMARK_WORLD_SCALE 20.0f
+
+// The SIMD and the scalar code round differently so a normal can be off in the last bits
+#define MAX_NORMAL_ERROR 1e-5f
+
+
+static long long CalcNormalsSerial(const Array2D<float>& HeightMap, std::vector<Vector3f>& Normals)
+{
+    long long Start = GetCurrentTimeMillis();
+
+    for (int z = 0; z < HeightMap.GetRows(); z++) {
+        CalcHeightMapNormalRow(HeightMap, BENCHMARK_WORLD_SCALE, z, 0, HeightMap.GetCols(), &Normals[(size_t)z * HeightMap.GetCols()]);
+    }
+
+    return GetCurrentTimeMillis() - Start;
+}
+
+
+static long long CalcNormalsParallel(const Array2D<float>& HeightMap, std::vector<Vector3f>& Normals)
+{
+    long long Start = GetCurrentTimeMillis();
+
+    CalcHeightMapNormals(HeightMap, BENCHMARK_WORLD_SCALE, 0, 0, HeightMap.GetCols(), HeightMap.GetRows(), &Normals[0], HeightMap.GetCols());
+
+    return GetCurrentTimeMillis() - Start;
+}
+
+
+static float CalcMaxError(const std::vector<Vector3f>& Normals, const std::vector<Vector3f>& Expected)
+{
+    float MaxError = 0.0f;
+
+    for (size_t i = 0; i < Normals.size(); i++) {
+        MaxError = std::max(MaxError, fabsf(Normals[i].x - Expected[i].x));
+        MaxError = std::max(MaxError, fabsf(Normals[i].y - Expected[i].y));
+        MaxError = std::max(MaxError, fabsf(Normals[i].z - Expected[i].z));
+    }
+
+    return MaxError;
+}
+
+
+// Raises a bump in [x0, x1) x [z0, z1), recomputes the normals of the rectangle
+// grown by one sample in place and compares all of them with a full pass
+static bool VerifyDirtyRegion(Array2D<float>& HeightMap, std::vector<Vector3f>& Normals, int x0, int z0, int x1, int z1)
+{
+    for (int z = z0; z < z1; z++) {
+        for (int x = x0; x < x1; x++) {
+            HeightMap.Set(x, z, HeightMap.Get(x, z) + 10.0f + (float)((x * 7 + z * 13) % 17));
+        }
+    }
+
+    int Cols = HeightMap.GetCols();
+    int MinX = std::max(x0 - 1, 0);
+    int MinZ = std::max(z0 - 1, 0);
+    int MaxX = std::min(x1 + 1, Cols);
+    int MaxZ = std::min(z1 + 1, HeightMap.GetRows());
+
+    CalcHeightMapNormals(HeightMap, BENCHMARK_WORLD_SCALE, MinX, MinZ, MaxX, MaxZ, &Normals[(size_t)MinZ * Cols + MinX], Cols);
+
+    std::vector<Vector3f> Expected(Normals.size());
+    CalcNormalsParallel(HeightMap, Expected);
+
+    float MaxError = CalcMaxError(Normals, Expected);
+
+    if (MaxError > MAX_NORMAL_ERROR) {
+        printf("Normals of the region [%d, %d) x [%d, %d) differ from a full pass by %g\n", x0, x1, z0, z1, MaxError);
+        return false;
+    }
+
+    return true;
+}
+
+
+void RunNormalsBenchmark(int TerrainSize)
+{
+    printf("Height map normals benchmark - %dx%d, best of %d runs\n", TerrainSize, TerrainSize, NUM_BENCHMARK_RUNS);
+
+    Array2D<float> HeightMap;
+    CreateMidpointDisplacementF32(HeightMap, TerrainSize, 1.0f, 1234, 0);
+    HeightMap.Normalize(0.0f, 400.0f);
+
+    std::vector<Vector3f> Normals((size_t)TerrainSize * TerrainSize);
+    std::vector<Vector3f> SerialNormals(Normals.size());
+
+    long long SerialTime = -1;
+    long long ParallelTime = -1;
+
+    for (int i = 0; i < NUM_BENCHMARK_RUNS; i++) {
+        long long Serial = CalcNormalsSerial(HeightMap, SerialNormals);
+        long long Parallel = CalcNormalsParallel(HeightMap, Normals);
+
+        if ((SerialTime < 0) || (Serial < SerialTime)) {
+            SerialTime = Serial;
+        }
+
+        if ((ParallelTime < 0) || (Parallel < ParallelTime)) {
+            ParallelTime = Parallel;
+        }
+    }
+
+    if (CalcMaxError(Normals, SerialNormals) > MAX_NORMAL_ERROR) {
+        printf("The pool and the single thread normals differ\n");
+        exit(0);
+    }
+
+    // Inside the map, on its edges and on a corner
+    int Quarter = TerrainSize / 4;
+
+    if (!VerifyDirtyRegion(HeightMap, Normals, Quarter, Quarter + 3, 2 * Quarter + 5, 2 * Quarter) ||
+        !VerifyDirtyRegion(HeightMap, Normals, 0, Quarter, Quarter, Quarter + 9) ||
+        !VerifyDirtyRegion(HeightMap, Normals, TerrainSize - Quarter, TerrainSize - 11, TerrainSize, TerrainSize)) {
+        exit(0);
+    }
+
+    double NumMillions = (double)TerrainSize * TerrainSize / 1000000.0;
+
+    printf("Dirty regions match a full pass\n");
+    printf("%-32s %8lld ms %10.1f M normals/s\n", "normals (1 thread)", SerialTime, NumMillions / ((double)std::max(SerialTime, 1LL) / 1000.0));
+    printf("%-32s %8lld ms %10.1f M normals/s\n", "normals (pool)", ParallelTime, NumMillions / ((double)std::max(ParallelTime, 1LL) / 1000.0));
+}
@@ -0,0 +1,10 @@
+#ifndef NORMALS_BENCHMARK_H
+#define NORMALS_BENCHMARK_H
+
+// Times the normals of a generated height map (see height_map_normals.h) on one
+// thread and on the whole pool, then changes the heights in a rectangle, redoes
+// only the normals around it and checks them against a pass over the whole map.
+// Doesn't need a GL context - run it with --bench-normals [size].
+void RunNormalsBenchmark(int TerrainSize);
+
+#endif
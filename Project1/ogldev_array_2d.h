@@ -3,11 +3,63 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
 
-template<typename Type>
+#include "simd_utils.h"
+#include "mapped_file.h"
+
+// Memory layouts - map (Col, Row) to the position of the element in the allocation
+
+// Plain row major order. Rows are contiguous so GetAddr(0, Row) can be used as a
+// pointer to a whole row - the rest of the code relies on that for float height maps.
+struct Array2DRowMajor {
+    static const bool IsRowMajor = true;
+
+    static size_t CalcAllocSize(int Cols, int Rows)
+    {
+        return (size_t)Cols * Rows;
+    }
+
+    static size_t CalcIndex(int Col, int Row, int Cols)
+    {
+        return (size_t)Row * Cols + Col;
+    }
+};
+
+
+// Square blocks of (1 << BlockBits) samples per side stored one after the other
+// (blocks in row major order, samples inside a block in row major order). Samples
+// that are close in both directions share cache lines and pages, which helps the
+// large strides of diamond-square and patch by patch traversals of big maps.
+// The allocation is padded up to whole blocks.
+template<int BlockBits = 5>
+struct Array2DTiled {
+    static const bool IsRowMajor = false;
+    static const int BlockSize = 1 << BlockBits;
+
+    static int CalcNumBlocks(int Count)
+    {
+        return (Count + BlockSize - 1) >> BlockBits;
+    }
+
+    static size_t CalcAllocSize(int Cols, int Rows)
+    {
+        return (size_t)CalcNumBlocks(Cols) * CalcNumBlocks(Rows) * BlockSize * BlockSize;
+    }
+
+    static size_t CalcIndex(int Col, int Row, int Cols)
+    {
+        size_t Block = (size_t)(Row >> BlockBits) * CalcNumBlocks(Cols) + (Col >> BlockBits);
+
+        return (Block << (2 * BlockBits)) + ((Row & (BlockSize - 1)) << BlockBits) + (Col & (BlockSize - 1));
+    }
+};
+
+
+template<typename Type, typename Layout = Array2DRowMajor>
 class Array2D {
 public:
     Array2D() {}
@@ -20,14 +72,12 @@ public:
 
     void InitArray2D(int Cols, int Rows)
     {
+        Destroy();
+
         m_cols = Cols;
         m_rows = Rows;
 
-        if (m_p) {
-            free(m_p);
-        }
-
-        m_p = (Type*)malloc(Cols * Rows * sizeof(Type));
+        m_p = (Type*)malloc(Layout::CalcAllocSize(Cols, Rows) * sizeof(Type));
     }
 
 
@@ -35,22 +85,60 @@ public:
     {
         InitArray2D(Cols, Rows);
 
-        for (int i = 0; i < Cols * Rows; i++) {
+        size_t AllocSize = Layout::CalcAllocSize(Cols, Rows);
+
+        for (size_t i = 0; i < AllocSize; i++) {
             m_p[i] = InitVal;
         }
     }
 
 
+    // pData must be laid out according to Layout (e.g. row major for the default)
     void InitArray2D(int Cols, int Rows, void* pData)
     {
+        Destroy();
+
         m_cols = Cols;
         m_rows = Rows;
 
-        if (m_p) {
-            free(m_p);
+        m_p = (Type*)pData;
+    }
+
+
+    // Maps Cols x Rows elements stored (in the order of Layout) at Offset in the file
+    // instead of reading them - see mapped_file.h. Loading takes the same time for any
+    // size and the pages are read when they are first accessed. Changes stay in memory.
+    void InitArray2DMapped(int Cols, int Rows, const char* pFilename, size_t Offset = 0)
+    {
+        Destroy();
+
+        m_cols = Cols;
+        m_rows = Rows;
+
+        m_p = (Type*)MapFile(pFilename, Offset, Layout::CalcAllocSize(Cols, Rows) * sizeof(Type), m_pMapping, m_mappingSize);
+    }
+
+
+    bool IsMapped() const
+    {
+        return m_pMapping != NULL;
+    }
+
+
+    // Starts reading the given rows of a mapped array in the background. Only row
+    // major arrays have whole rows in one range - for the other layouts it does nothing.
+    void PrefetchRows(int FirstRow, int NumRows) const
+    {
+        if (!m_pMapping || !Layout::IsRowMajor) {
+            return;
         }
 
-        m_p = (Type*)pData;
+        int Begin = FirstRow < 0 ? 0 : FirstRow;
+        int End = FirstRow + NumRows > m_rows ? m_rows : FirstRow + NumRows;
+
+        if (Begin < End) {
+            PrefetchMappedRange(m_p + (size_t)Begin * m_cols, (size_t)(End - Begin) * m_cols * sizeof(Type));
+        }
     }
 
 
@@ -62,12 +150,81 @@ public:
 
     void Destroy()
     {
-        if (m_p) {
+        if (m_pMapping) {
+            UnmapFile(m_pMapping, m_mappingSize);
+            m_pMapping = NULL;
+            m_mappingSize = 0;
+        } else if (m_p) {
             free(m_p);
-            m_p = NULL;
+        }
+
+        m_p = NULL;
+        m_cols = 0;
+        m_rows = 0;
+    }
+
+
+    // Exchanges the contents of two arrays without copying the data
+    void Swap(Array2D& Other)
+    {
+        Type* p = m_p;
+        m_p = Other.m_p;
+        Other.m_p = p;
+
+        int Cols = m_cols;
+        m_cols = Other.m_cols;
+        Other.m_cols = Cols;
+
+        int Rows = m_rows;
+        m_rows = Other.m_rows;
+        Other.m_rows = Rows;
+
+        void* pMapping = m_pMapping;
+        m_pMapping = Other.m_pMapping;
+        Other.m_pMapping = pMapping;
+
+        size_t MappingSize = m_mappingSize;
+        m_mappingSize = Other.m_mappingSize;
+        Other.m_mappingSize = MappingSize;
+    }
+
+    // Keeps the top left Cols x Rows elements and releases the rest of the memory.
+    // Elements must be trivially copyable.
+    void Crop(int Cols, int Rows)
+    {
+        if ((Cols > m_cols) || (Rows > m_rows)) {
+            printf("%s:%d - can't crop %dx%d to a bigger size %dx%d\n", __FILE__, __LINE__, m_cols, m_rows, Cols, Rows);
+            exit(0);
+        }
+
+        if (Layout::IsRowMajor && !m_pMapping) {
+            // Every row moves to a lower (or the same) address so it can be done in place
+            for (int Row = 1; Row < Rows; Row++) {
+                memmove(m_p + (size_t)Row * Cols, m_p + (size_t)Row * m_cols, Cols * sizeof(Type));
+            }
+
+            Type* p = (Type*)realloc(m_p, Layout::CalcAllocSize(Cols, Rows) * sizeof(Type));
+
+            if (p) {
+                m_p = p;
+            }
+
+            m_cols = Cols;
+            m_rows = Rows;
+        } else {
+            Array2D Cropped(Cols, Rows);
+
+            for (int Row = 0; Row < Rows; Row++) {
+                for (int Col = 0; Col < Cols; Col++) {
+                    Cropped.At(Col, Row) = Get(Col, Row);
+                }
+            }
+
+            Swap(Cropped);
         }
     }
 
+
     Type* GetAddr(int Col, int Row) const
     {
         size_t Index = CalcIndex(Col, Row);
@@ -82,13 +239,25 @@ public:
     }
 
 
-    int GetSize() const
+    size_t GetSize() const
+    {
+        return (size_t)m_rows * m_cols;
+    }
+
+
+    int GetCols() const
+    {
+        return m_cols;
+    }
+
+
+    int GetRows() const
     {
-        return m_rows * m_cols;
+        return m_rows;
     }
 
 
-    int GetSizeInBytes() const
+    size_t GetSizeInBytes() const
     {
         return GetSize() * sizeof(Type);
     }
@@ -100,6 +269,7 @@ public:
     }
 
 
+    // Index is the position in memory - same as Row * Cols + Col only for the row major layout
     const Type& Get(int Index) const
     {
 #ifndef NDEBUG
@@ -141,15 +311,19 @@ public:
 
     void GetMinMax(Type& Min, Type& Max)
     {
-        Max = Min = m_p[0];
+        Max = Min = Get(0, 0);
 
-        for (int i = 1; i < m_rows * m_cols; i++) {
-            if (m_p[i] < Min) {
-                Min = m_p[i];
-            }
+        for (int y = 0; y < m_rows; y++) {
+            for (int x = 0; x < m_cols; x++) {
+                const Type& Val = Get(x, y);
 
-            if (m_p[i] > Max) {
-                Max = m_p[i];
+                if (Val < Min) {
+                    Min = Val;
+                }
+
+                if (Val > Max) {
+                    Max = Val;
+                }
             }
         }
     }
@@ -168,8 +342,11 @@ public:
         Type MinMaxDelta = Max - Min;
         Type MinMaxRange = MaxRange - MinRange;
 
-        for (int i = 0; i < m_rows * m_cols; i++) {
-            m_p[i] = ((m_p[i] - Min) / MinMaxDelta) * MinMaxRange + MinRange;
+        for (int y = 0; y < m_rows; y++) {
+            for (int x = 0; x < m_cols; x++) {
+                Type& Val = At(x, y);
+                Val = ((Val - Min) / MinMaxDelta) * MinMaxRange + MinRange;
+            }
         }
     }
 
@@ -179,7 +356,7 @@ public:
         for (int y = 0; y < m_rows; y++) {
             printf("%d: ", y);
             for (int x = 0; x < m_cols; x++) {
-                float f = (float)m_p[y * m_cols + x];
+                float f = (float)Get(x, y);
                 printf("%.6f ", f);
             }
             printf("\n");
@@ -209,7 +386,7 @@ private:
             exit(0);
         }
 #endif
-        size_t Index = Row * m_cols + Col;
+        size_t Index = Layout::CalcIndex(Col, Row, m_cols);
 
         return Index;
     }
@@ -217,7 +394,27 @@ private:
     Type* m_p = NULL;
     int m_cols = 0;
     int m_rows = 0;
+    void* m_pMapping = NULL;     // set when m_p points into a mapped file
+    size_t m_mappingSize = 0;
 };
 
 
+// Height maps are float arrays and these two run over every sample after each
+// terrain generation so they go through the SIMD (and for big maps, multithreaded) kernels.
+// Only for the row major layout - the other layouts have padding that must be skipped.
+
+template<>
+inline void Array2D<float, Array2DRowMajor>::GetMinMax(float& Min, float& Max)
+{
+    MinMaxF32(m_p, GetSize(), Min, Max);
+}
+
+
+template<>
+inline void Array2D<float, Array2DRowMajor>::Normalize(float MinRange, float MaxRange)
+{
+    NormalizeF32(m_p, GetSize(), MinRange, MaxRange);
+}
+
+
 #endif
\ No newline at end of file
@@ -24,6 +24,41 @@
 float RandomFloat();
 float RandomFloatRange(float Start, float End);
 
+// Counter based random numbers. Unlike RandomFloat() there is no global state -
+// the same (Seed, Level, x, z) always gives the same value, no matter in which
+// order or on which thread the values are requested. Only integer multiplies,
+// xors and shifts so it maps directly to SIMD lanes.
+inline u32 HashU32(u32 h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+inline u32 HashRandomU32(u32 Seed, u32 Level, u32 x, u32 z)
+{
+    u32 h = HashU32(Seed ^ (Level * 0x9E3779B9u));
+    h = HashU32(h ^ (x * 0x85EBCA77u));
+    h = HashU32(h ^ (z * 0xC2B2AE3Du));
+
+    return h;
+}
+
+// Returns a value in [0, 1) - the top 24 bits are exactly representable as a float
+inline float HashRandomFloat(u32 Seed, u32 Level, u32 x, u32 z)
+{
+    return (float)(HashRandomU32(Seed, Level, x, z) >> 8) * (1.0f / 16777216.0f);
+}
+
+inline float HashRandomFloatRange(u32 Seed, u32 Level, u32 x, u32 z, float Start, float End)
+{
+    return HashRandomFloat(Seed, Level, x, z) * (End - Start) + Start;
+}
+
 struct Vector2i
 {
     int x;
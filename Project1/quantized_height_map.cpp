@@ -0,0 +1,241 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "quantized_height_map.h"
+#include "thread_pool.h"
+
+// Rows handed to a thread at a time
+#define MIN_ROWS_PER_BAND 16
+
+// Stored in front of the patch bases in TERRAIN_SECTION_QUANTIZED_PATCHES
+struct QuantizedPatchHeader {
+    i32 PatchSize = 0;
+    i32 NumPatchesX = 0;
+    i32 NumPatchesZ = 0;
+    float Step = 0.0f;
+    float Origin = 0.0f;
+    float MaxError = 0.0f;
+};
+
+
+void QuantizedHeightMap::InitPatches(int Width, int Depth, int PatchSize)
+{
+    // Same patches as the geomip grid - the last ones may stick out of the map
+    m_patchSize = PatchSize;
+    m_numPatchesX = (Width - 1 + PatchSize - 2) / (PatchSize - 1);
+    m_numPatchesZ = (Depth - 1 + PatchSize - 2) / (PatchSize - 1);
+    m_patchBase.resize(m_numPatchesX * m_numPatchesZ);
+}
+
+
+bool QuantizedHeightMap::Quantize(const Array2D<float>& HeightMap, int PatchSize, float Tolerance)
+{
+    Destroy();
+
+    int Width = HeightMap.GetCols();
+    int Depth = HeightMap.GetRows();
+
+    InitPatches(Width, Depth, PatchSize);
+
+    int NumPatches = m_numPatchesX * m_numPatchesZ;
+    std::vector<float> PatchMin(NumPatches);
+    std::vector<float> PatchMax(NumPatches);
+
+    // Height range of every patch including the border it shares with its neighbours
+    GetThreadPool().ParallelFor(0, m_numPatchesZ, 1, [&](int PatchRowBegin, int PatchRowEnd) {
+        for (int PatchZ = PatchRowBegin; PatchZ < PatchRowEnd; PatchZ++) {
+            int z0 = PatchZ * (PatchSize - 1);
+            int z1 = std::min(z0 + PatchSize - 1, Depth - 1);
+
+            for (int PatchX = 0; PatchX < m_numPatchesX; PatchX++) {
+                int x0 = PatchX * (PatchSize - 1);
+                int x1 = std::min(x0 + PatchSize - 1, Width - 1);
+
+                float Min = HeightMap.Get(x0, z0);
+                float Max = Min;
+
+                for (int z = z0; z <= z1; z++) {
+                    for (int x = x0; x <= x1; x++) {
+                        float Height = HeightMap.Get(x, z);
+                        Min = std::min(Min, Height);
+                        Max = std::max(Max, Height);
+                    }
+                }
+
+                PatchMin[PatchZ * m_numPatchesX + PatchX] = Min;
+                PatchMax[PatchZ * m_numPatchesX + PatchX] = Max;
+            }
+        }
+    });
+
+    float MaxSpan = 0.0f;
+    m_origin = PatchMin[0];
+
+    for (int i = 0; i < NumPatches; i++) {
+        MaxSpan = std::max(MaxSpan, PatchMax[i] - PatchMin[i]);
+        m_origin = std::min(m_origin, PatchMin[i]);
+    }
+
+    // One index is left as a margin for the rounding
+    m_step = (MaxSpan > 0.0f) ? MaxSpan / 65534.0f : 1.0f;
+
+    if (m_step * 0.5f > Tolerance) {
+        printf("%s: 16 bits can't keep the error under %f - the steepest patch spans %f (error %f)\n",
+               __FUNCTION__, Tolerance, MaxSpan, m_step * 0.5f);
+        Destroy();
+        return false;
+    }
+
+    for (int i = 0; i < NumPatches; i++) {
+        m_patchBase[i] = (i32)floor((double)(PatchMin[i] - m_origin) / m_step + 0.5);
+    }
+
+    m_heights.InitArray2D(Width, Depth);
+
+    std::vector<float> RowError(Depth);
+
+    GetThreadPool().ParallelFor(0, Depth, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            float MaxError = 0.0f;
+
+            for (int x = 0; x < Width; x++) {
+                float Height = HeightMap.Get(x, z);
+                i32 Index = (i32)floor((double)(Height - m_origin) / m_step + 0.5);
+
+                m_heights.Set(x, z, (u16)Index);
+
+                MaxError = std::max(MaxError, fabsf(Get(x, z) - Height));
+            }
+
+            RowError[z] = MaxError;
+        }
+    });
+
+    m_maxError = *std::max_element(RowError.begin(), RowError.end());
+
+    printf("Quantized heights %dx%d: step %f, max error %f (tolerance %f), %zu KB instead of %zu KB\n",
+           Width, Depth, m_step, m_maxError, Tolerance, GetSizeInBytes() / 1024, HeightMap.GetSizeInBytes() / 1024);
+
+    if (m_maxError > Tolerance) {
+        printf("%s: max error %f is over the tolerance %f\n", __FUNCTION__, m_maxError, Tolerance);
+        Destroy();
+        return false;
+    }
+
+    return true;
+}
+
+
+void QuantizedHeightMap::Destroy()
+{
+    m_heights.Destroy();
+    m_patchBase.clear();
+    m_maxError = 0.0f;
+}
+
+
+void QuantizedHeightMap::Dequantize(Array2D<float>& HeightMap) const
+{
+    int Width = m_heights.GetCols();
+    int Depth = m_heights.GetRows();
+
+    HeightMap.InitArray2D(Width, Depth);
+
+    GetThreadPool().ParallelFor(0, Depth, MIN_ROWS_PER_BAND, [&](int RowBegin, int RowEnd) {
+        for (int z = RowBegin; z < RowEnd; z++) {
+            for (int x = 0; x < Width; x++) {
+                HeightMap.Set(x, z, Get(x, z));
+            }
+        }
+    });
+}
+
+
+void QuantizedHeightMap::Remap(float SrcMin, float Scale, float DstMin)
+{
+    m_step *= Scale;
+    m_origin = (m_origin - SrcMin) * Scale + DstMin;
+    m_maxError *= fabsf(Scale);
+}
+
+
+void QuantizedHeightMap::Swap(QuantizedHeightMap& Other)
+{
+    m_heights.Swap(Other.m_heights);
+    m_patchBase.swap(Other.m_patchBase);
+    std::swap(m_patchSize, Other.m_patchSize);
+    std::swap(m_numPatchesX, Other.m_numPatchesX);
+    std::swap(m_numPatchesZ, Other.m_numPatchesZ);
+    std::swap(m_step, Other.m_step);
+    std::swap(m_origin, Other.m_origin);
+    std::swap(m_maxError, Other.m_maxError);
+}
+
+
+void QuantizedHeightMap::SaveToFile(TerrainFileWriter& Writer) const
+{
+    QuantizedPatchHeader Header;
+    Header.PatchSize = m_patchSize;
+    Header.NumPatchesX = m_numPatchesX;
+    Header.NumPatchesZ = m_numPatchesZ;
+    Header.Step = m_step;
+    Header.Origin = m_origin;
+    Header.MaxError = m_maxError;
+
+    Writer.BeginSection(TERRAIN_SECTION_QUANTIZED_PATCHES, sizeof(Header) + sizeof(i32) * m_patchBase.size());
+    Writer.Write(&Header, sizeof(Header));
+    Writer.Write(m_patchBase.data(), sizeof(i32) * m_patchBase.size());
+
+    Writer.AddSection(TERRAIN_SECTION_QUANTIZED_HEIGHTS, m_heights.GetBaseAddr(), m_heights.GetSizeInBytes());
+}
+
+
+bool QuantizedHeightMap::LoadFromFile(const TerrainFileReader& Reader, const char* pFilename)
+{
+    Destroy();
+
+    int Width = Reader.GetHeader().Width;
+    int Depth = Reader.GetHeader().Depth;
+
+    size_t PatchesSize = 0;
+    const u8* pPatches = (const u8*)Reader.GetSection(TERRAIN_SECTION_QUANTIZED_PATCHES, PatchesSize);
+
+    size_t HeightsOffset = 0;
+    size_t HeightsSize = 0;
+
+    if (!pPatches || !Reader.FindSection(TERRAIN_SECTION_QUANTIZED_HEIGHTS, HeightsOffset, HeightsSize)) {
+        return false;
+    }
+
+    QuantizedPatchHeader Header;
+
+    if (PatchesSize >= sizeof(Header)) {
+        memcpy(&Header, pPatches, sizeof(Header));
+    }
+
+    if (Header.PatchSize < 3) {
+        printf("%s: '%s' has an invalid quantization patch size %d\n", __FUNCTION__, pFilename, Header.PatchSize);
+        return false;
+    }
+
+    InitPatches(Width, Depth, Header.PatchSize);
+
+    if ((Header.NumPatchesX != m_numPatchesX) || (Header.NumPatchesZ != m_numPatchesZ) ||
+        (PatchesSize != sizeof(Header) + sizeof(i32) * m_patchBase.size()) ||
+        (HeightsSize != sizeof(u16) * Width * Depth)) {
+        printf("%s: the quantized heights in '%s' don't match the %dx%d height map\n", __FUNCTION__, pFilename, Width, Depth);
+        Destroy();
+        return false;
+    }
+
+    memcpy(m_patchBase.data(), pPatches + sizeof(Header), sizeof(i32) * m_patchBase.size());
+
+    m_step = Header.Step;
+    m_origin = Header.Origin;
+    m_maxError = Header.MaxError;
+
+    m_heights.InitArray2DMapped(Width, Depth, pFilename, HeightsOffset);
+
+    return true;
+}
@@ -0,0 +1,103 @@
+#ifndef QUANTIZED_HEIGHT_MAP_H
+#define QUANTIZED_HEIGHT_MAP_H
+
+#include <vector>
+#include <algorithm>
+
+#include "ogldev_types.h"
+#include "ogldev_array_2d.h"
+#include "terrain_file.h"
+
+// 16 bit height map. Every height is rounded to a lattice
+//
+//     Height = Index * Step + Origin
+//
+// where Step is the smallest one that lets the index range of every patch fit in
+// 16 bits. A patch stores the index of its lowest sample (its base) and a sample
+// stores its index modulo 2^16, so
+//
+//     Index = Base + ((Sample - Base) mod 2^16)
+//
+// gives the same height for a sample on the border of two patches with either
+// base. That's what lets the GPU decode the vertices of a patch with a single
+// per patch uniform without cracks between the patches.
+class QuantizedHeightMap {
+public:
+    QuantizedHeightMap() {}
+
+    // Quantizes the heights in patches of PatchSize x PatchSize samples (neighbours
+    // share their border). Returns false and stays empty if the rounding error would
+    // be bigger than Tolerance.
+    bool Quantize(const Array2D<float>& HeightMap, int PatchSize, float Tolerance);
+
+    void Destroy();
+
+    bool IsEmpty() const { return m_patchBase.empty(); }
+
+    float Get(int x, int z) const
+    {
+        int PatchX = std::min(x / (m_patchSize - 1), m_numPatchesX - 1);
+        int PatchZ = std::min(z / (m_patchSize - 1), m_numPatchesZ - 1);
+
+        return Decode(m_heights.Get(x, z), m_patchBase[PatchZ * m_numPatchesX + PatchX]);
+    }
+
+    float Decode(u16 Sample, i32 Base) const
+    {
+        i32 Index = Base + (i32)(u16)(Sample - (u16)Base);
+
+        return (float)Index * m_step + m_origin;
+    }
+
+    // See Array2D::PrefetchRows
+    void PrefetchRows(int FirstRow, int NumRows) const { m_heights.PrefetchRows(FirstRow, NumRows); }
+
+    u16 GetSample(int x, int z) const { return m_heights.Get(x, z); }
+
+    const Array2D<u16>& GetSamples() const { return m_heights; }
+
+    i32 GetPatchBase(int PatchX, int PatchZ) const { return m_patchBase[PatchZ * m_numPatchesX + PatchX]; }
+
+    const std::vector<i32>& GetPatchBases() const { return m_patchBase; }
+
+    int GetPatchSize() const { return m_patchSize; }
+
+    float GetStep() const { return m_step; }
+
+    float GetOrigin() const { return m_origin; }
+
+    // Largest difference between a source height and its decoded value
+    float GetMaxError() const { return m_maxError; }
+
+    size_t GetSizeInBytes() const { return m_heights.GetSize() * sizeof(u16) + m_patchBase.size() * sizeof(i32); }
+
+    // Decodes all the heights (the array is initialized to the size of the map)
+    void Dequantize(Array2D<float>& HeightMap) const;
+
+    // Height -> (Height - SrcMin) * Scale + DstMin by changing the lattice only. The
+    // samples stay the same and the error is scaled as well.
+    void Remap(float SrcMin, float Scale, float DstMin);
+
+    void Swap(QuantizedHeightMap& Other);
+
+    // Writes the patch table and the samples as two terrain file sections
+    void SaveToFile(TerrainFileWriter& Writer) const;
+
+    // Returns false if the file has no quantized heights or they don't match its
+    // header. The samples are mapped from the file, not read.
+    bool LoadFromFile(const TerrainFileReader& Reader, const char* pFilename);
+
+private:
+    void InitPatches(int Width, int Depth, int PatchSize);
+
+    Array2D<u16> m_heights;
+    std::vector<i32> m_patchBase;
+    int m_patchSize = 0;
+    int m_numPatchesX = 0;
+    int m_numPatchesZ = 0;
+    float m_step = 1.0f;
+    float m_origin = 0.0f;
+    float m_maxError = 0.0f;
+};
+
+#endif
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <algorithm>
+#include <mutex>
+
+#include "simd_utils.h"
+#include "thread_pool.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Number of floats handed to a thread in one go by the parallel variants
+#define SIMD_BAND_SIZE (256 * 1024)
+
+
+SIMD_LEVEL GetSimdLevel()
+{
+    static SIMD_LEVEL Level = []() {
+#ifdef SIMD_X86
+#ifdef _MSC_VER
+        int Info[4] = { 0 };
+        __cpuid(Info, 0);
+        int MaxLeaf = Info[0];
+
+        __cpuid(Info, 1);
+        bool OSXSave = (Info[2] & (1 << 27)) != 0;
+        bool FMA = (Info[2] & (1 << 12)) != 0;
+
+        bool AVX2 = false;
+
+        if ((MaxLeaf >= 7) && OSXSave && FMA) {
+            // The OS must save the YMM registers on a context switch
+            bool YMMEnabled = (_xgetbv(0) & 0x6) == 0x6;
+
+            __cpuidex(Info, 7, 0);
+            AVX2 = YMMEnabled && ((Info[1] & (1 << 5)) != 0);
+        }
+
+        return AVX2 ? SIMD_LEVEL_AVX2 : SIMD_LEVEL_SSE2;
+#else
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return SIMD_LEVEL_AVX2;
+        }
+
+        return SIMD_LEVEL_SSE2;
+#endif
+#else
+        return SIMD_LEVEL_NONE;
+#endif
+    }();
+
+    return Level;
+}
+
+
+static void MinMaxF32_Scalar(const float* p, size_t Count, float& Min, float& Max)
+{
+    for (size_t i = 0; i < Count; i++) {
+        if (p[i] < Min) {
+            Min = p[i];
+        }
+
+        if (p[i] > Max) {
+            Max = p[i];
+        }
+    }
+}
+
+
+static void RemapF32_Scalar(float* p, size_t Count, float SrcMin, float Scale, float DstMin)
+{
+    for (size_t i = 0; i < Count; i++) {
+        p[i] = (p[i] - SrcMin) * Scale + DstMin;
+    }
+}
+
+
+static void BlendF32_Scalar(float* p, const float* pPrev, size_t Count, float Weight)
+{
+    float CurWeight = 1.0f - Weight;
+
+    for (size_t i = 0; i < Count; i++) {
+        p[i] = pPrev[i] * Weight + p[i] * CurWeight;
+    }
+}
+
+
+#ifdef SIMD_X86
+
+static void MinMaxF32_SSE2(const float* p, size_t Count, float& Min, float& Max)
+{
+    size_t i = 0;
+
+    if (Count >= 8) {
+        // Two accumulators to hide the latency of min/max
+        __m128 Min0 = _mm_loadu_ps(p);
+        __m128 Max0 = Min0;
+        __m128 Min1 = _mm_loadu_ps(p + 4);
+        __m128 Max1 = Min1;
+
+        for (i = 8; i + 8 <= Count; i += 8) {
+            __m128 a = _mm_loadu_ps(p + i);
+            __m128 b = _mm_loadu_ps(p + i + 4);
+            Min0 = _mm_min_ps(Min0, a);
+            Max0 = _mm_max_ps(Max0, a);
+            Min1 = _mm_min_ps(Min1, b);
+            Max1 = _mm_max_ps(Max1, b);
+        }
+
+        Min0 = _mm_min_ps(Min0, Min1);
+        Max0 = _mm_max_ps(Max0, Max1);
+
+        float MinLanes[4], MaxLanes[4];
+        _mm_storeu_ps(MinLanes, Min0);
+        _mm_storeu_ps(MaxLanes, Max0);
+
+        MinMaxF32_Scalar(MinLanes, 4, Min, Max);
+        MinMaxF32_Scalar(MaxLanes, 4, Min, Max);
+    }
+
+    MinMaxF32_Scalar(p + i, Count - i, Min, Max);
+}
+
+
+static void RemapF32_SSE2(float* p, size_t Count, float SrcMin, float Scale, float DstMin)
+{
+    __m128 vSrcMin = _mm_set1_ps(SrcMin);
+    __m128 vScale = _mm_set1_ps(Scale);
+    __m128 vDstMin = _mm_set1_ps(DstMin);
+
+    size_t i = 0;
+
+    for (; i + 4 <= Count; i += 4) {
+        __m128 a = _mm_loadu_ps(p + i);
+        _mm_storeu_ps(p + i, _mm_add_ps(_mm_mul_ps(_mm_sub_ps(a, vSrcMin), vScale), vDstMin));
+    }
+
+    RemapF32_Scalar(p + i, Count - i, SrcMin, Scale, DstMin);
+}
+
+
+static void BlendF32_SSE2(float* p, const float* pPrev, size_t Count, float Weight)
+{
+    __m128 vWeight = _mm_set1_ps(Weight);
+    __m128 vCurWeight = _mm_set1_ps(1.0f - Weight);
+
+    size_t i = 0;
+
+    for (; i + 4 <= Count; i += 4) {
+        __m128 a = _mm_loadu_ps(p + i);
+        __m128 b = _mm_loadu_ps(pPrev + i);
+        _mm_storeu_ps(p + i, _mm_add_ps(_mm_mul_ps(b, vWeight), _mm_mul_ps(a, vCurWeight)));
+    }
+
+    BlendF32_Scalar(p + i, pPrev + i, Count - i, Weight);
+}
+
+
+SIMD_TARGET_AVX2 static void MinMaxF32_AVX2(const float* p, size_t Count, float& Min, float& Max)
+{
+    size_t i = 0;
+
+    if (Count >= 16) {
+        __m256 Min0 = _mm256_loadu_ps(p);
+        __m256 Max0 = Min0;
+        __m256 Min1 = _mm256_loadu_ps(p + 8);
+        __m256 Max1 = Min1;
+
+        for (i = 16; i + 16 <= Count; i += 16) {
+            __m256 a = _mm256_loadu_ps(p + i);
+            __m256 b = _mm256_loadu_ps(p + i + 8);
+            Min0 = _mm256_min_ps(Min0, a);
+            Max0 = _mm256_max_ps(Max0, a);
+            Min1 = _mm256_min_ps(Min1, b);
+            Max1 = _mm256_max_ps(Max1, b);
+        }
+
+        Min0 = _mm256_min_ps(Min0, Min1);
+        Max0 = _mm256_max_ps(Max0, Max1);
+
+        float MinLanes[8], MaxLanes[8];
+        _mm256_storeu_ps(MinLanes, Min0);
+        _mm256_storeu_ps(MaxLanes, Max0);
+
+        MinMaxF32_Scalar(MinLanes, 8, Min, Max);
+        MinMaxF32_Scalar(MaxLanes, 8, Min, Max);
+    }
+
+    MinMaxF32_Scalar(p + i, Count - i, Min, Max);
+}
+
+
+SIMD_TARGET_AVX2 static void RemapF32_AVX2(float* p, size_t Count, float SrcMin, float Scale, float DstMin)
+{
+    __m256 vSrcMin = _mm256_set1_ps(SrcMin);
+    __m256 vScale = _mm256_set1_ps(Scale);
+    __m256 vDstMin = _mm256_set1_ps(DstMin);
+
+    size_t i = 0;
+
+    for (; i + 8 <= Count; i += 8) {
+        __m256 a = _mm256_loadu_ps(p + i);
+        _mm256_storeu_ps(p + i, _mm256_fmadd_ps(_mm256_sub_ps(a, vSrcMin), vScale, vDstMin));
+    }
+
+    RemapF32_Scalar(p + i, Count - i, SrcMin, Scale, DstMin);
+}
+
+
+SIMD_TARGET_AVX2 static void BlendF32_AVX2(float* p, const float* pPrev, size_t Count, float Weight)
+{
+    __m256 vWeight = _mm256_set1_ps(Weight);
+    __m256 vCurWeight = _mm256_set1_ps(1.0f - Weight);
+
+    size_t i = 0;
+
+    for (; i + 8 <= Count; i += 8) {
+        __m256 a = _mm256_loadu_ps(p + i);
+        __m256 b = _mm256_loadu_ps(pPrev + i);
+        _mm256_storeu_ps(p + i, _mm256_add_ps(_mm256_mul_ps(b, vWeight), _mm256_mul_ps(a, vCurWeight)));
+    }
+
+    BlendF32_Scalar(p + i, pPrev + i, Count - i, Weight);
+}
+
+#endif
+
+
+// Single threaded kernels - pick the best implementation for this CPU
+
+static void MinMaxF32_Serial(const float* p, size_t Count, float& Min, float& Max)
+{
+    switch (GetSimdLevel()) {
+#ifdef SIMD_X86
+    case SIMD_LEVEL_AVX2:
+        MinMaxF32_AVX2(p, Count, Min, Max);
+        break;
+
+    case SIMD_LEVEL_SSE2:
+        MinMaxF32_SSE2(p, Count, Min, Max);
+        break;
+#endif
+    default:
+        MinMaxF32_Scalar(p, Count, Min, Max);
+    }
+}
+
+
+static void RemapF32_Serial(float* p, size_t Count, float SrcMin, float Scale, float DstMin)
+{
+    switch (GetSimdLevel()) {
+#ifdef SIMD_X86
+    case SIMD_LEVEL_AVX2:
+        RemapF32_AVX2(p, Count, SrcMin, Scale, DstMin);
+        break;
+
+    case SIMD_LEVEL_SSE2:
+        RemapF32_SSE2(p, Count, SrcMin, Scale, DstMin);
+        break;
+#endif
+    default:
+        RemapF32_Scalar(p, Count, SrcMin, Scale, DstMin);
+    }
+}
+
+
+void BlendF32(float* p, const float* pPrev, size_t Count, float Weight)
+{
+    switch (GetSimdLevel()) {
+#ifdef SIMD_X86
+    case SIMD_LEVEL_AVX2:
+        BlendF32_AVX2(p, pPrev, Count, Weight);
+        break;
+
+    case SIMD_LEVEL_SSE2:
+        BlendF32_SSE2(p, pPrev, Count, Weight);
+        break;
+#endif
+    default:
+        BlendF32_Scalar(p, pPrev, Count, Weight);
+    }
+}
+
+
+void MinMaxF32(const float* p, size_t Count, float& Min, float& Max)
+{
+    if (Count == 0) {
+        return;
+    }
+
+    Min = Max = p[0];
+
+    if (Count < SIMD_PARALLEL_THRESHOLD) {
+        MinMaxF32_Serial(p, Count, Min, Max);
+        return;
+    }
+
+    int NumBands = (int)((Count + SIMD_BAND_SIZE - 1) / SIMD_BAND_SIZE);
+    std::mutex ResultMutex;
+
+    GetThreadPool().ParallelFor(0, NumBands, 1, [&](int BandBegin, int BandEnd) {
+        size_t Begin = (size_t)BandBegin * SIMD_BAND_SIZE;
+        size_t End = std::min((size_t)BandEnd * SIMD_BAND_SIZE, Count);
+
+        float BandMin = p[Begin];
+        float BandMax = p[Begin];
+        MinMaxF32_Serial(p + Begin, End - Begin, BandMin, BandMax);
+
+        std::lock_guard<std::mutex> Lock(ResultMutex);
+        Min = std::min(Min, BandMin);
+        Max = std::max(Max, BandMax);
+    });
+}
+
+
+void RemapF32(float* p, size_t Count, float SrcMin, float Scale, float DstMin)
+{
+    if (Count < SIMD_PARALLEL_THRESHOLD) {
+        RemapF32_Serial(p, Count, SrcMin, Scale, DstMin);
+        return;
+    }
+
+    int NumBands = (int)((Count + SIMD_BAND_SIZE - 1) / SIMD_BAND_SIZE);
+
+    GetThreadPool().ParallelFor(0, NumBands, 1, [&](int BandBegin, int BandEnd) {
+        size_t Begin = (size_t)BandBegin * SIMD_BAND_SIZE;
+        size_t End = std::min((size_t)BandEnd * SIMD_BAND_SIZE, Count);
+
+        RemapF32_Serial(p + Begin, End - Begin, SrcMin, Scale, DstMin);
+    });
+}
+
+
+void NormalizeF32(float* p, size_t Count, float MinRange, float MaxRange)
+{
+    float Min = 0.0f, Max = 0.0f;
+
+    MinMaxF32(p, Count, Min, Max);
+
+    if (Max <= Min) {
+        return;
+    }
+
+    // The division is hoisted out of the loop - Min still maps exactly to MinRange
+    float Scale = (MaxRange - MinRange) / (Max - Min);
+
+    RemapF32(p, Count, Min, Scale, MinRange);
+}
@@ -0,0 +1,45 @@
+#ifndef SIMD_UTILS_H
+#define SIMD_UTILS_H
+
+#include <stddef.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#endif
+
+// Functions that use AVX2 intrinsics must be tagged so that GCC/clang generate
+// them even when the rest of the file is built for the baseline instruction set.
+// MSVC allows the intrinsics anywhere.
+#if defined(SIMD_X86) && !defined(_MSC_VER)
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define SIMD_TARGET_AVX2
+#endif
+
+enum SIMD_LEVEL {
+    SIMD_LEVEL_NONE = 0,
+    SIMD_LEVEL_SSE2 = 1,
+    SIMD_LEVEL_AVX2 = 2
+};
+
+// Best instruction set supported by the CPU and the OS - detected once
+SIMD_LEVEL GetSimdLevel();
+
+// Arrays of at least this many floats are processed by the shared thread pool
+#define SIMD_PARALLEL_THRESHOLD (16 * 1024 * 1024)
+
+void MinMaxF32(const float* p, size_t Count, float& Min, float& Max);
+
+// p[i] = (p[i] - SrcMin) * Scale + DstMin
+void RemapF32(float* p, size_t Count, float SrcMin, float Scale, float DstMin);
+
+// Linearly maps the values of the array to [MinRange, MaxRange] - one pass to find
+// the current range and one pass to rescale
+void NormalizeF32(float* p, size_t Count, float MinRange, float MaxRange);
+
+// p[i] = pPrev[i] * Weight + p[i] * (1 - Weight) - one step of a first order filter
+// applied to a whole row at once. Always runs on the calling thread; callers split
+// their rows across the pool themselves.
+void BlendF32(float* p, const float* pPrev, size_t Count, float Weight);
+
+#endif
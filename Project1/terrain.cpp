@@ -5,10 +5,17 @@
 #include <sys/stat.h>
 #include <cerrno>
 #include <string.h>
+#include <chrono>
+#include <memory>
+#include <string>
 
 #include "terrain.h"
+#include "terrain_file.h"
+#include "mapped_file.h"
+#include "tile_archive.h"
+#include "height_map_png.h"
 #include "texture_config.h"
-#include "stb_image_write.h"
+#include "terrain_pager.h"
 
 //#define DEBUG_PRINT
 
@@ -20,7 +27,10 @@ BaseTerrain::~BaseTerrain()
 
 void BaseTerrain::Destroy()
 {
+    CancelAsyncBuild();
     m_heightMap.Destroy();
+    m_quantizedHeights.Destroy();
+    m_heightMips.Destroy();
     m_geomipGrid.Destroy();
 }
 
@@ -67,7 +77,148 @@ void BaseTerrain::InitTerrain(float WorldScale, float TextureScale, const std::v
 
 void BaseTerrain::Finalize()
 {
+    m_quantizedHeights.Destroy();
+
+    // The grid is built from the decoded heights so that the CPU and the GPU agree
+    if (m_quantizeHeights && m_quantizedHeights.Quantize(m_heightMap, m_patchSize, m_quantizationTolerance)) {
+        m_quantizedHeights.Dequantize(m_heightMap);
+    }
+
+    m_geomipGrid.SetCompactVertices(m_compactVertices);
+    m_geomipGrid.SetHeightTextures(m_heightTextures);
     m_geomipGrid.CreateGeomipGrid(m_terrainSize, m_terrainSize, m_patchSize, this);
+    m_heightMips.Build(m_heightMap);
+
+    if (!m_quantizedHeights.IsEmpty()) {
+        m_heightMap.Destroy();
+    }
+
+    SetQuantizationUniforms();
+
+    if (!m_pendingCachePath.empty()) {
+        SaveToCache(m_cacheDir, m_pendingCachePath, [this](const char* pFilename) { SaveToFile(pFilename); });
+        m_pendingCachePath.clear();
+    }
+}
+
+
+void BaseTerrain::SetHeightQuantization(bool Enabled, float Tolerance)
+{
+    m_quantizeHeights = Enabled;
+    m_quantizationTolerance = Tolerance;
+}
+
+
+void BaseTerrain::SetQuantizationUniforms()
+{
+    m_terrainTech.Enable();
+    m_terrainTech.SetQuantizedHeights(!m_quantizedHeights.IsEmpty(), m_quantizedHeights.GetStep(), m_quantizedHeights.GetOrigin(),
+                                      m_textureScale / (m_worldScale * m_terrainSize));
+}
+
+
+bool BaseTerrain::StartAsyncBuild(int TerrainSize, int PatchSize, float MinHeight, float MaxHeight,
+                                  const std::function<void(Array2D<float>&)>& GenerateFunc)
+{
+    if (m_pPendingBuild) {
+        printf("%s: a terrain build is already in progress\n", __FUNCTION__);
+        return false;
+    }
+
+    PendingBuild* pBuild = new PendingBuild;
+    pBuild->TerrainSize = TerrainSize;
+    pBuild->PatchSize = PatchSize;
+    pBuild->MinHeight = MinHeight;
+    pBuild->MaxHeight = MaxHeight;
+    pBuild->CachePath.swap(m_pendingCachePath);
+    pBuild->Grid.SetCompactVertices(m_compactVertices);
+    pBuild->Grid.SetHeightTextures(m_heightTextures);
+
+    float WorldScale = m_worldScale;
+    float TextureScale = m_textureScale;
+    bool Quantize = m_quantizeHeights;
+    float Tolerance = m_quantizationTolerance;
+    std::string CacheDir = m_cacheDir;
+    TerrainFileHeader Header = GetFileHeader(TerrainSize, PatchSize, MinHeight, MaxHeight);
+
+    // The background thread only touches the pending build - the current
+    // height map and GL state stay with the render thread
+    pBuild->Done = std::async(std::launch::async, [pBuild, GenerateFunc, WorldScale, TextureScale, Quantize, Tolerance, CacheDir, Header]() {
+        long long StartTime = GetCurrentTimeMillis();
+
+        GenerateFunc(pBuild->HeightMap);
+
+        QuantizedHeightMap* pQuantized = NULL;
+
+        if (Quantize && pBuild->QuantizedHeights.Quantize(pBuild->HeightMap, pBuild->PatchSize, Tolerance)) {
+            pBuild->QuantizedHeights.Dequantize(pBuild->HeightMap);
+            pQuantized = &pBuild->QuantizedHeights;
+        }
+
+        pBuild->Grid.PrepareGeomipGrid(pBuild->TerrainSize, pBuild->TerrainSize, pBuild->PatchSize, pBuild->HeightMap, WorldScale, TextureScale,
+                                       pQuantized);
+
+        pBuild->HeightMips.Build(pBuild->HeightMap);
+
+        printf("Background terrain build took %lld ms\n", GetCurrentTimeMillis() - StartTime);
+
+        // From the CPU copies of the grid, before the upload releases them
+        if (!pBuild->CachePath.empty()) {
+            SaveToCache(CacheDir, pBuild->CachePath, [pBuild, &Header](const char* pFilename) {
+                WriteTerrainFile(pFilename, Header, pBuild->HeightMap, pBuild->QuantizedHeights, pBuild->Grid, pBuild->HeightMips);
+            });
+        }
+    });
+
+    m_pPendingBuild = pBuild;
+
+    return true;
+}
+
+
+bool BaseTerrain::UpdateAsyncBuild()
+{
+    if (!m_pPendingBuild) {
+        return false;
+    }
+
+    if (m_pPendingBuild->Done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return false;
+    }
+
+    m_pPendingBuild->Done.get();
+
+    m_pPendingBuild->Grid.UploadGeomipGrid(this);
+
+    m_heightMap.Swap(m_pPendingBuild->HeightMap);
+    m_quantizedHeights.Swap(m_pPendingBuild->QuantizedHeights);
+    m_heightMips.Swap(m_pPendingBuild->HeightMips);
+    m_geomipGrid.Swap(m_pPendingBuild->Grid);
+    m_terrainSize = m_pPendingBuild->TerrainSize;
+    m_patchSize = m_pPendingBuild->PatchSize;
+    SetMinMaxHeight(m_pPendingBuild->MinHeight, m_pPendingBuild->MaxHeight);
+
+    if (!m_quantizedHeights.IsEmpty()) {
+        m_heightMap.Destroy();
+    }
+
+    SetQuantizationUniforms();
+
+    // Releases the old height map and GL buffers
+    delete m_pPendingBuild;
+    m_pPendingBuild = NULL;
+
+    return true;
+}
+
+
+void BaseTerrain::CancelAsyncBuild()
+{
+    if (m_pPendingBuild) {
+        m_pPendingBuild->Done.wait();
+        delete m_pPendingBuild;
+        m_pPendingBuild = NULL;
+    }
 }
 
 
@@ -98,54 +249,323 @@ float BaseTerrain::GetHeightInterpolated(float x, float z) const
 
 void BaseTerrain::LoadFromFile(const char* pFilename)
 {
-    LoadHeightMapFile(pFilename);
+    if (!LoadTerrainFile(pFilename)) {
+        printf("%s: can't load the terrain from '%s'\n", __FUNCTION__, pFilename);
+        exit(0);
+    }
+}
 
-    // how do we know the patch size at this point?
-    assert(0);
 
-    m_geomipGrid.CreateGeomipGrid(m_terrainSize, m_terrainSize, m_patchSize, this);
+bool BaseTerrain::LoadTerrainFile(const char* pFilename)
+{
+    CancelAsyncBuild();
+
+    long long StartTime = GetCurrentTimeMillis();
+
+    TerrainFileReader Reader;
+
+    if (!Reader.Load(pFilename)) {
+        return false;
+    }
+
+    const TerrainFileHeader& Header = Reader.GetHeader();
+
+    if (Header.Width != Header.Depth) {
+        printf("%s: '%s' has a %dx%d height map - only square terrains are supported\n", __FUNCTION__, pFilename, Header.Width, Header.Depth);
+        return false;
+    }
+
+    size_t HeightsOffset = 0;
+    size_t HeightsSize = 0;
+    bool HaveHeights = Reader.FindSection(TERRAIN_SECTION_HEIGHTS, HeightsOffset, HeightsSize) &&
+                       (HeightsSize == sizeof(float) * Header.Width * Header.Depth);
+
+    QuantizedHeightMap QuantizedHeights;
+
+    if (!HaveHeights && !QuantizedHeights.LoadFromFile(Reader, pFilename)) {
+        printf("%s: '%s' doesn't have a %dx%d height map\n", __FUNCTION__, pFilename, Header.Width, Header.Depth);
+        return false;
+    }
+
+    // The grid decodes a patch with the base of the quantized patch it covers
+    if (!QuantizedHeights.IsEmpty() && (QuantizedHeights.GetPatchSize() != Header.PatchSize)) {
+        printf("%s: '%s' has heights quantized in patches of %d but the terrain patch size is %d\n", __FUNCTION__,
+               pFilename, QuantizedHeights.GetPatchSize(), Header.PatchSize);
+        return false;
+    }
+
+    // The current terrain is only replaced once the file is known to be usable
+    m_heightMap.Destroy();
+    m_quantizedHeights.Swap(QuantizedHeights);
+
+    // Mapped instead of copied - with a precomputed grid in the file the heights
+    // are only read around the camera
+    if (HaveHeights) {
+        m_heightMap.InitArray2DMapped(Header.Width, Header.Depth, pFilename, HeightsOffset);
+    }
+
+    m_terrainSize = Header.Width;
+    m_patchSize = Header.PatchSize;
+    m_worldScale = Header.WorldScale;
+    m_textureScale = Header.TextureScale;
+
+    SetMinMaxHeight(Header.MinHeight, Header.MaxHeight);
+    SetQuantizationUniforms();
+
+    m_geomipGrid.Destroy();
+    m_geomipGrid.SetCompactVertices(m_compactVertices);
+    m_geomipGrid.SetHeightTextures(m_heightTextures);
+
+    bool HaveGrid = m_geomipGrid.LoadFromFile(Reader, m_terrainSize, m_terrainSize, m_patchSize, m_worldScale, this);
+    bool HaveMips = m_heightMips.LoadFromFile(Reader, m_terrainSize, m_terrainSize);
+
+    if (HaveGrid && HaveMips) {
+        printf("Terrain %dx%d loaded from '%s' in %lld ms\n", m_terrainSize, m_terrainSize, pFilename, GetCurrentTimeMillis() - StartTime);
+        return true;
+    }
+
+    // Either one reads the whole height map
+    printf("'%s' has no usable%s%s - building from the height map\n", pFilename, HaveGrid ? "" : " geomip grid",
+           HaveMips ? "" : " height mips");
+
+    if (!m_quantizedHeights.IsEmpty()) {
+        m_quantizedHeights.Dequantize(m_heightMap);
+    }
+
+    if (!HaveGrid) {
+        m_geomipGrid.CreateGeomipGrid(m_terrainSize, m_terrainSize, m_patchSize, this);
+    }
+
+    if (!HaveMips) {
+        m_heightMips.Build(m_heightMap);
+    }
+
+    if (!m_quantizedHeights.IsEmpty()) {
+        m_heightMap.Destroy();
+    }
+
+    return true;
 }
 
 
 void BaseTerrain::LoadHeightMapFile(const char* pFilename)
 {
-    int FileSize = 0;
-    unsigned char* p = (unsigned char*)ReadBinaryFile(pFilename, FileSize);
+    size_t FileSize = GetFileSize(pFilename);
 
     if (FileSize % sizeof(float) != 0) {
-        printf("%s:%d - '%s' does not contain an whole number of floats (size %d)\n", __FILE__, __LINE__, pFilename, FileSize);
+        printf("%s:%d - '%s' does not contain an whole number of floats (size %zu)\n", __FILE__, __LINE__, pFilename, FileSize);
         exit(0);
     }
 
-    m_terrainSize = (int)sqrtf((float)FileSize / (float)sizeof(float));
+    m_terrainSize = (int)sqrt((double)(FileSize / sizeof(float)));
 
     printf("Terrain size %d\n", m_terrainSize);
 
-    if ((m_terrainSize * m_terrainSize) != (FileSize / sizeof(float))) {
-        printf("%s:%d - '%s' does not contain a square height map - size %d\n", __FILE__, __LINE__, pFilename, FileSize);
+    if ((size_t)m_terrainSize * m_terrainSize != FileSize / sizeof(float)) {
+        printf("%s:%d - '%s' does not contain a square height map - size %zu\n", __FILE__, __LINE__, pFilename, FileSize);
         exit(0);
     }
 
-    m_heightMap.InitArray2D(m_terrainSize, m_terrainSize, (float*)p);
+    m_heightMap.InitArray2DMapped(m_terrainSize, m_terrainSize, pFilename);
+}
+
+
+void BaseTerrain::PrefetchHeightMap(const Vector3f& Pos, int NumPatches)
+{
+    int PatchSegments = m_patchSize > 1 ? m_patchSize - 1 : 1;
+    int CenterRow = (int)(Pos.z / m_worldScale);
+    int HalfRows = NumPatches * PatchSegments;
+
+    m_heightMap.PrefetchRows(CenterRow - HalfRows, 2 * HalfRows + 1);
+    m_quantizedHeights.PrefetchRows(CenterRow - HalfRows, 2 * HalfRows + 1);
 }
 
 
 void BaseTerrain::SaveToFile(const char* pFilename)
 {
-    unsigned char* p = (unsigned char*)malloc(m_terrainSize * m_terrainSize);
+    WriteTerrainFile(pFilename, GetFileHeader(m_terrainSize, m_patchSize, m_minHeight, m_maxHeight), m_heightMap, m_quantizedHeights,
+                     m_geomipGrid, m_heightMips);
+}
+
+
+TerrainFileHeader BaseTerrain::GetFileHeader(int TerrainSize, int PatchSize, float MinHeight, float MaxHeight) const
+{
+    TerrainFileHeader Header;
+    Header.Width = TerrainSize;
+    Header.Depth = TerrainSize;
+    Header.PatchSize = PatchSize;
+    Header.WorldScale = m_worldScale;
+    Header.TextureScale = m_textureScale;
+    Header.MinHeight = MinHeight;
+    Header.MaxHeight = MaxHeight;
+
+    return Header;
+}
+
+
+void BaseTerrain::WriteTerrainFile(const char* pFilename, const TerrainFileHeader& Header, const Array2D<float>& HeightMap,
+                                   const QuantizedHeightMap& QuantizedHeights, const GeomipGrid& Grid, const HeightMipPyramid& HeightMips)
+{
+    TerrainFileWriter Writer;
+    Writer.Open(pFilename, Header);
+
+    if (QuantizedHeights.IsEmpty()) {
+        Writer.AddSection(TERRAIN_SECTION_HEIGHTS, HeightMap.GetBaseAddr(), HeightMap.GetSizeInBytes());
+    } else {
+        QuantizedHeights.SaveToFile(Writer);
+    }
+
+    Grid.SaveToFile(Writer);
+    HeightMips.SaveToFile(Writer);
+
+    Writer.Close();
+}
+
+
+TerrainCacheKey BaseTerrain::GetCacheKey(const char* pGenerator, int TerrainSize, int PatchSize, float MinHeight, float MaxHeight) const
+{
+    TerrainCacheKey Key;
+    Key.Add(TERRAIN_CACHE_VERSION);
+    Key.Add(TERRAIN_FILE_VERSION);
+    Key.Add(pGenerator);
+    Key.Add(TerrainSize);
+    Key.Add(PatchSize);
+    Key.Add(MinHeight);
+    Key.Add(MaxHeight);
+    Key.Add(m_worldScale);
+    Key.Add(m_textureScale);
+    Key.Add(m_quantizeHeights ? m_quantizationTolerance : -1.0f);
+    Key.Add(m_compactVertices ? 1 : 0);
+    Key.Add(m_heightTextures ? 1 : 0);
+
+    return Key;
+}
+
+
+bool BaseTerrain::LoadFromCache(const TerrainCacheKey& Key)
+{
+    m_pendingCachePath.clear();
+
+    if (m_cacheDir.empty()) {
+        return false;
+    }
+
+    std::string Path = GetTerrainCachePath(m_cacheDir.c_str(), Key);
+
+    if (!IsTerrainCached(Path)) {
+        printf("Terrain cache miss - the terrain will be saved as '%s'\n", Path.c_str());
+        m_pendingCachePath = Path;
+        return false;
+    }
+
+    if (LoadTerrainFile(Path.c_str())) {
+        return true;
+    }
+
+    // A damaged or outdated entry is rebuilt like a missing one
+    printf("Terrain cache entry '%s' can't be used - the terrain will be rebuilt\n", Path.c_str());
+    remove(Path.c_str());
+    m_pendingCachePath = Path;
+
+    return false;
+}
+
+
+void BaseTerrain::SaveToCache(const std::string& CacheDir, const std::string& Path, const std::function<void(const char*)>& SaveFunc)
+{
+    if (!CreateTerrainCacheDir(CacheDir.c_str())) {
+        return;
+    }
+
+    long long StartTime = GetCurrentTimeMillis();
+
+    // Written under a temporary name so that an interrupted save never leaves a
+    // partial file that looks like a cached terrain
+    std::string TempPath = Path + ".tmp";
 
-    float* src = m_heightMap.GetBaseAddr();
+    SaveFunc(TempPath.c_str());
 
-    float Delta = m_maxHeight - m_minHeight;
+    remove(Path.c_str());
 
-    for (int i = 0; i < m_terrainSize * m_terrainSize; i++) {
-        float f = (src[i] - m_minHeight) / Delta;
-        p[i] = (unsigned char)(f * 255.0f);
+    if (rename(TempPath.c_str(), Path.c_str()) != 0) {
+        printf("%s: can't rename '%s' to '%s': %s\n", __FUNCTION__, TempPath.c_str(), Path.c_str(), strerror(errno));
+        remove(TempPath.c_str());
+        return;
     }
 
-    stbi_write_png("heightmap.png", m_terrainSize, m_terrainSize, 1, p, m_terrainSize);
+    printf("Terrain cached as '%s' in %lld ms\n", Path.c_str(), GetCurrentTimeMillis() - StartTime);
+}
+
 
-    free(p);
+void BaseTerrain::SaveTileArchive(const char* pFilename, int TileSize)
+{
+    if (m_quantizedHeights.IsEmpty()) {
+        WriteTileArchive(pFilename, m_heightMap, TileSize);
+    } else {
+        Array2D<float> HeightMap;
+        m_quantizedHeights.Dequantize(HeightMap);
+        WriteTileArchive(pFilename, HeightMap, TileSize);
+    }
+}
+
+
+void BaseTerrain::LoadFromPNG(const char* pFilename, int PatchSize, float MinHeight, float MaxHeight)
+{
+    CancelAsyncBuild();
+
+    m_quantizedHeights.Destroy();
+
+    LoadHeightMapPNG(pFilename, m_heightMap, MinHeight, MaxHeight);
+
+    if (m_heightMap.GetCols() != m_heightMap.GetRows()) {
+        printf("%s: '%s' is %dx%d - only square terrains are supported\n", __FUNCTION__, pFilename, m_heightMap.GetCols(), m_heightMap.GetRows());
+        exit(0);
+    }
+
+    m_terrainSize = m_heightMap.GetCols();
+    m_patchSize = PatchSize;
+
+    SetMinMaxHeight(MinHeight, MaxHeight);
+
+    Finalize();
+}
+
+
+void BaseTerrain::SaveHeightMapImage(const char* pFilename)
+{
+    if (m_quantizedHeights.IsEmpty()) {
+        SaveHeightMapPNG(pFilename, m_heightMap, m_minHeight, m_maxHeight);
+    } else {
+        Array2D<float> HeightMap;
+        m_quantizedHeights.Dequantize(HeightMap);
+        SaveHeightMapPNG(pFilename, HeightMap, m_minHeight, m_maxHeight);
+    }
+}
+
+
+std::future<void> BaseTerrain::SaveHeightMapImageAsync(const char* pFilename)
+{
+    // Copying is much faster than the compression - the render thread only waits for that
+    std::shared_ptr<Array2D<float> > pSnapshot = std::make_shared<Array2D<float> >();
+
+    if (m_quantizedHeights.IsEmpty()) {
+        pSnapshot->InitArray2D(m_heightMap.GetCols(), m_heightMap.GetRows());
+        memcpy(pSnapshot->GetBaseAddr(), m_heightMap.GetBaseAddr(), m_heightMap.GetSizeInBytes());
+    } else {
+        m_quantizedHeights.Dequantize(*pSnapshot);
+    }
+
+    std::string Filename = pFilename;
+    float MinHeight = m_minHeight;
+    float MaxHeight = m_maxHeight;
+
+    return std::async(std::launch::async, [pSnapshot, Filename, MinHeight, MaxHeight]() {
+        long long StartTime = GetCurrentTimeMillis();
+
+        SaveHeightMapPNG(Filename.c_str(), *pSnapshot, MinHeight, MaxHeight);
+
+        printf("Height map saved to '%s' in %lld ms\n", Filename.c_str(), GetCurrentTimeMillis() - StartTime);
+    });
 }
 
 
@@ -165,12 +585,32 @@ void BaseTerrain::Render(const BasicCamera& Camera)
 
     m_terrainTech.SetLightDir(m_lightDir);
 
-    m_geomipGrid.Render(Camera.GetPos(), VP);
+    if (m_pPager) {
+        // Set every frame since rebuilding the height map sets them for its own heights
+        m_terrainTech.SetMinMaxHeight(m_pPager->GetMinHeight(), m_pPager->GetMaxHeight());
+        m_terrainTech.SetQuantizedHeights(false, 1.0f, 0.0f, 0.0f);
+
+        m_pPager->Update(Camera.GetPos());
+        m_pPager->Render(Camera.GetPos(), VP, &m_terrainTech);
+    } else {
+        m_geomipGrid.Render(Camera.GetPos(), VP, &m_terrainTech);
+    }
 
     m_pSkydome->Render(Camera);
 }
 
 
+void BaseTerrain::SetPager(TerrainPager* pPager)
+{
+    m_pPager = pPager;
+
+    if (!m_pPager) {
+        SetMinMaxHeight(m_minHeight, m_maxHeight);
+        SetQuantizationUniforms();
+    }
+}
+
+
 void BaseTerrain::SetMinMaxHeight(float MinHeight, float MaxHeight)
 {
     m_minHeight = MinHeight;
@@ -181,6 +621,65 @@ void BaseTerrain::SetMinMaxHeight(float MinHeight, float MaxHeight)
 }
 
 
+void BaseTerrain::SetHeightRange(float MinHeight, float MaxHeight)
+{
+    if (!m_quantizedHeights.IsEmpty()) {
+        if ((m_maxHeight <= m_minHeight) || (MaxHeight <= MinHeight)) {
+            printf("%s: can't rescale quantized heights from or to a flat range\n", __FUNCTION__);
+            return;
+        }
+
+        // Only the lattice changes - the 16 bit samples stay as they are and the grid
+        // just rescales its normals
+        float SrcMin = m_minHeight;
+        float Scale = (MaxHeight - MinHeight) / (m_maxHeight - m_minHeight);
+        m_quantizedHeights.Remap(SrcMin, Scale, MinHeight);
+        m_heightMips.Remap(SrcMin, Scale, MinHeight);
+
+        SetMinMaxHeight(MinHeight, MaxHeight);
+        SetQuantizationUniforms();
+
+        m_geomipGrid.RescaleHeights(m_heightMap, SrcMin, Scale, MinHeight, &m_quantizedHeights);
+
+        printf("Quantized heights rescaled: step %f, max error %f\n", m_quantizedHeights.GetStep(), m_quantizedHeights.GetMaxError());
+        return;
+    }
+
+    if (m_heightMap.GetSize() == 0) {
+        SetMinMaxHeight(MinHeight, MaxHeight);
+        return;
+    }
+
+    if ((m_maxHeight > m_minHeight) && (MaxHeight > MinHeight)) {
+        // The heights already span [m_minHeight, m_maxHeight] so there's no need to scan
+        // for the range, and the grid only has to scale its heights and normals
+        float SrcMin = m_minHeight;
+        float Scale = (MaxHeight - MinHeight) / (m_maxHeight - m_minHeight);
+        RemapF32(m_heightMap.GetBaseAddr(), m_heightMap.GetSize(), SrcMin, Scale, MinHeight);
+        m_heightMips.Remap(SrcMin, Scale, MinHeight);
+
+        SetMinMaxHeight(MinHeight, MaxHeight);
+
+        m_geomipGrid.RescaleHeights(m_heightMap, SrcMin, Scale, MinHeight);
+        return;
+    }
+
+    // To or from a flat terrain the normals are computed again
+    if (m_maxHeight > m_minHeight) {
+        float Scale = (MaxHeight - MinHeight) / (m_maxHeight - m_minHeight);
+        RemapF32(m_heightMap.GetBaseAddr(), m_heightMap.GetSize(), m_minHeight, Scale, MinHeight);
+        m_heightMips.Remap(m_minHeight, Scale, MinHeight);
+    } else {
+        m_heightMap.Normalize(MinHeight, MaxHeight);
+        m_heightMips.Build(m_heightMap);
+    }
+
+    SetMinMaxHeight(MinHeight, MaxHeight);
+
+    m_geomipGrid.UpdateHeights(m_heightMap, m_textureScale);
+}
+
+
 void BaseTerrain::SetTextureHeights(float Tex0Height, float Tex1Height, float Tex2Height, float Tex3Height)
 {
     m_terrainTech.SetTextureHeights(Tex0Height, Tex1Height, Tex2Height, Tex3Height);
@@ -189,6 +688,10 @@ void BaseTerrain::SetTextureHeights(float Tex0Height, float Tex1Height, float Te
 
 float BaseTerrain::GetWorldHeight(float x, float z) const
 {
+    if (m_pPager) {
+        return m_pPager->GetWorldHeight(x, z);
+    }
+
     float HeightMapX = x / m_worldScale;
     float HeightMapZ = z / m_worldScale;
 
@@ -200,21 +703,23 @@ Vector3f BaseTerrain::ConstrainCameraPosToTerrain(const Vector3f& CameraPos)
 {
     Vector3f NewCameraPos = CameraPos;
 
-    // Make sure camera doesn't go outside of the terrain bounds
-    if (CameraPos.x < 0.0f) {
-        NewCameraPos.x = 0.0f;
-    }
+    // Make sure camera doesn't go outside of the terrain bounds - the paged world has none
+    if (!m_pPager) {
+        if (CameraPos.x < 0.0f) {
+            NewCameraPos.x = 0.0f;
+        }
 
-    if (CameraPos.z < 0.0f) {
-        NewCameraPos.z = 0.0f;
-    }
+        if (CameraPos.z < 0.0f) {
+            NewCameraPos.z = 0.0f;
+        }
 
-    if (CameraPos.x >= GetWorldSize()) {
-        NewCameraPos.x = GetWorldSize() - 0.5f;
-    }
+        if (CameraPos.x >= GetWorldSize()) {
+            NewCameraPos.x = GetWorldSize() - 0.5f;
+        }
 
-    if (CameraPos.z >= GetWorldSize()) {
-        NewCameraPos.z = GetWorldSize() - 0.5f;
+        if (CameraPos.z >= GetWorldSize()) {
+            NewCameraPos.z = GetWorldSize() - 0.5f;
+        }
     }
 
     NewCameraPos.y = GetWorldHeight(CameraPos.x, CameraPos.z) + m_cameraHeight;
@@ -1,15 +1,24 @@
 #ifndef TERRAIN_H
 #define TERRAIN_H
 
+#include <future>
+#include <functional>
+#include <string>
+
 #include "ogldev_types.h"
 #include "ogldev_basic_glfw_camera.h"
 #include "ogldev_array_2d.h"
 #include "ogldev_texture.h"
 
 #include "geomip_grid.h"
+#include "quantized_height_map.h"
+#include "height_mip_pyramid.h"
+#include "terrain_cache.h"
 #include "terrain_technique.h"
 #include "ogldev_skydome.h"
 
+class TerrainPager;
+
 class BaseTerrain
 {
 public:
@@ -23,11 +32,65 @@ public:
 
     void Render(const BasicCamera& Camera);
 
+    // Terrain container with the height map, the terrain parameters and the
+    // precomputed geomip grid (see terrain_file.h)
     void LoadFromFile(const char* pFilename);
 
     void SaveToFile(const char* pFilename);
 
-    float GetHeight(int x, int z) const { return m_heightMap.Get(x, z); }
+    // Generated terrains are saved in pDir (created if needed) and loaded from there
+    // the next time they are created with the same parameters (see terrain_cache.h).
+    // NULL turns the cache off - the default.
+    void SetCacheDir(const char* pDir) { m_cacheDir = pDir ? pDir : ""; }
+
+    // With a pager the terrain is drawn from its tiles around the camera instead of the
+    // height map (which stays as it is) and the camera isn't kept within the world
+    // size. The textures, lights and sky are still the terrain's. NULL goes back to
+    // the height map. The pager isn't owned.
+    void SetPager(TerrainPager* pPager);
+
+    // Height map only, split into compressed tiles that can be loaded one by one
+    // (see tile_archive.h)
+    void SaveTileArchive(const char* pFilename, int TileSize);
+
+    // Height maps loaded from files are mapped and read on first access. This starts
+    // reading the rows of the patches within NumPatches of Pos (in world space) in the
+    // background so that the first frames don't wait for them.
+    void PrefetchHeightMap(const Vector3f& Pos, int NumPatches);
+
+    // Square grayscale PNG (8 or 16 bit) as the height map. Samples map to
+    // MinHeight..MaxHeight unless the file has its own range (see height_map_png.h).
+    void LoadFromPNG(const char* pFilename, int PatchSize, float MinHeight, float MaxHeight);
+
+    // 16 bit grayscale PNG of the height map
+    void SaveHeightMapImage(const char* pFilename);
+
+    // Same but the file is written in the background from a copy of the heights, so
+    // the terrain can change (or be destroyed) in the meantime
+    std::future<void> SaveHeightMapImageAsync(const char* pFilename);
+
+    float GetHeight(int x, int z) const { return m_quantizedHeights.IsEmpty() ? m_heightMap.Get(x, z) : m_quantizedHeights.Get(x, z); }
+
+    // Empty when the heights are quantized - see GetQuantizedHeightMap
+    const Array2D<float>& GetHeightMap() const { return m_heightMap; }
+
+    // NULL unless the heights are kept in 16 bits
+    const QuantizedHeightMap* GetQuantizedHeightMap() const { return m_quantizedHeights.IsEmpty() ? NULL : &m_quantizedHeights; }
+
+    // From the next build on the heights are kept in 16 bits (in memory, in the
+    // vertex buffer and in saved files) if the rounding error stays within Tolerance
+    void SetHeightQuantization(bool Enabled, float Tolerance);
+
+    // From the next build (or load) on the vertex buffer has 4 byte vertices - see
+    // GeomipGrid::SetCompactVertices
+    void SetCompactVertices(bool Enabled) { m_compactVertices = Enabled; }
+
+    // From the next build (or load) on the grid has height and normal textures instead
+    // of a vertex buffer - see GeomipGrid::SetHeightTextures
+    void SetHeightTextures(bool Enabled) { m_heightTextures = Enabled; }
+
+    // Min/max/average heights of ever coarser cells, built with the terrain
+    const HeightMipPyramid& GetHeightMips() const { return m_heightMips; }
 
     float GetHeightInterpolated(float x, float z) const;
 
@@ -37,23 +100,53 @@ public:
 
     int GetSize() const { return m_terrainSize; }
 
+    int GetPatchSize() const { return m_patchSize; }
+
     void SetTexture(Texture* pTexture) { m_pTextures[0] = pTexture; }
 
     void SetTextureHeights(float Tex0Height, float Tex1Height, float Tex2Height, float Tex3Height);
 
     void SetLightDir(const Vector3f& Dir) { m_lightDir = Dir; }
 
+    float GetMinHeight() const { return m_minHeight; }
+
     float GetMaxHeight() const { return m_maxHeight; }
 
+    // Rescales the current heights to the new range in place and refreshes the
+    // vertex buffer. Much cheaper than generating the terrain again.
+    void SetHeightRange(float MinHeight, float MaxHeight);
+
     float GetWorldSize() const { return m_terrainSize * m_worldScale; }
 
     Vector3f ConstrainCameraPosToTerrain(const Vector3f& CameraPos);
     float GetWorldHeight(float x, float z) const;
 
+    // Must be called once per frame on the render thread (before rendering). If a
+    // background build has finished, its height map and buffers replace the current
+    // ones and true is returned.
+    bool UpdateAsyncBuild();
+
+    bool IsAsyncBuildPending() const { return m_pPendingBuild != NULL; }
+
 protected:
 
+    // Runs GenerateFunc (which must init and fill the height map) followed by the CPU
+    // side of the geomip grid on a background thread. The current terrain keeps
+    // rendering until UpdateAsyncBuild swaps the new one in.
+    bool StartAsyncBuild(int TerrainSize, int PatchSize, float MinHeight, float MaxHeight,
+                         const std::function<void(Array2D<float>&)>& GenerateFunc);
+
     void LoadHeightMapFile(const char* pFilename);
 
+    // The parameters of BaseTerrain that end up in the built terrain - the generator
+    // adds its name and its own parameters
+    TerrainCacheKey GetCacheKey(const char* pGenerator, int TerrainSize, int PatchSize, float MinHeight, float MaxHeight) const;
+
+    // Loads the cached terrain and returns true if there is one for Key. Otherwise
+    // the next terrain that is built (by Finalize or by an async build) is saved
+    // under Key.
+    bool LoadFromCache(const TerrainCacheKey& Key);
+
     void SetMinMaxHeight(float MinHeight, float MaxHeight);
 
     void Finalize();
@@ -68,13 +161,54 @@ protected:
     float m_textureScale = 1.0f;
 
 private:
+
+    void CancelAsyncBuild();
+
+    void SetQuantizationUniforms();
+
+    // LoadFromFile that returns false instead of exiting if the file can't be used.
+    // The current terrain is kept in that case.
+    bool LoadTerrainFile(const char* pFilename);
+
+    TerrainFileHeader GetFileHeader(int TerrainSize, int PatchSize, float MinHeight, float MaxHeight) const;
+
+    // Doesn't touch GL if the grid is only prepared so the background build can use it
+    static void WriteTerrainFile(const char* pFilename, const TerrainFileHeader& Header, const Array2D<float>& HeightMap,
+                                 const QuantizedHeightMap& QuantizedHeights, const GeomipGrid& Grid, const HeightMipPyramid& HeightMips);
+
+    // SaveFunc writes the terrain file under the name it is given
+    static void SaveToCache(const std::string& CacheDir, const std::string& Path, const std::function<void(const char*)>& SaveFunc);
+
+    struct PendingBuild {
+        Array2D<float> HeightMap;
+        QuantizedHeightMap QuantizedHeights;
+        HeightMipPyramid HeightMips;
+        GeomipGrid Grid;
+        int TerrainSize = 0;
+        int PatchSize = 0;
+        float MinHeight = 0.0f;
+        float MaxHeight = 0.0f;
+        std::string CachePath;
+        std::future<void> Done;
+    };
+
+    PendingBuild* m_pPendingBuild = NULL;
     GeomipGrid m_geomipGrid;
+    QuantizedHeightMap m_quantizedHeights;
+    HeightMipPyramid m_heightMips;
+    bool m_quantizeHeights = false;
+    float m_quantizationTolerance = 0.0f;
+    bool m_compactVertices = false;
+    bool m_heightTextures = false;
+    std::string m_cacheDir;
+    std::string m_pendingCachePath;     // where the terrain that is being built goes
     float m_minHeight = 0.0f;
     float m_maxHeight = 0.0f;
     TerrainTechnique m_terrainTech;
     Vector3f m_lightDir;
     float m_cameraHeight = 2.0f;
     Skydome* m_pSkydome = NULL;
+    TerrainPager* m_pPager = NULL;
 };
 
 #endif
\ No newline at end of file
@@ -3,31 +3,111 @@
 layout (location = 0) in vec3 Position;
 layout (location = 1) in vec2 InTex;
 layout (location = 2) in vec3 InNormal;
+layout (location = 3) in uint InHeight;
 
 uniform mat4 gVP;
 uniform float gMinHeight;
 uniform float gMaxHeight;
 
+// 16 bit heights - Position.xy holds the world X and Z and InHeight the lattice
+// index modulo 2^16 (see quantized_height_map.h)
+uniform bool gQuantizedHeights;
+uniform float gHeightStep;
+uniform float gHeightOrigin;
+uniform float gTexCoordScale;
+uniform int gPatchHeightBase;
+
+// Compact vertices - only InHeight (decoded as above) and the octahedral normal in
+// InNormal.xy. The vertices are in blocks of gPatchSize x gPatchSize per patch, row
+// after row of patches, so gl_VertexID (which includes the base vertex) gives the
+// position in the grid.
+uniform bool gCompactVertices;
+uniform int gPatchSize;
+uniform int gNumPatchesX;
+uniform ivec2 gHeightMapSize;
+uniform float gWorldScale;
+
+// No vertex attributes at all - the vertices are laid out like the compact ones and
+// the heights (float, or 16 bit samples decoded as above) and the octahedral normals
+// are read from textures of the height map size
+uniform bool gHeightTextures;
+uniform sampler2D gHeightMap;
+uniform usampler2D gQuantizedHeightMap;
+uniform sampler2D gNormalMap;
+
 out vec4 Color;
 out vec2 Tex;
 out vec3 WorldPos;
 out vec3 Normal;
 
+float DecodeHeight(uint Sample)
+{
+    int Index = gPatchHeightBase + int((Sample - uint(gPatchHeightBase)) & 0xFFFFu);
+
+    return float(Index) * gHeightStep + gHeightOrigin;
+}
+
+vec3 DecodeOctahedral(vec2 Oct)
+{
+    vec3 n = vec3(Oct.x, 1.0 - abs(Oct.x) - abs(Oct.y), Oct.y);
+
+    if (n.y < 0.0) {
+        vec2 Signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.z >= 0.0 ? 1.0 : -1.0);
+        n.xz = (1.0 - abs(n.zx)) * Signs;
+    }
+
+    return normalize(n);
+}
+
 void main()
 {
-    gl_Position = gVP * vec4(Position, 1.0);
+    vec3 Pos = Position;
+    vec2 TexCoord = InTex;
+    vec3 VertexNormal = InNormal;
+
+    if (gCompactVertices || gHeightTextures) {
+        int BlockSize = gPatchSize * gPatchSize;
+        int Block = gl_VertexID / BlockSize;
+        int InBlock = gl_VertexID - Block * BlockSize;
+        ivec2 PatchPos = ivec2(Block % gNumPatchesX, Block / gNumPatchesX);
+        ivec2 GridPos = PatchPos * (gPatchSize - 1) + ivec2(InBlock % gPatchSize, InBlock / gPatchSize);
+
+        // The edge patches can stick out of the height map
+        GridPos = min(GridPos, gHeightMapSize - 1);
+        vec2 XZ = vec2(GridPos) * gWorldScale;
+
+        float Height;
+        vec2 Oct;
+
+        if (gHeightTextures) {
+            Height = gQuantizedHeights ? DecodeHeight(texelFetch(gQuantizedHeightMap, GridPos, 0).r) : texelFetch(gHeightMap, GridPos, 0).r;
+            Oct = texelFetch(gNormalMap, GridPos, 0).rg;
+        } else {
+            Height = DecodeHeight(InHeight);
+            Oct = InNormal.xy;
+        }
+
+        Pos = vec3(XZ.x, Height, XZ.y);
+        TexCoord = XZ * gTexCoordScale;
+        VertexNormal = DecodeOctahedral(Oct);
+    } else if (gQuantizedHeights) {
+        Pos = vec3(Position.x, DecodeHeight(InHeight), Position.y);
+        TexCoord = Position.xy * gTexCoordScale;
+    }
+
+    gl_Position = gVP * vec4(Pos, 1.0);
 
     float DeltaHeight = gMaxHeight - gMinHeight;
 
-    float HeightRatio = (Position.y - gMinHeight) / DeltaHeight;
+    float HeightRatio = (Pos.y - gMinHeight) / DeltaHeight;
 
     float c = HeightRatio * 0.8 + 0.2;
 
     Color = vec4(c, c, c, 1.0);
 
-    Tex = InTex;
+    Tex = TexCoord;
     
-    WorldPos = Position;
+    WorldPos = Pos;
     
-    Normal = InNormal;
+    Normal = VertexNormal;
 }
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "terrain_cache.h"
+
+
+void TerrainCacheKey::Add(const void* pData, size_t Size)
+{
+    const u8* p = (const u8*)pData;
+
+    for (size_t i = 0; i < Size; i++) {
+        m_hash ^= p[i];
+        m_hash *= 1099511628211ULL;
+    }
+}
+
+
+void TerrainCacheKey::Add(const char* pString)
+{
+    Add(pString, strlen(pString) + 1);
+}
+
+
+std::string GetTerrainCachePath(const char* pDir, const TerrainCacheKey& Key)
+{
+    char Filename[64];
+    snprintf(Filename, sizeof(Filename), "terrain_%016llx.otrn", (unsigned long long)Key.GetHash());
+
+    return std::string(pDir) + "/" + Filename;
+}
+
+
+bool IsTerrainCached(const std::string& Path)
+{
+    struct stat StatBuf;
+
+    return (stat(Path.c_str(), &StatBuf) == 0) && (StatBuf.st_mode & S_IFREG);
+}
+
+
+bool CreateTerrainCacheDir(const char* pDir)
+{
+#ifdef _WIN32
+    int Error = _mkdir(pDir);
+#else
+    int Error = mkdir(pDir, 0755);
+#endif
+
+    if (Error && (errno != EEXIST)) {
+        printf("Error creating the terrain cache directory '%s': %s\n", pDir, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
\ No newline at end of file
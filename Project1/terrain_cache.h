@@ -0,0 +1,47 @@
+#ifndef TERRAIN_CACHE_H
+#define TERRAIN_CACHE_H
+
+#include <string>
+
+#include "ogldev_types.h"
+
+// Disk cache of generated terrains. A terrain is saved as a terrain file (see
+// terrain_file.h) named after a hash of everything it was generated from, so the
+// next build with the same parameters maps the file and uploads the stored vertex
+// and index buffers instead of generating anything.
+
+// Part of every key - bump it when a generator or the built data changes in a way
+// that the parameters don't show
+#define TERRAIN_CACHE_VERSION 3
+
+// 64 bit FNV-1a of the parameters in the order they are added
+class TerrainCacheKey {
+public:
+    TerrainCacheKey() {}
+
+    void Add(const void* pData, size_t Size);
+
+    void Add(int Value) { Add(&Value, sizeof(Value)); }
+
+    void Add(uint Value) { Add(&Value, sizeof(Value)); }
+
+    void Add(float Value) { Add(&Value, sizeof(Value)); }
+
+    // Includes the terminator so that consecutive strings can't run into each other
+    void Add(const char* pString);
+
+    u64 GetHash() const { return m_hash; }
+
+private:
+    u64 m_hash = 14695981039346656037ULL;
+};
+
+// <Dir>/terrain_<hash in hex>.otrn
+std::string GetTerrainCachePath(const char* pDir, const TerrainCacheKey& Key);
+
+bool IsTerrainCached(const std::string& Path);
+
+// Creates the directory if it doesn't exist. Returns false on error.
+bool CreateTerrainCacheDir(const char* pDir);
+
+#endif
\ No newline at end of file
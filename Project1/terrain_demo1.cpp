@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <glew.h>
 
@@ -19,15 +20,30 @@
 #include "demo_config.h"
 #include "texture_config.h"
 #include "midpoint_disp_terrain.h"
+#include "terrain_pager.h"
+#include "array_2d_benchmark.h"
+#include "tile_archive_benchmark.h"
+#include "normals_benchmark.h"
 
 #define WINDOW_WIDTH  2560
 #define WINDOW_HEIGHT 1440
 
+// Rows of patches of a mapped height map read ahead on each side of the camera
+#define PREFETCH_PATCHES 4
+
+#define PAGED_TILE_SIZE 257
+
 static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
 static void CursorPosCallback(GLFWwindow* window, double x, double y);
 static void MouseButtonCallback(GLFWwindow* window, int Button, int Action, int Mode);
+static bool FileExists(const char* pFilename);
 
 static int g_seed = 4428;
+static bool g_cacheTerrain = false;     // with a fixed seed (--seed) the terrain is the same every launch
+static bool g_pagedTerrain = false;     // --paged: endless noise terrain streamed in tiles around the camera
+static const char* g_tileArchiveFile = NULL;    // --paged <file>: the tiles come from an archive instead of noise
+static const char* g_heightMapFile = NULL;  // --heightmap <file.png>: the terrain comes from a grayscale PNG
+static const char* g_terrainFile = NULL;    // --terrain <file>: a terrain saved with SaveToFile, mapped
 unsigned int m_numMainBodyIndices;
 unsigned int m_numTailIndices;
 extern int gShowPoints;
@@ -776,6 +792,7 @@ public:
         InitCallbacks();
         InitTerrain();
         InitCamera();
+        PrefetchHeightMap();
         InitPlayerCube();
 		InitBirds();
         InitGUI();
@@ -1055,6 +1072,14 @@ public:
 
             glfwPollEvents();
 
+            // Swap in a terrain that finished building in the background
+            if (m_terrain.UpdateAsyncBuild() && (m_terrain.GetMaxHeight() != m_maxHeight)) {
+                // The slider moved while the terrain was building
+                UpdateHeightRange();
+            }
+
+            PrefetchHeightMap();
+
             if (m_cubeControlMode) {
                 Vector3f moveDirection(0.0f, 0.0f, 0.0f);
 
@@ -1122,8 +1147,20 @@ public:
 
                 ImGui::Begin("Terrain Demo 12 - Cube Follows Camera");
 
+                // Only the range changes so the current terrain is rescaled in place - once
+                // the slider is let go, not on every step of the drag
                 ImGui::SliderFloat("Max height", &this->m_maxHeight, 0.0f, 1000.0f);
+
+                if (ImGui::IsItemDeactivatedAfterEdit()) {
+                    UpdateHeightRange();
+                }
+
                 ImGui::SliderFloat("Terrain roughness", &this->m_roughness, 0.0f, 5.0f);
+                ImGui::SliderInt("Erosion iterations", &this->m_erosionParams.Iterations, 0, 500);
+                ImGui::SliderFloat("Erosion talus", &this->m_erosionParams.Talus, 0.0f, 10.0f);
+                ImGui::Checkbox("16 bit heights", &m_quantizeHeights);
+                ImGui::Checkbox("Compact vertices", &m_compactVertices);
+                ImGui::Checkbox("Height textures", &m_heightTextures);
 
                 static float Height0 = 64.0f;
                 static float Height1 = 128.0f;
@@ -1135,13 +1172,29 @@ public:
                 ImGui::SliderFloat("Height2", &Height2, 128.0f, 192.0f);
                 ImGui::SliderFloat("Height3", &Height3, 192.0f, 256.0f);
 
-                if (ImGui::Button("Generate")) {
-                    m_terrain.Destroy();
-                    srand(g_seed);
-                    m_terrain.CreateMidpointDisplacement(m_terrainSize, m_patchSize, m_roughness, m_minHeight, m_maxHeight);
+                if (m_terrain.IsAsyncBuildPending()) {
+                    ImGui::Text("Generating terrain...");
+                }
+                else if (ImGui::Button("Generate")) {
+                    m_terrain.SetErosionParams(m_erosionParams);
+                    m_terrain.SetHeightQuantization(m_quantizeHeights, m_quantizationTolerance);
+                    m_terrain.SetCompactVertices(m_compactVertices);
+                    m_terrain.SetHeightTextures(m_heightTextures);
+                    m_terrain.CreateMidpointDisplacementAsync(m_terrainSize, m_patchSize, m_roughness, m_minHeight, m_maxHeight, g_seed);
+
+                    // A cached terrain is mapped right away - its rows are read ahead again
+                    m_prefetchPatchRow = INT_MIN;
                     m_terrain.SetTextureHeights(Height0, Height1, Height2, Height3);
                 }
 
+                // Written in the background - the terrain keeps rendering meanwhile
+                if (m_saveHeightMap.valid() && (m_saveHeightMap.wait_for(std::chrono::seconds(0)) != std::future_status::ready)) {
+                    ImGui::Text("Saving height map...");
+                }
+                else if (ImGui::Button("Save height map")) {
+                    m_saveHeightMap = m_terrain.SaveHeightMapImageAsync("heightmap16.png");
+                }
+
                 Vector3f cubePos = m_pPlayerCube->GetPosition();
                 Vector3f cameraPos = m_pGameCamera->GetPos();
                 ImGui::Text("Camera Position: (%.1f, %.1f, %.1f)", cameraPos.x, cameraPos.y, cameraPos.z);
@@ -1403,7 +1456,53 @@ private:
         TextureFilenames.push_back("water.png");
 
         m_terrain.InitTerrain(WorldScale, TextureScale, TextureFilenames);
-        m_terrain.CreateMidpointDisplacement(m_terrainSize, m_patchSize, m_roughness, m_minHeight, m_maxHeight);
+
+        if (g_cacheTerrain) {
+            m_terrain.SetCacheDir("terrain_cache");
+        }
+
+        // The pager doesn't draw the terrain - it is only generated to write a missing archive
+        bool HaveArchive = g_tileArchiveFile && FileExists(g_tileArchiveFile);
+        bool NeedTerrain = !g_pagedTerrain || (g_tileArchiveFile && !HaveArchive);
+
+        if (g_terrainFile) {
+            m_terrain.LoadFromFile(g_terrainFile);
+
+            m_minHeight = m_terrain.GetMinHeight();
+            m_maxHeight = m_terrain.GetMaxHeight();
+        } else if (g_heightMapFile) {
+            m_terrain.LoadFromPNG(g_heightMapFile, m_patchSize, m_minHeight, m_maxHeight);
+
+            // The file can have its own height range
+            m_minHeight = m_terrain.GetMinHeight();
+            m_maxHeight = m_terrain.GetMaxHeight();
+        } else if (NeedTerrain) {
+            m_terrain.CreateMidpointDisplacement(m_terrainSize, m_patchSize, m_roughness, m_minHeight, m_maxHeight, g_seed);
+        }
+
+        if (g_tileArchiveFile) {
+            if (!HaveArchive) {
+                m_terrain.SaveTileArchive(g_tileArchiveFile, PAGED_TILE_SIZE);
+                printf("Tile archive '%s' written\n", g_tileArchiveFile);
+            }
+
+            m_tileArchive.Open(g_tileArchiveFile);
+
+            // The archive heights are used as they are
+            m_minHeight = m_tileArchive.GetHeader().MinHeight;
+            m_maxHeight = m_tileArchive.GetHeader().MaxHeight;
+
+            m_pager.Init(m_tileArchive.GetTileSize(), m_patchSize, WorldScale, 8, m_minHeight, m_maxHeight);
+            m_pager.SetArchiveSource(&m_tileArchive);
+            m_terrain.SetPager(&m_pager);
+        } else if (g_pagedTerrain) {
+            NoiseParams Params;
+            Params.Seed = g_seed;
+
+            m_pager.Init(PAGED_TILE_SIZE, m_patchSize, WorldScale, 8, m_minHeight, m_maxHeight);
+            m_pager.SetNoiseSource(Params);
+            m_terrain.SetPager(&m_pager);
+        }
 
         Vector3f LightDir(0.0f, -1.0f, 0.0f);
         m_terrain.SetLightDir(LightDir);
@@ -1422,6 +1521,34 @@ private:
         ImGui_ImplOpenGL3_Init(glsl_version);
     }
 
+    // Loaded (and cached) terrains have their height map mapped from the file. Its rows
+    // around the camera are read ahead at the start and whenever the camera gets to
+    // another row of patches.
+    void PrefetchHeightMap()
+    {
+        float PatchWorldSize = m_terrain.GetWorldScale() * (m_terrain.GetPatchSize() - 1);
+
+        if (PatchWorldSize <= 0.0f) {
+            return;
+        }
+
+        Vector3f CameraPos = m_pGameCamera->GetPos();
+        int PatchRow = (int)floorf(CameraPos.z / PatchWorldSize);
+
+        if (PatchRow != m_prefetchPatchRow) {
+            m_terrain.PrefetchHeightMap(CameraPos, PREFETCH_PATCHES);
+            m_prefetchPatchRow = PatchRow;
+        }
+    }
+
+    // Skipped while a build is pending - the new terrain is rescaled when it arrives
+    void UpdateHeightRange()
+    {
+        if ((m_maxHeight > m_minHeight) && !m_terrain.IsAsyncBuildPending()) {
+            m_terrain.SetHeightRange(m_minHeight, m_maxHeight);
+        }
+    }
+
     void ConstrainCameraToTerrain()
     {
         Vector3f NewCameraPos = m_terrain.ConstrainCameraPosToTerrain(m_pGameCamera->GetPos());
@@ -1433,13 +1560,22 @@ private:
     PlayerCube* m_pPlayerCube = NULL;
     bool m_isWireframe = false;
     MidpointDispTerrain m_terrain;
+    TileArchive m_tileArchive;      // before the pager, which loads from it until it is destroyed
+    TerrainPager m_pager;
     bool m_showGui = false;
     bool m_isPaused = false;
     int m_terrainSize = 513;
     float m_roughness = 0.4f;
+    bool m_quantizeHeights = false;
+    bool m_compactVertices = false;
+    bool m_heightTextures = false;
+    std::future<void> m_saveHeightMap;
+    float m_quantizationTolerance = 0.05f;
+    int m_prefetchPatchRow = INT_MIN;
     float m_minHeight = 30.0f;
     float m_maxHeight = 400.0f;
     int m_patchSize = 17;
+    ErosionParams m_erosionParams;
     bool m_constrainCamera = false;
     double m_lastFrameTime;
     double m_deltaTime;
@@ -1477,6 +1613,19 @@ static void CursorPosCallback(GLFWwindow* window, double x, double y)
     app->PassiveMouseCB((int)x, (int)y);
 }
 
+static bool FileExists(const char* pFilename)
+{
+    FILE* f = fopen(pFilename, "rb");
+
+    if (!f) {
+        return false;
+    }
+
+    fclose(f);
+    return true;
+}
+
+
 static void MouseButtonCallback(GLFWwindow* window, int Button, int Action, int Mode)
 {
     double x, y;
@@ -1486,11 +1635,50 @@ static void MouseButtonCallback(GLFWwindow* window, int Button, int Action, int
 
 int main(int argc, char** argv)
 {
+    if ((argc > 1) && (strcmp(argv[1], "--bench-layout") == 0)) {
+        int TerrainSize = (argc > 2) ? atoi(argv[2]) : 4097;
+        RunArray2DLayoutBenchmark(TerrainSize, 33);
+        return 0;
+    }
+
+    if ((argc > 1) && (strcmp(argv[1], "--bench-tiles") == 0)) {
+        int TerrainSize = (argc > 2) ? atoi(argv[2]) : 4097;
+        int TileSize = (argc > 3) ? atoi(argv[3]) : 257;
+        RunTileArchiveBenchmark(TerrainSize, TileSize);
+        return 0;
+    }
+
+    if ((argc > 1) && (strcmp(argv[1], "--bench-normals") == 0)) {
+        int TerrainSize = (argc > 2) ? atoi(argv[2]) : 4097;
+        RunNormalsBenchmark(TerrainSize);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--paged") == 0) {
+            g_pagedTerrain = true;
+
+            if ((i + 1 < argc) && (argv[i + 1][0] != '-')) {
+                g_tileArchiveFile = argv[++i];
+            }
+        } else if ((strcmp(argv[i], "--heightmap") == 0) && (i + 1 < argc)) {
+            g_heightMapFile = argv[++i];
+        } else if ((strcmp(argv[i], "--terrain") == 0) && (i + 1 < argc)) {
+            g_terrainFile = argv[++i];
+        }
+    }
+
+    if ((argc > 2) && (strcmp(argv[1], "--seed") == 0)) {
+        g_seed = atoi(argv[2]);
+        g_cacheTerrain = true;
+    } else {
 #ifdef _WIN64
-    g_seed = GetCurrentProcessId();
+        g_seed = GetCurrentProcessId();
 #else
-    g_seed = getpid();
+        g_seed = getpid();
 #endif
+    }
+
     printf("random seed %d\n", g_seed);
 
     srand(g_seed);
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "terrain_file.h"
+#include "mapped_file.h"
+
+#define TERRAIN_FILE_ALIGNMENT 8
+
+
+static size_t CalcPadding(size_t Size)
+{
+    return (TERRAIN_FILE_ALIGNMENT - Size % TERRAIN_FILE_ALIGNMENT) % TERRAIN_FILE_ALIGNMENT;
+}
+
+
+static FILE* OpenFile(const char* pFilename, const char* pMode)
+{
+    FILE* f = NULL;
+
+#ifdef _WIN32
+    fopen_s(&f, pFilename, pMode);
+#else
+    f = fopen(pFilename, pMode);
+#endif
+
+    if (!f) {
+        printf("Error opening '%s': %s\n", pFilename, strerror(errno));
+        exit(0);
+    }
+
+    return f;
+}
+
+
+TerrainFileWriter::~TerrainFileWriter()
+{
+    if (m_pFile) {
+        Close();
+    }
+}
+
+
+void TerrainFileWriter::Open(const char* pFilename, const TerrainFileHeader& Header)
+{
+    if (m_pFile) {
+        printf("%s: the previous file wasn't closed\n", __FUNCTION__);
+        exit(0);
+    }
+
+    m_pFile = OpenFile(pFilename, "wb");
+
+    m_header = Header;
+    m_header.NumSections = 0;
+
+    // Rewritten with the final number of sections by Close
+    WriteBytes(&m_header, sizeof(m_header));
+}
+
+
+void TerrainFileWriter::BeginSection(u32 Type, size_t Size)
+{
+    EndSection();
+
+    TerrainFileSection Section;
+    Section.Type = Type;
+    Section.Size = Size;
+
+    WriteBytes(&Section, sizeof(Section));
+
+    m_sectionSize = Size;
+    m_sectionWritten = 0;
+    m_inSection = true;
+    m_header.NumSections++;
+}
+
+
+void TerrainFileWriter::Write(const void* pData, size_t Size)
+{
+    if (!m_inSection || (m_sectionWritten + Size > m_sectionSize)) {
+        printf("%s: writing %zu bytes past the end of the section (%zu of %zu written)\n", __FUNCTION__, Size, m_sectionWritten, m_sectionSize);
+        exit(0);
+    }
+
+    WriteBytes(pData, Size);
+
+    m_sectionWritten += Size;
+}
+
+
+void TerrainFileWriter::AddSection(u32 Type, const void* pData, size_t Size)
+{
+    BeginSection(Type, Size);
+
+    Write(pData, Size);
+}
+
+
+void TerrainFileWriter::EndSection()
+{
+    if (!m_inSection) {
+        return;
+    }
+
+    if (m_sectionWritten != m_sectionSize) {
+        printf("%s: section size is %zu but only %zu bytes were written\n", __FUNCTION__, m_sectionSize, m_sectionWritten);
+        exit(0);
+    }
+
+    u8 Zeros[TERRAIN_FILE_ALIGNMENT] = { 0 };
+    WriteBytes(Zeros, CalcPadding(m_sectionSize));
+
+    m_inSection = false;
+}
+
+
+void TerrainFileWriter::Close()
+{
+    EndSection();
+
+    fseek(m_pFile, 0, SEEK_SET);
+    WriteBytes(&m_header, sizeof(m_header));
+
+    fclose(m_pFile);
+    m_pFile = NULL;
+}
+
+
+void TerrainFileWriter::WriteBytes(const void* pData, size_t Size)
+{
+    if (fwrite(pData, 1, Size, m_pFile) != Size) {
+        printf("Error writing terrain file: %s\n", strerror(errno));
+        exit(0);
+    }
+}
+
+
+TerrainFileReader::~TerrainFileReader()
+{
+    if (m_pMapping) {
+        UnmapFile(m_pMapping, m_mappingSize);
+    }
+}
+
+
+bool TerrainFileReader::Load(const char* pFilename)
+{
+    if (m_pMapping) {
+        UnmapFile(m_pMapping, m_mappingSize);
+        m_pMapping = NULL;
+    }
+
+    m_pData = NULL;
+    m_sections.clear();
+
+    size_t FileSize = GetFileSize(pFilename);
+
+    if (FileSize < sizeof(m_header)) {
+        printf("%s: '%s' is too short for a terrain file\n", __FUNCTION__, pFilename);
+        return false;
+    }
+
+    m_pData = (const u8*)MapFile(pFilename, 0, FileSize, m_pMapping, m_mappingSize);
+
+    memcpy(&m_header, m_pData, sizeof(m_header));
+
+    if (memcmp(m_header.Magic, TerrainFileHeader().Magic, sizeof(m_header.Magic)) != 0) {
+        printf("%s: '%s' is not a terrain file\n", __FUNCTION__, pFilename);
+        return false;
+    }
+
+    if ((m_header.Version == 0) || (m_header.Version > TERRAIN_FILE_VERSION)) {
+        printf("%s: '%s' has version %u - only up to %d is supported\n", __FUNCTION__, pFilename, m_header.Version, TERRAIN_FILE_VERSION);
+        return false;
+    }
+
+    if ((m_header.Width < 2) || (m_header.Depth < 2) || (m_header.PatchSize < 3)) {
+        printf("%s: '%s' has an invalid size %dx%d (patch size %d)\n", __FUNCTION__, pFilename, m_header.Width, m_header.Depth, m_header.PatchSize);
+        return false;
+    }
+
+    // Before the table is allocated
+    if (m_header.NumSections > (FileSize - sizeof(m_header)) / sizeof(TerrainFileSection)) {
+        printf("%s: '%s' is too short for %u sections\n", __FUNCTION__, pFilename, m_header.NumSections);
+        return false;
+    }
+
+    std::vector<SectionEntry> Sections(m_header.NumSections);
+
+    size_t Offset = sizeof(m_header);
+
+    for (u32 i = 0; i < m_header.NumSections; i++) {
+        TerrainFileSection Section;
+
+        if (FileSize - Offset < sizeof(Section)) {
+            printf("%s: '%s' is truncated in the header of section %u\n", __FUNCTION__, pFilename, i);
+            return false;
+        }
+
+        memcpy(&Section, m_pData + Offset, sizeof(Section));
+        Offset += sizeof(Section);
+
+        if (Section.Size > FileSize - Offset) {
+            printf("%s: '%s' is truncated in section %u (type %u, %llu bytes)\n", __FUNCTION__, pFilename, i, Section.Type, (unsigned long long)Section.Size);
+            return false;
+        }
+
+        Sections[i].Type = Section.Type;
+        Sections[i].Offset = Offset;
+        Sections[i].Size = (size_t)Section.Size;
+
+        // The padding of the last section may be missing
+        Offset += std::min((size_t)Section.Size + CalcPadding((size_t)Section.Size), FileSize - Offset);
+    }
+
+    m_sections.swap(Sections);
+
+    return true;
+}
+
+
+const void* TerrainFileReader::GetSection(u32 Type, size_t& Size) const
+{
+    size_t Offset = 0;
+
+    if (!FindSection(Type, Offset, Size)) {
+        return NULL;
+    }
+
+    return m_pData + Offset;
+}
+
+
+bool TerrainFileReader::FindSection(u32 Type, size_t& Offset, size_t& Size) const
+{
+    for (size_t i = 0; i < m_sections.size(); i++) {
+        if (m_sections[i].Type == Type) {
+            Offset = m_sections[i].Offset;
+            Size = m_sections[i].Size;
+            return true;
+        }
+    }
+
+    Offset = 0;
+    Size = 0;
+
+    return false;
+}
@@ -0,0 +1,128 @@
+#ifndef TERRAIN_FILE_H
+#define TERRAIN_FILE_H
+
+#include <stdio.h>
+#include <vector>
+
+#include "ogldev_types.h"
+
+// Binary terrain container:
+//
+//     TerrainFileHeader
+//     NumSections x (TerrainFileSection, Size bytes of data, padding to 8 bytes)
+//
+// Only the height map is required - either as floats or quantized. The others hold data that is otherwise
+// computed from the heights when the terrain is built - if they are present (and
+// match the header) loading skips that work. Readers skip sections they don't know
+// so new ones can be added without bumping the version. Values are stored in the
+// byte order of the machine that wrote the file (little endian on all our targets).
+
+#define TERRAIN_FILE_VERSION 2
+
+// Version 2 stores the geomip grid as a block of vertices per patch with 16 bit
+// patch local indices. The grid sections of older files are ignored and the grid
+// is built from their heights.
+#define TERRAIN_FILE_PATCH_BLOCKS_VERSION 2
+
+enum TERRAIN_FILE_SECTION {
+    TERRAIN_SECTION_HEIGHTS = 1,        // Width x Depth floats, row major
+    TERRAIN_SECTION_PATCH_BOUNDS = 2,   // min/max height of every patch
+    TERRAIN_SECTION_VERTICES = 3,       // the geomip grid vertex buffer - a block of positions, texture coordinates and normals per patch
+    TERRAIN_SECTION_LOD_TABLES = 4,     // the geomip grid LOD index ranges followed by the 16 bit index buffer
+    TERRAIN_SECTION_QUANTIZED_PATCHES = 5,  // lattice and per patch bases of the 16 bit heights
+    TERRAIN_SECTION_QUANTIZED_HEIGHTS = 6,  // Width x Depth 16 bit samples, row major
+    TERRAIN_SECTION_QUANTIZED_VERTICES = 7, // the geomip grid vertex buffer with 16 bit heights and normals
+    TERRAIN_SECTION_HEIGHT_MIPS = 8,        // min/max/average pyramid of the heights (see height_mip_pyramid.h)
+    TERRAIN_SECTION_COMPACT_VERTICES = 9,   // the geomip grid vertex buffer with 16 bit heights and octahedral normals only
+    TERRAIN_SECTION_NORMAL_MAP = 10,        // Width x Depth octahedral normals (2 signed bytes), row major - for grids without a vertex buffer
+};
+
+struct TerrainFileHeader {
+    char Magic[4] = { 'O', 'T', 'R', 'N' };
+    u32 Version = TERRAIN_FILE_VERSION;
+    i32 Width = 0;                      // of the height map
+    i32 Depth = 0;
+    i32 PatchSize = 0;
+    float WorldScale = 1.0f;
+    float TextureScale = 1.0f;
+    float MinHeight = 0.0f;
+    float MaxHeight = 0.0f;
+    u32 NumSections = 0;
+};
+
+struct TerrainFileSection {
+    u32 Type = 0;
+    u32 Flags = 0;                      // reserved - must be zero
+    u64 Size = 0;                       // without the padding
+};
+
+
+// Writes the file front to back. A section is declared with its total size and
+// can then be written in as many pieces as needed.
+class TerrainFileWriter {
+public:
+    TerrainFileWriter() {}
+
+    ~TerrainFileWriter();
+
+    void Open(const char* pFilename, const TerrainFileHeader& Header);
+
+    void BeginSection(u32 Type, size_t Size);
+
+    void Write(const void* pData, size_t Size);
+
+    void AddSection(u32 Type, const void* pData, size_t Size);
+
+    // Completes the last section and writes the final section count into the header
+    void Close();
+
+private:
+    void EndSection();
+
+    void WriteBytes(const void* pData, size_t Size);
+
+    FILE* m_pFile = NULL;
+    TerrainFileHeader m_header;
+    size_t m_sectionSize = 0;
+    size_t m_sectionWritten = 0;
+    bool m_inSection = false;
+};
+
+
+// Maps the file (see mapped_file.h) and validates the section table - the sections
+// themselves are only read when they are used.
+class TerrainFileReader {
+public:
+    TerrainFileReader() {}
+
+    ~TerrainFileReader();
+
+    // Returns false (and says why) if the file is not a terrain file or is damaged
+    bool Load(const char* pFilename);
+
+    const TerrainFileHeader& GetHeader() const { return m_header; }
+
+    // Returns NULL if the file doesn't have the section. The data is 8 byte aligned.
+    const void* GetSection(u32 Type, size_t& Size) const;
+
+    // Position of the section data in the file - for mapping it separately
+    bool FindSection(u32 Type, size_t& Offset, size_t& Size) const;
+
+private:
+    TerrainFileReader(const TerrainFileReader&);
+    TerrainFileReader& operator=(const TerrainFileReader&);
+
+    struct SectionEntry {
+        u32 Type = 0;
+        size_t Offset = 0;
+        size_t Size = 0;
+    };
+
+    TerrainFileHeader m_header;
+    const u8* m_pData = NULL;
+    void* m_pMapping = NULL;
+    size_t m_mappingSize = 0;
+    std::vector<SectionEntry> m_sections;
+};
+
+#endif
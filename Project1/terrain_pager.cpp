@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#include "terrain_pager.h"
+#include "terrain_technique.h"
+#include "height_map_normals.h"
+#include "simd_utils.h"
+
+
+TerrainPager::~TerrainPager()
+{
+    Destroy();
+}
+
+
+void TerrainPager::Init(int TileSize, int PatchSize, float WorldScale, int TextureRepeats, float MinHeight, float MaxHeight)
+{
+    Destroy();
+
+    if ((PatchSize < 3) || (TileSize < PatchSize) || ((TileSize - 1) % (PatchSize - 1) != 0)) {
+        printf("%s: tile size %d isn't made of whole patches of size %d\n", __FUNCTION__, TileSize, PatchSize);
+        exit(0);
+    }
+
+    m_tileSize = TileSize;
+    m_patchSize = PatchSize;
+    m_worldScale = WorldScale;
+    m_minHeight = MinHeight;
+    m_maxHeight = MaxHeight;
+
+    // The grid maps the samples [0, TileSize) to [0, TextureScale) - this puts the
+    // last sample of a tile on a whole number of repeats, where the next tile starts
+    m_textureScale = (float)std::max(TextureRepeats, 1) * (float)TileSize / (float)(TileSize - 1);
+}
+
+
+void TerrainPager::SetTileSource(const TileSourceFunc& Source)
+{
+    Destroy();
+
+    m_source = Source;
+}
+
+
+void TerrainPager::SetNoiseSource(const NoiseParams& Params)
+{
+    int TileSize = m_tileSize;
+    float MinHeight = m_minHeight;
+    float Scale = (m_maxHeight - m_minHeight) / 2.0f;
+    NoiseParams ParamsCopy = Params;
+
+    SetTileSource([=](int TileX, int TileZ, Array2D<float>& HeightMap) {
+        NoiseTerrain::GenerateTile(HeightMap, TileX * (TileSize - 1) - 1, TileZ * (TileSize - 1) - 1, ParamsCopy);
+
+        // The noise is roughly in [-1, 1]. A fixed mapping (instead of normalizing
+        // every tile) keeps the shared edges identical.
+        RemapF32(HeightMap.GetBaseAddr(), HeightMap.GetSize(), -1.0f, Scale, MinHeight);
+
+        return true;
+    });
+}
+
+
+// The apron is the second row or column of the neighbouring tiles (the first one is
+// shared). On the edges of the archive it continues the slope of the edge instead,
+// which gives the same normals as the one sided differences of a single height map.
+static void LoadArchiveTile(const TileArchive* pArchive, int TileX, int TileZ, Array2D<float>& HeightMap)
+{
+    int TileSize = pArchive->GetTileSize();
+
+    Array2D<float> Tile;
+    pArchive->LoadTile(TileX, TileZ, Tile);
+
+    for (int z = 0; z < TileSize; z++) {
+        memcpy(HeightMap.GetAddr(1, z + 1), Tile.GetAddr(0, z), sizeof(float) * TileSize);
+    }
+
+    for (int Side = 0; Side < 2; Side++) {
+        int NeighbourX = Side ? TileX + 1 : TileX - 1;
+        int DstX = Side ? TileSize + 1 : 0;
+
+        if ((NeighbourX >= 0) && (NeighbourX < pArchive->GetNumTilesX())) {
+            pArchive->LoadTile(NeighbourX, TileZ, Tile);
+
+            int SrcX = Side ? 1 : TileSize - 2;
+
+            for (int z = 0; z < TileSize; z++) {
+                HeightMap.Set(DstX, z + 1, Tile.Get(SrcX, z));
+            }
+        } else {
+            int EdgeX = Side ? TileSize : 1;
+            int InnerX = Side ? TileSize - 1 : 2;
+
+            for (int z = 1; z <= TileSize; z++) {
+                HeightMap.Set(DstX, z, 2.0f * HeightMap.Get(EdgeX, z) - HeightMap.Get(InnerX, z));
+            }
+        }
+    }
+
+    for (int Side = 0; Side < 2; Side++) {
+        int NeighbourZ = Side ? TileZ + 1 : TileZ - 1;
+        float* pDst = HeightMap.GetAddr(1, Side ? TileSize + 1 : 0);
+
+        if ((NeighbourZ >= 0) && (NeighbourZ < pArchive->GetNumTilesZ())) {
+            pArchive->LoadTile(TileX, NeighbourZ, Tile);
+            memcpy(pDst, Tile.GetAddr(0, Side ? 1 : TileSize - 2), sizeof(float) * TileSize);
+        } else {
+            const float* pEdge = HeightMap.GetAddr(1, Side ? TileSize : 1);
+            const float* pInner = HeightMap.GetAddr(1, Side ? TileSize - 1 : 2);
+
+            for (int x = 0; x < TileSize; x++) {
+                pDst[x] = 2.0f * pEdge[x] - pInner[x];
+            }
+        }
+    }
+}
+
+
+// Moves the samples of the tile out of the apron map and keeps the apron for the normals
+static void SplitApron(const Array2D<float>& Apron, int TileSize, Array2D<float>& HeightMap, HeightMapBorder& Border)
+{
+    Border.Left.resize(TileSize);
+    Border.Right.resize(TileSize);
+    Border.Top.assign(Apron.GetAddr(1, 0), Apron.GetAddr(1, 0) + TileSize);
+    Border.Bottom.assign(Apron.GetAddr(1, TileSize + 1), Apron.GetAddr(1, TileSize + 1) + TileSize);
+
+    for (int z = 0; z < TileSize; z++) {
+        const float* pSrc = Apron.GetAddr(0, z + 1);
+
+        Border.Left[z] = pSrc[0];
+        memcpy(HeightMap.GetAddr(0, z), pSrc + 1, sizeof(float) * TileSize);
+        Border.Right[z] = pSrc[TileSize + 1];
+    }
+}
+
+
+void TerrainPager::SetArchiveSource(const TileArchive* pArchive)
+{
+    if (pArchive->GetTileSize() != m_tileSize) {
+        printf("%s: the archive has tiles of size %d instead of %d\n", __FUNCTION__, pArchive->GetTileSize(), m_tileSize);
+        exit(0);
+    }
+
+    SetTileSource([pArchive](int TileX, int TileZ, Array2D<float>& HeightMap) {
+        if ((TileX < 0) || (TileZ < 0) || (TileX >= pArchive->GetNumTilesX()) || (TileZ >= pArchive->GetNumTilesZ())) {
+            return false;
+        }
+
+        LoadArchiveTile(pArchive, TileX, TileZ, HeightMap);
+
+        return true;
+    });
+}
+
+
+TerrainPager::Tile* TerrainPager::FindTile(int TileX, int TileZ) const
+{
+    std::unordered_map<u64, Tile*>::const_iterator it = m_tiles.find(GetTileKey(TileX, TileZ));
+
+    return (it == m_tiles.end()) ? NULL : it->second;
+}
+
+
+TerrainPager::Tile* TerrainPager::StartLoading(int TileX, int TileZ)
+{
+    Tile* pTile = new Tile;
+    pTile->TileX = TileX;
+    pTile->TileZ = TileZ;
+    pTile->LastUsedFrame = m_frame;
+    pTile->Grid.SetStitchEdges(true);
+
+    m_tiles[GetTileKey(TileX, TileZ)] = pTile;
+    m_lru.push_front(pTile);
+    pTile->LruPos = m_lru.begin();
+    m_numPendingTiles++;
+
+    TileSourceFunc Source = m_source;
+    int TileSize = m_tileSize;
+    int PatchSize = m_patchSize;
+    float WorldScale = m_worldScale;
+    float TextureScale = m_textureScale;
+
+    // The background thread only touches the tile, which isn't used by the render
+    // thread until the future is ready
+    pTile->Loading = std::async(std::launch::async, [pTile, Source, TileSize, PatchSize, WorldScale, TextureScale]() {
+        Array2D<float> Apron;
+        Apron.InitArray2D(TileSize + 2, TileSize + 2);
+
+        if (!Source(pTile->TileX, pTile->TileZ, Apron)) {
+            pTile->Empty = true;
+            return;
+        }
+
+        HeightMapBorder Border;
+        pTile->HeightMap.InitArray2D(TileSize, TileSize);
+        SplitApron(Apron, TileSize, pTile->HeightMap, Border);
+
+        pTile->Grid.PrepareGeomipGrid(TileSize, TileSize, PatchSize, pTile->HeightMap, WorldScale, TextureScale, NULL, &Border);
+    });
+
+    return pTile;
+}
+
+
+void TerrainPager::FinishLoading(Tile* pTile)
+{
+    pTile->Loading.get();
+    m_numPendingTiles--;
+
+    // Empty tiles are cached too so that they aren't asked for again every frame
+    pTile->SizeInBytes = sizeof(Tile);
+
+    if (!pTile->Empty) {
+        // Tiles don't use the view space culling, the only thing the terrain is needed for
+        pTile->Grid.UploadGeomipGrid(NULL);
+        pTile->SizeInBytes += pTile->HeightMap.GetSizeInBytes() + pTile->Grid.GetSizeInBytes();
+    }
+
+    m_residentSize += pTile->SizeInBytes;
+}
+
+
+void TerrainPager::Update(const Vector3f& CameraPos)
+{
+    if (!m_source) {
+        return;
+    }
+
+    m_frame++;
+
+    float TileWorldSize = GetTileWorldSize();
+
+    int CameraTileX = (int)floorf(CameraPos.x / TileWorldSize);
+    int CameraTileZ = (int)floorf(CameraPos.z / TileWorldSize);
+
+    Tile* pCameraTile = FindTile(CameraTileX, CameraTileZ);
+
+    if (!pCameraTile) {
+        pCameraTile = StartLoading(CameraTileX, CameraTileZ);
+    }
+
+    for (std::list<Tile*>::iterator it = m_lru.begin(); it != m_lru.end(); it++) {
+        Tile* pTile = *it;
+
+        if (pTile->Loading.valid() && (pTile->Loading.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+            FinishLoading(pTile);
+        }
+    }
+
+    // Until the tile under the camera is ready the heights come from the last one
+    if (!pCameraTile->Loading.valid() && !pCameraTile->Empty) {
+        m_heightTileX = CameraTileX;
+        m_heightTileZ = CameraTileZ;
+        m_haveHeightTile = true;
+    }
+
+    struct MissingTile {
+        float Distance;
+        int TileX;
+        int TileZ;
+    };
+
+    std::vector<MissingTile> Missing;
+    m_visibleTiles.clear();
+
+    int MinTileX = (int)floorf((CameraPos.x - m_loadRadius) / TileWorldSize);
+    int MaxTileX = (int)floorf((CameraPos.x + m_loadRadius) / TileWorldSize);
+    int MinTileZ = (int)floorf((CameraPos.z - m_loadRadius) / TileWorldSize);
+    int MaxTileZ = (int)floorf((CameraPos.z + m_loadRadius) / TileWorldSize);
+
+    for (int TileZ = MinTileZ; TileZ <= MaxTileZ; TileZ++) {
+        for (int TileX = MinTileX; TileX <= MaxTileX; TileX++) {
+            // Distance from the camera to the closest point of the tile
+            float x0 = TileX * TileWorldSize;
+            float z0 = TileZ * TileWorldSize;
+            float dx = std::max(0.0f, std::max(x0 - CameraPos.x, CameraPos.x - (x0 + TileWorldSize)));
+            float dz = std::max(0.0f, std::max(z0 - CameraPos.z, CameraPos.z - (z0 + TileWorldSize)));
+            float Distance = sqrtf(dx * dx + dz * dz);
+
+            if (Distance > m_loadRadius) {
+                continue;
+            }
+
+            Tile* pTile = FindTile(TileX, TileZ);
+
+            if (!pTile) {
+                MissingTile t = { Distance, TileX, TileZ };
+                Missing.push_back(t);
+                continue;
+            }
+
+            pTile->LastUsedFrame = m_frame;
+            m_lru.splice(m_lru.begin(), m_lru, pTile->LruPos);
+
+            if (!pTile->Loading.valid() && !pTile->Empty) {
+                m_visibleTiles.push_back(pTile);
+            }
+        }
+    }
+
+    std::sort(Missing.begin(), Missing.end(), [](const MissingTile& l, const MissingTile& r) { return l.Distance < r.Distance; });
+
+    for (size_t i = 0; (i < Missing.size()) && (m_numPendingTiles < m_maxPendingTiles); i++) {
+        StartLoading(Missing[i].TileX, Missing[i].TileZ);
+    }
+
+    EvictTiles();
+}
+
+
+void TerrainPager::EvictTiles()
+{
+    std::list<Tile*>::iterator it = m_lru.end();
+
+    while ((m_residentSize > m_memoryBudget) && (it != m_lru.begin())) {
+        it--;
+
+        Tile* pTile = *it;
+
+        // The tiles in range are all at the front
+        if (pTile->LastUsedFrame == m_frame) {
+            break;
+        }
+
+        if (pTile->Loading.valid()) {
+            continue;
+        }
+
+        m_residentSize -= pTile->SizeInBytes;
+        m_tiles.erase(GetTileKey(pTile->TileX, pTile->TileZ));
+        it = m_lru.erase(it);
+        delete pTile;
+    }
+}
+
+
+void TerrainPager::Render(const Vector3f& CameraPos, const Matrix4f& ViewProj, TerrainTechnique* pTech)
+{
+    float TileWorldSize = GetTileWorldSize();
+
+    for (size_t i = 0; i < m_visibleTiles.size(); i++) {
+        Tile* pTile = m_visibleTiles[i];
+
+        Vector3f Origin(pTile->TileX * TileWorldSize, 0.0f, pTile->TileZ * TileWorldSize);
+
+        Matrix4f Translation;
+        Translation.InitTranslationTransform(Origin);
+
+        Matrix4f TileVP = ViewProj * Translation;
+        pTech->SetVP(TileVP);
+
+        pTile->Grid.Render(CameraPos - Origin, TileVP, pTech);
+    }
+}
+
+
+float TerrainPager::GetWorldHeight(float x, float z) const
+{
+    if (m_tileSize == 0) {
+        return m_minHeight;
+    }
+
+    float TileWorldSize = GetTileWorldSize();
+
+    int TileX = (int)floorf(x / TileWorldSize);
+    int TileZ = (int)floorf(z / TileWorldSize);
+
+    const Tile* pTile = FindTile(TileX, TileZ);
+
+    // The position is clamped to the edge of the last tile the camera was on
+    if ((!pTile || pTile->Loading.valid() || pTile->Empty) && m_haveHeightTile) {
+        TileX = m_heightTileX;
+        TileZ = m_heightTileZ;
+        pTile = FindTile(TileX, TileZ);
+    }
+
+    if (!pTile || pTile->Loading.valid() || pTile->Empty) {
+        return m_minHeight;
+    }
+
+    float HeightMapX = std::max(0.0f, std::min((x - TileX * TileWorldSize) / m_worldScale, (float)(m_tileSize - 1)));
+    float HeightMapZ = std::max(0.0f, std::min((z - TileZ * TileWorldSize) / m_worldScale, (float)(m_tileSize - 1)));
+
+    int x0 = std::min((int)HeightMapX, m_tileSize - 2);
+    int z0 = std::min((int)HeightMapZ, m_tileSize - 2);
+
+    float FactorX = HeightMapX - (float)x0;
+    float FactorZ = HeightMapZ - (float)z0;
+
+    const Array2D<float>& HeightMap = pTile->HeightMap;
+
+    float Bottom = (HeightMap.Get(x0 + 1, z0) - HeightMap.Get(x0, z0)) * FactorX + HeightMap.Get(x0, z0);
+    float Top = (HeightMap.Get(x0 + 1, z0 + 1) - HeightMap.Get(x0, z0 + 1)) * FactorX + HeightMap.Get(x0, z0 + 1);
+
+    return (Top - Bottom) * FactorZ + Bottom;
+}
+
+
+void TerrainPager::Destroy()
+{
+    // The tiles that are still loading are waited for before they are deleted
+    for (std::list<Tile*>::iterator it = m_lru.begin(); it != m_lru.end(); it++) {
+        if ((*it)->Loading.valid()) {
+            (*it)->Loading.wait();
+        }
+
+        delete *it;
+    }
+
+    m_tiles.clear();
+    m_lru.clear();
+    m_visibleTiles.clear();
+    m_numPendingTiles = 0;
+    m_residentSize = 0;
+    m_haveHeightTile = false;
+}
\ No newline at end of file
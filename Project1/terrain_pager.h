@@ -0,0 +1,141 @@
+#ifndef TERRAIN_PAGER_H
+#define TERRAIN_PAGER_H
+
+#include <future>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "ogldev_types.h"
+#include "ogldev_math_3d.h"
+#include "ogldev_array_2d.h"
+#include "geomip_grid.h"
+#include "noise_terrain.h"
+#include "tile_archive.h"
+#include "demo_config.h"
+
+class TerrainTechnique;
+
+// Terrain without edges made of square tiles around the camera. A tile has
+// TileSize x TileSize samples and shares its last row and column with its
+// neighbours (like the tiles of tile_archive.h) and has a geomip grid of its own.
+//
+// Tiles are generated or loaded together with the CPU half of their grid on
+// background threads as the camera moves and the render thread uploads them in
+// Update. Every tile is drawn relative to its own origin, so the vertices stay
+// small however far the camera goes, and the edge patches are stitched to the
+// LODs of the neighbouring tiles (see LodManager::SetStitchEdges).
+//
+// Tiles that fall out of range stay cached in LRU order until the resident tiles
+// go over the memory budget.
+class TerrainPager {
+public:
+    // Fills the height map of a tile with a one sample apron - it has TileSize + 2
+    // samples each way and sample (x + 1, z + 1) is sample (x, z) of the tile. The
+    // apron holds the next samples of the neighbouring tiles so that the normals along
+    // the tile edges are the same on both sides (its corners aren't used). Runs on
+    // background threads. Returns false if the world has no tile there.
+    typedef std::function<bool(int TileX, int TileZ, Array2D<float>& HeightMap)> TileSourceFunc;
+
+    TerrainPager() {}
+
+    ~TerrainPager();
+
+    // TileSize - 1 must be a multiple of PatchSize - 1 so the tiles are made of whole
+    // patches. The texture repeats TextureRepeats times across every tile so that
+    // it lines up along the seams.
+    void Init(int TileSize, int PatchSize, float WorldScale, int TextureRepeats, float MinHeight, float MaxHeight);
+
+    // Drops the resident tiles
+    void SetTileSource(const TileSourceFunc& Source);
+
+    // Unbounded world of noise (see NoiseTerrain::GenerateTile) in MinHeight..MaxHeight
+    void SetNoiseSource(const NoiseParams& Params);
+
+    // The tiles of the archive - its heights are used as they are so the pager should
+    // have the range of the archive. The tile size must match and the archive must
+    // stay open while the pager uses it.
+    void SetArchiveSource(const TileArchive* pArchive);
+
+    // Tiles closer than Radius (in world space) to the camera are loaded and drawn
+    void SetLoadRadius(float Radius) { m_loadRadius = Radius; }
+
+    // Out of range tiles are evicted while the resident ones use more than this
+    void SetMemoryBudget(size_t Bytes) { m_memoryBudget = Bytes; }
+
+    void SetMaxPendingTiles(int MaxPendingTiles) { m_maxPendingTiles = MaxPendingTiles; }
+
+    // Once per frame on the render thread. Starts loading the missing tiles in range
+    // (nearest first), uploads the finished ones and evicts. Nothing is waited for -
+    // the tile under the camera is started first and drawn once it is ready.
+    void Update(const Vector3f& CameraPos);
+
+    // pTech must be enabled. Leaves the VP of the last tile in pTech.
+    void Render(const Vector3f& CameraPos, const Matrix4f& ViewProj, TerrainTechnique* pTech);
+
+    // Where the tile isn't ready the height comes from the closest point of the last
+    // tile the camera was on, MinHeight before the first one is ready
+    float GetWorldHeight(float x, float z) const;
+
+    float GetMinHeight() const { return m_minHeight; }
+
+    float GetMaxHeight() const { return m_maxHeight; }
+
+    int GetNumResidentTiles() const { return (int)m_tiles.size(); }
+
+    size_t GetResidentSize() const { return m_residentSize; }
+
+    void Destroy();
+
+private:
+    TerrainPager(const TerrainPager&);
+    TerrainPager& operator=(const TerrainPager&);
+
+    struct Tile {
+        int TileX = 0;
+        int TileZ = 0;
+        bool Empty = false;             // the source has no tile here
+        int LastUsedFrame = 0;          // in range during this frame
+        size_t SizeInBytes = 0;         // once uploaded
+        Array2D<float> HeightMap;
+        GeomipGrid Grid;
+        std::list<Tile*>::iterator LruPos;
+        std::future<void> Loading;      // valid until the tile is uploaded
+    };
+
+    static u64 GetTileKey(int TileX, int TileZ) { return ((u64)(u32)TileX << 32) | (u32)TileZ; }
+
+    Tile* FindTile(int TileX, int TileZ) const;
+
+    Tile* StartLoading(int TileX, int TileZ);
+
+    void FinishLoading(Tile* pTile);
+
+    void EvictTiles();
+
+    float GetTileWorldSize() const { return (m_tileSize - 1) * m_worldScale; }
+
+    int m_tileSize = 0;
+    int m_patchSize = 0;
+    float m_worldScale = 1.0f;
+    float m_textureScale = 1.0f;
+    float m_minHeight = 0.0f;
+    float m_maxHeight = 0.0f;
+    float m_loadRadius = Z_FAR;
+    size_t m_memoryBudget = 256 * 1024 * 1024;
+    int m_maxPendingTiles = 2;
+    TileSourceFunc m_source;
+
+    std::unordered_map<u64, Tile*> m_tiles;
+    std::list<Tile*> m_lru;             // most recently used first
+    std::vector<Tile*> m_visibleTiles;  // uploaded tiles in range, from the last Update
+    int m_numPendingTiles = 0;
+    size_t m_residentSize = 0;
+    int m_frame = 0;
+    bool m_haveHeightTile = false;      // the last ready tile under the camera
+    int m_heightTileX = 0;
+    int m_heightTileZ = 0;
+};
+
+#endif
\ No newline at end of file
@@ -40,6 +40,20 @@ bool TerrainTechnique::Init()
     m_tex3UnitLoc = GetUniformLocation("gTextureHeight3");
     m_mainLightIntensityLoc = GetUniformLocation("gMainLightIntensity");
     m_secondLightIntensityLoc = GetUniformLocation("gSecondLightIntensity");
+    m_quantizedHeightsLoc = GetUniformLocation("gQuantizedHeights");
+    m_heightStepLoc = GetUniformLocation("gHeightStep");
+    m_heightOriginLoc = GetUniformLocation("gHeightOrigin");
+    m_texCoordScaleLoc = GetUniformLocation("gTexCoordScale");
+    m_patchHeightBaseLoc = GetUniformLocation("gPatchHeightBase");
+    m_compactVerticesLoc = GetUniformLocation("gCompactVertices");
+    m_patchSizeLoc = GetUniformLocation("gPatchSize");
+    m_numPatchesXLoc = GetUniformLocation("gNumPatchesX");
+    m_heightMapSizeLoc = GetUniformLocation("gHeightMapSize");
+    m_worldScaleLoc = GetUniformLocation("gWorldScale");
+    m_heightTexturesLoc = GetUniformLocation("gHeightTextures");
+    m_heightMapUnitLoc = GetUniformLocation("gHeightMap");
+    m_quantizedHeightMapUnitLoc = GetUniformLocation("gQuantizedHeightMap");
+    m_normalMapUnitLoc = GetUniformLocation("gNormalMap");
 
     if (m_VPLoc == INVALID_UNIFORM_LOCATION ||
         m_minHeightLoc == INVALID_UNIFORM_LOCATION ||
@@ -55,7 +69,21 @@ bool TerrainTechnique::Init()
         m_tex2UnitLoc == INVALID_UNIFORM_LOCATION ||
         m_tex3UnitLoc == INVALID_UNIFORM_LOCATION ||
         m_mainLightIntensityLoc == INVALID_UNIFORM_LOCATION ||
-        m_secondLightIntensityLoc == INVALID_UNIFORM_LOCATION) {
+        m_secondLightIntensityLoc == INVALID_UNIFORM_LOCATION ||
+        m_quantizedHeightsLoc == INVALID_UNIFORM_LOCATION ||
+        m_heightStepLoc == INVALID_UNIFORM_LOCATION ||
+        m_heightOriginLoc == INVALID_UNIFORM_LOCATION ||
+        m_texCoordScaleLoc == INVALID_UNIFORM_LOCATION ||
+        m_patchHeightBaseLoc == INVALID_UNIFORM_LOCATION ||
+        m_compactVerticesLoc == INVALID_UNIFORM_LOCATION ||
+        m_patchSizeLoc == INVALID_UNIFORM_LOCATION ||
+        m_numPatchesXLoc == INVALID_UNIFORM_LOCATION ||
+        m_heightMapSizeLoc == INVALID_UNIFORM_LOCATION ||
+        m_worldScaleLoc == INVALID_UNIFORM_LOCATION ||
+        m_heightTexturesLoc == INVALID_UNIFORM_LOCATION ||
+        m_heightMapUnitLoc == INVALID_UNIFORM_LOCATION ||
+        m_quantizedHeightMapUnitLoc == INVALID_UNIFORM_LOCATION ||
+        m_normalMapUnitLoc == INVALID_UNIFORM_LOCATION) {
         return false;
     }
 
@@ -66,6 +94,11 @@ bool TerrainTechnique::Init()
     glUniform1i(m_tex2UnitLoc, COLOR_TEXTURE_UNIT_INDEX_2);
     glUniform1i(m_tex3UnitLoc, COLOR_TEXTURE_UNIT_INDEX_3);
 
+    // The float and integer samplers can't share a unit
+    glUniform1i(m_heightMapUnitLoc, HEIGHT_MAP_TEXTURE_UNIT_INDEX);
+    glUniform1i(m_quantizedHeightMapUnitLoc, QUANTIZED_HEIGHT_MAP_TEXTURE_UNIT_INDEX);
+    glUniform1i(m_normalMapUnitLoc, NORMAL_MAP_TEXTURE_UNIT_INDEX);
+
     glUseProgram(0);
 
     return true;
@@ -101,6 +134,42 @@ void TerrainTechnique::SetLightDir(const Vector3f& Dir)
     glUniform3f(m_reversedLightDirLoc, ReversedLightDir.x, ReversedLightDir.y, ReversedLightDir.z);
 }
 
+void TerrainTechnique::SetQuantizedHeights(bool Enabled, float Step, float Origin, float TexCoordScale)
+{
+    glUniform1i(m_quantizedHeightsLoc, Enabled ? 1 : 0);
+    glUniform1f(m_heightStepLoc, Step);
+    glUniform1f(m_heightOriginLoc, Origin);
+    glUniform1f(m_texCoordScaleLoc, TexCoordScale);
+}
+
+
+void TerrainTechnique::SetPatchHeightBase(int Base)
+{
+    glUniform1i(m_patchHeightBaseLoc, Base);
+}
+
+
+void TerrainTechnique::SetGridLayout(int PatchSize, int NumPatchesX, int HeightMapWidth, int HeightMapDepth, float WorldScale)
+{
+    glUniform1i(m_patchSizeLoc, PatchSize);
+    glUniform1i(m_numPatchesXLoc, NumPatchesX);
+    glUniform2i(m_heightMapSizeLoc, HeightMapWidth, HeightMapDepth);
+    glUniform1f(m_worldScaleLoc, WorldScale);
+}
+
+
+void TerrainTechnique::SetCompactVertices(bool Enabled)
+{
+    glUniform1i(m_compactVerticesLoc, Enabled ? 1 : 0);
+}
+
+
+void TerrainTechnique::SetHeightTextures(bool Enabled)
+{
+    glUniform1i(m_heightTexturesLoc, Enabled ? 1 : 0);
+}
+
+
 void TerrainTechnique::SetSecondLightDir(const Vector3f& Dir)
 {
     Vector3f ReversedLightDir = Dir * -1.0f;
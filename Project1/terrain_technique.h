@@ -20,6 +20,24 @@ public:
 
     void SetLightDir(const Vector3f& Dir);
 
+    // Vertices with 16 bit heights (see QuantizedHeightMap). TexCoordScale maps the
+    // world space XZ to texture coordinates since these vertices don't have them.
+    void SetQuantizedHeights(bool Enabled, float Step, float Origin, float TexCoordScale);
+
+    void SetPatchHeightBase(int Base);
+
+    // Layout of the vertex blocks of a geomip grid - the shader finds the grid position
+    // of a vertex from its index with it when the vertices don't have a position
+    void SetGridLayout(int PatchSize, int NumPatchesX, int HeightMapWidth, int HeightMapDepth, float WorldScale);
+
+    // Vertices with nothing but a height and a normal (see GeomipGrid::SetCompactVertices).
+    // The heights are decoded with the uniforms of SetQuantizedHeights.
+    void SetCompactVertices(bool Enabled);
+
+    // No vertex attributes - the heights and normals are read from the textures of
+    // GeomipGrid::SetHeightTextures. Quantized heights are decoded as above.
+    void SetHeightTextures(bool Enabled);
+
     void SetSecondLightDir(const Vector3f& Dir);
 
     // New methods for light intensities
@@ -42,6 +60,20 @@ private:
     GLuint m_secondLightDirLoc = -1;
     GLuint m_mainLightIntensityLoc = -1;
     GLuint m_secondLightIntensityLoc = -1;
+    GLuint m_quantizedHeightsLoc = -1;
+    GLuint m_heightStepLoc = -1;
+    GLuint m_heightOriginLoc = -1;
+    GLuint m_texCoordScaleLoc = -1;
+    GLuint m_patchHeightBaseLoc = -1;
+    GLuint m_compactVerticesLoc = -1;
+    GLuint m_patchSizeLoc = -1;
+    GLuint m_numPatchesXLoc = -1;
+    GLuint m_heightMapSizeLoc = -1;
+    GLuint m_worldScaleLoc = -1;
+    GLuint m_heightTexturesLoc = -1;
+    GLuint m_heightMapUnitLoc = -1;
+    GLuint m_quantizedHeightMapUnitLoc = -1;
+    GLuint m_normalMapUnitLoc = -1;
 };
 
 #endif  /* TERRAIN_TECHNIQUE_H */
\ No newline at end of file
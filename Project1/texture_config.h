@@ -29,5 +29,13 @@
 #define COLOR_TEXTURE_UNIT_3 GL_TEXTURE3
 #define COLOR_TEXTURE_UNIT_INDEX_3 3
 
+// Height and normal textures of a geomip grid without a vertex buffer
+#define HEIGHT_MAP_TEXTURE_UNIT GL_TEXTURE4
+#define HEIGHT_MAP_TEXTURE_UNIT_INDEX 4
+#define QUANTIZED_HEIGHT_MAP_TEXTURE_UNIT GL_TEXTURE5
+#define QUANTIZED_HEIGHT_MAP_TEXTURE_UNIT_INDEX 5
+#define NORMAL_MAP_TEXTURE_UNIT GL_TEXTURE6
+#define NORMAL_MAP_TEXTURE_UNIT_INDEX 6
+
 
 #endif
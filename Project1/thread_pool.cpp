@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <algorithm>
+
+#include "thread_pool.h"
+
+// Set on pool threads (and on the caller while it works on a job) so that a
+// nested ParallelFor runs inline instead of deadlocking on the job mutex
+static thread_local bool t_insidePool = false;
+
+
+ThreadPool::ThreadPool(int NumWorkers)
+{
+    for (int i = 0; i < NumWorkers; i++) {
+        m_workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+    }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> Lock(m_mutex);
+        m_quit = true;
+    }
+
+    m_wakeCond.notify_all();
+
+    for (unsigned int i = 0; i < m_workers.size(); i++) {
+        m_workers[i].join();
+    }
+}
+
+
+void ThreadPool::ParallelFor(int Begin, int End, int MinBandSize, const std::function<void(int, int)>& Func, int MaxThreads)
+{
+    int Count = End - Begin;
+
+    if (Count <= 0) {
+        return;
+    }
+
+    if (MinBandSize < 1) {
+        MinBandSize = 1;
+    }
+
+    int NumThreads = GetNumThreads();
+
+    if ((MaxThreads > 0) && (MaxThreads < NumThreads)) {
+        NumThreads = MaxThreads;
+    }
+
+    // Several bands per thread so that there is something left to steal
+    int NumBands = std::min(NumThreads * 8, (Count + MinBandSize - 1) / MinBandSize);
+
+    if ((NumThreads == 1) || (NumBands <= 1) || t_insidePool) {
+        Func(Begin, End);
+        return;
+    }
+
+    std::lock_guard<std::mutex> JobLock(m_jobMutex);
+
+    Job j;
+    j.pFunc = &Func;
+    j.Begin = Begin;
+    j.End = End;
+    j.BandSize = (Count + NumBands - 1) / NumBands;
+    j.NumBands = (Count + j.BandSize - 1) / j.BandSize;
+    j.MaxWorkers = NumThreads - 1;
+    j.Ranges = std::vector<BandRange>(NumThreads);
+
+    // Contiguous runs of bands - participants that never show up are stolen from
+    for (int i = 0; i < NumThreads; i++) {
+        unsigned long long First = (unsigned long long)j.NumBands * i / NumThreads;
+        unsigned long long Last = (unsigned long long)j.NumBands * (i + 1) / NumThreads;
+        j.Ranges[i].Range = (First << 32) | Last;
+    }
+
+    {
+        std::lock_guard<std::mutex> Lock(m_mutex);
+        m_pJob = &j;
+        m_jobID++;
+    }
+
+    m_wakeCond.notify_all();
+
+    t_insidePool = true;
+    RunBands(j, 0);
+    t_insidePool = false;
+
+    // All bands have been handed out - stop new workers from joining and
+    // wait for the ones still working on their last band
+    std::unique_lock<std::mutex> Lock(m_mutex);
+    m_pJob = NULL;
+    m_doneCond.wait(Lock, [this] { return m_activeWorkers == 0; });
+}
+
+
+void ThreadPool::RunBands(Job& j, int Slot)
+{
+    std::atomic<unsigned long long>& MyRange = j.Ranges[Slot].Range;
+
+    while (true) {
+        unsigned long long Range = MyRange.load();
+        unsigned int First = (unsigned int)(Range >> 32);
+        unsigned int Last = (unsigned int)Range;
+
+        if (First >= Last) {
+            if (!StealBands(j, Slot)) {
+                break;
+            }
+            continue;
+        }
+
+        unsigned long long NewRange = ((unsigned long long)(First + 1) << 32) | Last;
+
+        if (!MyRange.compare_exchange_weak(Range, NewRange)) {
+            continue;
+        }
+
+        int BandBegin = j.Begin + (int)First * j.BandSize;
+        int BandEnd = std::min(BandBegin + j.BandSize, j.End);
+
+        (*j.pFunc)(BandBegin, BandEnd);
+    }
+}
+
+
+// Moves the back half of the first non empty run of another participant into the
+// (empty) run of Slot. Returns false when there is nothing left to steal.
+bool ThreadPool::StealBands(Job& j, int Slot)
+{
+    int NumSlots = (int)j.Ranges.size();
+
+    for (int i = 1; i < NumSlots; i++) {
+        std::atomic<unsigned long long>& Victim = j.Ranges[(Slot + i) % NumSlots].Range;
+
+        unsigned long long Range = Victim.load();
+
+        while (true) {
+            unsigned int First = (unsigned int)(Range >> 32);
+            unsigned int Last = (unsigned int)Range;
+
+            if (First >= Last) {
+                break;
+            }
+
+            unsigned int Split = Last - (Last - First + 1) / 2;
+            unsigned long long NewRange = ((unsigned long long)First << 32) | Split;
+
+            if (Victim.compare_exchange_weak(Range, NewRange)) {
+                // Only the owner adds bands to its own run so a plain store is safe
+                j.Ranges[Slot].Range = ((unsigned long long)Split << 32) | Last;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+void ThreadPool::WorkerLoop()
+{
+    t_insidePool = true;
+
+    unsigned int LastJobID = 0;
+
+    std::unique_lock<std::mutex> Lock(m_mutex);
+
+    while (true) {
+        m_wakeCond.wait(Lock, [&] { return m_quit || (m_pJob && (m_jobID != LastJobID)); });
+
+        if (m_quit) {
+            break;
+        }
+
+        LastJobID = m_jobID;
+        Job* pJob = m_pJob;
+
+        if (pJob->WorkersJoined >= pJob->MaxWorkers) {
+            continue;
+        }
+
+        int Slot = ++pJob->WorkersJoined;
+        m_activeWorkers++;
+
+        Lock.unlock();
+        RunBands(*pJob, Slot);
+        Lock.lock();
+
+        m_activeWorkers--;
+
+        if (m_activeWorkers == 0) {
+            m_doneCond.notify_all();
+        }
+    }
+}
+
+
+ThreadPool& GetThreadPool()
+{
+    static ThreadPool Pool(std::max((int)std::thread::hardware_concurrency(), 1) - 1);
+
+    return Pool;
+}
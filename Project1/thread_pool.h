@@ -0,0 +1,72 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// A fixed set of worker threads used to split data parallel work (e.g. the rows
+// of a height map) into bands. The calling thread always takes part in the work
+// so a pool with zero workers simply runs everything serially.
+// Every participant starts with a contiguous run of bands and, once it runs out,
+// steals the back half of the run of another participant. Neighbouring bands
+// mostly stay on the same thread while uneven bands still get balanced.
+class ThreadPool {
+public:
+    ThreadPool(int NumWorkers);
+
+    ~ThreadPool();
+
+    // Number of threads that can work on a job, including the calling thread
+    int GetNumThreads() const { return (int)m_workers.size() + 1; }
+
+    // Calls Func(BandBegin, BandEnd) for contiguous bands that cover [Begin, End)
+    // and returns when all of them are done. Bands are never smaller than MinBandSize
+    // (except the last one). MaxThreads limits the number of participating threads
+    // (0 means all of them).
+    void ParallelFor(int Begin, int End, int MinBandSize, const std::function<void(int, int)>& Func, int MaxThreads = 0);
+
+private:
+
+    // Bands [First, Last) still owned by one participant, packed as First << 32 | Last
+    // so that the owner (taking from the front) and thieves (taking from the back)
+    // can both claim bands with a single compare-and-swap
+    struct BandRange {
+        std::atomic<unsigned long long> Range;
+    };
+
+    struct Job {
+        const std::function<void(int, int)>* pFunc = NULL;
+        int Begin = 0;
+        int End = 0;
+        int BandSize = 0;
+        int NumBands = 0;
+        int MaxWorkers = 0;
+        int WorkersJoined = 0;
+        std::vector<BandRange> Ranges;     // one per participant, the caller is slot 0
+    };
+
+    void WorkerLoop();
+
+    void RunBands(Job& j, int Slot);
+
+    bool StealBands(Job& j, int Slot);
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeCond;
+    std::condition_variable m_doneCond;
+    std::mutex m_jobMutex;     // serializes ParallelFor calls from different threads
+    Job* m_pJob = NULL;
+    unsigned int m_jobID = 0;  // lets a worker tell a new job from the one it already finished
+    int m_activeWorkers = 0;
+    bool m_quit = false;
+};
+
+// Shared pool sized to the number of hardware threads
+ThreadPool& GetThreadPool();
+
+#endif
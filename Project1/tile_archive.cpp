@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "tile_archive.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+// Bytes at the end of the input that are always literals - lets the match search
+// read 4 bytes without checking
+#define LZ_LAST_LITERALS 5
+
+
+static u32 Read32(const u8* p)
+{
+    u32 Value;
+    memcpy(&Value, p, sizeof(Value));
+    return Value;
+}
+
+
+static u32 HashLZ(u32 Value)
+{
+    return (Value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+static void WriteLength(std::vector<u8>& Out, size_t Length)
+{
+    while (Length >= 255) {
+        Out.push_back(255);
+        Length -= 255;
+    }
+
+    Out.push_back((u8)Length);
+}
+
+
+static bool ReadLength(const u8*& pIn, const u8* pEnd, size_t& Length)
+{
+    u8 Byte;
+
+    do {
+        if (pIn == pEnd) {
+            return false;
+        }
+
+        Byte = *pIn++;
+        Length += Byte;
+    } while (Byte == 255);
+
+    return true;
+}
+
+
+// Sequence: token (literal count << 4 | match length - 4, 15 means more length
+// bytes follow), the literals, a 16 bit offset and the rest of the match length.
+// The last sequence has literals only.
+static void EmitSequence(std::vector<u8>& Out, const u8* pLiterals, size_t NumLiterals, size_t Offset, size_t MatchLength)
+{
+    size_t MatchCode = MatchLength - LZ_MIN_MATCH;
+
+    Out.push_back((u8)((std::min(NumLiterals, (size_t)15) << 4) | std::min(MatchCode, (size_t)15)));
+
+    if (NumLiterals >= 15) {
+        WriteLength(Out, NumLiterals - 15);
+    }
+
+    Out.insert(Out.end(), pLiterals, pLiterals + NumLiterals);
+
+    Out.push_back((u8)(Offset & 0xFF));
+    Out.push_back((u8)(Offset >> 8));
+
+    if (MatchCode >= 15) {
+        WriteLength(Out, MatchCode - 15);
+    }
+}
+
+
+static void EmitLastLiterals(std::vector<u8>& Out, const u8* pLiterals, size_t NumLiterals)
+{
+    Out.push_back((u8)(std::min(NumLiterals, (size_t)15) << 4));
+
+    if (NumLiterals >= 15) {
+        WriteLength(Out, NumLiterals - 15);
+    }
+
+    Out.insert(Out.end(), pLiterals, pLiterals + NumLiterals);
+}
+
+
+static void CompressLZ(const u8* pSrc, size_t Size, std::vector<u8>& Out)
+{
+    // Position + 1 of the last occurrence of every hash, 0 is empty
+    thread_local std::vector<u32> Table;
+    Table.assign((size_t)1 << LZ_HASH_BITS, 0);
+
+    Out.clear();
+
+    size_t Anchor = 0;
+    size_t Pos = 0;
+    size_t Limit = Size > LZ_LAST_LITERALS ? Size - LZ_LAST_LITERALS : 0;
+
+    while (Pos < Limit) {
+        u32 Sequence = Read32(pSrc + Pos);
+        u32 Hash = HashLZ(Sequence);
+        size_t Candidate = Table[Hash];
+        Table[Hash] = (u32)(Pos + 1);
+
+        if ((Candidate == 0) || (Pos - (Candidate - 1) > LZ_MAX_OFFSET) || (Read32(pSrc + Candidate - 1) != Sequence)) {
+            // Skips faster through data that doesn't compress
+            Pos += 1 + ((Pos - Anchor) >> 6);
+            continue;
+        }
+
+        size_t Match = Candidate - 1;
+        size_t Length = LZ_MIN_MATCH;
+
+        while ((Pos + Length < Size) && (pSrc[Match + Length] == pSrc[Pos + Length])) {
+            Length++;
+        }
+
+        EmitSequence(Out, pSrc + Anchor, Pos - Anchor, Pos - Match, Length);
+
+        Pos += Length;
+        Anchor = Pos;
+    }
+
+    EmitLastLiterals(Out, pSrc + Anchor, Size - Anchor);
+}
+
+
+static bool DecompressLZ(const u8* pSrc, size_t SrcSize, u8* pDst, size_t DstSize)
+{
+    const u8* pIn = pSrc;
+    const u8* pEnd = pSrc + SrcSize;
+    u8* pOut = pDst;
+    u8* pOutEnd = pDst + DstSize;
+
+    while (pIn < pEnd) {
+        u8 Token = *pIn++;
+
+        size_t NumLiterals = Token >> 4;
+
+        if ((NumLiterals == 15) && !ReadLength(pIn, pEnd, NumLiterals)) {
+            return false;
+        }
+
+        if ((NumLiterals > (size_t)(pEnd - pIn)) || (NumLiterals > (size_t)(pOutEnd - pOut))) {
+            return false;
+        }
+
+        memcpy(pOut, pIn, NumLiterals);
+        pIn += NumLiterals;
+        pOut += NumLiterals;
+
+        if (pIn == pEnd) {
+            break;
+        }
+
+        if (pEnd - pIn < 2) {
+            return false;
+        }
+
+        size_t Offset = pIn[0] | ((size_t)pIn[1] << 8);
+        pIn += 2;
+
+        size_t Length = Token & 15;
+
+        if ((Length == 15) && !ReadLength(pIn, pEnd, Length)) {
+            return false;
+        }
+
+        Length += LZ_MIN_MATCH;
+
+        if ((Offset == 0) || (Offset > (size_t)(pOut - pDst)) || (Length > (size_t)(pOutEnd - pOut))) {
+            return false;
+        }
+
+        const u8* pMatch = pOut - Offset;
+
+        if (Offset >= Length) {
+            memcpy(pOut, pMatch, Length);
+        } else {
+            // Overlapping match - repeats the last Offset bytes
+            for (size_t i = 0; i < Length; i++) {
+                pOut[i] = pMatch[i];
+            }
+        }
+
+        pOut += Length;
+    }
+
+    return pOut == pOutEnd;
+}
+
+
+// Maps the float bits to unsigned integers in the same order as the floats so that
+// the prediction works across zero as well
+static u32 FloatToOrdered(float f)
+{
+    u32 Bits;
+    memcpy(&Bits, &f, sizeof(Bits));
+    return (Bits & 0x80000000u) ? ~Bits : (Bits | 0x80000000u);
+}
+
+
+static float OrderedToFloat(u32 Ordered)
+{
+    u32 Bits = (Ordered & 0x80000000u) ? (Ordered & 0x7FFFFFFFu) : ~Ordered;
+    float f;
+    memcpy(&f, &Bits, sizeof(f));
+    return f;
+}
+
+
+// Left + up - up left (plane through the three neighbours), only one of them on the
+// first row/column
+static u32 Predict(const u32* pRow, const u32* pPrevRow, int x)
+{
+    if (pPrevRow) {
+        return x > 0 ? pRow[x - 1] + pPrevRow[x] - pPrevRow[x - 1] : pPrevRow[x];
+    }
+
+    return x > 0 ? pRow[x - 1] : 0;
+}
+
+
+void CompressTile(const float* pHeights, int TileSize, std::vector<u8>& Out, u32& Flags)
+{
+    size_t NumSamples = (size_t)TileSize * TileSize;
+
+    thread_local std::vector<u32> Ordered;
+    thread_local std::vector<u8> Planes;
+    Ordered.resize(NumSamples);
+    Planes.resize(NumSamples * 4);
+
+    for (size_t i = 0; i < NumSamples; i++) {
+        Ordered[i] = FloatToOrdered(pHeights[i]);
+    }
+
+    for (int z = 0; z < TileSize; z++) {
+        const u32* pRow = &Ordered[(size_t)z * TileSize];
+        const u32* pPrevRow = z > 0 ? pRow - TileSize : NULL;
+
+        for (int x = 0; x < TileSize; x++) {
+            size_t i = (size_t)z * TileSize + x;
+            u32 Residual = pRow[x] - Predict(pRow, pPrevRow, x);
+            u32 ZigZag = (Residual << 1) ^ (u32)((i32)Residual >> 31);
+
+            Planes[i] = (u8)ZigZag;
+            Planes[NumSamples + i] = (u8)(ZigZag >> 8);
+            Planes[NumSamples * 2 + i] = (u8)(ZigZag >> 16);
+            Planes[NumSamples * 3 + i] = (u8)(ZigZag >> 24);
+        }
+    }
+
+    CompressLZ(Planes.data(), Planes.size(), Out);
+
+    Flags = 0;
+
+    if (Out.size() >= Planes.size()) {
+        Out.assign(Planes.begin(), Planes.end());
+        Flags = TILE_FLAG_STORED;
+    }
+}
+
+
+bool DecompressTile(const u8* pData, size_t Size, u32 Flags, int TileSize, float* pHeights)
+{
+    size_t NumSamples = (size_t)TileSize * TileSize;
+
+    thread_local std::vector<u8> Planes;
+    thread_local std::vector<u32> Rows;
+    Planes.resize(NumSamples * 4);
+    Rows.resize((size_t)TileSize * 2);
+
+    if (Flags & TILE_FLAG_STORED) {
+        if (Size != Planes.size()) {
+            return false;
+        }
+
+        memcpy(Planes.data(), pData, Size);
+    } else if (!DecompressLZ(pData, Size, Planes.data(), Planes.size())) {
+        return false;
+    }
+
+    const u8* pPlane0 = Planes.data();
+    const u8* pPlane1 = pPlane0 + NumSamples;
+    const u8* pPlane2 = pPlane1 + NumSamples;
+    const u8* pPlane3 = pPlane2 + NumSamples;
+
+    for (int z = 0; z < TileSize; z++) {
+        // Only the previous row is needed for the prediction
+        u32* pRow = &Rows[(size_t)(z & 1) * TileSize];
+        const u32* pPrevRow = z > 0 ? &Rows[(size_t)((z - 1) & 1) * TileSize] : NULL;
+
+        for (int x = 0; x < TileSize; x++) {
+            size_t i = (size_t)z * TileSize + x;
+            u32 ZigZag = pPlane0[i] | ((u32)pPlane1[i] << 8) | ((u32)pPlane2[i] << 16) | ((u32)pPlane3[i] << 24);
+            u32 Residual = (ZigZag >> 1) ^ (0u - (ZigZag & 1));
+
+            pRow[x] = Residual + Predict(pRow, pPrevRow, x);
+            pHeights[i] = OrderedToFloat(pRow[x]);
+        }
+    }
+
+    return true;
+}
+
+
+static FILE* OpenFile(const char* pFilename, const char* pMode)
+{
+    FILE* f = NULL;
+
+#ifdef _WIN32
+    fopen_s(&f, pFilename, pMode);
+#else
+    f = fopen(pFilename, pMode);
+#endif
+
+    if (!f) {
+        printf("Error opening '%s': %s\n", pFilename, strerror(errno));
+        exit(0);
+    }
+
+    return f;
+}
+
+
+static void WriteBytes(FILE* f, const void* pData, size_t Size)
+{
+    if (fwrite(pData, 1, Size, f) != Size) {
+        printf("Error writing tile archive: %s\n", strerror(errno));
+        exit(0);
+    }
+}
+
+
+void WriteTileArchive(const char* pFilename, const Array2D<float>& HeightMap, int TileSize)
+{
+    if (TileSize < 2) {
+        printf("%s: invalid tile size %d\n", __FUNCTION__, TileSize);
+        exit(0);
+    }
+
+    int Width = HeightMap.GetCols();
+    int Depth = HeightMap.GetRows();
+
+    TileArchiveHeader Header;
+    Header.Width = Width;
+    Header.Depth = Depth;
+    Header.TileSize = TileSize;
+    Header.NumTilesX = std::max((Width - 1 + TileSize - 2) / (TileSize - 1), 1);
+    Header.NumTilesZ = std::max((Depth - 1 + TileSize - 2) / (TileSize - 1), 1);
+
+    std::vector<TileArchiveEntry> Entries((size_t)Header.NumTilesX * Header.NumTilesZ);
+
+    FILE* f = OpenFile(pFilename, "wb");
+
+    // The header and the directory are written again once the offsets and the
+    // height range are known
+    WriteBytes(f, &Header, sizeof(Header));
+    WriteBytes(f, Entries.data(), sizeof(TileArchiveEntry) * Entries.size());
+
+    u64 Offset = sizeof(Header) + sizeof(TileArchiveEntry) * Entries.size();
+
+    std::vector<std::vector<u8> > Compressed(Header.NumTilesX);
+
+    for (int TileZ = 0; TileZ < Header.NumTilesZ; TileZ++) {
+        GetThreadPool().ParallelFor(0, Header.NumTilesX, 1, [&](int Begin, int End) {
+            std::vector<float> Tile((size_t)TileSize * TileSize);
+
+            for (int TileX = Begin; TileX < End; TileX++) {
+                int x0 = TileX * (TileSize - 1);
+                int z0 = TileZ * (TileSize - 1);
+
+                for (int z = 0; z < TileSize; z++) {
+                    for (int x = 0; x < TileSize; x++) {
+                        Tile[(size_t)z * TileSize + x] = HeightMap.Get(std::min(x0 + x, Width - 1), std::min(z0 + z, Depth - 1));
+                    }
+                }
+
+                TileArchiveEntry& Entry = Entries[(size_t)TileZ * Header.NumTilesX + TileX];
+                Entry.MinHeight = *std::min_element(Tile.begin(), Tile.end());
+                Entry.MaxHeight = *std::max_element(Tile.begin(), Tile.end());
+
+                CompressTile(Tile.data(), TileSize, Compressed[TileX], Entry.Flags);
+            }
+        });
+
+        for (int TileX = 0; TileX < Header.NumTilesX; TileX++) {
+            TileArchiveEntry& Entry = Entries[(size_t)TileZ * Header.NumTilesX + TileX];
+            Entry.Offset = Offset;
+            Entry.Size = (u32)Compressed[TileX].size();
+
+            WriteBytes(f, Compressed[TileX].data(), Compressed[TileX].size());
+
+            Offset += Entry.Size;
+        }
+    }
+
+    Header.MinHeight = Entries[0].MinHeight;
+    Header.MaxHeight = Entries[0].MaxHeight;
+
+    for (size_t i = 1; i < Entries.size(); i++) {
+        Header.MinHeight = std::min(Header.MinHeight, Entries[i].MinHeight);
+        Header.MaxHeight = std::max(Header.MaxHeight, Entries[i].MaxHeight);
+    }
+
+    fseek(f, 0, SEEK_SET);
+    WriteBytes(f, &Header, sizeof(Header));
+    WriteBytes(f, Entries.data(), sizeof(TileArchiveEntry) * Entries.size());
+
+    fclose(f);
+
+    printf("Tile archive '%s': %dx%d tiles of %d, %llu KB (%.2f:1)\n", pFilename, Header.NumTilesX, Header.NumTilesZ, TileSize,
+           (unsigned long long)(Offset / 1024), (double)HeightMap.GetSizeInBytes() / (double)Offset);
+}
+
+
+TileArchive::~TileArchive()
+{
+    Close();
+}
+
+
+void TileArchive::Open(const char* pFilename)
+{
+    Close();
+
+    size_t FileSize = GetFileSize(pFilename);
+
+    if (FileSize < sizeof(m_header)) {
+        printf("%s: '%s' is too short for a tile archive\n", __FUNCTION__, pFilename);
+        exit(0);
+    }
+
+    m_pData = (const u8*)MapFile(pFilename, 0, FileSize, m_pMapping, m_mappingSize);
+
+    memcpy(&m_header, m_pData, sizeof(m_header));
+
+    if (memcmp(m_header.Magic, TileArchiveHeader().Magic, sizeof(m_header.Magic)) != 0) {
+        printf("%s: '%s' is not a tile archive\n", __FUNCTION__, pFilename);
+        exit(0);
+    }
+
+    if ((m_header.Version == 0) || (m_header.Version > TILE_ARCHIVE_VERSION)) {
+        printf("%s: '%s' has version %u - only up to %d is supported\n", __FUNCTION__, pFilename, m_header.Version, TILE_ARCHIVE_VERSION);
+        exit(0);
+    }
+
+    if ((m_header.TileSize < 2) || (m_header.NumTilesX < 1) || (m_header.NumTilesZ < 1)) {
+        printf("%s: '%s' has an invalid layout - %dx%d tiles of %d\n", __FUNCTION__, pFilename, m_header.NumTilesX, m_header.NumTilesZ, m_header.TileSize);
+        exit(0);
+    }
+
+    size_t NumTiles = (size_t)m_header.NumTilesX * m_header.NumTilesZ;
+
+    if (NumTiles > (FileSize - sizeof(m_header)) / sizeof(TileArchiveEntry)) {
+        printf("%s: '%s' is truncated in the tile directory\n", __FUNCTION__, pFilename);
+        exit(0);
+    }
+
+    m_pEntries = (const TileArchiveEntry*)(m_pData + sizeof(m_header));
+
+    for (size_t i = 0; i < NumTiles; i++) {
+        const TileArchiveEntry& Entry = m_pEntries[i];
+
+        if ((Entry.Offset > FileSize) || (Entry.Size > FileSize - Entry.Offset) || (Entry.Flags & ~(u32)TILE_FLAG_STORED)) {
+            printf("%s: '%s' has an invalid directory entry for tile %zu\n", __FUNCTION__, pFilename, i);
+            exit(0);
+        }
+    }
+}
+
+
+void TileArchive::Close()
+{
+    if (m_pMapping) {
+        UnmapFile(m_pMapping, m_mappingSize);
+    }
+
+    m_pMapping = NULL;
+    m_mappingSize = 0;
+    m_pData = NULL;
+    m_pEntries = NULL;
+}
+
+
+void TileArchive::LoadTile(int TileX, int TileZ, Array2D<float>& Tile) const
+{
+    if ((TileX < 0) || (TileX >= m_header.NumTilesX) || (TileZ < 0) || (TileZ >= m_header.NumTilesZ)) {
+        printf("%s: tile %d,%d is outside the %dx%d archive\n", __FUNCTION__, TileX, TileZ, m_header.NumTilesX, m_header.NumTilesZ);
+        exit(0);
+    }
+
+    if ((Tile.GetCols() != m_header.TileSize) || (Tile.GetRows() != m_header.TileSize) || Tile.IsMapped()) {
+        Tile.InitArray2D(m_header.TileSize, m_header.TileSize);
+    }
+
+    const TileArchiveEntry& Entry = GetEntry(TileX, TileZ);
+
+    if (!DecompressTile(m_pData + Entry.Offset, Entry.Size, Entry.Flags, m_header.TileSize, Tile.GetBaseAddr())) {
+        printf("%s: tile %d,%d is corrupt\n", __FUNCTION__, TileX, TileZ);
+        exit(0);
+    }
+}
+
+
+void TileArchive::PrefetchTile(int TileX, int TileZ) const
+{
+    const TileArchiveEntry& Entry = GetEntry(TileX, TileZ);
+
+    PrefetchMappedRange(m_pData + Entry.Offset, Entry.Size);
+}
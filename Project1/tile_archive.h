@@ -0,0 +1,102 @@
+#ifndef TILE_ARCHIVE_H
+#define TILE_ARCHIVE_H
+
+#include <vector>
+
+#include "ogldev_types.h"
+#include "ogldev_array_2d.h"
+
+// On disk archive of square height map tiles for worlds that don't fit in memory:
+//
+//     TileArchiveHeader
+//     NumTilesX x NumTilesZ TileArchiveEntry (row major)
+//     the compressed tiles
+//
+// A tile has TileSize x TileSize samples and shares its last row and column with
+// its neighbours, like the patches of the geomip grid, so a tile is a complete
+// height map of its own. Tiles that stick out of the map repeat its last row/column.
+//
+// Every tile is compressed on its own so any of them can be read without the others.
+// The codec is lossless: the float bits are mapped to ordered integers, predicted
+// from their left/up neighbours, the residuals are split into 4 byte planes (the
+// high planes are nearly all zero) and the planes go through a byte oriented LZ77
+// with an LZ4 style sequence format.
+
+#define TILE_ARCHIVE_VERSION 1
+
+enum TILE_ARCHIVE_FLAGS {
+    TILE_FLAG_STORED = 1,   // the byte planes didn't compress and are stored as they are
+};
+
+struct TileArchiveHeader {
+    char Magic[4] = { 'O', 'T', 'L', 'A' };
+    u32 Version = TILE_ARCHIVE_VERSION;
+    i32 Width = 0;          // of the whole height map
+    i32 Depth = 0;
+    i32 TileSize = 0;
+    i32 NumTilesX = 0;
+    i32 NumTilesZ = 0;
+    float MinHeight = 0.0f;
+    float MaxHeight = 0.0f;
+    u32 Reserved = 0;
+};
+
+struct TileArchiveEntry {
+    u64 Offset = 0;         // from the start of the file
+    u32 Size = 0;           // compressed
+    u32 Flags = 0;
+    float MinHeight = 0.0f; // lets the tile be culled before it is loaded
+    float MaxHeight = 0.0f;
+};
+
+// Splits the height map into tiles and writes them. The tiles are compressed in
+// parallel one row of tiles at a time so the memory use doesn't grow with the map.
+void WriteTileArchive(const char* pFilename, const Array2D<float>& HeightMap, int TileSize);
+
+
+// Maps the archive (see mapped_file.h) and validates the directory. LoadTile only
+// uses per thread scratch memory so tiles can be loaded from several threads at once.
+class TileArchive {
+public:
+    TileArchive() {}
+
+    ~TileArchive();
+
+    void Open(const char* pFilename);
+
+    void Close();
+
+    const TileArchiveHeader& GetHeader() const { return m_header; }
+
+    int GetTileSize() const { return m_header.TileSize; }
+
+    int GetNumTilesX() const { return m_header.NumTilesX; }
+
+    int GetNumTilesZ() const { return m_header.NumTilesZ; }
+
+    const TileArchiveEntry& GetEntry(int TileX, int TileZ) const { return m_pEntries[TileZ * m_header.NumTilesX + TileX]; }
+
+    // Decompresses the tile into Tile (resized to TileSize x TileSize if needed)
+    void LoadTile(int TileX, int TileZ, Array2D<float>& Tile) const;
+
+    // Starts reading the compressed tile in the background
+    void PrefetchTile(int TileX, int TileZ) const;
+
+private:
+    TileArchive(const TileArchive&);
+    TileArchive& operator=(const TileArchive&);
+
+    TileArchiveHeader m_header;
+    const TileArchiveEntry* m_pEntries = NULL;
+    const u8* m_pData = NULL;
+    void* m_pMapping = NULL;
+    size_t m_mappingSize = 0;
+};
+
+// The tile codec on its own - used by the archive and the benchmark. pHeights is
+// TileSize x TileSize floats, row major. DecompressTile returns false on corrupt data.
+void CompressTile(const float* pHeights, int TileSize, std::vector<u8>& Out, u32& Flags);
+
+bool DecompressTile(const u8* pData, size_t Size, u32 Flags, int TileSize, float* pHeights);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "tile_archive_benchmark.h"
+#include "tile_archive.h"
+#include "midpoint_disp_terrain.h"
+#include "thread_pool.h"
+#include "ogldev_util.h"
+
+#define NUM_BENCHMARK_RUNS 5
+#define BENCHMARK_FILENAME "tile_archive_benchmark.tiles"
+
+
+static double CalcMBPerSec(size_t Bytes, long long Millis)
+{
+    return (double)Bytes / (1024.0 * 1024.0) / ((double)std::max(Millis, 1LL) / 1000.0);
+}
+
+
+// Loads every tile and compares it with the height map
+static bool VerifyTiles(const TileArchive& Archive, const Array2D<float>& HeightMap)
+{
+    int TileSize = Archive.GetTileSize();
+    Array2D<float> Tile;
+
+    for (int TileZ = 0; TileZ < Archive.GetNumTilesZ(); TileZ++) {
+        for (int TileX = 0; TileX < Archive.GetNumTilesX(); TileX++) {
+            Archive.LoadTile(TileX, TileZ, Tile);
+
+            for (int z = 0; z < TileSize; z++) {
+                for (int x = 0; x < TileSize; x++) {
+                    float Expected = HeightMap.Get(std::min(TileX * (TileSize - 1) + x, HeightMap.GetCols() - 1),
+                                                   std::min(TileZ * (TileSize - 1) + z, HeightMap.GetRows() - 1));
+                    float Height = Tile.Get(x, z);
+
+                    if (memcmp(&Expected, &Height, sizeof(float)) != 0) {
+                        printf("Tile %d,%d differs at %d,%d: %f instead of %f\n", TileX, TileZ, x, z, Height, Expected);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+
+static long long LoadAllTiles(const TileArchive& Archive, int MaxThreads)
+{
+    int NumTiles = Archive.GetNumTilesX() * Archive.GetNumTilesZ();
+
+    long long Start = GetCurrentTimeMillis();
+
+    GetThreadPool().ParallelFor(0, NumTiles, 1, [&](int Begin, int End) {
+        Array2D<float> Tile;
+
+        for (int i = Begin; i < End; i++) {
+            Archive.LoadTile(i % Archive.GetNumTilesX(), i / Archive.GetNumTilesX(), Tile);
+        }
+    }, MaxThreads);
+
+    return GetCurrentTimeMillis() - Start;
+}
+
+
+void RunTileArchiveBenchmark(int TerrainSize, int TileSize)
+{
+    printf("Tile archive benchmark - %dx%d, tile size %d, best of %d runs\n", TerrainSize, TerrainSize, TileSize, NUM_BENCHMARK_RUNS);
+
+    Array2D<float> HeightMap;
+    CreateMidpointDisplacementF32(HeightMap, TerrainSize, 1.0f, 1234, 0);
+    HeightMap.Normalize(0.0f, 400.0f);
+
+    long long WriteTime = -1;
+
+    for (int i = 0; i < NUM_BENCHMARK_RUNS; i++) {
+        long long Start = GetCurrentTimeMillis();
+        WriteTileArchive(BENCHMARK_FILENAME, HeightMap, TileSize);
+        long long Time = GetCurrentTimeMillis() - Start;
+
+        if ((WriteTime < 0) || (Time < WriteTime)) {
+            WriteTime = Time;
+        }
+    }
+
+    TileArchive Archive;
+    Archive.Open(BENCHMARK_FILENAME);
+
+    if (!VerifyTiles(Archive, HeightMap)) {
+        exit(0);
+    }
+
+    // Counts the tile borders and the padding - that's what the decoder produces
+    size_t NumTiles = (size_t)Archive.GetNumTilesX() * Archive.GetNumTilesZ();
+    size_t TileBytes = NumTiles * TileSize * TileSize * sizeof(float);
+    size_t CompressedBytes = 0;
+
+    for (int TileZ = 0; TileZ < Archive.GetNumTilesZ(); TileZ++) {
+        for (int TileX = 0; TileX < Archive.GetNumTilesX(); TileX++) {
+            CompressedBytes += Archive.GetEntry(TileX, TileZ).Size;
+        }
+    }
+
+    long long SerialTime = -1;
+    long long ParallelTime = -1;
+
+    for (int i = 0; i < NUM_BENCHMARK_RUNS; i++) {
+        long long Serial = LoadAllTiles(Archive, 1);
+        long long Parallel = LoadAllTiles(Archive, 0);
+
+        if ((SerialTime < 0) || (Serial < SerialTime)) {
+            SerialTime = Serial;
+        }
+
+        if ((ParallelTime < 0) || (Parallel < ParallelTime)) {
+            ParallelTime = Parallel;
+        }
+    }
+
+    Archive.Close();
+    remove(BENCHMARK_FILENAME);
+
+    printf("%zu tiles, %zu KB -> %zu KB (%.2f:1), round trip is bit exact\n", NumTiles, TileBytes / 1024, CompressedBytes / 1024,
+           (double)TileBytes / (double)std::max(CompressedBytes, (size_t)1));
+    printf("%-32s %8lld ms %10.1f MB/s\n", "write (pool)", WriteTime, CalcMBPerSec(TileBytes, WriteTime));
+    printf("%-32s %8lld ms %10.1f MB/s\n", "load all tiles (1 thread)", SerialTime, CalcMBPerSec(TileBytes, SerialTime));
+    printf("%-32s %8lld ms %10.1f MB/s\n", "load all tiles (pool)", ParallelTime, CalcMBPerSec(TileBytes, ParallelTime));
+}
@@ -0,0 +1,10 @@
+#ifndef TILE_ARCHIVE_BENCHMARK_H
+#define TILE_ARCHIVE_BENCHMARK_H
+
+// Writes a generated height map as a tile archive, reads every tile back (one
+// thread and the whole pool), checks that the heights are bit exact and prints the
+// compression ratio and the throughput in MB/s of uncompressed heights. Doesn't
+// need a GL context - run it with --bench-tiles [size] [tile size].
+void RunTileArchiveBenchmark(int TerrainSize, int TileSize);
+
+#endif
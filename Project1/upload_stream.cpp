@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "upload_stream.h"
+
+
+UploadStream::~UploadStream()
+{
+    Destroy();
+}
+
+
+void UploadStream::Init(size_t ChunkSize, int NumChunks)
+{
+    Destroy();
+
+    m_chunkSize = ChunkSize;
+    m_fences.assign(NumChunks, (GLsync)0);
+    m_chunk = 0;
+    m_used = 0;
+    m_totalSize = 0;
+
+    if (!GLEW_VERSION_4_4 && !GLEW_ARB_buffer_storage) {
+        return;
+    }
+
+    // Coherent so that the writes are visible to the copies without flushing
+    GLbitfield Flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    glGenBuffers(1, &m_buffer);
+    glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+    glBufferStorage(GL_COPY_READ_BUFFER, ChunkSize * NumChunks, NULL, Flags);
+    m_pMapped = (u8*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, ChunkSize * NumChunks, Flags);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    if (!m_pMapped) {
+        printf("%s: can't map the staging buffer - using glBufferSubData\n", __FUNCTION__);
+        glDeleteBuffers(1, &m_buffer);
+        m_buffer = 0;
+    }
+}
+
+
+void UploadStream::Write(GLuint DstBuffer, size_t DstOffset, const void* pData, size_t Size)
+{
+    m_totalSize += Size;
+
+    if (!m_pMapped) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, DstBuffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, DstOffset, Size, pData);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        return;
+    }
+
+    const u8* pSrc = (const u8*)pData;
+
+    while (Size > 0) {
+        // A chunk is copied as one range so it can only continue the previous write
+        if ((m_used > 0) && ((DstBuffer != m_dstBuffer) || (DstOffset != m_dstOffset + m_used))) {
+            Flush();
+        }
+
+        if (m_used == 0) {
+            WaitForChunk();
+            m_dstBuffer = DstBuffer;
+            m_dstOffset = DstOffset;
+        }
+
+        size_t Count = std::min(Size, m_chunkSize - m_used);
+        memcpy(m_pMapped + m_chunk * m_chunkSize + m_used, pSrc, Count);
+
+        m_used += Count;
+        pSrc += Count;
+        DstOffset += Count;
+        Size -= Count;
+
+        if (m_used == m_chunkSize) {
+            Flush();
+        }
+    }
+}
+
+
+void UploadStream::Flush()
+{
+    if (m_used == 0) {
+        return;
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m_dstBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, m_chunk * m_chunkSize, m_dstOffset, m_used);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    m_fences[m_chunk] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    m_chunk = (m_chunk + 1) % (int)m_fences.size();
+    m_used = 0;
+}
+
+
+void UploadStream::WaitForChunk()
+{
+    GLsync Fence = m_fences[m_chunk];
+
+    if (!Fence) {
+        return;
+    }
+
+    // The first wait flushes the GL command queue so the fence is sure to signal
+    GLenum Result = glClientWaitSync(Fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+
+    while (Result == GL_TIMEOUT_EXPIRED) {
+        Result = glClientWaitSync(Fence, 0, 1000000000);
+    }
+
+    if (Result == GL_WAIT_FAILED) {
+        printf("%s: waiting for an upload failed\n", __FUNCTION__);
+    }
+
+    glDeleteSync(Fence);
+    m_fences[m_chunk] = 0;
+}
+
+
+void UploadStream::Destroy()
+{
+    Flush();
+
+    // Deleting the staging buffer is deferred by GL until the pending copies are done
+    for (size_t i = 0; i < m_fences.size(); i++) {
+        if (m_fences[i]) {
+            glDeleteSync(m_fences[i]);
+            m_fences[i] = 0;
+        }
+    }
+
+    m_fences.clear();
+
+    if (m_buffer) {
+        glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &m_buffer);
+        m_buffer = 0;
+    }
+
+    m_pMapped = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,58 @@
+#ifndef UPLOAD_STREAM_H
+#define UPLOAD_STREAM_H
+
+#include <glew.h>
+#include <vector>
+
+#include "ogldev_types.h"
+
+// Fills buffer objects a piece at a time without a full size copy of the data in
+// memory. The pieces are written into a small persistently mapped staging buffer
+// (GL 4.4 / ARB_buffer_storage) split into chunks, and every full chunk is copied
+// to its destination on the GPU. A fence per chunk keeps the writes from
+// overwriting a chunk whose copy hasn't run yet. Without buffer storage the
+// pieces go through glBufferSubData.
+// Only uses GL_COPY_READ_BUFFER and GL_COPY_WRITE_BUFFER so the other bindings
+// (and the bound VAO) are left alone. Must be used on the thread of the GL context.
+class UploadStream {
+public:
+    UploadStream() {}
+
+    ~UploadStream();
+
+    void Init(size_t ChunkSize = 4 * 1024 * 1024, int NumChunks = 3);
+
+    // Copies Size bytes to DstBuffer at DstOffset. pData can be reused as soon as
+    // this returns.
+    void Write(GLuint DstBuffer, size_t DstOffset, const void* pData, size_t Size);
+
+    // Issues the copy of the chunk that is being filled
+    void Flush();
+
+    // Flushes and releases the staging buffer
+    void Destroy();
+
+    bool IsPersistent() const { return m_pMapped != NULL; }
+
+    bool IsInitialized() const { return !m_fences.empty(); }
+
+    size_t GetTotalSize() const { return m_totalSize; }
+
+private:
+    UploadStream(const UploadStream&);
+    UploadStream& operator=(const UploadStream&);
+
+    void WaitForChunk();
+
+    GLuint m_buffer = 0;
+    u8* m_pMapped = NULL;
+    size_t m_chunkSize = 0;
+    std::vector<GLsync> m_fences;   // one per chunk, NULL when the chunk is free
+    int m_chunk = 0;                // the one being filled
+    size_t m_used = 0;
+    GLuint m_dstBuffer = 0;         // where the chunk being filled goes
+    size_t m_dstOffset = 0;
+    size_t m_totalSize = 0;
+};
+
+#endif
\ No newline at end of file